@@ -163,7 +163,7 @@ static inline void rtcan_mscan_err_interrupt(struct rtcan_device *dev,
 			/* Disable receiver interrupts */
 			out_8(&regs->canrier, 0);
 			/* Wake up waiting senders */
-			rtdm_sem_destroy(&dev->tx_sem);
+			rtcan_dev_tx_close(dev);
 			break;
 
 		case CAN_STATE_BUS_PASSIVE:
@@ -205,6 +205,10 @@ static int rtcan_mscan_interrupt(rtdm_irq_t *irq_handle)
 	dev = (struct rtcan_device *)rtdm_irq_get_arg(irq_handle, void);
 	regs = (struct mscan_regs *)dev->base_addr;
 
+	/* Reception time of the frame, taken at IRQ entry */
+	skb.timestamp = rtdm_clock_read();
+	rtcan_trace_irq(&skb, skb.timestamp);
+
 	rtdm_lock_get(&dev->device_lock);
 
 	canrflg = in_8(&regs->canrflg);
@@ -215,18 +219,18 @@ static int rtcan_mscan_interrupt(rtdm_irq_t *irq_handle)
 	if ((in_8(&regs->cantier) & MSCAN_TXIE0) &&
 	    (in_8(&regs->cantflg) & MSCAN_TXE0)) {
 		out_8(&regs->cantier, 0);
+		rtcan_tx_done(dev, 0);
 		/* Wake up a sender */
-		rtdm_sem_up(&dev->tx_sem);
+		rtcan_dev_tx_release(dev);
 
-		if (rtcan_loopback_pending(dev)) {
+		if (rtcan_loopback_pending(dev, 0)) {
 
 			if (recv_lock_free) {
 				recv_lock_free = 0;
-				rtdm_lock_get(&rtcan_recv_list_lock);
-				rtdm_lock_get(&rtcan_socket_lock);
+				rtdm_lock_get(&dev->recv_list_lock);
 			}
 
-			rtcan_loopback(dev);
+			rtcan_loopback(dev, 0);
 		}
 	}
 
@@ -240,6 +244,7 @@ static int rtcan_mscan_interrupt(rtdm_irq_t *irq_handle)
 
 		/* Read out HW registers */
 		rtcan_mscan_rx_interrupt(dev, &skb);
+		rtcan_trace_hw(&skb);
 
 		/* Take more locks. Ensure that they are taken and
 		 * released only once in the IRQ handler. */
@@ -248,8 +253,7 @@ static int rtcan_mscan_interrupt(rtdm_irq_t *irq_handle)
 		 * not be possible. */
 		if (recv_lock_free) {
 			recv_lock_free = 0;
-			rtdm_lock_get(&rtcan_recv_list_lock);
-			rtdm_lock_get(&rtcan_socket_lock);
+			rtdm_lock_get(&dev->recv_list_lock);
 		}
 
 		/* Pass received frame out to the sockets */
@@ -263,8 +267,7 @@ static int rtcan_mscan_interrupt(rtdm_irq_t *irq_handle)
 
 		if (recv_lock_free) {
 			recv_lock_free = 0;
-			rtdm_lock_get(&rtcan_recv_list_lock);
-			rtdm_lock_get(&rtcan_socket_lock);
+			rtdm_lock_get(&dev->recv_list_lock);
 		}
 
 		/* Pass error frame out to the sockets */
@@ -278,8 +281,7 @@ static int rtcan_mscan_interrupt(rtdm_irq_t *irq_handle)
 		out_8(&regs->canrflg, canrflg);
 
 	if (!recv_lock_free) {
-		rtdm_lock_put(&rtcan_socket_lock);
-		rtdm_lock_put(&rtcan_recv_list_lock);
+		rtdm_lock_put(&dev->recv_list_lock);
 	}
 	rtdm_lock_put(&dev->device_lock);
 
@@ -372,7 +374,7 @@ static int rtcan_mscan_mode_stop(struct rtcan_device *dev,
 	/* Volatile state could have changed while we slept busy. */
 	dev->state = CAN_STATE_STOPPED;
 	/* Wake up waiting senders */
-	rtdm_sem_destroy(&dev->tx_sem);
+	rtcan_dev_tx_close(dev);
 
 out:
 	return ret;
@@ -417,7 +419,7 @@ static int rtcan_mscan_mode_start(struct rtcan_device *dev,
 		/* Set error active state */
 		state = CAN_STATE_ACTIVE;
 		/* Set up sender "mutex" */
-		rtdm_sem_init(&dev->tx_sem, 1);
+		rtcan_dev_tx_open(dev, 1);
 
 		if ((dev->ctrl_mode & CAN_CTRLMODE_LISTENONLY)) {
 			setbits8(&regs->canctl1, MSCAN_LISTEN);
@@ -454,7 +456,7 @@ static int rtcan_mscan_mode_start(struct rtcan_device *dev,
 		/* Trigger bus-off recovery */
 		out_8(&regs->canrier, MSCAN_RIER);
 		/* Set up sender "mutex" */
-		rtdm_sem_init(&dev->tx_sem, 1);
+		rtcan_dev_tx_open(dev, 1);
 		/* Set error active state */
 		state = CAN_STATE_ACTIVE;
 
@@ -0,0 +1,348 @@
+/*
+ * Bus capture for RT-Socket-CAN
+ *
+ * Copyright (C) 2026 RT-Socket-CAN Development Team
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A capturing socket (RTCAN_RTIOC_CAPTURE_START) gets the frames passing
+ * its filters written as pcap records into one of two preallocated
+ * buffers, right from the reception path and under the socket's rx_lock.
+ * When that buffer is full, the roles are swapped if the reader has
+ * emptied the other one, so a reader which writes to disk only has to
+ * keep up on average, not with each frame. RTCAN_RTIOC_CAPTURE_READ
+ * copies a whole buffer at a time. The reader owns the full buffer while
+ * copying, the reception path never touches it then.
+ *
+ * The reader is a plain Linux task, it waits on a Linux wait queue and
+ * copies in non-real-time context. The reception path can't wake it up
+ * directly and pends a non-real-time signal instead.
+ *
+ * Frames sent through the local interfaces are only seen as far as they
+ * come back as loopback echoes (rtcan_loopback()), i.e. those of senders
+ * with CAN_RAW_LOOPBACK enabled, and the capturing socket's own ones only
+ * with CAN_RAW_RECV_OWN_MSGS. Without CONFIG_XENO_DRIVERS_CAN_LOOPBACK,
+ * no local transmission is captured.
+ * Frames of other nodes on the bus are always captured.
+ */
+
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <linux/delay.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+
+#include <rtdm/rtdm_driver.h>
+
+#include <rtdm/rtcan.h>
+#include "rtcan_ext.h"
+#include "rtcan_socket.h"
+#include "rtcan_dev.h"
+#include "rtcan_raw.h"
+#include "rtcan_internal.h"
+
+
+struct rtcan_capture {
+    /* Both buffers, vmalloc'ed, and the bytes of records in each */
+    unsigned char       *buf[2];
+    size_t              fill[2];
+    size_t              size;
+
+    /* Buffer written by the reception path */
+    int                 active;
+
+    /* The other buffer is full, or being read */
+    int                 full;
+
+    /* A reader is in rtcan_capture_read() */
+    int                 reading;
+
+    uint32_t            dropped;
+
+    /* Pended when a buffer becomes full, wakes up the reader on wait */
+    rtdm_nrtsig_t       nrt_sig;
+    wait_queue_head_t   wait;
+};
+
+
+static void rtcan_capture_wakeup(rtdm_nrtsig_t nrt_sig, void *arg)
+{
+    struct rtcan_capture *cap = arg;
+
+    wake_up_interruptible(&cap->wait);
+}
+
+
+/* Called by rtcan_rcv_deliver() with the socket's rx_lock held */
+void rtcan_capture_frame(struct rtcan_socket *sock, struct rtcan_skb *skb)
+{
+    struct rtcan_capture *cap = sock->capture;
+    struct rtcan_rb_frame *frame = &skb->rb_frame;
+    size_t data_size = rtcan_skb_payload(skb);
+    size_t mtu = CAN_MTU;
+    struct rtcan_pcap_rec *rec;
+    unsigned char *out;
+    u32 nsec;
+
+    if (frame->can_dlc & RTCAN_FD_FRAME)
+	mtu = CANFD_MTU;
+    if (data_size > mtu - 8)
+	data_size = mtu - 8;
+
+    if (cap->fill[cap->active] + sizeof(*rec) + mtu > cap->size) {
+	if (cap->full) {
+	    cap->dropped++;
+	    return;
+	}
+	/* The other buffer has been read, hand this one over */
+	cap->full = 1;
+	cap->active ^= 1;
+	rtdm_nrtsig_pend(&cap->nrt_sig);
+    }
+
+    rec = (struct rtcan_pcap_rec *)
+	(cap->buf[cap->active] + cap->fill[cap->active]);
+    rec->ts_sec = div_u64_rem(skb->timestamp, 1000000000, &nsec);
+    rec->ts_nsec = nsec;
+    rec->incl_len = rec->orig_len = mtu;
+
+    out = (unsigned char *)(rec + 1);
+    *(__be32 *)out = cpu_to_be32(frame->can_id);
+    if (frame->can_dlc & RTCAN_FD_FRAME) {
+	out[4] = rtcan_fd_dlc2len(frame->can_dlc);
+	out[5] = RTCAN_PCAP_FDF |
+	    ((frame->can_dlc & RTCAN_FD_BRS) ? CANFD_BRS : 0) |
+	    ((frame->can_dlc & RTCAN_FD_ESI) ? CANFD_ESI : 0);
+    } else {
+	out[4] = frame->can_dlc & RTCAN_HAS_NO_TIMESTAMP;
+	out[5] = 0;
+    }
+    out[6] = frame->can_ifindex;
+    out[7] = 0;
+    memcpy(out + 8, frame->data, data_size);
+    memset(out + 8 + data_size, 0, mtu - 8 - data_size);
+
+    cap->fill[cap->active] += sizeof(*rec) + mtu;
+}
+
+
+int rtcan_capture_start(struct rtcan_socket *sock,
+			struct rtcan_capture_start *start)
+{
+    struct rtcan_capture *cap;
+    size_t size = start->buf_size;
+    rtdm_lockctx_t lock_ctx;
+    int ret = 0;
+
+    if (size == 0)
+	size = RTCAN_CAPTURE_DEFAULT_SIZE;
+    if (size < sizeof(struct rtcan_pcap_rec) + CANFD_MTU ||
+	size > RTCAN_CAPTURE_MAX_SIZE)
+	return -EINVAL;
+
+    cap = kmalloc(sizeof(struct rtcan_capture), GFP_KERNEL);
+    if (!cap)
+	return -ENOMEM;
+    memset(cap, 0, sizeof(struct rtcan_capture));
+
+    /* Touch the buffers now rather than on the first frames */
+    cap->buf[0] = vmalloc(size);
+    cap->buf[1] = vmalloc(size);
+    if (!cap->buf[0] || !cap->buf[1]) {
+	ret = -ENOMEM;
+	goto out_free;
+    }
+    memset(cap->buf[0], 0, size);
+    memset(cap->buf[1], 0, size);
+    cap->size = size;
+
+    init_waitqueue_head(&cap->wait);
+    ret = rtdm_nrtsig_init(&cap->nrt_sig, rtcan_capture_wakeup, cap);
+    if (ret)
+	goto out_free;
+
+    rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+    if (sock->capture || rtcan_rx_ring_mapped(sock->rx_ring))
+	ret = -EBUSY;
+    else
+	sock->capture = cap;
+    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+    if (ret) {
+	rtdm_nrtsig_destroy(&cap->nrt_sig);
+	goto out_free;
+    }
+
+    start->buf_size = size;
+
+    return 0;
+
+ out_free:
+    vfree(cap->buf[0]);
+    vfree(cap->buf[1]);
+    kfree(cap);
+    return ret;
+}
+
+
+int rtcan_capture_stop(struct rtcan_socket *sock)
+{
+    struct rtcan_capture *cap;
+    rtdm_lockctx_t lock_ctx;
+    int reading;
+
+    /* No new frames once the capture is detached */
+    rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+    cap = sock->capture;
+    sock->capture = NULL;
+    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+    if (!cap)
+	return -EINVAL;
+
+    /* Wakes up the reader, which may still be copying a buffer */
+    wake_up_interruptible(&cap->wait);
+
+    do {
+	rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+	reading = cap->reading;
+	rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+	if (reading)
+	    msleep(1);
+    } while (reading);
+
+    rtdm_nrtsig_destroy(&cap->nrt_sig);
+    vfree(cap->buf[0]);
+    vfree(cap->buf[1]);
+    kfree(cap);
+
+    return 0;
+}
+
+
+/* Wakeup condition of the reader, checked without rx_lock */
+static inline int rtcan_capture_ready(struct rtcan_socket *sock,
+				      struct rtcan_capture *cap)
+{
+    return ACCESS_ONCE(cap->full) || ACCESS_ONCE(sock->capture) != cap;
+}
+
+
+/* Called in non-real-time context */
+int rtcan_capture_read(struct rtcan_socket *sock, rtdm_user_info_t *user_info,
+		       struct rtcan_capture_read *rd)
+{
+    struct rtcan_capture *cap;
+    rtdm_lockctx_t lock_ctx;
+    long remaining = 0;
+    int expired = 0;
+    int idx, ret = 0;
+
+    rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+    cap = sock->capture;
+    if (!cap)
+	ret = -EINVAL;
+    else if (rd->size < cap->size)
+	ret = -EMSGSIZE;
+    else if (cap->reading)
+	ret = -EBUSY;
+    else
+	cap->reading = 1;
+    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+    if (ret)
+	return ret;
+
+    if (user_info && !rtdm_rw_user_ok(user_info, rd->buf, cap->size)) {
+	ret = -EFAULT;
+	goto out;
+    }
+
+    if (rd->timeout > 0)
+	remaining = msecs_to_jiffies(div_u64(rd->timeout + 999999, 1000000));
+
+    for (;;) {
+	rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+	if (sock->capture != cap) {
+	    /* Stopped while we were waiting */
+	    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+	    ret = -EBADF;
+	    goto out;
+	}
+	if (cap->full)
+	    break;
+	if (expired && cap->fill[cap->active]) {
+	    /* Take what there is, the reception path continues in the
+	     * other buffer, which is empty */
+	    cap->full = 1;
+	    cap->active ^= 1;
+	    break;
+	}
+	rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+	if (expired) {
+	    ret = expired;
+	    goto out;
+	}
+
+	if (rd->timeout < 0) {
+	    /* We would block but don't want to */
+	    expired = -EAGAIN;
+	} else if (rd->timeout == 0) {
+	    if (wait_event_interruptible(cap->wait,
+					 rtcan_capture_ready(sock, cap))) {
+		ret = -EINTR;
+		goto out;
+	    }
+	} else {
+	    remaining = wait_event_interruptible_timeout(cap->wait,
+				rtcan_capture_ready(sock, cap), remaining);
+	    if (remaining < 0) {
+		ret = -EINTR;
+		goto out;
+	    }
+	    if (remaining == 0)
+		expired = -ETIMEDOUT;
+	}
+    }
+
+    idx = cap->active ^ 1;
+    rd->length = cap->fill[idx];
+    rd->dropped = cap->dropped;
+    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+    if (user_info) {
+	if (rtdm_copy_to_user(user_info, rd->buf, cap->buf[idx], rd->length))
+	    ret = -EFAULT;
+    } else
+	memcpy(rd->buf, cap->buf[idx], rd->length);
+
+    /* Give the buffer back to the reception path */
+    rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+    cap->fill[idx] = 0;
+    cap->full = 0;
+    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+ out:
+    rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+    cap->reading = 0;
+    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+    return ret;
+}
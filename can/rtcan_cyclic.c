@@ -0,0 +1,497 @@
+/*
+ * Cyclic transmission for RT-Socket-CAN
+ *
+ * Copyright (C) 2026 RT-Socket-CAN Development Team
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A socket can hand a set of frames with periods and phase offsets to the
+ * kernel (RTCAN_RTIOC_CYCLIC_START), which sends them until the set is
+ * stopped, similar to the broadcast manager of SocketCAN. All sets of a
+ * device are served by one real-time task of that device, created with
+ * its first set. The task sleeps until the earliest deadline of all
+ * frames and sends the frame through the same path as sendmsg(), waiting
+ * for a TX slot until the end of that frame's period at most. It runs as
+ * a task rather than in a timer handler, because taking a TX slot
+ * (dev->tx_sem) must be possible from its context.
+ *
+ * The payloads live in slots shared with user space, which updates them
+ * under a sequence counter without any system call.
+ */
+
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/delay.h>
+#include <linux/math64.h>
+
+#include <rtdm/rtdm_driver.h>
+
+#include <rtdm/rtcan.h>
+#include "rtcan_ext.h"
+#include "rtcan_socket.h"
+#include "rtcan_dev.h"
+#include "rtcan_raw.h"
+#include "rtcan_internal.h"
+
+
+static int cyclic_prio = 95;
+module_param(cyclic_prio, int, 0444);
+MODULE_PARM_DESC(cyclic_prio, "Priority of the cyclic transmission tasks "
+		 "(default 95)");
+
+/* Serialises starting and stopping sets, and with it the creation and
+ * destruction of the devices' schedulers */
+static DEFINE_BINARY_SEMAPHORE(rtcan_cyclic_nrt_lock);
+
+struct rtcan_cyclic_entry {
+    /* Frame as last read consistently from the slot */
+    can_frame_t         frame;
+    int                 paused;
+
+    nanosecs_rel_t      period;
+
+    /* Start of the period of the next transmission */
+    nanosecs_abs_t      next;
+};
+
+struct rtcan_cyclic_set {
+    /* Entry in the list of the device's scheduler */
+    struct list_head    list;
+
+    struct rtcan_socket *sock;
+    struct rtcan_device *dev;
+
+    /* Slots shared with user space, vmalloc'ed */
+    struct rtcan_cyclic_slot *slots;
+    size_t              size;
+
+    /* One reference for the socket, one for the mapping */
+    atomic_t            refcount;
+
+    unsigned int        count;
+    struct rtcan_cyclic_entry entry[0];
+};
+
+/* Scheduler of a device, dev->cyclic */
+struct rtcan_cyclic {
+    struct rtcan_device *dev;
+    rtdm_task_t         task;
+
+    /* Signalled when a set was added */
+    rtdm_event_t        changed;
+
+    /* Protects sets, the schedule of their entries and busy */
+    rtdm_lock_t         lock;
+    struct list_head    sets;
+
+    /* Set whose frame the task is sending, outside of lock */
+    struct rtcan_cyclic_set *busy;
+};
+
+
+static void rtcan_cyclic_set_put(struct rtcan_cyclic_set *set)
+{
+    if (atomic_dec_and_test(&set->refcount)) {
+	vfree(set->slots);
+	kfree(set);
+    }
+}
+
+
+static void rtcan_cyclic_vm_open(struct vm_area_struct *vma)
+{
+    struct rtcan_cyclic_set *set = vma->vm_private_data;
+
+    atomic_inc(&set->refcount);
+}
+
+
+static void rtcan_cyclic_vm_close(struct vm_area_struct *vma)
+{
+    rtcan_cyclic_set_put(vma->vm_private_data);
+}
+
+
+static struct vm_operations_struct rtcan_cyclic_vm_ops = {
+    open:       rtcan_cyclic_vm_open,
+    close:      rtcan_cyclic_vm_close,
+};
+
+
+/*
+ * Take over the payload of the slot, unless user space is just updating
+ * it. Called with the scheduler's lock held.
+ */
+static inline void rtcan_cyclic_fetch(struct rtcan_cyclic_entry *entry,
+				      struct rtcan_cyclic_slot *slot)
+{
+    uint32_t seq = slot->seq;
+    uint8_t can_dlc, flags;
+    uint8_t data[8];
+
+    if (seq & 1)
+	return;
+    smp_rmb();
+
+    can_dlc = slot->can_dlc;
+    flags = slot->flags;
+    memcpy(data, slot->data, 8);
+
+    smp_rmb();
+    if (slot->seq != seq)
+	return;
+
+    /* A DLC up to 15 is valid, it means 8 bytes beyond 8 */
+    entry->frame.can_dlc = can_dlc & 0x0f;
+    memcpy(entry->frame.data, data, 8);
+    entry->paused = flags & RTCAN_CYCLIC_PAUSED;
+}
+
+
+/*
+ * Pick the frame with the earliest deadline and, if it is due, prepare
+ * its transmission: copy it to @frame, advance its schedule and mark its
+ * set busy. Returns the set and sets @deadline to the end of the frame's
+ * period, or returns NULL and sets @deadline to the time the next frame
+ * is due.
+ */
+static struct rtcan_cyclic_set *rtcan_cyclic_next(struct rtcan_cyclic *cyc,
+						  can_frame_t *frame,
+						  unsigned int *index,
+						  nanosecs_abs_t *deadline)
+{
+    struct rtcan_cyclic_entry *entry, *due = NULL;
+    struct rtcan_cyclic_set *set, *due_set = NULL;
+    nanosecs_abs_t now = rtdm_clock_read();
+    nanosecs_rel_t late;
+    rtdm_lockctx_t lock_ctx;
+    uint64_t skipped;
+    unsigned int i;
+
+    rtdm_lock_get_irqsave(&cyc->lock, lock_ctx);
+
+    list_for_each_entry(set, &cyc->sets, list)
+	for (i = 0; i < set->count; i++) {
+	    entry = &set->entry[i];
+	    if (!due || entry->next < due->next) {
+		due = entry;
+		due_set = set;
+	    }
+	}
+
+    if (!due || due->next > now) {
+	/* Nothing due, without sets the task is destroyed anyway */
+	*deadline = due ? due->next : now + 1000000000;
+	rtdm_lock_put_irqrestore(&cyc->lock, lock_ctx);
+	return NULL;
+    }
+
+    i = due - due_set->entry;
+    rtcan_cyclic_fetch(due, &due_set->slots[i]);
+    *frame = due->frame;
+    *index = i;
+
+    due->next += due->period;
+    if (due->next <= now) {
+	/* Whole periods went by, resume in phase */
+	late = now - due->next;
+	skipped = div64_u64(late, due->period) + 1;
+	due->next += skipped * due->period;
+	if (!due->paused)
+	    due_set->slots[i].missed += skipped;
+    }
+    *deadline = due->next;
+
+    if (due->paused)
+	due_set = NULL;
+    cyc->busy = due_set;
+
+    rtdm_lock_put_irqrestore(&cyc->lock, lock_ctx);
+
+    return due_set;
+}
+
+
+static void rtcan_cyclic_task(void *arg)
+{
+    struct rtcan_cyclic *cyc = arg;
+    struct rtcan_device *dev = cyc->dev;
+    struct rtcan_cyclic_set *set;
+    nanosecs_abs_t deadline;
+    nanosecs_rel_t timeout;
+    rtdm_lockctx_t lock_ctx;
+    can_frame_t frame;
+    unsigned int i;
+    int ret;
+
+    for (;;) {
+	set = rtcan_cyclic_next(cyc, &frame, &i, &deadline);
+	if (!set) {
+	    /* Sleep until then or until a set was added */
+	    timeout = deadline - rtdm_clock_read();
+	    if (timeout > 0)
+		rtdm_event_timedwait(&cyc->changed, timeout, NULL);
+	    continue;
+	}
+
+	/* Wait for a TX slot until the frame is due again */
+	timeout = deadline - rtdm_clock_read();
+	ret = rtdm_sem_timeddown(&dev->tx_sem, timeout > 0 ?
+				 timeout : RTDM_TIMEOUT_NONE, NULL);
+	if (!ret)
+	    ret = rtcan_raw_xmit(set->sock, dev, &frame, 1);
+
+	/* The slots stay valid while the set is busy */
+	if (ret > 0)
+	    set->slots[i].sent++;
+	else
+	    set->slots[i].missed++;
+
+	rtdm_lock_get_irqsave(&cyc->lock, lock_ctx);
+	cyc->busy = NULL;
+	rtdm_lock_put_irqrestore(&cyc->lock, lock_ctx);
+    }
+}
+
+
+/* Get the scheduler of a device, creating it if needed */
+static struct rtcan_cyclic *rtcan_cyclic_get(struct rtcan_device *dev)
+{
+    struct rtcan_cyclic *cyc = dev->cyclic;
+
+    if (cyc)
+	return cyc;
+
+    cyc = kmalloc(sizeof(struct rtcan_cyclic), GFP_KERNEL);
+    if (!cyc)
+	return NULL;
+
+    cyc->dev = dev;
+    rtdm_lock_init(&cyc->lock);
+    INIT_LIST_HEAD(&cyc->sets);
+    cyc->busy = NULL;
+    rtdm_event_init(&cyc->changed, 0);
+
+    if (rtdm_task_init(&cyc->task, dev->name, rtcan_cyclic_task, cyc,
+		       cyclic_prio, 0)) {
+	rtdm_event_destroy(&cyc->changed);
+	kfree(cyc);
+	return NULL;
+    }
+
+    dev->cyclic = cyc;
+    return cyc;
+}
+
+
+/* Destroy the scheduler of a device once it has no sets anymore */
+static void rtcan_cyclic_put(struct rtcan_device *dev)
+{
+    struct rtcan_cyclic *cyc = dev->cyclic;
+
+    if (!list_empty(&cyc->sets))
+	return;
+
+    rtdm_task_destroy(&cyc->task);
+    rtdm_event_destroy(&cyc->changed);
+    dev->cyclic = NULL;
+    kfree(cyc);
+}
+
+
+int rtcan_cyclic_start(struct rtcan_socket *sock,
+		       rtdm_user_info_t *user_info,
+		       struct rtcan_cyclic_start *start)
+{
+    struct rtcan_cyclic_frame cf;
+    struct rtcan_cyclic_entry *entry;
+    struct rtcan_cyclic_set *set;
+    struct rtcan_cyclic *cyc;
+    struct rtcan_device *dev;
+    rtdm_lockctx_t lock_ctx;
+    nanosecs_abs_t now;
+    unsigned int i;
+    void *addr;
+    int ifindex;
+    int ret;
+
+    if (start->count == 0 || start->count > RTCAN_CYCLIC_MAX_FRAMES)
+	return -EINVAL;
+
+    ifindex = start->ifindex ? start->ifindex : atomic_read(&sock->ifindex);
+    if (!ifindex)
+	return -ENXIO;
+
+    if (user_info &&
+	!rtdm_read_user_ok(user_info, start->frames,
+			   start->count * sizeof(struct rtcan_cyclic_frame)))
+	return -EFAULT;
+
+    set = kmalloc(sizeof(struct rtcan_cyclic_set) +
+		  start->count * sizeof(struct rtcan_cyclic_entry),
+		  GFP_KERNEL);
+    if (!set)
+	return -ENOMEM;
+
+    set->count = start->count;
+    set->size = PAGE_ALIGN(start->count * sizeof(struct rtcan_cyclic_slot));
+    set->slots = vmalloc(set->size);
+    if (!set->slots) {
+	kfree(set);
+	return -ENOMEM;
+    }
+    memset(set->slots, 0, set->size);
+
+    for (i = 0; i < set->count; i++) {
+	if (user_info) {
+	    if (rtdm_copy_from_user(user_info, &cf, &start->frames[i],
+				    sizeof(cf))) {
+		ret = -EFAULT;
+		goto out_free;
+	    }
+	} else
+	    cf = start->frames[i];
+
+	if (rtcan_raw_check_frame(&cf.frame) ||
+	    cf.period < RTCAN_CYCLIC_MIN_PERIOD ||
+	    cf.offset < 0 || cf.offset >= cf.period) {
+	    ret = -EINVAL;
+	    goto out_free;
+	}
+
+	entry = &set->entry[i];
+	entry->frame = cf.frame;
+	entry->paused = 0;
+	entry->period = cf.period;
+	entry->next = cf.offset;
+
+	set->slots[i].can_dlc = cf.frame.can_dlc;
+	memcpy(set->slots[i].data, cf.frame.data, 8);
+    }
+
+    if ((dev = rtcan_dev_get_by_index(ifindex)) == NULL) {
+	ret = -ENXIO;
+	goto out_free;
+    }
+
+    down(&rtcan_cyclic_nrt_lock);
+
+    if (sock->cyclic) {
+	ret = -EBUSY;
+	goto out_unlock;
+    }
+
+    cyc = rtcan_cyclic_get(dev);
+    if (!cyc) {
+	ret = -ENOMEM;
+	goto out_unlock;
+    }
+
+    if (user_info) {
+	/* One reference for the socket, one for the mapping */
+	atomic_set(&set->refcount, 2);
+	ret = rtdm_mmap_to_user(user_info, set->slots, set->size,
+				PROT_READ | PROT_WRITE, &addr,
+				&rtcan_cyclic_vm_ops, set);
+	if (ret) {
+	    rtcan_cyclic_put(dev);
+	    goto out_unlock;
+	}
+    } else {
+	atomic_set(&set->refcount, 1);
+	addr = set->slots;
+    }
+
+    set->sock = sock;
+    set->dev = dev;
+
+    /* The offsets count from now */
+    now = rtdm_clock_read();
+    for (i = 0; i < set->count; i++)
+	set->entry[i].next += now;
+
+    rtdm_lock_get_irqsave(&cyc->lock, lock_ctx);
+    list_add_tail(&set->list, &cyc->sets);
+    rtdm_lock_put_irqrestore(&cyc->lock, lock_ctx);
+
+    /* Let the task take the new deadlines into account */
+    rtdm_event_signal(&cyc->changed);
+
+    sock->cyclic = set;
+
+    up(&rtcan_cyclic_nrt_lock);
+
+    start->slots = addr;
+    start->size = set->size;
+
+    return 0;
+
+ out_unlock:
+    up(&rtcan_cyclic_nrt_lock);
+    rtcan_dev_dereference(dev);
+ out_free:
+    vfree(set->slots);
+    kfree(set);
+    return ret;
+}
+
+
+int rtcan_cyclic_stop(struct rtcan_socket *sock)
+{
+    struct rtcan_cyclic_set *set;
+    struct rtcan_device *dev;
+    struct rtcan_cyclic *cyc;
+    rtdm_lockctx_t lock_ctx;
+    int busy;
+
+    down(&rtcan_cyclic_nrt_lock);
+
+    set = sock->cyclic;
+    if (!set) {
+	up(&rtcan_cyclic_nrt_lock);
+	return -EINVAL;
+    }
+    sock->cyclic = NULL;
+
+    dev = set->dev;
+    cyc = dev->cyclic;
+
+    rtdm_lock_get_irqsave(&cyc->lock, lock_ctx);
+    list_del(&set->list);
+    busy = (cyc->busy == set);
+    rtdm_lock_put_irqrestore(&cyc->lock, lock_ctx);
+
+    /* The task may still be sending a frame of the set, which takes one
+     * period at most */
+    while (busy) {
+	msleep(1);
+	rtdm_lock_get_irqsave(&cyc->lock, lock_ctx);
+	busy = (cyc->busy == set);
+	rtdm_lock_put_irqrestore(&cyc->lock, lock_ctx);
+    }
+
+    rtcan_cyclic_put(dev);
+
+    up(&rtcan_cyclic_nrt_lock);
+
+    rtcan_dev_dereference(dev);
+    rtcan_cyclic_set_put(set);
+
+    return 0;
+}
@@ -30,7 +30,9 @@
 #include <linux/module.h>
 
 #include "rtcan_internal.h"
+#include "rtcan_socket.h"
 #include "rtcan_dev.h"
+#include "rtcan_raw.h"
 
 
 static struct rtcan_device *rtcan_devices[RTCAN_MAX_DEVICES];
@@ -40,12 +42,9 @@ static int rtcan_global_init_done;
 
 DEFINE_BINARY_SEMAPHORE(rtcan_devices_nrt_lock);
 
-/* Spinlock for all reception lists and also for some members in
- * struct rtcan_socket */
-rtdm_lock_t rtcan_socket_lock;
-
-/* Spinlock for all reception lists and also for some members in
- * struct rtcan_socket */
+/* Spinlock serializing changes of the reception lists (bind, filters) and
+ * protecting the socket list. The reception path only takes the
+ * per-device recv_list_lock. */
 rtdm_lock_t rtcan_recv_list_lock;
 
 
@@ -53,7 +52,6 @@ rtdm_lock_t rtcan_recv_list_lock;
 static inline void rtcan_global_init(void)
 {
     if (!rtcan_global_init_done) {
-	rtdm_lock_init(&rtcan_socket_lock);
 	rtdm_lock_init(&rtcan_recv_list_lock);
 	rtcan_global_init_done = 1;
     }
@@ -156,9 +154,10 @@ void rtcan_dev_alloc_name(struct rtcan_device *dev, const char *mask)
 struct rtcan_device *rtcan_dev_alloc(int sizeof_priv, int sizeof_board_priv)
 {
     struct rtcan_device *dev;
-    struct rtcan_recv *recv_list_elem;
     int alloc_size;
+#ifdef CONFIG_XENO_DRIVERS_CAN_LOOPBACK
     int j;
+#endif
 
 
     alloc_size = sizeof(*dev) + sizeof_priv + sizeof_board_priv;
@@ -174,20 +173,27 @@ struct rtcan_device *rtcan_dev_alloc(int sizeof_priv, int sizeof_board_priv)
     sema_init(&dev->nrt_lock, 1);
 
     rtdm_lock_init(&dev->device_lock);
+    rtdm_lock_init(&dev->recv_list_lock);
+    seqcount_init(&dev->tx_seq);
+    seqcount_init(&dev->rx_seq);
 
     /* Init TX Semaphore, will be destroyed forthwith
      * when setting stop mode */
     rtdm_sem_init(&dev->tx_sem, 0);
+    rtdm_event_init(&dev->tx_event, 0);
 #ifdef RTCAN_USE_REFCOUNT
     atomic_set(&dev->refcount, 0);
 #endif
 
-    /* Initialize receive list */
-    dev->empty_list = recv_list_elem = dev->receivers;
-    for (j = 0; j < RTCAN_MAX_RECEIVERS - 1; j++, recv_list_elem++)
-	recv_list_elem->next = recv_list_elem + 1;
-    recv_list_elem->next = NULL;
-    dev->free_entries = RTCAN_MAX_RECEIVERS;
+    /* The reception list takes its entries from the pool shared by all
+     * devices, see rtcan_raw_filter.c */
+    dev->rx_handler = rtcan_rcv_list;
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_LOOPBACK
+    for (j = 0; j < RTCAN_TX_MAILBOXES; j++)
+	dev->tx_echo[j] = &dev->tx_echo_pool[j];
+    dev->tx_echo_next = &dev->tx_echo_pool[RTCAN_TX_MAILBOXES];
+#endif
 
     if (sizeof_priv)
 	dev->priv = (void *)((unsigned long)dev + sizeof(*dev));
@@ -201,11 +207,35 @@ void rtcan_dev_free (struct rtcan_device *dev)
 {
     if (dev != NULL) {
 	rtdm_sem_destroy(&dev->tx_sem);
+	rtdm_event_destroy(&dev->tx_event);
+	kfree(dev->recv_masks.recv);
 	kfree(dev);
     }
 }
 
 
+/*
+ * Fetch the statistics counters without taking any lock, retrying while a
+ * writer is in the middle of an update.
+ */
+void rtcan_dev_get_counters(struct rtcan_device *dev,
+			    struct rtcan_dev_counters *counters)
+{
+    unsigned int seq;
+
+    do {
+	seq = read_seqcount_begin(&dev->tx_seq);
+	counters->tx_count = dev->tx_count;
+    } while (read_seqcount_retry(&dev->tx_seq, seq));
+
+    do {
+	seq = read_seqcount_begin(&dev->rx_seq);
+	counters->rx_count = dev->rx_count;
+	counters->err_count = dev->err_count;
+    } while (read_seqcount_retry(&dev->rx_seq, seq));
+}
+
+
 static inline int __rtcan_dev_new_index(void)
 {
     int i;
@@ -219,6 +249,146 @@ static inline int __rtcan_dev_new_index(void)
 }
 
 
+#ifdef CONFIG_XENO_DRIVERS_CAN_STATS
+
+#define RTCAN_STATS_PERIOD      1000000000  /* ns */
+
+static inline void rtcan_traffic_add(struct rtcan_traffic *sum,
+				     struct rtcan_traffic *a,
+				     struct rtcan_traffic *b)
+{
+    sum->frames = a->frames + b->frames;
+    sum->bytes = a->bytes + b->bytes;
+    sum->bits = a->bits + b->bits;
+}
+
+/* Store the traffic of the last second */
+static void rtcan_stats_timer(rtdm_timer_t *timer)
+{
+    struct rtcan_device *dev =
+	container_of(timer, struct rtcan_device, stats_timer);
+    struct rtcan_stats_sample *sample = &dev->stats_samples[dev->stats_next];
+    struct rtcan_traffic now;
+
+    rtdm_lock_get(&dev->device_lock);
+    rtdm_lock_get(&dev->recv_list_lock);
+
+    rtcan_traffic_add(&now, &dev->stats_rx, &dev->stats_tx);
+    sample->frames = now.frames - dev->stats_last.frames;
+    sample->bytes = now.bytes - dev->stats_last.bytes;
+    sample->bits = now.bits - dev->stats_last.bits;
+    dev->stats_last = now;
+
+    dev->stats_next = (dev->stats_next + 1) % RTCAN_STATS_SAMPLES;
+    if (dev->stats_count < RTCAN_STATS_SAMPLES)
+	dev->stats_count++;
+
+    rtdm_lock_put(&dev->recv_list_lock);
+    rtdm_lock_put(&dev->device_lock);
+}
+
+static void rtcan_stats_init(struct rtcan_device *dev)
+{
+    rtdm_timer_init(&dev->stats_timer, rtcan_stats_timer, dev->name);
+}
+
+static void rtcan_stats_cleanup(struct rtcan_device *dev)
+{
+    rtdm_timer_destroy(&dev->stats_timer);
+}
+
+/*
+ * Sample the traffic only while the controller is started, nothing is
+ * counted otherwise. Called with device_lock held after the driver
+ * switched to @mode.
+ */
+void rtcan_stats_set_mode(struct rtcan_device *dev, can_mode_t mode)
+{
+    if (mode == CAN_MODE_START)
+	rtdm_timer_start(&dev->stats_timer, RTCAN_STATS_PERIOD,
+			 RTCAN_STATS_PERIOD, RTDM_TIMERMODE_RELATIVE);
+    else if (mode == CAN_MODE_STOP)
+	rtdm_timer_stop(&dev->stats_timer);
+}
+
+/*
+ * Fill in everything but the interface name of @stats. May be called from
+ * any context.
+ */
+void rtcan_dev_get_stats(struct rtcan_device *dev,
+			 struct rtcan_bus_stats *stats)
+{
+    static const unsigned int window_len[RTCAN_STATS_WINDOWS] = { 1, 10, 60 };
+    struct rtcan_stats_sample samples[RTCAN_STATS_SAMPLES];
+    struct rtcan_stats_id ids[RTCAN_STATS_ID_SLOTS];
+    struct rtcan_stats_window *window;
+    unsigned int next, count, frames, bytes, bits;
+    rtdm_lockctx_t lock_ctx;
+    int i, j, best;
+
+    rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+    rtdm_lock_get(&dev->recv_list_lock);
+
+    stats->rx_frames = dev->stats_rx.frames;
+    stats->rx_bytes = dev->stats_rx.bytes;
+    stats->rx_bits = dev->stats_rx.bits;
+    stats->tx_frames = dev->stats_tx.frames;
+    stats->tx_bytes = dev->stats_tx.bytes;
+    stats->tx_bits = dev->stats_tx.bits;
+    stats->bitrate = dev->baudrate;
+    memcpy(samples, dev->stats_samples, sizeof(samples));
+    memcpy(ids, dev->stats_ids, sizeof(ids));
+    next = dev->stats_next;
+    count = dev->stats_count;
+
+    rtdm_lock_put(&dev->recv_list_lock);
+    rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+
+    for (i = 0; i < RTCAN_STATS_WINDOWS; i++) {
+	window = &stats->window[i];
+	window->seconds = min(window_len[i], count);
+	frames = bytes = bits = 0;
+	for (j = 1; j <= window->seconds; j++) {
+	    struct rtcan_stats_sample *sample =
+		&samples[(next + RTCAN_STATS_SAMPLES - j) % RTCAN_STATS_SAMPLES];
+
+	    frames += sample->frames;
+	    bytes += sample->bytes;
+	    bits += sample->bits;
+	}
+	if (window->seconds) {
+	    frames /= window->seconds;
+	    bytes /= window->seconds;
+	    bits /= window->seconds;
+	}
+	window->frames = frames;
+	window->bytes = bytes;
+	window->load = stats->bitrate ?
+	    div_u64((u64)bits * 1000, stats->bitrate) : 0;
+    }
+
+    /* Pick the most frequent identifiers from the table */
+    for (stats->top_count = 0; stats->top_count < RTCAN_STATS_TOP_IDS;
+	 stats->top_count++) {
+	best = -1;
+	for (i = 0; i < RTCAN_STATS_ID_SLOTS; i++)
+	    if (ids[i].count && (best < 0 || ids[i].count > ids[best].count))
+		best = i;
+	if (best < 0)
+	    break;
+	stats->top[stats->top_count] = ids[best];
+	ids[best].count = 0;
+    }
+}
+
+#else /* !CONFIG_XENO_DRIVERS_CAN_STATS */
+
+static inline void rtcan_stats_init(struct rtcan_device *dev) { }
+static inline void rtcan_stats_cleanup(struct rtcan_device *dev) { }
+
+#endif /* CONFIG_XENO_DRIVERS_CAN_STATS */
+
+
 int rtcan_dev_register(struct rtcan_device *dev)
 {
     rtdm_lockctx_t context;
@@ -247,6 +417,7 @@ int rtcan_dev_register(struct rtcan_device *dev)
     rtcan_devices[dev->ifindex - 1] = dev;
 
     rtdm_lock_put_irqrestore(&rtcan_devices_rt_lock, context);
+    rtcan_stats_init(dev);
     rtcan_dev_create_proc(dev);
 
     up(&rtcan_devices_nrt_lock);
@@ -295,6 +466,8 @@ int rtcan_dev_unregister(struct rtcan_device *dev)
     rtdm_lock_put_irqrestore(&rtcan_devices_rt_lock, context);
     up(&rtcan_devices_nrt_lock);
 
+    rtcan_stats_cleanup(dev);
+
 #ifdef RTCAN_USE_REFCOUNT
     RTCAN_ASSERT(atomic_read(&dev->refcount) == 0,
 		 printk("RTCAN: dev reference counter < 0!\n"););
@@ -306,10 +479,55 @@ int rtcan_dev_unregister(struct rtcan_device *dev)
 }
 
 
-EXPORT_SYMBOL_GPL(rtcan_socket_lock);
+/*
+ * Account the end of the transmission from TX mailbox @mailbox in the
+ * latency histogram. To be called by the driver's TX-done path with
+ * device_lock held. A mailbox without submission time is skipped, e.g.
+ * one the driver reports done twice.
+ */
+void rtcan_tx_done(struct rtcan_device *dev, int mailbox)
+{
+    nanosecs_abs_t submit = dev->tx_submit[mailbox];
+    nanosecs_rel_t latency;
+    unsigned long long units;
+    int bucket = RTCAN_TX_LATENCY_BUCKETS - 1;
+
+    if (!submit)
+	return;
+    dev->tx_submit[mailbox] = 0;
+
+    latency = rtdm_clock_read() - submit;
+    units = latency >> 10;
+    if (units < (1ULL << (RTCAN_TX_LATENCY_BUCKETS - 1)))
+	bucket = fls((unsigned int)units);
+
+    dev->tx_latency[bucket]++;
+    if (latency > dev->tx_latency_max)
+	dev->tx_latency_max = latency;
+}
+
+
+/*
+ * Clear dev->tx_event if the TX slot just taken was the last one. The
+ * probe and the clearing happen under nklock, which rtdm_sem_up() and
+ * rtdm_event_signal() take as well, so a slot released meanwhile is not
+ * missed: either the probe sees it or its signal comes afterwards.
+ */
+void rtcan_dev_tx_taken(struct rtcan_device *dev)
+{
+    RTDM_EXECUTE_ATOMICALLY(
+	if (rtdm_sem_timeddown(&dev->tx_sem, RTDM_TIMEOUT_NONE, NULL))
+	    rtdm_event_clear(&dev->tx_event);
+	else
+	    rtdm_sem_up(&dev->tx_sem);
+    );
+}
+
+
 EXPORT_SYMBOL_GPL(rtcan_recv_list_lock);
 
 EXPORT_SYMBOL_GPL(rtcan_dev_free);
+EXPORT_SYMBOL_GPL(rtcan_dev_get_counters);
 
 EXPORT_SYMBOL_GPL(rtcan_dev_alloc);
 EXPORT_SYMBOL_GPL(rtcan_dev_alloc_name);
@@ -319,3 +537,5 @@ EXPORT_SYMBOL_GPL(rtcan_dev_unregister);
 
 EXPORT_SYMBOL_GPL(rtcan_dev_get_by_name);
 EXPORT_SYMBOL_GPL(rtcan_dev_get_by_index);
+
+EXPORT_SYMBOL_GPL(rtcan_tx_done);
@@ -31,6 +31,8 @@
 
 #include <asm/atomic.h>
 #include <linux/netdevice.h>
+#include <linux/seqlock.h>
+#include <linux/math64.h>
 
 #include "rtcan_list.h"
 
@@ -38,10 +40,31 @@
 /* Number of MSCAN devices the driver can handle */
 #define RTCAN_MAX_DEVICES    CONFIG_XENO_DRIVERS_CAN_MAX_DEVICES
 
-/* Maximum number of single filters per controller which can be registered
- * for reception at the same time using Bind */
+/* Number of reception list entries preallocated for all devices together,
+ * the pool grows beyond when sockets are bound in non-real-time context.
+ * Also the growth step of the mask arrays in struct rtcan_recv_masks. */
 #define RTCAN_MAX_RECEIVERS  CONFIG_XENO_DRIVERS_CAN_MAX_RECEIVERS
 
+/*
+ * The filters of the reception list which are not hashed, compiled into
+ * flat arrays in list order (inverted ones with inv set). A frame is
+ * matched against RTCAN_RECV_BLOCK of them at a time without following
+ * pointers, the set bits of the resulting word index the hits. The arrays
+ * are carved from one allocation starting at recv. It is made when a
+ * socket binds in non-real-time context and grows with the reception
+ * list pool, so that it always has room for size filters.
+ */
+#define RTCAN_RECV_BLOCK     32
+
+struct rtcan_recv_masks {
+    unsigned int        count;
+    unsigned int        size;
+    struct rtcan_recv   **recv;
+    uint32_t            *id;
+    uint32_t            *mask;
+    uint32_t            *inv;
+};
+
 /* Suppress handling of refcount if module support is not enabled
  * or modules cannot be unloaded */
 
@@ -68,6 +91,110 @@ struct can_bittiming_const {
 	__u32 brp_inc;
 };
 
+/*
+ * Single acceptance filter (ID/mask) letting pass at least all frames
+ * accepted by any filter of a device's reception list. CAN_EFF_FLAG in
+ * can_mask means the filter is restricted to the frame format given by
+ * CAN_EFF_FLAG in can_id, otherwise can_mask is 0 and every frame must be
+ * accepted. All other bits of can_mask apply to the identifier.
+ */
+struct rtcan_hw_filter {
+    uint32_t            can_id;
+    uint32_t            can_mask;
+};
+
+#define rtcan_hw_filter_accept_all(f)  (!((f)->can_mask & CAN_EFF_FLAG))
+
+/* Number of TX slots whose submission time is tracked, at least the
+ * number of frames a driver can hold: its hardware mailboxes plus the
+ * entries of a software TX queue in front of them */
+#define RTCAN_TX_MAILBOXES          32
+
+/* Buckets of the TX latency histogram. Bucket 0 counts latencies below
+ * 1024 ns, bucket n those from 2^(n+9) to 2^(n+10) - 1 ns, the last one
+ * also all longer ones. */
+#define RTCAN_TX_LATENCY_BUCKETS    24
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_STATS
+/* Seconds of traffic kept for the statistics windows */
+#define RTCAN_STATS_SAMPLES         60
+
+/* Counters of the CAN ID table (2^N) */
+#define RTCAN_STATS_ID_SLOTS        64
+
+struct rtcan_traffic {
+    unsigned long long  frames;
+    unsigned long long  bytes;
+    unsigned long long  bits;
+};
+
+/* Traffic of one second */
+struct rtcan_stats_sample {
+    unsigned int        frames;
+    unsigned int        bytes;
+    unsigned int        bits;
+};
+#endif /* CONFIG_XENO_DRIVERS_CAN_STATS */
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE
+/* Steps of the reception traced per frame */
+enum rtcan_trace_step {
+    RTCAN_TRACE_HW,         /* IRQ entry to frame read from controller */
+    RTCAN_TRACE_RCV,        /* ... to entry of rtcan_rcv() */
+    RTCAN_TRACE_LOCK,       /* ... to the first socket's rx_lock taken */
+    RTCAN_TRACE_DELIVER,    /* ... to all sockets served */
+    RTCAN_TRACE_WAKEUP,     /* delivery to reader returning from recv_sem */
+    RTCAN_TRACE_STEPS
+};
+
+/* Frames kept per step (2^N) */
+#define RTCAN_TRACE_SAMPLES         256
+
+/*
+ * Durations of the last frames per step in ns. The steps up to
+ * RTCAN_TRACE_DELIVER are written by rtcan_rcv() under recv_list_lock,
+ * the wakeup by the readers, which claim a sample with an atomic counter.
+ */
+struct rtcan_trace {
+    unsigned int        rx_next;
+    atomic_t            wake_next;
+    uint32_t            samples[RTCAN_TRACE_STEPS][RTCAN_TRACE_SAMPLES];
+};
+
+#define rtcan_trace_irq(skb, t)     ((skb)->trace_irq = (t))
+#define rtcan_trace_hw(skb)         ((skb)->trace_hw = rtdm_clock_read())
+#else /* !CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE */
+#define rtcan_trace_irq(skb, t)     do {} while(0)
+#define rtcan_trace_hw(skb)         do {} while(0)
+#endif /* CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE */
+
+/* Number of transactions which can wait for their response on a device at
+ * the same time */
+#define RTCAN_MAX_TRANSACTIONS      16
+
+/*
+ * Transaction waiting for its response, see RTCAN_RTIOC_TRANSACT. It lives
+ * on the stack of the waiting task and is entered into the device's table
+ * until rtcan_rcv() completes it or the task gives up.
+ */
+struct rtcan_transact {
+    uint32_t            can_id;
+    uint32_t            can_mask;
+    rtdm_event_t        done;
+    int                 matched;
+    can_frame_t         response;
+    nanosecs_abs_t      timestamp;
+};
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_LOOPBACK
+/* Frame to be looped back to the local sockets when its transmission is
+ * done, see rtcan_loopback() */
+struct rtcan_tx_echo {
+    struct rtcan_skb    skb;
+    struct rtcan_socket *sock;
+};
+#endif /* CONFIG_XENO_DRIVERS_CAN_LOOPBACK */
+
 struct rtcan_device {
     unsigned int        version;
 
@@ -90,16 +217,17 @@ struct rtcan_device {
 
     struct semaphore    nrt_lock;   /* non-real-time locking        */
 
-    /* Spinlock for all devices (but not for all attributes) and also for HW
-     * access to all CAN controllers
-     */
-    rtdm_lock_t         device_lock;
 
     /* Acts as a mutex allowing only one sender to write to the MSCAN
      * simultaneously. Created when the controller goes into operating mode,
      * destroyed if it goes into reset mode. */
     rtdm_sem_t          tx_sem;
 
+    /* Set while a TX slot may be free, for select(). Unlike tx_sem it
+     * lives as long as the device, so selectors stay bound across mode
+     * changes. See rtcan_dev_tx_open(). */
+    rtdm_event_t        tx_event;
+
     /* Baudrate of this device. Protected by device_lock in all device
      * structures. */
     unsigned int        can_sys_clock;
@@ -112,9 +240,12 @@ struct rtcan_device {
     struct can_bittime  bit_time;
     const struct can_bittiming_const *bittiming_const;
 
-    /* State which the controller is in. Protected by device_lock in all
-     * device structures. */
-    can_state_t state;
+    /* Bitrate and bit timing of the data phase of CAN FD frames, set by
+     * RTCAN_RTIOC_SET_DATA_BITTIME. The limits are only given by
+     * controllers supporting CAN FD. Protected by device_lock. */
+    can_baudrate_t      data_baudrate;
+    struct can_bittime_std data_bit_time;
+    const struct can_bittiming_const *data_bittiming_const;
 
     /* State which the controller was before sleeping. Protected by
      * device_lock in all device structures. */
@@ -124,9 +255,20 @@ struct rtcan_device {
      * device structures. */
     can_ctrlmode_t       ctrl_mode;
 
+    /* Acceptance filter for the controller, a superset of all filters in
+     * the reception list. Drivers program it when the controller is
+     * started. Protected by device_lock. */
+    struct rtcan_hw_filter hw_filter;
+
     /* Device operations */
     int                 (*hard_start_xmit)(struct rtcan_device *dev,
 					   struct can_frame *frame);
+    /* Optional, set by controllers supporting CAN FD. Called like
+     * hard_start_xmit() for FD frames, only while CAN_CTRLMODE_FD is set.
+     * Received FD frames are passed to rtcan_rcv() with RTCAN_FD_FRAME in
+     * the can_dlc of their skb. */
+    int                 (*hard_start_xmit_fd)(struct rtcan_device *dev,
+					      struct canfd_frame *frame);
     int                 (*do_set_mode)(struct rtcan_device *dev,
 				       can_mode_t mode,
 				       rtdm_lockctx_t *lock_ctx);
@@ -137,33 +279,150 @@ struct rtcan_device {
 #ifdef CONFIG_XENO_DRIVERS_CAN_BUS_ERR
     void                (*do_enable_bus_err)(struct rtcan_device *dev);
 #endif
+    /* Optional, for controllers supporting CAN FD. Called with
+     * device_lock held and the controller stopped. */
+    int                 (*do_set_data_bit_time)(struct rtcan_device *dev,
+						struct can_bittime_std *bit_time,
+						rtdm_lockctx_t *lock_ctx);
+    /* Optional, driver specific requests, see rtcan_raw_ioctl_driver().
+     * @arg is a kernel copy of the argument, which starts with the name
+     * of the interface. Called without locks held, in real-time or
+     * non-real-time context. */
+    int                 (*do_ioctl)(struct rtcan_device *dev,
+				    int request, void *arg);
+
+    /*
+     * Transmission path, written on every frame sent and every TX done
+     * interrupt. Starts on a cache line of its own.
+     */
+
+    /* Spinlock for all devices (but not for all attributes) and also for HW
+     * access to all CAN controllers
+     */
+    rtdm_lock_t          device_lock ____cacheline_aligned_in_smp;
+
+    /* State which the controller is in. Protected by device_lock in all
+     * device structures. */
+    can_state_t          state;
+
+    /* TX slot used by the last hard_start_xmit() call. Only drivers
+     * with several mailboxes set it, see rtcan_tx_done(). */
+    int                  tx_mailbox;
+
+    /* CAN_RAW_TX_PRIO of the socket sending the frame passed to
+     * hard_start_xmit(), for drivers scheduling their mailboxes */
+    int                  tx_prio;
+
+    /* Frames passed to hard_start_xmit(). Written under device_lock
+     * inside tx_seq, see rtcan_dev_get_counters(). */
+    seqcount_t           tx_seq;
+    u64                  tx_count;
+
+    /* Time each mailbox was handed its frame, 0 once accounted, and the
+     * histogram of the time from there to the end of the transmission.
+     * Protected by device_lock. */
+    nanosecs_abs_t       tx_submit[RTCAN_TX_MAILBOXES];
+    unsigned int         tx_latency[RTCAN_TX_LATENCY_BUCKETS];
+    nanosecs_rel_t       tx_latency_max;
+
+    /*
+     * Reception path, written on every frame received. Starts on a cache
+     * line of its own.
+     */
+
+    /* Spinlock for the reception list and its lookup index. Taken by the
+     * driver around rtcan_rcv() and rtcan_loopback(), nested inside
+     * device_lock, and by the bind code nested inside
+     * rtcan_recv_list_lock. */
+    rtdm_lock_t                     recv_list_lock ____cacheline_aligned_in_smp;
 
     /* Reception list head. This list contains all filters which have been
-     * registered via a bind call. */
+     * registered via a bind call. Protected by recv_list_lock. */
     struct rtcan_recv               *recv_list;
 
-    /* Empty list head. This list contains all empty entries not needed
-     * by the reception list and therefore is disjunctive with it. */
-    struct rtcan_recv               *empty_list;
+    /* Reception path called by rtcan_rcv(), rtcan_rcv_list() or, while
+     * rx_single is the only entry of the reception list and accepts all
+     * frames, rtcan_rcv_single(). Selected by rtcan_raw_index_filter(),
+     * protected by recv_list_lock. */
+    void                            (*rx_handler)(struct rtcan_device *dev,
+						  struct rtcan_skb *skb);
+    struct rtcan_recv               *rx_single;
+
+    /* Frames and error frames received, loopback echoes included.
+     * Written under recv_list_lock inside rx_seq, see
+     * rtcan_dev_get_counters(). */
+    seqcount_t                      rx_seq;
+    u64                             rx_count;
+    u64                             err_count;
+
+    /* Number of sockets with CAN_RAW_LATENCY_CRITICAL bound to the
+     * device. Drivers moderating their receive interrupts don't do so
+     * while it is non-zero. Changed under recv_list_lock. */
+    unsigned int                    rx_critical;
+
+    /* Transactions waiting for their response, checked by rtcan_rcv()
+     * while transact_count is non-zero. Protected by recv_list_lock. */
+    unsigned int                    transact_count;
+    struct rtcan_transact           *transact[RTCAN_MAX_TRANSACTIONS];
+
+    /* Lookup index over the reception list, see rtcan_list.h. Rebuilt by
+     * rtcan_raw_add_filter() and rtcan_raw_remove_filter(). */
+    struct rtcan_recv               *recv_hash[RTCAN_RECV_HASH_SIZE];
+    struct rtcan_recv_masks         recv_masks;
+
+    /* Bus the device is attached to, set by drivers which know it (the
+     * virtual bus), NULL otherwise. Routing rules between two devices
+     * on the same bus are refused, they would forward in a loop. */
+    void                            *bus;
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_STATS
+    /* Traffic counters, the RX side protected by recv_list_lock, the TX
+     * side by device_lock. Error frames and loopback echoes are not
+     * counted. */
+    struct rtcan_traffic stats_rx;
+    struct rtcan_traffic stats_tx;
+    struct rtcan_stats_id stats_ids[RTCAN_STATS_ID_SLOTS];
+
+    /* Traffic of the last seconds, sampled by stats_timer under both
+     * locks. stats_next is the sample to be written next. */
+    rtdm_timer_t         stats_timer;
+    struct rtcan_traffic stats_last;
+    struct rtcan_stats_sample stats_samples[RTCAN_STATS_SAMPLES];
+    unsigned int         stats_next;
+    unsigned int         stats_count;
+#endif
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE
+    struct rtcan_trace   trace;
+#endif
 
-    /* Preallocated array for the list entries. To increase cache
-     * locality all list elements are kept in this array. */
-    struct rtcan_recv               receivers[RTCAN_MAX_RECEIVERS];
+#ifdef CONFIG_XENO_DRIVERS_CAN_CYCLIC
+    /* Scheduler of the cyclic transmission sets, created with the first
+     * set, see rtcan_cyclic.c */
+    struct rtcan_cyclic  *cyclic;
+#endif
 
-    /* Indicates the length of the empty list */
-    int                             free_entries;
+#ifdef CONFIG_XENO_DRIVERS_CAN_GW
+    /* Routing rules with this device as source, checked by rtcan_rcv()
+     * while non-NULL. Protected by recv_list_lock. */
+    struct rtcan_gw_route *gw_routes;
 
-    /* A few statistics counters */
-    unsigned int tx_count;
-    unsigned int rx_count;
-    unsigned int err_count;
+    /* Queue and task sending the frames routed to this device, created
+     * with the first rule, see rtcan_gw.c */
+    struct rtcan_gw_queue *gw_queue;
+#endif
 
 #ifdef CONFIG_PROC_FS
     struct proc_dir_entry *proc_root;
 #endif
 #ifdef CONFIG_XENO_DRIVERS_CAN_LOOPBACK
-    struct rtcan_skb tx_skb;
-    struct rtcan_socket *tx_socket;
+    /* Echoes of the frames held by the TX mailboxes, indexed like
+     * tx_submit, and the one of the frame being passed to
+     * hard_start_xmit(). They point into tx_echo_pool and are exchanged
+     * instead of copied. Protected by device_lock. */
+    struct rtcan_tx_echo *tx_echo[RTCAN_TX_MAILBOXES];
+    struct rtcan_tx_echo *tx_echo_next;
+    struct rtcan_tx_echo tx_echo_pool[RTCAN_TX_MAILBOXES + 1];
 #endif /* CONFIG_XENO_DRIVERS_CAN_LOOPBACK */
 };
 
@@ -182,6 +441,186 @@ void rtcan_dev_alloc_name (struct rtcan_device *dev, const char *name_mask);
 struct rtcan_device *rtcan_dev_get_by_name(const char *if_name);
 struct rtcan_device *rtcan_dev_get_by_index(int ifindex);
 
+void rtcan_tx_done(struct rtcan_device *dev, int mailbox);
+
+/*
+ * Drivers open and close the TX slots (dev->tx_sem) and release them
+ * through these helpers, which keep dev->tx_event set whenever a sender
+ * would not block: after a release, and while the slots are closed and
+ * senders fail. rtcan_dev_tx_taken() clears it once the last slot is gone.
+ */
+static inline void rtcan_dev_tx_open(struct rtcan_device *dev,
+				     unsigned long slots)
+{
+    rtdm_sem_init(&dev->tx_sem, slots);
+    if (slots)
+	rtdm_event_signal(&dev->tx_event);
+    else
+	rtdm_event_clear(&dev->tx_event);
+}
+
+/* Also wakes up waiting senders, who fail with -ENETDOWN */
+static inline void rtcan_dev_tx_close(struct rtcan_device *dev)
+{
+    rtdm_sem_destroy(&dev->tx_sem);
+    rtdm_event_signal(&dev->tx_event);
+}
+
+static inline void rtcan_dev_tx_release(struct rtcan_device *dev)
+{
+    rtdm_sem_up(&dev->tx_sem);
+    rtdm_event_signal(&dev->tx_event);
+}
+
+void rtcan_dev_tx_taken(struct rtcan_device *dev);
+
+/* Consistent copy of the statistics counters of a device */
+struct rtcan_dev_counters {
+    u64 tx_count;
+    u64 rx_count;
+    u64 err_count;
+};
+
+void rtcan_dev_get_counters(struct rtcan_device *dev,
+			    struct rtcan_dev_counters *counters);
+
+/*
+ * Counter updates. Their writers are serialised by the lock named along
+ * with the counter, the sequence only lets rtcan_dev_get_counters() see
+ * both halves of a 64-bit value on 32-bit machines.
+ */
+static inline void rtcan_dev_count(seqcount_t *seq, u64 *counter)
+{
+    write_seqcount_begin(seq);
+    (*counter)++;
+    write_seqcount_end(seq);
+}
+
+#define rtcan_dev_count_tx(dev)   rtcan_dev_count(&(dev)->tx_seq, &(dev)->tx_count)
+#define rtcan_dev_count_rx(dev)   rtcan_dev_count(&(dev)->rx_seq, &(dev)->rx_count)
+#define rtcan_dev_count_err(dev)  rtcan_dev_count(&(dev)->rx_seq, &(dev)->err_count)
+
+/*
+ * For drivers passing a frame from one TX slot to another, e.g. from a
+ * software queue to a hardware mailbox: takes its submission time and
+ * loopback echo along. Called with device_lock held.
+ */
+static inline void rtcan_tx_move(struct rtcan_device *dev, int from, int to)
+{
+#ifdef CONFIG_XENO_DRIVERS_CAN_LOOPBACK
+    struct rtcan_tx_echo *echo = dev->tx_echo[to];
+
+    dev->tx_echo[to] = dev->tx_echo[from];
+    dev->tx_echo[from] = echo;
+#endif
+    dev->tx_submit[to] = dev->tx_submit[from];
+}
+
+/*
+ * For drivers dropping the frame of a TX slot without sending it, e.g.
+ * on bus-off: no loopback echo and submission time is left behind for
+ * the next frame of the slot. Called with device_lock held.
+ */
+static inline void rtcan_tx_forget(struct rtcan_device *dev, int mailbox)
+{
+#ifdef CONFIG_XENO_DRIVERS_CAN_LOOPBACK
+    dev->tx_echo[mailbox]->sock = NULL;
+#endif
+    dev->tx_submit[mailbox] = 0;
+}
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_STATS
+/* Format of a frame passed to rtcan_stats_rx() and rtcan_stats_tx() */
+#define RTCAN_STATS_FD      0x1     /* CAN FD frame */
+#define RTCAN_STATS_BRS     0x2     /* with the data phase at data_baudrate */
+
+/*
+ * Estimated number of bits a frame with @len payload bytes occupies on
+ * the bus, in bit times of the nominal bitrate: the part from SOF to the
+ * CRC with the worst case of stuff bits, plus CRC delimiter, ACK, EOF and
+ * intermission. The data phase of a CAN FD frame with bit rate switch,
+ * ESI to CRC, is scaled down by the ratio of the two bitrates.
+ */
+static inline unsigned int rtcan_frame_bits(struct rtcan_device *dev,
+					    uint32_t can_id, unsigned int len,
+					    unsigned int format)
+{
+    unsigned int bits, data;
+
+    if (!(format & RTCAN_STATS_FD)) {
+	bits = ((can_id & CAN_EFF_FLAG) ? 54 : 34) + 8 * len;
+	return bits + (bits - 1) / 4 + 13;
+    }
+
+    /* SOF to BRS */
+    bits = (can_id & CAN_EFF_FLAG) ? 36 : 17;
+    bits += (bits - 1) / 4 + 13;
+
+    /* ESI, DLC, data, stuff count and a CRC of 17 or 21 bits */
+    data = 8 * len + ((len > 16) ? 30 : 26);
+    data += (data - 1) / 4;
+
+    if ((format & RTCAN_STATS_BRS) && dev->data_baudrate &&
+	dev->data_baudrate != CAN_BAUDRATE_UNKNOWN &&
+	dev->baudrate && dev->baudrate != CAN_BAUDRATE_UNKNOWN)
+	data = div_u64((u64)data * dev->baudrate, dev->data_baudrate);
+
+    return bits + data;
+}
+
+static inline void rtcan_stats_count(struct rtcan_device *dev,
+				     struct rtcan_traffic *traffic,
+				     uint32_t can_id, unsigned int len,
+				     unsigned int format)
+{
+    traffic->frames++;
+    traffic->bytes += len;
+    traffic->bits += rtcan_frame_bits(dev, can_id, len, format);
+}
+
+/*
+ * Account a received frame. Each identifier maps to one counter of
+ * stats_ids, which it takes over once the counter dropped to 0 by frames
+ * of other identifiers. So the frequent identifiers stay in the table.
+ * Called with recv_list_lock held.
+ */
+static inline void rtcan_stats_rx(struct rtcan_device *dev,
+				  uint32_t can_id, unsigned int len,
+				  unsigned int format)
+{
+    struct rtcan_stats_id *id;
+    uint32_t hash = can_id ^ (can_id >> 6) ^ (can_id >> 12) ^ (can_id >> 18);
+
+    rtcan_stats_count(dev, &dev->stats_rx, can_id, len, format);
+
+    id = &dev->stats_ids[(hash ^ (hash >> 24)) & (RTCAN_STATS_ID_SLOTS - 1)];
+    if (id->can_id == can_id)
+	id->count++;
+    else if (id->count)
+	id->count--;
+    else {
+	id->can_id = can_id;
+	id->count = 1;
+    }
+}
+
+/* Account a frame handed to the controller, device_lock held */
+static inline void rtcan_stats_tx(struct rtcan_device *dev,
+				  uint32_t can_id, unsigned int len,
+				  unsigned int format)
+{
+    rtcan_stats_count(dev, &dev->stats_tx, can_id, len, format);
+}
+
+void rtcan_stats_set_mode(struct rtcan_device *dev, can_mode_t mode);
+void rtcan_dev_get_stats(struct rtcan_device *dev,
+			 struct rtcan_bus_stats *stats);
+#else /* !CONFIG_XENO_DRIVERS_CAN_STATS */
+#define rtcan_stats_rx(dev, can_id, len, format)    do {} while(0)
+#define rtcan_stats_tx(dev, can_id, len, format)    do {} while(0)
+#define rtcan_stats_set_mode(dev, mode)             do {} while(0)
+#endif /* CONFIG_XENO_DRIVERS_CAN_STATS */
+
 #ifdef RTCAN_USE_REFCOUNT
 #define rtcan_dev_reference(dev)      atomic_inc(&(dev)->refcount)
 #define rtcan_dev_dereference(dev)    atomic_dec(&(dev)->refcount)
@@ -0,0 +1,944 @@
+/*
+ * Extensions to the RT-Socket-CAN device profile
+ *
+ * Copyright (C) 2026 RT-Socket-CAN Development Team
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * This header complements <rtdm/rtcan.h> with the requests and socket
+ * options implemented by this driver in addition to the standard profile.
+ * It can be included by applications as well.
+ */
+
+#ifndef __RTCAN_EXT_H_
+#define __RTCAN_EXT_H_
+
+#include <rtdm/rtcan.h>
+
+
+/*
+ * Batched reception, see RTCAN_RTIOC_RECV_BATCH
+ */
+struct rtcan_recv_batch {
+    /* Buffer for up to @count frames */
+    can_frame_t         *frames;
+
+    /* Optional buffer for @count timestamps, may be NULL. Entries are 0
+     * if the socket does not take timestamps. */
+    nanosecs_abs_t      *timestamps;
+
+    /* Optional buffer for @count interface indices, may be NULL */
+    int                 *ifindex;
+
+    /* In: capacity of the buffers, up to RTCAN_RECV_BATCH_MAX. Out:
+     * number of frames received. */
+    unsigned int        count;
+
+    /* Keep on collecting frames until at least @min_count have been
+     * received or @timeout expired (0 or 1 = return what is available
+     * after the first frame). */
+    unsigned int        min_count;
+
+    /* Time to collect @min_count frames, counting from the call. The wait
+     * for the first frame is bound by the socket's reception timeout. */
+    nanosecs_rel_t      timeout;
+
+    /* MSG_DONTWAIT or 0 */
+    int                 flags;
+};
+
+/**
+ * Receive a batch of CAN frames
+ *
+ * @param [in,out] arg Pointer to struct rtcan_recv_batch
+ *
+ * @return Number of frames received (>= 1) on success, otherwise the
+ * same negative error codes as recvmsg(), or -EINVAL for an invalid count.
+ *
+ * Frames are fetched from the socket's ring buffer under a single lock
+ * acquisition per chunk and copied to the caller's buffers in one go.
+ */
+#define RTCAN_RTIOC_RECV_BATCH      _IOWR(RTIOC_TYPE_CAN, 0x20, \
+					  struct rtcan_recv_batch)
+
+#define RTCAN_RECV_BATCH_MAX        65536
+
+/*
+ * CAN FD frames, laid out like in Linux. The first 8 bytes match
+ * can_frame_t, len takes the place of can_dlc and is the payload length
+ * in bytes: 0 to 8, 12, 16, 20, 24, 32, 48 or 64. CAN FD has no remote
+ * frames.
+ */
+#ifndef CANFD_MAX_DLEN
+#define CANFD_MAX_DLEN              64
+
+#define CANFD_BRS                   0x01    /* bit rate switch */
+#define CANFD_ESI                   0x02    /* error state indicator */
+
+struct canfd_frame {
+    can_id_t            can_id;
+    uint8_t             len;
+    uint8_t             flags;
+    uint8_t             __res0;
+    uint8_t             __res1;
+    uint8_t             data[CANFD_MAX_DLEN] __attribute__((aligned(8)));
+};
+
+#define CAN_MTU                     (sizeof(can_frame_t))
+#define CANFD_MTU                   (sizeof(struct canfd_frame))
+#endif /* !CANFD_MAX_DLEN */
+
+/* Controller mode (SIOCSCANCTRLMODE) sending and receiving CAN FD frames,
+ * only accepted by drivers supporting it */
+#ifndef CAN_CTRLMODE_FD
+#define CAN_CTRLMODE_FD             0x20
+#endif
+
+/*
+ * Socket options (level SOL_CAN_RAW) in addition to the standard profile
+ */
+
+/**
+ * Size of the socket's receive ring buffer in bytes
+ *
+ * Takes an int. The value is rounded up to the next power of 2, at least
+ * 64 bytes; the maximum is set by the rcvbuf_max module parameter, 1 MiB
+ * by default. Frames pending in the old buffer are kept, the call fails
+ * with -EBUSY if they don't fit into the new one. The default is
+ * CONFIG_XENO_DRIVERS_CAN_RXBUF_SIZE. Each frame occupies 6 bytes plus its
+ * payload plus 8 bytes if timestamps are taken. The buffer is allocated
+ * in non-real-time context, a real-time caller is switched over.
+ */
+#define CAN_RAW_RCVBUF              0x10
+
+/**
+ * Transmission priority of the socket's frames
+ *
+ * Takes an int from 0 (default) to CAN_RAW_TX_PRIO_MAX. Drivers which
+ * hold several frames at once (C_CAN) hand frames of a higher priority to
+ * the bus first, frames of the same priority in the order of their CAN
+ * identifiers, i.e. as bus arbitration would. Other drivers ignore it.
+ */
+#define CAN_RAW_TX_PRIO             0x11
+#define CAN_RAW_TX_PRIO_MAX         7
+
+/**
+ * Fixed-slot receive ring
+ *
+ * Takes an int, the number of slots (rounded up to the next power of 2,
+ * 4 to 65536), or 0 to return to the byte-packed ring buffer (default).
+ * Every frame occupies one 24 byte slot regardless of its payload and
+ * timestamp. The reception path stores and the readers fetch a slot with
+ * a single copy, and readers don't take the socket's lock. Fails with
+ * -EBUSY if frames are pending.
+ */
+#define CAN_RAW_RX_SLOTS            0x12
+
+/**
+ * Last-value cache
+ *
+ * Takes an int, the number of distinct CAN IDs to keep (up to 4096), or
+ * 0 to return to the normal receive buffer (default). Instead of queuing
+ * every frame, the socket keeps only the latest frame of each CAN ID,
+ * overwriting it in place as repetitions arrive. A read returns one frame
+ * per ID that was updated since it was last read, the IDs in turn, so a
+ * slow reader sees current values and can't be overrun by cyclic frames.
+ * Frames of further IDs once the limit is reached are dropped and counted
+ * as buffer overflows. Frames differing only in the EFF or RTR flag are
+ * kept apart. Fails with -EBUSY if frames are pending or CAN_RAW_RX_SLOTS
+ * is set.
+ */
+#define CAN_RAW_LAST_VALUE          0x13
+
+/**
+ * Latency-critical reception
+ *
+ * Takes an int, non-zero to mark the socket as latency-critical (default
+ * 0). While such a socket is bound to an interface, its driver doesn't
+ * moderate receive interrupts (see RTCAN_RTIOC_SET_COALESCE), every frame
+ * is delivered as soon as it has been received. Takes effect immediately,
+ * also for a bound socket.
+ */
+#define CAN_RAW_LATENCY_CRITICAL    0x14
+
+/**
+ * CAN FD frames
+ *
+ * Takes an int, non-zero to let the socket send and receive CAN FD frames
+ * (default 0). Without it, FD frames received are not delivered to the
+ * socket. With it:
+ * - recvmsg() returns CAN_MTU for a classic frame and CANFD_MTU for a
+ *   struct canfd_frame. With a buffer smaller than CANFD_MTU, it fails
+ *   with -EMSGSIZE on an FD frame, which is left in the queue.
+ * - sendmsg() sends a passed struct canfd_frame (iov_len CANFD_MTU) as FD
+ *   frame, one per call, if the interface is in CAN_CTRLMODE_FD.
+ *   Otherwise it fails with -EOPNOTSUPP. Classic frames are sent as
+ *   before.
+ * - RTCAN_RTIOC_RECV_BATCH fails with -EINVAL.
+ * FD frames are never stored in a mapped ring, CAN_RAW_RX_SLOTS or
+ * CAN_RAW_LAST_VALUE, whose slots hold classic frames only. Fails with
+ * -EBUSY if frames are pending.
+ */
+#define CAN_RAW_FD_FRAMES           0x15
+
+/*
+ * CAN_RAW_RECV_OWN_MSGS of the standard profile (int, default 0) is
+ * supported as well: with loopback enabled, the sending socket receives
+ * its own frames, timestamped at the end of their transmission.
+ */
+
+/*
+ * Batched transmission: sendmsg() accepts a buffer holding an array of
+ * can_frame_t (iov_len a multiple of sizeof(can_frame_t)). The frames are
+ * sent in order, as many at once as the controller has TX slots free. The
+ * call returns the number of bytes accepted, which is less than iov_len if
+ * the timeout expired or an error occurred after the first frame. An error
+ * code is only returned if no frame was accepted at all.
+ */
+
+/*
+ * Waiting for several sockets: select() (rtdm_select() in RTDM) reports a
+ * socket readable while it holds frames and writable while the interface
+ * it is bound to has a free TX slot, so a single task can serve any number
+ * of sockets. Waiting for writability needs a socket bound to one
+ * interface (-EDESTADDRREQ otherwise). While the controller is stopped or
+ * bus-off, the socket is reported writable as well, sending fails with
+ * -ENETDOWN then. With a mapped ring, readability is signalled when the ring becomes non-empty;
+ * the indication is reset by RTCAN_RTIOC_RING_WAIT finding the ring empty,
+ * e.g. with a timeout of RTDM_TIMEOUT_NONE after the ring has been
+ * drained. The socket must be added to the select set after mapping.
+ */
+
+/*
+ * Shared reception ring, see RTCAN_RTIOC_MMAP_RING
+ *
+ * The mapped area starts with struct rtcan_ring_header, followed by
+ * slot_count entries of struct rtcan_ring_slot. The kernel advances head
+ * after a slot has been written, user space advances tail after it has
+ * consumed one. Both are free-running counters, the slot of a counter
+ * value is (value & (slot_count - 1)). The ring is empty if head == tail.
+ * A consumer must read head before the slot contents and must have read
+ * the slot before writing tail (memory barriers on SMP). The kernel never
+ * overwrites unconsumed slots: frames arriving on a full ring are dropped
+ * and counted in overruns, which also shows up as a gap in seq.
+ */
+struct rtcan_ring_slot {
+    can_frame_t         frame;
+
+    /* Reception time, always taken in ring mode */
+    nanosecs_abs_t      timestamp;
+
+    /* Interface the frame was received on */
+    int32_t             ifindex;
+
+    /* Sequence number of the frame, counting dropped frames as well */
+    uint32_t            seq;
+};
+
+struct rtcan_ring_header {
+    /* Written by the kernel */
+    volatile uint32_t   head;
+    uint32_t            slot_count;
+    volatile uint32_t   overruns;
+    uint32_t            __reserved1[13];
+
+    /* Written by user space, kept in a cache line of its own */
+    volatile uint32_t   tail;
+    uint32_t            __reserved2[15];
+};
+
+struct rtcan_ring_map {
+    /* In: requested number of slots (power of 2, 0 for the default),
+     * out: number of slots of the ring */
+    unsigned int        slots;
+
+    /* Out: start address and length of the mapping (for munmap) */
+    void                *addr;
+    size_t              size;
+};
+
+/**
+ * Map a reception ring into the caller's address space
+ *
+ * @param [in,out] arg Pointer to struct rtcan_ring_map
+ *
+ * @return 0 on success, otherwise:
+ * - -EBUSY: a ring of this socket is still mapped
+ * - -EINVAL: invalid number of slots
+ * - -ENOMEM: out of memory
+ * - -ENOSYS: called from real-time mode (the request is handled in
+ *   non-real-time context only)
+ *
+ * From now on until the last mapping is removed (munmap or close), frames
+ * are written to the ring instead of the socket's buffer and recvmsg()
+ * as well as RTCAN_RTIOC_RECV_BATCH fail with -EBUSY. Frames which have
+ * been queued before remain in the socket buffer.
+ */
+#define RTCAN_RTIOC_MMAP_RING       _IOWR(RTIOC_TYPE_CAN, 0x21, \
+					  struct rtcan_ring_map)
+
+/**
+ * Wait for the mapped reception ring to become non-empty
+ *
+ * @param [in] arg Pointer to a nanosecs_rel_t timeout value
+ *
+ * @return 0 if the ring holds at least one frame, otherwise:
+ * - -EINVAL: no ring is mapped
+ * - -ETIMEDOUT, -EINTR, -EBADF, -EAGAIN: as for recvmsg()
+ */
+#define RTCAN_RTIOC_RING_WAIT       _IOW(RTIOC_TYPE_CAN, 0x22, nanosecs_rel_t)
+
+/*
+ * Traffic statistics of a device, see RTCAN_RTIOC_BUS_STATS
+ */
+
+/* Averages over the last 1, 10 and 60 seconds */
+#define RTCAN_STATS_WINDOWS         3
+
+/* Entries of the most frequent CAN ID table */
+#define RTCAN_STATS_TOP_IDS         16
+
+struct rtcan_stats_window {
+    /* Seconds covered, less than the window while the device is young.
+     * Only seconds in which the device was started are sampled. */
+    uint32_t            seconds;
+
+    /* Frames and payload bytes per second, received and sent */
+    uint32_t            frames;
+    uint32_t            bytes;
+
+    /* Bus load in 1/10 % of the bitrate */
+    uint32_t            load;
+};
+
+struct rtcan_stats_id {
+    uint32_t            can_id;
+    uint32_t            count;
+};
+
+struct rtcan_bus_stats {
+    /* In: name of the interface */
+    char                ifname[IFNAMSIZ];
+
+    /* Totals since the device was registered. Bits are estimated from
+     * the frame format and length, with the worst case of bit stuffing,
+     * in bit times of the nominal bitrate. */
+    uint64_t            rx_frames;
+    uint64_t            rx_bytes;
+    uint64_t            rx_bits;
+    uint64_t            tx_frames;
+    uint64_t            tx_bytes;
+    uint64_t            tx_bits;
+
+    /* Bitrate the load refers to, 0 if unknown (no load is given then) */
+    uint32_t            bitrate;
+
+    struct rtcan_stats_window window[RTCAN_STATS_WINDOWS];
+
+    /* Most frequent received identifiers (including the CAN_EFF_FLAG and
+     * CAN_RTR_FLAG bits), by decreasing count. The table is approximate:
+     * identifiers compete for a small number of counters, the counts of
+     * those reported are lower bounds. */
+    uint32_t            top_count;
+    struct rtcan_stats_id top[RTCAN_STATS_TOP_IDS];
+};
+
+/**
+ * Get the traffic statistics of a device
+ *
+ * @param [in,out] arg Pointer to struct rtcan_bus_stats
+ *
+ * @return 0 on success, otherwise:
+ * - -ENODEV: no device of this name
+ * - -EOPNOTSUPP: statistics are disabled (CONFIG_XENO_DRIVERS_CAN_STATS)
+ *
+ * The same data is shown in /proc/rtcan/<ifname>/stats.
+ */
+#define RTCAN_RTIOC_BUS_STATS       _IOWR(RTIOC_TYPE_CAN, 0x23, \
+					  struct rtcan_bus_stats)
+
+/*
+ * Driver specific requests: requests of the RTIOC_TYPE_CAN type whose
+ * argument starts with the name of an interface (char[IFNAMSIZ]) are
+ * passed to the driver of that interface. They fail with -EOPNOTSUPP if
+ * it does not handle them.
+ */
+
+/*
+ * Virtual bus (xeno_can_virt), see RTCAN_RTIOC_VIRT_SET_CONFIG
+ */
+struct rtcan_virt_config {
+    /* In: name of any device of the virtual bus */
+    char                ifname[IFNAMSIZ];
+
+    /* Bitrate of the bus, 0 to deliver frames instantly. With a bitrate,
+     * each frame occupies the bus for its length in bits (including stuff
+     * bits) at the bitrate of the sending device, concurrent frames are
+     * arbitrated by identifier and a sender's TX slot is freed at the end
+     * of its frame. Can only be changed while all devices are stopped,
+     * it sets their bitrate as well. */
+    uint32_t            bitrate;
+
+    /* Background traffic in 1/10 % of the bitrate, 0 for none. It is
+     * sent by a node without interface, frames which could not go out
+     * before the next one was due are skipped. */
+    uint32_t            load;
+
+    /* Identifier and payload length of the background frames */
+    uint32_t            load_id;
+    uint32_t            load_dlc;
+
+    /* Out: background frames sent and skipped (ignored on set) */
+    uint32_t            load_frames;
+    uint32_t            load_skipped;
+};
+
+/**
+ * Get the configuration of the virtual bus
+ *
+ * @param [in,out] arg Pointer to struct rtcan_virt_config
+ *
+ * @return 0 on success, otherwise:
+ * - -ENODEV: no device of this name
+ * - -EOPNOTSUPP: not a device of the virtual bus
+ */
+#define RTCAN_RTIOC_VIRT_GET_CONFIG _IOWR(RTIOC_TYPE_CAN, 0x24, \
+					  struct rtcan_virt_config)
+
+/**
+ * Configure the virtual bus
+ *
+ * @param [in] arg Pointer to struct rtcan_virt_config
+ *
+ * @return 0 on success, otherwise:
+ * - -ENODEV: no device of this name
+ * - -EOPNOTSUPP: not a device of the virtual bus
+ * - -EBUSY: bitrate changed while a device is started
+ * - -EINVAL: load above 1000, load without bitrate or invalid frame
+ *
+ * The initial configuration is given by the module parameters of the
+ * same names.
+ */
+#define RTCAN_RTIOC_VIRT_SET_CONFIG _IOW(RTIOC_TYPE_CAN, 0x25, \
+					 struct rtcan_virt_config)
+
+/*
+ * Receive interrupt moderation, see RTCAN_RTIOC_SET_COALESCE
+ */
+struct rtcan_coalesce {
+    /* In: name of the interface */
+    char                ifname[IFNAMSIZ];
+
+    /* Longest time in us a received frame may wait before it is handed
+     * to the sockets, 0 to disable moderation (default). Up to
+     * RTCAN_COALESCE_MAX_USECS. Controllers without receive timestamps
+     * (C_CAN) date the frames of a window at its end, so their timestamps
+     * may be up to rx_usecs late. */
+    uint32_t            rx_usecs;
+
+    /* Number of frames which end the wait early, 0 or 1 for none (only
+     * the time counts). Rounded to what the controller supports. */
+    uint32_t            rx_frames;
+
+    /* Out: moderation windows opened and frames delivered at their end
+     * since the driver was loaded (ignored on set). C_CAN with its
+     * receive task (rx_thread) counts the windows only. */
+    uint32_t            rx_windows;
+    uint32_t            rx_coalesced;
+};
+
+#define RTCAN_COALESCE_MAX_USECS    1000
+
+/**
+ * Get the receive interrupt moderation of an interface
+ *
+ * @param [in,out] arg Pointer to struct rtcan_coalesce
+ *
+ * @return 0 on success, otherwise:
+ * - -ENODEV: no device of this name
+ * - -EOPNOTSUPP: the driver does not moderate interrupts
+ */
+#define RTCAN_RTIOC_GET_COALESCE    _IOWR(RTIOC_TYPE_CAN, 0x29, \
+					  struct rtcan_coalesce)
+
+/**
+ * Set the receive interrupt moderation of an interface
+ *
+ * @param [in] arg Pointer to struct rtcan_coalesce
+ *
+ * @return 0 on success, otherwise:
+ * - -ENODEV: no device of this name
+ * - -EOPNOTSUPP: the driver does not moderate interrupts
+ * - -EINVAL: rx_usecs above RTCAN_COALESCE_MAX_USECS
+ *
+ * With moderation, the first frame received opens a window of rx_usecs
+ * in which the driver leaves the receive interrupt off. The frames
+ * received up to its end, or up to rx_frames, are delivered in one go,
+ * which saves interrupts on a busy bus at the cost of latency. Nothing
+ * is moderated while a socket with CAN_RAW_LATENCY_CRITICAL is bound to
+ * the interface. Supported by:
+ * - FlexCAN: rx_frames > 1 ends the window when the RX FIFO holds 5
+ *   frames (its warning level), 1 frame before it is full.
+ * - C_CAN: only the time counts. The 16 receive objects must not fill up
+ *   within rx_usecs, or frames are lost.
+ * Takes effect with the next frame received.
+ */
+#define RTCAN_RTIOC_SET_COALESCE    _IOW(RTIOC_TYPE_CAN, 0x2a, \
+					 struct rtcan_coalesce)
+
+/*
+ * Request/response exchange, see RTCAN_RTIOC_TRANSACT
+ */
+struct rtcan_transaction {
+    /* In: interface to use, 0 for the one the socket is bound to */
+    int                 ifindex;
+
+    /* In: frame to send */
+    can_frame_t         request;
+
+    /* In: the response is the first frame received afterwards with
+     * (can_id & resp_mask) == (resp_id & resp_mask). Include CAN_EFF_FLAG
+     * and CAN_RTR_FLAG in the mask to check the frame format as well.
+     * Error frames never match. */
+    uint32_t            resp_id;
+    uint32_t            resp_mask;
+
+    /* In: timeout for sending and receiving together, in ns (0 for
+     * infinite) */
+    nanosecs_rel_t      timeout;
+
+    /* Out: response and its reception time */
+    can_frame_t         response;
+    nanosecs_abs_t      timestamp;
+};
+
+/**
+ * Send a request and wait for the matching response
+ *
+ * @param [in,out] arg Pointer to struct rtcan_transaction
+ *
+ * @return 0 on success, otherwise:
+ * - -ETIMEDOUT: no response within the timeout
+ * - -EBUSY: too many transactions are pending on the interface
+ * - -ENXIO: no interface given and the socket is not bound to one
+ * - -EINVAL: invalid request frame
+ * - -ENOSYS: called from non-real-time mode
+ * - -ENETDOWN, -ECOMM, -EIO, -EINTR, -EBADF, -EAGAIN: as for sendmsg()
+ *
+ * The match is armed before the request is sent, the socket's filters
+ * play no role. The response is delivered to the sockets whose filters
+ * accept it as usual, so a socket only used for transactions is best
+ * left unbound (with ifindex set) or bound without filters.
+ */
+#define RTCAN_RTIOC_TRANSACT        _IOWR(RTIOC_TYPE_CAN, 0x28, \
+					  struct rtcan_transaction)
+
+/*
+ * Cyclic transmission, see RTCAN_RTIOC_CYCLIC_START
+ */
+
+/* Limits of a transmission set */
+#define RTCAN_CYCLIC_MAX_FRAMES     64
+#define RTCAN_CYCLIC_MIN_PERIOD     100000
+
+struct rtcan_cyclic_frame {
+    /* Frame to send, its payload can be changed through the slot */
+    can_frame_t         frame;
+
+    /* Period and position of the first transmission after the start, in
+     * ns. The offset must be less than the period. */
+    nanosecs_rel_t      period;
+    nanosecs_rel_t      offset;
+};
+
+/* Set in flags of a slot to suspend its transmissions */
+#define RTCAN_CYCLIC_PAUSED         0x01
+
+/*
+ * Slot of a frame of a running set in the area mapped by
+ * RTCAN_RTIOC_CYCLIC_START. User space changes can_dlc, flags and data
+ * under seq: it increments seq to an odd value, writes the fields and
+ * increments seq again, with write barriers in between (see
+ * rtcan_cyclic_update()). A transmission falling into an update sends
+ * the previous contents, so a frame never carries a mix of both.
+ */
+struct rtcan_cyclic_slot {
+    volatile uint32_t   seq;
+    uint8_t             can_dlc;
+    uint8_t             flags;
+    uint16_t            __reserved;
+    uint8_t             data[8];
+
+    /* Written by the kernel: frames handed to the controller and
+     * transmissions which could not take place in their period, as the
+     * controller had no TX slot free or was not operating */
+    volatile uint32_t   sent;
+    volatile uint32_t   missed;
+};
+
+struct rtcan_cyclic_start {
+    /* In: interface to send on, 0 for the one the socket is bound to */
+    int                 ifindex;
+
+    /* In: number of frames and their array */
+    unsigned int        count;
+    struct rtcan_cyclic_frame *frames;
+
+    /* Out: start address and length of the mapped slots (for munmap),
+     * one per frame in the order given */
+    struct rtcan_cyclic_slot *slots;
+    size_t              size;
+};
+
+#ifndef __KERNEL__
+/* Change the payload of a cyclic frame */
+static inline void rtcan_cyclic_update(struct rtcan_cyclic_slot *slot,
+				       uint8_t can_dlc, const uint8_t *data)
+{
+    int i;
+
+    slot->seq++;
+    __sync_synchronize();
+    slot->can_dlc = can_dlc;
+    for (i = 0; i < 8; i++)
+	slot->data[i] = data[i];
+    __sync_synchronize();
+    slot->seq++;
+}
+#endif
+
+/**
+ * Start sending a set of frames cyclically
+ *
+ * @param [in,out] arg Pointer to struct rtcan_cyclic_start
+ *
+ * @return 0 on success, otherwise:
+ * - -EBUSY: the socket runs a set already
+ * - -ENXIO: no interface given and the socket is not bound to one
+ * - -EINVAL: invalid frame, period or offset, or count out of range
+ * - -ENOMEM: out of memory
+ * - -EOPNOTSUPP: cyclic transmission is disabled
+ *   (CONFIG_XENO_DRIVERS_CAN_CYCLIC)
+ * - -ENOSYS: called from real-time mode (the request is handled in
+ *   non-real-time context only)
+ *
+ * The frames are sent by a kernel task of the interface, so their timing
+ * does not depend on the caller. All sets of an interface share this task,
+ * frames due at the same time go out in the order of their deadlines.
+ * The set runs until RTCAN_RTIOC_CYCLIC_STOP or close(), the mapping
+ * stays valid until munmap. Loopback and CAN_RAW_TX_PRIO of the socket
+ * apply to the frames.
+ */
+#define RTCAN_RTIOC_CYCLIC_START    _IOWR(RTIOC_TYPE_CAN, 0x26, \
+					  struct rtcan_cyclic_start)
+
+/**
+ * Stop the cyclic transmission set of the socket
+ *
+ * @return 0 on success, otherwise:
+ * - -EINVAL: no set is running
+ * - -EOPNOTSUPP, -ENOSYS: as for RTCAN_RTIOC_CYCLIC_START
+ */
+#define RTCAN_RTIOC_CYCLIC_STOP     _IO(RTIOC_TYPE_CAN, 0x27)
+
+/*
+ * Routing rule, see RTCAN_RTIOC_GW_ADD
+ */
+struct rtcan_gw_rule {
+    /* Interface the frames are received on and the one they are sent to */
+    int                 src_ifindex;
+    int                 dst_ifindex;
+
+    /* Data frames whose ID matches can_id in the bits of can_mask are
+     * routed. The EFF and RTR flags are compared if set in can_mask.
+     * Error frames are never routed. */
+    uint32_t            can_id;
+    uint32_t            can_mask;
+
+    /* ID rewrite: the bits of mod_mask are replaced by those of mod_id,
+     * 0 keeps the ID as received */
+    uint32_t            mod_id;
+    uint32_t            mod_mask;
+
+    /* Out: handle of the rule for RTCAN_RTIOC_GW_DEL */
+    int                 handle;
+};
+
+#define RTCAN_GW_MAX_RULES          32
+
+/* Handle deleting all rules */
+#define RTCAN_GW_ALL                -1
+
+/**
+ * Add a routing rule
+ *
+ * @param [in,out] arg Pointer to struct rtcan_gw_rule
+ *
+ * @return 0 on success, otherwise:
+ * - -ENXIO: no interface with the given index
+ * - -EINVAL: source and destination are the same
+ * - -ELOOP: source and destination are on the same bus, as far as the
+ *   driver knows (the devices of the virtual bus)
+ * - -ENOSPC: RTCAN_GW_MAX_RULES rules exist already
+ * - -ENOMEM: out of memory
+ * - -EOPNOTSUPP: routing is disabled (CONFIG_XENO_DRIVERS_CAN_GW)
+ * - -ENOSYS: called from real-time mode (the request is handled in
+ *   non-real-time context only)
+ *
+ * Received frames matching a rule are forwarded to its destination, in
+ * addition to being delivered to the local sockets. A real-time task of
+ * the destination sends them in the order received. A frame is dropped
+ * if 64 frames are waiting already, if no TX slot becomes free within
+ * 10 ms or if its rewritten ID is invalid. The local sockets of the
+ * destination receive the routed frames if loopback is enabled.
+ *
+ * Rules are global and stay until deleted, independent of the socket
+ * which added them. They keep their interfaces from being unregistered.
+ * Controllers wired to the same bus must not be connected by a rule, the
+ * frames would be forwarded in a loop. CAN FD frames are not routed.
+ * The rules and the number of frames routed and dropped by each are
+ * listed in /proc/rtcan/gateway.
+ */
+#define RTCAN_RTIOC_GW_ADD          _IOWR(RTIOC_TYPE_CAN, 0x2b, \
+					  struct rtcan_gw_rule)
+
+/**
+ * Delete a routing rule
+ *
+ * @param [in] arg Handle of the rule (passed by value), or RTCAN_GW_ALL
+ *
+ * @return 0 on success, otherwise:
+ * - -EINVAL: invalid handle
+ * - -ENOENT: no rule with this handle
+ * - -EOPNOTSUPP, -ENOSYS: as for RTCAN_RTIOC_GW_ADD
+ *
+ * Frames of the rule still waiting are dropped.
+ */
+#define RTCAN_RTIOC_GW_DEL          _IOW(RTIOC_TYPE_CAN, 0x2c, int)
+
+/*
+ * Bit timing of the data phase of CAN FD frames, see
+ * RTCAN_RTIOC_SET_DATA_BITTIME
+ */
+struct rtcan_data_bittime {
+    /* In: name of the interface */
+    char                ifname[IFNAMSIZ];
+
+    /* Bitrate of the data phase, computed from the controller's limits,
+     * or 0 to take bit_time as is. Out: CAN_BAUDRATE_UNKNOWN if the
+     * timing was set directly. */
+    can_baudrate_t      bitrate;
+
+    struct can_bittime_std bit_time;
+};
+
+/**
+ * Get the data phase bit timing of an interface
+ *
+ * @param [in,out] arg Pointer to struct rtcan_data_bittime
+ *
+ * @return 0 on success, otherwise:
+ * - -ENODEV: no device of this name
+ * - -EOPNOTSUPP: the controller does not support CAN FD
+ */
+#define RTCAN_RTIOC_GET_DATA_BITTIME _IOWR(RTIOC_TYPE_CAN, 0x2d, \
+					   struct rtcan_data_bittime)
+
+/**
+ * Set the data phase bit timing of an interface
+ *
+ * @param [in] arg Pointer to struct rtcan_data_bittime
+ *
+ * @return 0 on success, otherwise:
+ * - -ENODEV: no device of this name
+ * - -EOPNOTSUPP: the controller does not support CAN FD
+ * - -EDOM: the bitrate can't be reached with the controller's clock
+ *
+ * Like SIOCSCANBAUDRATE, the controller is stopped and restarted if it
+ * is operating. Frames with CANFD_BRS use this timing after the
+ * arbitration phase.
+ */
+#define RTCAN_RTIOC_SET_DATA_BITTIME _IOW(RTIOC_TYPE_CAN, 0x2e, \
+					  struct rtcan_data_bittime)
+
+/*
+ * Bus capture, see RTCAN_RTIOC_CAPTURE_START
+ *
+ * The records are those of a pcap file with nanosecond timestamps and
+ * link type LINKTYPE_CAN_SOCKETCAN: struct rtcan_pcap_rec in host byte
+ * order, followed by the frame as struct can_frame (CAN_MTU) or struct
+ * canfd_frame (CANFD_MTU) with can_id in network byte order. The byte
+ * after the flags (__res0) holds the index of the receiving interface.
+ * A file starting with struct rtcan_pcap_hdr and continuing with the
+ * records as read from the kernel can be opened by the usual pcap tools.
+ * Timestamps are taken from rtdm_clock_read().
+ */
+#define RTCAN_PCAP_MAGIC_NSEC       0xa1b23c4d
+#define RTCAN_PCAP_LINKTYPE_CAN     227
+
+/* Set in the flags of CAN FD frames in the capture */
+#define RTCAN_PCAP_FDF              0x04
+
+struct rtcan_pcap_hdr {
+    uint32_t            magic;
+    uint16_t            version_major;      /* 2 */
+    uint16_t            version_minor;      /* 4 */
+    int32_t             thiszone;
+    uint32_t            sigfigs;
+    uint32_t            snaplen;
+    uint32_t            linktype;
+};
+
+struct rtcan_pcap_rec {
+    uint32_t            ts_sec;
+    uint32_t            ts_nsec;
+    uint32_t            incl_len;
+    uint32_t            orig_len;
+};
+
+/* Default and maximum size of each capture buffer */
+#define RTCAN_CAPTURE_DEFAULT_SIZE  (1 << 20)
+#define RTCAN_CAPTURE_MAX_SIZE      (64 << 20)
+
+struct rtcan_capture_start {
+    /* In: size of each of the two buffers in bytes (0 for the default),
+     * out: as allocated */
+    size_t              buf_size;
+};
+
+/**
+ * Start capturing the frames received by the socket
+ *
+ * @param [in,out] arg Pointer to struct rtcan_capture_start
+ *
+ * @return 0 on success, otherwise:
+ * - -EBUSY: the socket captures already or has a mapped ring
+ * - -EINVAL: buffer size too small or too large
+ * - -ENOMEM: out of memory
+ * - -EOPNOTSUPP: capturing is disabled (CONFIG_XENO_DRIVERS_CAN_CAPTURE)
+ * - -ENOSYS: called from real-time mode (the request is handled in
+ *   non-real-time context only)
+ *
+ * From now on until RTCAN_RTIOC_CAPTURE_STOP or close(), the frames
+ * passing the socket's filters are appended to one of two buffers as
+ * pcap records, CAN FD frames included, and recvmsg() as well as
+ * RTCAN_RTIOC_RECV_BATCH fail with -EBUSY. When the buffer is full, the
+ * reception path continues in the other one if that has been read, or
+ * drops the frames. Frames which have been queued before remain in the
+ * socket buffer.
+ */
+#define RTCAN_RTIOC_CAPTURE_START   _IOWR(RTIOC_TYPE_CAN, 0x2f, \
+					  struct rtcan_capture_start)
+
+/**
+ * Stop capturing, the records not read yet are lost
+ *
+ * @return 0 on success, otherwise:
+ * - -EINVAL: the socket does not capture
+ * - -EOPNOTSUPP, -ENOSYS: as for RTCAN_RTIOC_CAPTURE_START
+ */
+#define RTCAN_RTIOC_CAPTURE_STOP    _IO(RTIOC_TYPE_CAN, 0x30)
+
+struct rtcan_capture_read {
+    /* In: destination and its size, at least the buffer size */
+    void                *buf;
+    size_t              size;
+
+    /* In: time to wait for a full buffer, a partially filled one is taken
+     * after that */
+    nanosecs_rel_t      timeout;
+
+    /* Out: bytes of records copied to buf */
+    size_t              length;
+
+    /* Out: frames dropped since the start because both buffers were
+     * full */
+    uint32_t            dropped;
+};
+
+/**
+ * Read the records of a capture buffer
+ *
+ * @param [in,out] arg Pointer to struct rtcan_capture_read
+ *
+ * @return 0 on success, otherwise:
+ * - -EINVAL: the socket does not capture
+ * - -EMSGSIZE: destination smaller than the buffer size
+ * - -EFAULT: invalid destination
+ * - -ETIMEDOUT, -EAGAIN: no frame was captured within the timeout
+ *   (RTDM_TIMEOUT_NONE for -EAGAIN)
+ * - -EINTR, -EBADF: as for recvmsg()
+ * - -ENOSYS: called from real-time mode (the request is handled in
+ *   non-real-time context only)
+ *
+ * Meant to be called in a loop by a task which writes the records to disk
+ * in between, typically a plain Linux thread. Waiting and copying happen
+ * in non-real-time context. Only one reader at a time is supported.
+ */
+#define RTCAN_RTIOC_CAPTURE_READ    _IOWR(RTIOC_TYPE_CAN, 0x31, \
+					  struct rtcan_capture_read)
+
+/*
+ * Automatic bus-off recovery, see RTCAN_RTIOC_SET_RESTART
+ */
+struct rtcan_restart {
+    /* In: name of the interface */
+    char                ifname[IFNAMSIZ];
+
+    /* Time in ms from bus-off to the restart, 0 to wait for SIOCSCANMODE
+     * (default) */
+    uint32_t            restart_ms;
+
+    /* Out: restarts after bus-off since the driver was loaded, automatic
+     * or not (ignored on set) */
+    uint32_t            restarts;
+};
+
+/**
+ * Get the bus-off recovery of an interface
+ *
+ * @param [in,out] arg Pointer to struct rtcan_restart
+ *
+ * @return 0 on success, otherwise:
+ * - -ENODEV: no device of this name
+ * - -EOPNOTSUPP: the driver does not restart on its own
+ */
+#define RTCAN_RTIOC_GET_RESTART     _IOWR(RTIOC_TYPE_CAN, 0x32, \
+					  struct rtcan_restart)
+
+/**
+ * Set the bus-off recovery of an interface
+ *
+ * @param [in] arg Pointer to struct rtcan_restart
+ *
+ * @return 0 on success, otherwise:
+ * - -ENODEV: no device of this name
+ * - -EOPNOTSUPP: the driver does not restart on its own
+ *
+ * restart_ms after the controller went bus-off, the driver restarts it
+ * as SIOCSCANMODE with CAN_MODE_START would and the sockets receive an
+ * error frame with CAN_ERR_RESTARTED. Supported by C_CAN, which keeps its
+ * configuration and acceptance filter over bus-off, so the restart only
+ * drops the frames still waiting to be sent and the controller is back
+ * 128 times 11 recessive bits later. The initial value is given by the
+ * module parameter restart_ms. Takes effect with the next bus-off.
+ */
+#define RTCAN_RTIOC_SET_RESTART     _IOW(RTIOC_TYPE_CAN, 0x33, \
+					 struct rtcan_restart)
+
+#endif  /* __RTCAN_EXT_H_ */
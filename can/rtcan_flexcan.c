@@ -45,6 +45,7 @@
 #include <rtdm/rtcan.h>
 #include "rtcan_dev.h"
 #include "rtcan_raw.h"
+#include "rtcan_ext.h"
 #include "rtcan_internal.h"
 
 #define DEV_NAME	"rtcan%d"
@@ -142,6 +143,12 @@ enum flexcan_ip_version {
 
 /* FLEXCAN interrupt flag register (IFLAG) bits */
 #define FLEXCAN_TX_BUF_ID		8
+
+/* RX FIFO ID filter table, occupies MB 6 and 7 */
+#define FLEXCAN_RX_FIFO_IDTAB		6
+#define FLEXCAN_RX_FIFO_IDTAB_LEN	8
+#define FLEXCAN_IDTAB_A_RTR		BIT(31)
+#define FLEXCAN_IDTAB_A_IDE		BIT(30)
 #define FLEXCAN_IFLAG_BUF(x)		BIT(x)
 #define FLEXCAN_IFLAG_RX_FIFO_OVERFLOW	BIT(7)
 #define FLEXCAN_IFLAG_RX_FIFO_WARN	BIT(6)
@@ -177,6 +184,13 @@ enum flexcan_ip_version {
 #define FLEXCAN_HAS_V10_FEATURES	BIT(1) /* For core version >= 10 */
 #define FLEXCAN_HAS_BROKEN_ERR_STATE	BIT(2) /* [TR]WRN_INT not connected */
 
+static int hw_filter;
+module_param(hw_filter, int, 0444);
+MODULE_PARM_DESC(hw_filter, "Program the RX FIFO ID filter table from the "
+		 "bound sockets' filters when the controller is started "
+		 "(default 0). Filters changed while it is running take "
+		 "effect with the next start.");
+
 /* Structure of the message buffer */
 struct flexcan_mb {
 	u32 can_ctrl;
@@ -225,6 +239,28 @@ struct flexcan_priv {
 	struct flexcan_platform_data *pdata;
 	struct can_bittime bit_time;
 	const struct flexcan_devtype_data *devtype_data;
+
+	/*
+	 * Conversion of the free-running timer, which counts CAN bit times,
+	 * to the RTDM clock: the timer and the clock are read together at
+	 * IRQ entry, frames are dated relative to this reference point.
+	 */
+	nanosecs_abs_t ts_ref_time;
+	u16 ts_ref_timer;
+	u64 ts_tick_ns_q16;	/* bit time in ns, 16.16 fixed point */
+
+	/*
+	 * Receive interrupt moderation, see flexcan_rx_open(). While a
+	 * window is open, RX_FIFO_AVAILABLE is masked and the frames wait
+	 * in the FIFO for rx_timer, the FIFO warning (rx_frames > 1) or an
+	 * overflow. Protected by device_lock.
+	 */
+	rtdm_timer_t rx_timer;
+	u32 rx_usecs;
+	u32 rx_frames;
+	int rx_window;
+	u32 rx_windows;
+	u32 rx_coalesced;
 };
 
 static struct flexcan_devtype_data fsl_p1010_devtype_data = {
@@ -465,7 +501,7 @@ static void flexcan_do_state(struct rtcan_device *dev,
 	case CAN_STATE_BUS_OFF:
 		cf->can_id |= CAN_ERR_BUSOFF;
 		/* Wake up waiting senders */
-		rtdm_sem_destroy(&dev->tx_sem);
+		rtcan_dev_tx_close(dev);
 		break;
 	default:
 		break;
@@ -483,6 +519,14 @@ static void flexcan_rx_interrupt(struct rtcan_device *dev,
 
 	reg_ctrl = flexcan_read(&mb->can_ctrl);
 	reg_id = flexcan_read(&mb->can_id);
+
+	/* Reception time from the MB's timer capture, the timer wraps
+	 * after 65536 bit times */
+	skb->timestamp = priv->ts_ref_time -
+		(((u16)(priv->ts_ref_timer -
+			FLEXCAN_MB_CNT_TIMESTAMP(reg_ctrl)) *
+		  priv->ts_tick_ns_q16) >> 16);
+
 	if (reg_ctrl & FLEXCAN_MB_CNT_IDE)
 		cf->can_id = ((reg_id >> 0) & CAN_EFF_MASK) | CAN_EFF_FLAG;
 	else
@@ -545,6 +589,80 @@ static void flexcan_err_interrupt(struct rtcan_device *dev,
 		flexcan_do_bus_err(dev, cf, reg_esr);
 }
 
+/*
+ * Open a moderation window on the first frame received, unless a
+ * latency-critical socket is bound. The frames are dated by the MB's
+ * timer capture, so the delay doesn't affect their timestamps.
+ */
+static int flexcan_rx_open(struct rtcan_device *dev)
+{
+	struct flexcan_priv *priv = rtcan_priv(dev);
+	struct flexcan_regs __iomem *regs = priv->base;
+	u32 reg_imask = FLEXCAN_IFLAG_DEFAULT & ~FLEXCAN_IFLAG_RX_FIFO_AVAILABLE;
+
+	if (!priv->rx_usecs || dev->rx_critical)
+		return 0;
+
+	if (priv->rx_frames > 1) {
+		flexcan_write(FLEXCAN_IFLAG_RX_FIFO_WARN, &regs->iflag1);
+		reg_imask |= FLEXCAN_IFLAG_RX_FIFO_WARN;
+	}
+	flexcan_write(reg_imask, &regs->imask1);
+
+	rtdm_timer_start_in_handler(&priv->rx_timer,
+				    (nanosecs_rel_t)priv->rx_usecs * 1000,
+				    0, RTDM_TIMERMODE_RELATIVE);
+	priv->rx_window = 1;
+	priv->rx_windows++;
+
+	return 1;
+}
+
+/* End a moderation window, the caller reads the FIFO */
+static void flexcan_rx_close(struct rtcan_device *dev)
+{
+	struct flexcan_priv *priv = rtcan_priv(dev);
+	struct flexcan_regs __iomem *regs = priv->base;
+
+	priv->rx_window = 0;
+	flexcan_write(FLEXCAN_IFLAG_RX_FIFO_WARN, &regs->iflag1);
+	flexcan_write(FLEXCAN_IFLAG_DEFAULT, &regs->imask1);
+}
+
+static void flexcan_rx_timer(rtdm_timer_t *timer)
+{
+	struct flexcan_priv *priv =
+		container_of(timer, struct flexcan_priv, rx_timer);
+	struct rtcan_device *dev = priv->dev;
+	struct flexcan_regs __iomem *regs = priv->base;
+	struct rtcan_skb skb;
+	rtdm_lockctx_t lock_ctx;
+
+	rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+
+	/* Closed already by the interrupt handler or a stop? */
+	if (!priv->rx_window)
+		goto out;
+
+	flexcan_rx_close(dev);
+
+	priv->ts_ref_time = rtdm_clock_read();
+	priv->ts_ref_timer = flexcan_read(&regs->timer);
+
+	rtdm_lock_get(&dev->recv_list_lock);
+	while (flexcan_read(&regs->iflag1) & FLEXCAN_IFLAG_RX_FIFO_AVAILABLE) {
+		rtcan_trace_irq(&skb, priv->ts_ref_time);
+		flexcan_rx_interrupt(dev, &skb);
+		rtcan_trace_hw(&skb);
+		rtcan_rcv(dev, &skb);
+		priv->rx_coalesced++;
+	}
+	rtdm_lock_put(&dev->recv_list_lock);
+
+out:
+	rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+}
+
 static int flexcan_interrupt(rtdm_irq_t *irq_handle)
 {
 	struct rtcan_device *dev = rtdm_irq_get_arg(irq_handle, void);
@@ -554,10 +672,17 @@ static int flexcan_interrupt(rtdm_irq_t *irq_handle)
 	u32 reg_iflag1, reg_esr;
 	int recv_lock_free = 1;
 	int ret = RTDM_IRQ_NONE;
+	int drain = 0;
 	can_state_t new_state;
 
 	rtdm_lock_get(&dev->device_lock);
 
+	/* Take the timestamp reference, also used for error frames */
+	priv->ts_ref_time = rtdm_clock_read();
+	priv->ts_ref_timer = flexcan_read(&regs->timer);
+	skb.timestamp = priv->ts_ref_time;
+	rtcan_trace_irq(&skb, priv->ts_ref_time);
+
 	reg_iflag1 = flexcan_read(&regs->iflag1);
 	reg_esr = flexcan_read(&regs->esr);
 	/* ACK all bus error and state change IRQ sources */
@@ -567,23 +692,41 @@ static int flexcan_interrupt(rtdm_irq_t *irq_handle)
 	/* transmission complete interrupt */
 	if (reg_iflag1 & (1 << FLEXCAN_TX_BUF_ID)) {
 		flexcan_write((1 << FLEXCAN_TX_BUF_ID), &regs->iflag1);
+		rtcan_tx_done(dev, 0);
 
 		/* Wake up a sender */
-		rtdm_sem_up(&dev->tx_sem);
-		if (rtcan_loopback_pending(dev)) {
+		rtcan_dev_tx_release(dev);
+		if (rtcan_loopback_pending(dev, 0)) {
 			if (recv_lock_free) {
 				recv_lock_free = 0;
-				rtdm_lock_get(&rtcan_recv_list_lock);
-				rtdm_lock_get(&rtcan_socket_lock);
+				rtdm_lock_get(&dev->recv_list_lock);
 			}
-			rtcan_loopback(dev);
+			rtcan_loopback(dev, 0);
 		}
 		ret = RTDM_IRQ_HANDLED;
 	}
 
+	/* Leave the frames in the FIFO while a moderation window is open,
+	 * unless it fills up */
+	if (priv->rx_window) {
+		if (reg_iflag1 & (FLEXCAN_IFLAG_RX_FIFO_WARN |
+				  FLEXCAN_IFLAG_RX_FIFO_OVERFLOW)) {
+			rtdm_timer_stop_in_handler(&priv->rx_timer);
+			flexcan_rx_close(dev);
+			drain = 1;
+			ret = RTDM_IRQ_HANDLED;
+		} else
+			reg_iflag1 &= ~FLEXCAN_IFLAG_RX_FIFO_AVAILABLE;
+	} else if ((reg_iflag1 & FLEXCAN_IFLAG_RX_FIFO_AVAILABLE) &&
+		   flexcan_rx_open(dev)) {
+		reg_iflag1 &= ~FLEXCAN_IFLAG_RX_FIFO_AVAILABLE;
+		ret = RTDM_IRQ_HANDLED;
+	}
+
 	/* RX interrupt? */
 	while (reg_iflag1 & FLEXCAN_IFLAG_RX_FIFO_AVAILABLE) {
 		flexcan_rx_interrupt(dev, &skb);
+		rtcan_trace_hw(&skb);
 		reg_iflag1 = flexcan_read(&regs->iflag1);
 
 		/* Take more locks. Ensure that they are taken and
@@ -593,12 +736,12 @@ static int flexcan_interrupt(rtdm_irq_t *irq_handle)
 		 * not be possible. */
 		if (recv_lock_free) {
 			recv_lock_free = 0;
-			rtdm_lock_get(&rtcan_recv_list_lock);
-			rtdm_lock_get(&rtcan_socket_lock);
+			rtdm_lock_get(&dev->recv_list_lock);
 		}
 
 		/* Pass received frame out to the sockets */
 		rtcan_rcv(dev, &skb);
+		priv->rx_coalesced += drain;
 		ret = RTDM_IRQ_HANDLED;
 	}
 
@@ -608,13 +751,13 @@ static int flexcan_interrupt(rtdm_irq_t *irq_handle)
 	     (reg_iflag1 & FLEXCAN_IFLAG_RX_FIFO_OVERFLOW) ||
 	     (reg_esr & FLEXCAN_ESR_ERR_BUS)) {
 		/* Check error condition and fill error frame */
+		skb.timestamp = priv->ts_ref_time;
 		flexcan_err_interrupt(dev, &skb, reg_iflag1, reg_esr,
 				      new_state);
 
 		if (recv_lock_free) {
 			recv_lock_free = 0;
-			rtdm_lock_get(&rtcan_recv_list_lock);
-			rtdm_lock_get(&rtcan_socket_lock);
+			rtdm_lock_get(&dev->recv_list_lock);
 		}
 
 		/* Pass error frame out to the sockets */
@@ -623,8 +766,7 @@ static int flexcan_interrupt(rtdm_irq_t *irq_handle)
 	}
 
 	if (!recv_lock_free) {
-		rtdm_lock_put(&rtcan_socket_lock);
-		rtdm_lock_put(&rtcan_recv_list_lock);
+		rtdm_lock_put(&dev->recv_list_lock);
 	}
 	rtdm_lock_put(&dev->device_lock);
 
@@ -668,6 +810,14 @@ static int flexcan_set_bit_time(struct rtcan_device *dev)
 		FLEXCAN_CTRL_RJW(bt->std.sjw - 1) |
 		FLEXCAN_CTRL_PROPSEG(bt->std.prop_seg - 1);
 
+	/* length of a bit, the unit of the free-running timer */
+	priv->ts_tick_ns_q16 = div_u64((u64)bt->std.brp *
+				       (1 + bt->std.prop_seg +
+					bt->std.phase_seg1 +
+					bt->std.phase_seg2) *
+				       NSEC_PER_SEC << 16,
+				       dev->can_sys_clock);
+
 	if (dev->ctrl_mode & CAN_CTRLMODE_LOOPBACK)
 		reg |= FLEXCAN_CTRL_LPB;
 	if (dev->ctrl_mode & CAN_CTRLMODE_LISTENONLY)
@@ -695,9 +845,22 @@ static int flexcan_chip_start(struct rtcan_device *dev)
 {
 	struct flexcan_priv *priv = rtcan_priv(dev);
 	struct flexcan_regs __iomem *regs = priv->base;
+	struct rtcan_hw_filter *hw = &dev->hw_filter;
 	unsigned int i;
-	int err;
-	u32 reg_mcr, reg_ctrl;
+	int err, filter = hw_filter && !rtcan_hw_filter_accept_all(hw);
+	u32 reg_mcr, reg_ctrl, filter_id = 0, filter_mask = 0;
+
+	/* RX FIFO ID table entry and mask, format A */
+	if (filter && (hw->can_id & CAN_EFF_FLAG)) {
+		filter_id = FLEXCAN_IDTAB_A_IDE |
+			((hw->can_id & CAN_EFF_MASK) << 1);
+		filter_mask = FLEXCAN_IDTAB_A_IDE |
+			((hw->can_mask & CAN_EFF_MASK) << 1);
+	} else if (filter) {
+		filter_id = (hw->can_id & CAN_SFF_MASK) << 19;
+		filter_mask = FLEXCAN_IDTAB_A_IDE |
+			((hw->can_mask & CAN_SFF_MASK) << 19);
+	}
 
 	/* enable module */
 	flexcan_chip_enable(priv);
@@ -731,8 +894,11 @@ static int flexcan_chip_start(struct rtcan_device *dev)
 	 */
 	reg_mcr = flexcan_read(&regs->mcr);
 	reg_mcr |= FLEXCAN_MCR_FRZ | FLEXCAN_MCR_FEN | FLEXCAN_MCR_HALT |
-		FLEXCAN_MCR_SUPV | FLEXCAN_MCR_WRN_EN |
-		FLEXCAN_MCR_IDAM_C | FLEXCAN_MCR_SRX_DIS;
+		FLEXCAN_MCR_SUPV | FLEXCAN_MCR_WRN_EN | FLEXCAN_MCR_SRX_DIS;
+	if (filter)
+		reg_mcr |= FLEXCAN_MCR_IDAM_A;
+	else
+		reg_mcr |= FLEXCAN_MCR_IDAM_C;
 	rtcandev_dbg(dev, "%s: writing mcr=0x%08x", __func__, reg_mcr);
 	flexcan_write(reg_mcr, &regs->mcr);
 
@@ -776,13 +942,27 @@ static int flexcan_chip_start(struct rtcan_device *dev)
 			&regs->cantxfg[i].can_ctrl);
 	}
 
-	/* acceptance mask/acceptance code (accept everything) */
-	flexcan_write(0x0, &regs->rxgmask);
-	flexcan_write(0x0, &regs->rx14mask);
-	flexcan_write(0x0, &regs->rx15mask);
+	/*
+	 * acceptance mask/acceptance code: accept everything or, with
+	 * hw_filter, the bound sockets' filters merged into one. The ID
+	 * table of the RX FIFO follows its six MBs, all eight entries of
+	 * format A get the same ID.
+	 */
+	if (filter) {
+		u32 __iomem *idtab =
+			(u32 __iomem *)&regs->cantxfg[FLEXCAN_RX_FIFO_IDTAB];
+
+		for (i = 0; i < FLEXCAN_RX_FIFO_IDTAB_LEN; i++)
+			flexcan_write(filter_id, idtab + i);
+	} else
+		filter_mask = 0;
+
+	flexcan_write(filter_mask, &regs->rxgmask);
+	flexcan_write(filter_mask, &regs->rx14mask);
+	flexcan_write(filter_mask, &regs->rx15mask);
 
 	if (priv->devtype_data->features & FLEXCAN_HAS_V10_FEATURES)
-		flexcan_write(0x0, &regs->rxfgmask);
+		flexcan_write(filter_mask, &regs->rxfgmask);
 
 	flexcan_transceiver_switch(priv, 1);
 
@@ -822,6 +1002,12 @@ static void flexcan_chip_stop(struct rtcan_device *dev)
 	/* Disable all interrupts */
 	flexcan_write(0, &regs->imask1);
 
+	/* Frames left in a moderation window are dropped with the FIFO */
+	if (priv->rx_window) {
+		rtdm_timer_stop(&priv->rx_timer);
+		priv->rx_window = 0;
+	}
+
 	/* Disable + halt module */
 	reg = flexcan_read(&regs->mcr);
 	reg |= FLEXCAN_MCR_MDIS | FLEXCAN_MCR_HALT;
@@ -846,7 +1032,7 @@ static int flexcan_mode_stop(struct rtcan_device *dev, rtdm_lockctx_t *lock_ctx)
 	flexcan_chip_stop(dev);
 
 	/* Wake up waiting senders */
-	rtdm_sem_destroy(&dev->tx_sem);
+	rtcan_dev_tx_close(dev);
 
 	rtdm_irq_free(&dev->irq_handle);
 
@@ -888,13 +1074,13 @@ static int flexcan_mode_start(struct rtcan_device *dev,
 			goto out_irq_free;
 
 		/* Set up sender "mutex" */
-		rtdm_sem_init(&dev->tx_sem, 1);
+		rtcan_dev_tx_open(dev, 1);
 
 		break;
 
 	case CAN_STATE_BUS_OFF:
 		/* Set up sender "mutex" */
-		rtdm_sem_init(&dev->tx_sem, 1);
+		rtcan_dev_tx_open(dev, 1);
 		/* start chip and queuing */
 		err = flexcan_chip_start(dev);
 		if (err)
@@ -917,6 +1103,37 @@ out:
 	return err;
 }
 
+static int flexcan_ioctl(struct rtcan_device *dev, int request, void *arg)
+{
+	struct flexcan_priv *priv = rtcan_priv(dev);
+	struct rtcan_coalesce *coal = arg;
+	rtdm_lockctx_t lock_ctx;
+
+	switch (request) {
+	case RTCAN_RTIOC_GET_COALESCE:
+		rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+		coal->rx_usecs = priv->rx_usecs;
+		coal->rx_frames = priv->rx_frames;
+		coal->rx_windows = priv->rx_windows;
+		coal->rx_coalesced = priv->rx_coalesced;
+		rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+		return 0;
+
+	case RTCAN_RTIOC_SET_COALESCE:
+		if (coal->rx_usecs > RTCAN_COALESCE_MAX_USECS)
+			return -EINVAL;
+		rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+		priv->rx_usecs = coal->rx_usecs;
+		/* The FIFO warning comes at 5 of 6 frames */
+		priv->rx_frames = coal->rx_frames > 1 ? 5 : 0;
+		rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+		return 0;
+
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
 int flexcan_set_mode(struct rtcan_device *dev, can_mode_t mode,
 		     rtdm_lockctx_t *lock_ctx)
 {
@@ -976,12 +1193,16 @@ static int register_flexcandev(struct rtcan_device *dev)
 		goto out_chip_disable;
 	}
 
+	rtdm_timer_init(&priv->rx_timer, flexcan_rx_timer, DRV_NAME);
+
 	err = rtcan_dev_register(dev);
 	if (err)
-		goto out_chip_disable;
+		goto out_timer_destroy;
 
 	return 0;
 
+out_timer_destroy:
+	rtdm_timer_destroy(&priv->rx_timer);
 out_chip_disable:
 	/* disable core and turn off clocks */
 	flexcan_chip_disable(priv);
@@ -992,8 +1213,11 @@ out_chip_disable:
 
 static void unregister_flexcandev(struct rtcan_device *dev)
 {
+	struct flexcan_priv *priv = rtcan_priv(dev);
+
 	flexcan_mode_stop(dev, NULL);
 	rtcan_dev_unregister(dev);
+	rtdm_timer_destroy(&priv->rx_timer);
 }
 
 #ifdef CONFIG_OF
@@ -1112,6 +1336,7 @@ static int flexcan_probe(struct platform_device *pdev)
 	dev->hard_start_xmit = flexcan_start_xmit;
 	dev->do_set_mode = flexcan_set_mode;
 	dev->do_set_bit_time = flexcan_save_bit_time;
+	dev->do_ioctl = flexcan_ioctl;
 	dev->bittiming_const = &flexcan_bittiming_const;
 	dev->state = CAN_STATE_STOPPED;
 
@@ -0,0 +1,444 @@
+/*
+ * In-kernel routing between interfaces for RT-Socket-CAN
+ *
+ * Copyright (C) 2026 RT-Socket-CAN Development Team
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Routing rules forward received frames from one interface to another
+ * without passing user space, similar to the can-gw module of SocketCAN.
+ * rtcan_rcv() matches the data frames against the rules of their interface
+ * and queues copies, possibly with a rewritten ID, for the destination.
+ * Each destination has a real-time task which takes the frames from its
+ * queue and sends them through the same path as sendmsg(). The frames are
+ * not sent from rtcan_rcv() itself, because a TX slot (dev->tx_sem) can't
+ * be taken in interrupt context and the destination's device_lock must not
+ * nest inside the source's.
+ *
+ * The rules live in a table indexed by the handle returned to user space.
+ * Those of a source interface are linked in its gw_routes.
+ */
+
+#include <linux/module.h>
+#include <linux/delay.h>
+#include <linux/seq_file.h>
+
+#include <rtdm/rtdm_driver.h>
+
+#include <rtdm/rtcan.h>
+#include "rtcan_ext.h"
+#include "rtcan_socket.h"
+#include "rtcan_dev.h"
+#include "rtcan_raw.h"
+#include "rtcan_internal.h"
+
+
+static int gw_prio = 90;
+module_param(gw_prio, int, 0444);
+MODULE_PARM_DESC(gw_prio, "Priority of the gateway transmission tasks "
+		 "(default 90)");
+
+/* Frames waiting per destination (2^N) */
+#define RTCAN_GW_QUEUE_SIZE     64
+
+/* Longest wait of a routed frame for a TX slot of its destination */
+#define RTCAN_GW_TX_TIMEOUT     10000000 /* ns */
+
+/* Serialises adding and deleting rules, and with it the creation and
+ * destruction of the destinations' queues */
+static DEFINE_BINARY_SEMAPHORE(rtcan_gw_nrt_lock);
+
+struct rtcan_gw_route {
+    /* Next rule of the source, protected by its recv_list_lock */
+    struct rtcan_gw_route *next;
+
+    struct rtcan_device *src;
+    struct rtcan_device *dst;
+    int                 in_use;
+
+    uint32_t            can_id;
+    uint32_t            can_mask;
+    uint32_t            mod_id;
+    uint32_t            mod_mask;
+
+    /* Frames sent to the destination and frames lost on the way.
+     * Protected by the destination's queue lock. */
+    unsigned int        routed;
+    unsigned int        dropped;
+};
+
+struct rtcan_gw_entry {
+    /* NULL once the rule was deleted */
+    struct rtcan_gw_route *route;
+    can_frame_t         frame;
+};
+
+/* Queue and task of a destination, dev->gw_queue */
+struct rtcan_gw_queue {
+    struct rtcan_device *dev;
+    rtdm_task_t         task;
+
+    /* Signalled when the queue becomes non-empty */
+    rtdm_event_t        ready;
+
+    /* Protects the entries, head, tail, busy and the rules' counters.
+     * Nests inside the sources' recv_list_lock. */
+    rtdm_lock_t         lock;
+    unsigned int        head;
+    unsigned int        tail;
+
+    /* Rule whose frame the task is sending, outside of lock */
+    struct rtcan_gw_route *busy;
+
+    /* Rules with this destination, under rtcan_gw_nrt_lock */
+    unsigned int        users;
+
+    struct rtcan_gw_entry entry[RTCAN_GW_QUEUE_SIZE];
+};
+
+static struct rtcan_gw_route rtcan_gw_routes[RTCAN_GW_MAX_RULES];
+
+/* Sender of the routed frames. They are looped back to all local sockets
+ * of the destination, as if another socket had sent them. */
+static struct rtcan_socket rtcan_gw_sock = {
+#ifdef CONFIG_XENO_DRIVERS_CAN_LOOPBACK
+    .loopback = 1,
+    .recv_own_msgs = 1,
+#endif
+};
+
+
+/*
+ * Queue a received data frame for the destinations of all matching rules,
+ * CAN FD frames are not routed. Called by rtcan_rcv() with the source's
+ * recv_list_lock held.
+ */
+void __rtcan_gw_route(struct rtcan_device *dev, struct rtcan_skb *skb)
+{
+    struct rtcan_rb_frame *frame = &skb->rb_frame;
+    struct rtcan_gw_route *route;
+    struct rtcan_gw_queue *queue;
+    struct rtcan_gw_entry *entry;
+    int wakeup;
+
+    /* The queues hold classic frames only */
+    if (unlikely(frame->can_dlc & RTCAN_FD_FRAME))
+	return;
+
+    for (route = dev->gw_routes; route != NULL; route = route->next) {
+	if ((frame->can_id ^ route->can_id) & route->can_mask)
+	    continue;
+
+	queue = route->dst->gw_queue;
+
+	rtdm_lock_get(&queue->lock);
+
+	if (queue->tail - queue->head == RTCAN_GW_QUEUE_SIZE) {
+	    route->dropped++;
+	    rtdm_lock_put(&queue->lock);
+	    continue;
+	}
+
+	entry = &queue->entry[queue->tail & (RTCAN_GW_QUEUE_SIZE - 1)];
+	entry->route = route;
+	entry->frame.can_id = (frame->can_id & ~route->mod_mask) |
+	    route->mod_id;
+	entry->frame.can_dlc = frame->can_dlc & RTCAN_HAS_NO_TIMESTAMP;
+	memcpy(entry->frame.data, frame->data,
+	       min_t(size_t, rtcan_skb_payload(skb), 8));
+	wakeup = (queue->tail++ == queue->head);
+
+	rtdm_lock_put(&queue->lock);
+
+	if (wakeup)
+	    rtdm_event_signal(&queue->ready);
+    }
+}
+
+
+static void rtcan_gw_task(void *arg)
+{
+    struct rtcan_gw_queue *queue = arg;
+    struct rtcan_device *dev = queue->dev;
+    struct rtcan_gw_entry *entry;
+    struct rtcan_gw_route *route;
+    rtdm_lockctx_t lock_ctx;
+    can_frame_t frame;
+    int ret;
+
+    for (;;) {
+	rtdm_lock_get_irqsave(&queue->lock, lock_ctx);
+
+	if (queue->head == queue->tail) {
+	    rtdm_lock_put_irqrestore(&queue->lock, lock_ctx);
+	    if (rtdm_event_wait(&queue->ready))
+		return;
+	    continue;
+	}
+
+	entry = &queue->entry[queue->head++ & (RTCAN_GW_QUEUE_SIZE - 1)];
+	route = entry->route;
+	frame = entry->frame;
+	queue->busy = route;
+
+	rtdm_lock_put_irqrestore(&queue->lock, lock_ctx);
+
+	if (!route)
+	    continue;
+
+	/* A rewritten ID may not be valid anymore */
+	ret = -EINVAL;
+	if (!rtcan_raw_check_frame(&frame)) {
+	    ret = rtdm_sem_timeddown(&dev->tx_sem, RTCAN_GW_TX_TIMEOUT, NULL);
+	    if (!ret)
+		ret = rtcan_raw_xmit(&rtcan_gw_sock, dev, &frame, 1);
+	}
+
+	rtdm_lock_get_irqsave(&queue->lock, lock_ctx);
+	if (ret > 0)
+	    route->routed++;
+	else
+	    route->dropped++;
+	queue->busy = NULL;
+	rtdm_lock_put_irqrestore(&queue->lock, lock_ctx);
+    }
+}
+
+
+/* Get the queue of a destination, creating it if needed */
+static struct rtcan_gw_queue *rtcan_gw_queue_get(struct rtcan_device *dev)
+{
+    struct rtcan_gw_queue *queue = dev->gw_queue;
+
+    if (queue) {
+	queue->users++;
+	return queue;
+    }
+
+    queue = kmalloc(sizeof(struct rtcan_gw_queue), GFP_KERNEL);
+    if (!queue)
+	return NULL;
+
+    queue->dev = dev;
+    rtdm_lock_init(&queue->lock);
+    queue->head = queue->tail = 0;
+    queue->busy = NULL;
+    queue->users = 1;
+    rtdm_event_init(&queue->ready, 0);
+
+    if (rtdm_task_init(&queue->task, dev->name, rtcan_gw_task, queue,
+		       gw_prio, 0)) {
+	rtdm_event_destroy(&queue->ready);
+	kfree(queue);
+	return NULL;
+    }
+
+    dev->gw_queue = queue;
+    return queue;
+}
+
+
+/* Destroy the queue of a destination once no rule uses it anymore */
+static void rtcan_gw_queue_put(struct rtcan_device *dev)
+{
+    struct rtcan_gw_queue *queue = dev->gw_queue;
+
+    if (--queue->users)
+	return;
+
+    rtdm_task_destroy(&queue->task);
+    rtdm_event_destroy(&queue->ready);
+    dev->gw_queue = NULL;
+    kfree(queue);
+}
+
+
+int rtcan_gw_add(struct rtcan_gw_rule *rule)
+{
+    struct rtcan_device *src, *dst;
+    struct rtcan_gw_route *route;
+    rtdm_lockctx_t lock_ctx;
+    int handle, ret;
+
+    if (rule->src_ifindex == rule->dst_ifindex)
+	return -EINVAL;
+
+    if ((src = rtcan_dev_get_by_index(rule->src_ifindex)) == NULL)
+	return -ENXIO;
+    if ((dst = rtcan_dev_get_by_index(rule->dst_ifindex)) == NULL) {
+	ret = -ENXIO;
+	goto out_src;
+    }
+
+    /* The source would receive the routed frames again */
+    if (src->bus && src->bus == dst->bus) {
+	ret = -ELOOP;
+	goto out_dst;
+    }
+
+    down(&rtcan_gw_nrt_lock);
+
+    for (handle = 0; handle < RTCAN_GW_MAX_RULES; handle++)
+	if (!rtcan_gw_routes[handle].in_use)
+	    break;
+    if (handle == RTCAN_GW_MAX_RULES) {
+	ret = -ENOSPC;
+	goto out_unlock;
+    }
+
+    if (!rtcan_gw_queue_get(dst)) {
+	ret = -ENOMEM;
+	goto out_unlock;
+    }
+
+    route = &rtcan_gw_routes[handle];
+    route->src = src;
+    route->dst = dst;
+    route->in_use = 1;
+    route->can_id = rule->can_id & rule->can_mask;
+    route->can_mask = rule->can_mask;
+    route->mod_id = rule->mod_id & rule->mod_mask;
+    route->mod_mask = rule->mod_mask;
+    route->routed = 0;
+    route->dropped = 0;
+
+    rtdm_lock_get_irqsave(&src->recv_list_lock, lock_ctx);
+    route->next = src->gw_routes;
+    src->gw_routes = route;
+    rtdm_lock_put_irqrestore(&src->recv_list_lock, lock_ctx);
+
+    up(&rtcan_gw_nrt_lock);
+
+    /* The rule keeps the references of both devices */
+    rule->handle = handle;
+    return 0;
+
+ out_unlock:
+    up(&rtcan_gw_nrt_lock);
+ out_dst:
+    rtcan_dev_dereference(dst);
+ out_src:
+    rtcan_dev_dereference(src);
+    return ret;
+}
+
+
+/* Called with rtcan_gw_nrt_lock held */
+static void rtcan_gw_remove(struct rtcan_gw_route *route)
+{
+    struct rtcan_device *src = route->src, *dst = route->dst;
+    struct rtcan_gw_queue *queue = dst->gw_queue;
+    struct rtcan_gw_route **prev;
+    rtdm_lockctx_t lock_ctx;
+    unsigned int i;
+    int busy;
+
+    /* No new frames once this returns */
+    rtdm_lock_get_irqsave(&src->recv_list_lock, lock_ctx);
+    for (prev = &src->gw_routes; *prev != route; prev = &(*prev)->next);
+    *prev = route->next;
+    rtdm_lock_put_irqrestore(&src->recv_list_lock, lock_ctx);
+
+    /* Forget the frames still queued */
+    rtdm_lock_get_irqsave(&queue->lock, lock_ctx);
+    for (i = queue->head; i != queue->tail; i++)
+	if (queue->entry[i & (RTCAN_GW_QUEUE_SIZE - 1)].route == route)
+	    queue->entry[i & (RTCAN_GW_QUEUE_SIZE - 1)].route = NULL;
+    busy = (queue->busy == route);
+    rtdm_lock_put_irqrestore(&queue->lock, lock_ctx);
+
+    /* The task may still be sending a frame of the rule, which ends
+     * within RTCAN_GW_TX_TIMEOUT */
+    while (busy) {
+	msleep(1);
+	rtdm_lock_get_irqsave(&queue->lock, lock_ctx);
+	busy = (queue->busy == route);
+	rtdm_lock_put_irqrestore(&queue->lock, lock_ctx);
+    }
+
+    route->in_use = 0;
+    rtcan_gw_queue_put(dst);
+
+    rtcan_dev_dereference(dst);
+    rtcan_dev_dereference(src);
+}
+
+
+int rtcan_gw_del(int handle)
+{
+    int ret = 0;
+
+    if (handle != RTCAN_GW_ALL &&
+	(handle < 0 || handle >= RTCAN_GW_MAX_RULES))
+	return -EINVAL;
+
+    down(&rtcan_gw_nrt_lock);
+
+    if (handle == RTCAN_GW_ALL) {
+	for (handle = 0; handle < RTCAN_GW_MAX_RULES; handle++)
+	    if (rtcan_gw_routes[handle].in_use)
+		rtcan_gw_remove(&rtcan_gw_routes[handle]);
+    } else if (rtcan_gw_routes[handle].in_use)
+	rtcan_gw_remove(&rtcan_gw_routes[handle]);
+    else
+	ret = -ENOENT;
+
+    up(&rtcan_gw_nrt_lock);
+
+    return ret;
+}
+
+
+#ifdef CONFIG_PROC_FS
+
+int rtcan_gw_read_proc(struct seq_file *p, void *data)
+{
+    struct rtcan_gw_route *route;
+    int handle;
+
+    /*  Id Source   Dest.    __CAN_ID__ _CAN_Mask_ __Mod_ID__ _Mod_Mask_ ...
+     *   0 rtcan0   rtcan1   0x12345678 0x12345678 0x12345678 0x12345678 ...
+     *
+     *  ... ____Routed ___Dropped
+     *  ... 1234567890 1234567890
+     */
+
+    seq_printf(p, "Id Source   Dest.    __CAN_ID__ _CAN_Mask_ __Mod_ID__ "
+	       "_Mod_Mask_ ____Routed ___Dropped\n");
+
+    down(&rtcan_gw_nrt_lock);
+
+    for (handle = 0; handle < RTCAN_GW_MAX_RULES; handle++) {
+	route = &rtcan_gw_routes[handle];
+	if (!route->in_use)
+	    continue;
+
+	seq_printf(p, "%2d %-8s %-8s 0x%08x 0x%08x 0x%08x 0x%08x "
+		   "%10u %10u\n",
+		   handle, route->src->name, route->dst->name,
+		   route->can_id, route->can_mask,
+		   route->mod_id, route->mod_mask,
+		   route->routed, route->dropped);
+    }
+
+    up(&rtcan_gw_nrt_lock);
+
+    return 0;
+}
+
+#endif /* CONFIG_PROC_FS */
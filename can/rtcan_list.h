@@ -43,9 +43,36 @@ struct rtcan_recv {
 					     */
     struct rtcan_recv       *next;          /* pointer to next list element
 					     */
+    struct rtcan_recv       *index_next;    /* pointer to next element in
+					     *   the same hash bucket */
 };
 
 
+/*
+ * Reception lookup index.
+ *
+ * Filters whose mask covers all bits of an SFF identifier (in particular
+ * exact SFF and EFF filters) and which are not inverted are hashed by the
+ * lower 11 bits of their identifier. A received frame only has to be
+ * checked against the entries of its bucket. All other filters are
+ * compiled into flat arrays, see struct rtcan_recv_masks. The index is
+ * rebuilt from the reception list whenever a socket adds or removes its
+ * filters.
+ */
+#define RTCAN_RECV_HASH_BITS      7
+#define RTCAN_RECV_HASH_SIZE      (1 << RTCAN_RECV_HASH_BITS)
+
+#define rtcan_recv_hashable(f) \
+    (((f)->can_mask & (CAN_SFF_MASK | CAN_INV_FILTER)) == CAN_SFF_MASK)
+
+static inline unsigned int rtcan_recv_hash(uint32_t can_id)
+{
+    can_id &= CAN_SFF_MASK;
+    return (can_id ^ (can_id >> RTCAN_RECV_HASH_BITS)) &
+	(RTCAN_RECV_HASH_SIZE - 1);
+}
+
+
 /*
  *  Element in a TX wait queue.
  *
@@ -60,8 +87,9 @@ struct tx_wait_queue {
 };
 
 
-/* Spinlock for all reception lists and also for some members in
- * struct rtcan_socket */
+/* Spinlock serializing changes of the reception lists and protecting the
+ * binding members of struct rtcan_socket as well as the socket list. Each
+ * device's list itself is additionally guarded by dev->recv_list_lock. */
 extern rtdm_lock_t rtcan_recv_list_lock;
 
 
@@ -25,6 +25,7 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
+#include <linux/sort.h>
 
 #include <rtdm/rtdm_driver.h>
 #include <rtdm/rtcan.h>
@@ -123,6 +124,7 @@ static int rtcan_read_proc_devices(struct seq_file *p, void *data)
 {
     int i;
     struct rtcan_device *dev;
+    struct rtcan_dev_counters counters;
     char state_name[20], baudrate_name[20];
 
     if (down_interruptible(&rtcan_devices_nrt_lock))
@@ -142,9 +144,12 @@ static int rtcan_read_proc_devices(struct seq_file *p, void *data)
 				     state_name, sizeof(state_name));
 	    rtcan_dev_get_baudrate_name(dev->baudrate,
 					baudrate_name, sizeof(baudrate_name));
-	    seq_printf(p, "%-15s %9s %-8s %10d %10d %10d\n",
-		       dev->name, baudrate_name, state_name, dev->tx_count,
-		       dev->rx_count, dev->err_count);
+	    rtcan_dev_get_counters(dev, &counters);
+	    seq_printf(p, "%-15s %9s %-8s %10llu %10llu %10llu\n",
+		       dev->name, baudrate_name, state_name,
+		       (unsigned long long)counters.tx_count,
+		       (unsigned long long)counters.rx_count,
+		       (unsigned long long)counters.err_count);
 	    rtcan_dev_dereference(dev);
 	}
     }
@@ -235,6 +240,7 @@ static int rtcan_read_proc_info(struct seq_file *p, void *data)
     struct rtcan_device *dev = p->private;
     char state_name[20], baudrate_name[20];
     char ctrlmode_name[80], bittime_name[80];
+    struct rtcan_dev_counters counters;
 
     if (down_interruptible(&rtcan_devices_nrt_lock))
 	return -ERESTARTSYS;
@@ -247,6 +253,7 @@ static int rtcan_read_proc_info(struct seq_file *p, void *data)
 				baudrate_name, sizeof(baudrate_name));
     rtcan_dev_get_bittime_name(&dev->bit_time,
 			       bittime_name, sizeof(bittime_name));
+    rtcan_dev_get_counters(dev, &counters);
 
     seq_printf(p, "Device     %s\n", dev->name);
     seq_printf(p, "Controller %s\n", dev->ctrl_name);
@@ -256,9 +263,9 @@ static int rtcan_read_proc_info(struct seq_file *p, void *data)
     seq_printf(p, "Bit-time   %s\n", bittime_name);
     seq_printf(p, "Ctrl-Mode  %s\n", ctrlmode_name);
     seq_printf(p, "State      %s\n", state_name);
-    seq_printf(p, "TX-Counter %d\n", dev->tx_count);
-    seq_printf(p, "RX-Counter %d\n", dev->rx_count);
-    seq_printf(p, "Errors     %d\n", dev->err_count);
+    seq_printf(p, "TX-Counter %llu\n", (unsigned long long)counters.tx_count);
+    seq_printf(p, "RX-Counter %llu\n", (unsigned long long)counters.rx_count);
+    seq_printf(p, "Errors     %llu\n", (unsigned long long)counters.err_count);
 #ifdef RTCAN_USE_REFCOUNT
     seq_printf(p, "Refcount   %d\n", atomic_read(&dev->refcount));
 #endif
@@ -331,6 +338,202 @@ static const struct file_operations rtcan_proc_filter_ops = {
 
 
 
+static int rtcan_read_proc_tx_latency(struct seq_file *p, void *data)
+{
+    struct rtcan_device *dev = p->private;
+    unsigned int hist[RTCAN_TX_LATENCY_BUCKETS];
+    nanosecs_rel_t max;
+    rtdm_lockctx_t lock_ctx;
+    int i;
+
+    rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+    memcpy(hist, dev->tx_latency, sizeof(hist));
+    max = dev->tx_latency_max;
+    rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+
+    /* Submission to end of transmission
+     * ______from________to Frames
+     *       1024       2047 1234567890
+     */
+    seq_printf(p, "______from________to Frames\n");
+
+    seq_printf(p, "%10d %10d %10u\n", 0, 1023, hist[0]);
+    for (i = 1; i < RTCAN_TX_LATENCY_BUCKETS - 1; i++)
+	seq_printf(p, "%10llu %10llu %10u\n", 1ULL << (i + 9),
+		   (1ULL << (i + 10)) - 1, hist[i]);
+    seq_printf(p, "%10llu          - %10u\n", 1ULL << (i + 9), hist[i]);
+
+    seq_printf(p, "Max latency %lld ns\n", (long long)max);
+
+    return 0;
+}
+
+static int rtcan_proc_tx_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rtcan_read_proc_tx_latency, PDE_DATA(inode));
+}
+
+static const struct file_operations rtcan_proc_tx_latency_ops = {
+	.open		= rtcan_proc_tx_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE
+
+static int rtcan_trace_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int rtcan_read_proc_latency_trace(struct seq_file *p, void *data)
+{
+    static const char *step_name[RTCAN_TRACE_STEPS] = {
+	"hw-read", "to-rcv", "to-lock", "deliver", "wakeup"
+    };
+    struct rtcan_device *dev = p->private;
+    unsigned long long sum;
+    unsigned int count;
+    uint32_t *samples;
+    rtdm_lockctx_t lock_ctx;
+    int step, i;
+
+    samples = kmalloc(sizeof(dev->trace.samples[0]), GFP_KERNEL);
+    if (!samples)
+	return -ENOMEM;
+
+    /* Step_____ Frames ______Min ______Avg ... ______Max (ns)
+     * hw-read      256      1234      1234 ...      5678
+     */
+    seq_printf(p, "Step_____ Frames ______Min ______Avg ______50%% ______90%% "
+	       "______99%% ______Max (ns)\n");
+
+    for (step = 0; step < RTCAN_TRACE_STEPS; step++) {
+	rtdm_lock_get_irqsave(&dev->recv_list_lock, lock_ctx);
+	memcpy(samples, dev->trace.samples[step], sizeof(dev->trace.samples[0]));
+	count = (step == RTCAN_TRACE_WAKEUP) ?
+	    atomic_read(&dev->trace.wake_next) : dev->trace.rx_next;
+	rtdm_lock_put_irqrestore(&dev->recv_list_lock, lock_ctx);
+
+	if (count > RTCAN_TRACE_SAMPLES)
+	    count = RTCAN_TRACE_SAMPLES;
+	if (!count) {
+	    seq_printf(p, "%-9s %6u\n", step_name[step], 0);
+	    continue;
+	}
+
+	sort(samples, count, sizeof(samples[0]), rtcan_trace_cmp, NULL);
+	for (sum = 0, i = 0; i < count; i++)
+	    sum += samples[i];
+
+	seq_printf(p, "%-9s %6u %9u %9u %9u %9u %9u %9u\n", step_name[step],
+		   count, samples[0], (unsigned int)(sum / count),
+		   samples[count / 2], samples[count * 9 / 10],
+		   samples[count * 99 / 100], samples[count - 1]);
+    }
+
+    kfree(samples);
+
+    return 0;
+}
+
+static int rtcan_proc_latency_trace_open(struct inode *inode,
+					 struct file *file)
+{
+	return single_open(file, rtcan_read_proc_latency_trace,
+			   PDE_DATA(inode));
+}
+
+static const struct file_operations rtcan_proc_latency_trace_ops = {
+	.open		= rtcan_proc_latency_trace_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+#endif /* CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE */
+
+
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_STATS
+
+static int rtcan_read_proc_stats(struct seq_file *p, void *data)
+{
+    struct rtcan_device *dev = p->private;
+    struct rtcan_bus_stats stats;
+    struct rtcan_stats_window *window;
+    int i;
+
+    rtcan_dev_get_stats(dev, &stats);
+
+    /* Totals
+     *         ________Frames _________Bytes _____Bits(est)
+     * RX          1234567890     1234567890     1234567890
+     */
+    seq_printf(p, "        ________Frames _________Bytes _____Bits(est)\n");
+    seq_printf(p, "RX      %14llu %14llu %14llu\n", stats.rx_frames,
+	       stats.rx_bytes, stats.rx_bits);
+    seq_printf(p, "TX      %14llu %14llu %14llu\n", stats.tx_frames,
+	       stats.tx_bytes, stats.tx_bits);
+
+    seq_printf(p, "\nWindow Frames/s  Bytes/s   Load\n");
+    for (i = 0; i < RTCAN_STATS_WINDOWS; i++) {
+	window = &stats.window[i];
+	if (stats.bitrate)
+	    seq_printf(p, "%5us %8u %8u %3u.%u%%\n", window->seconds,
+		       window->frames, window->bytes,
+		       window->load / 10, window->load % 10);
+	else
+	    seq_printf(p, "%5us %8u %8u      -\n", window->seconds,
+		       window->frames, window->bytes);
+    }
+
+    seq_printf(p, "\n__CAN_ID__ _____Count\n");
+    for (i = 0; i < stats.top_count; i++)
+	seq_printf(p, "0x%08x %10u\n", stats.top[i].can_id,
+		   stats.top[i].count);
+
+    return 0;
+}
+
+static int rtcan_proc_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rtcan_read_proc_stats, PDE_DATA(inode));
+}
+
+static const struct file_operations rtcan_proc_stats_ops = {
+	.open		= rtcan_proc_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+#endif /* CONFIG_XENO_DRIVERS_CAN_STATS */
+
+
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_GW
+
+static int rtcan_proc_gateway_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rtcan_gw_read_proc, NULL);
+}
+
+static const struct file_operations rtcan_proc_gateway_ops = {
+	.open		= rtcan_proc_gateway_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+#endif /* CONFIG_XENO_DRIVERS_CAN_GW */
+
+
 static int rtcan_read_proc_version(struct seq_file *p, void *data)
 {
 	seq_printf(p, "RT-Socket-CAN %d.%d.%d - built on %s %s\n",
@@ -360,6 +563,13 @@ void rtcan_dev_remove_proc(struct rtcan_device* dev)
 
     remove_proc_entry("info", dev->proc_root);
     remove_proc_entry("filters", dev->proc_root);
+    remove_proc_entry("tx_latency", dev->proc_root);
+#ifdef CONFIG_XENO_DRIVERS_CAN_STATS
+    remove_proc_entry("stats", dev->proc_root);
+#endif
+#ifdef CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE
+    remove_proc_entry("latency_trace", dev->proc_root);
+#endif
     remove_proc_entry(dev->name, rtcan_proc_root);
 
     dev->proc_root = NULL;
@@ -380,6 +590,16 @@ int rtcan_dev_create_proc(struct rtcan_device* dev)
 		     &rtcan_proc_info_ops, dev);
     proc_create_data("filters", S_IFREG | S_IRUGO | S_IWUSR, dev->proc_root,
 		     &rtcan_proc_filter_ops, dev);
+    proc_create_data("tx_latency", S_IFREG | S_IRUGO, dev->proc_root,
+		     &rtcan_proc_tx_latency_ops, dev);
+#ifdef CONFIG_XENO_DRIVERS_CAN_STATS
+    proc_create_data("stats", S_IFREG | S_IRUGO, dev->proc_root,
+		     &rtcan_proc_stats_ops, dev);
+#endif
+#ifdef CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE
+    proc_create_data("latency_trace", S_IFREG | S_IRUGO, dev->proc_root,
+		     &rtcan_proc_latency_trace_ops, dev);
+#endif
     return 0;
 
 }
@@ -399,6 +619,10 @@ static int rtcan_proc_register(void)
 		&rtcan_proc_version_ops);
     proc_create("sockets", S_IFREG | S_IRUGO | S_IWUSR, rtcan_proc_root,
 		&rtcan_proc_sockets_ops);
+#ifdef CONFIG_XENO_DRIVERS_CAN_GW
+    proc_create("gateway", S_IFREG | S_IRUGO, rtcan_proc_root,
+		&rtcan_proc_gateway_ops);
+#endif
     return 0;
 }
 
@@ -409,6 +633,9 @@ static void rtcan_proc_unregister(void)
     remove_proc_entry("devices", rtcan_proc_root);
     remove_proc_entry("version", rtcan_proc_root);
     remove_proc_entry("sockets", rtcan_proc_root);
+#ifdef CONFIG_XENO_DRIVERS_CAN_GW
+    remove_proc_entry("gateway", rtcan_proc_root);
+#endif
     remove_proc_entry("rtcan", 0);
 }
 #endif  /* CONFIG_PROC_FS */
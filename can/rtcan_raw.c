@@ -36,10 +36,14 @@
 
 #include <linux/module.h>
 #include <linux/delay.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
 
 #include <rtdm/rtdm_driver.h>
 
 #include <rtdm/rtcan.h>
+#include "rtcan_ext.h"
 #include "rtcan_version.h"
 #include "rtcan_socket.h"
 #include "rtcan_list.h"
@@ -59,9 +63,20 @@ MODULE_AUTHOR("RT-Socket-CAN Development Team");
 MODULE_DESCRIPTION("RTDM CAN raw socket device driver");
 MODULE_LICENSE("GPL");
 
+static unsigned int rcvbuf_max = RTCAN_RXBUF_MAX_SIZE;
+module_param(rcvbuf_max, uint, 0444);
+MODULE_PARM_DESC(rcvbuf_max, "Largest receive buffer in bytes a socket may "
+		 "set via CAN_RAW_RCVBUF (default 1048576)");
+
 void rtcan_tx_push(struct rtcan_device *dev, struct rtcan_socket *sock,
 		   can_frame_t *frame);
 
+static int rtcan_raw_recv_batch(struct rtdm_dev_context *context,
+				rtdm_user_info_t *user_info,
+				struct rtcan_recv_batch *batch);
+static int rtcan_raw_transact(struct rtdm_dev_context *context,
+			      struct rtcan_transaction *tr);
+
 static struct rtdm_device rtcan_proto_raw_dev;
 
 
@@ -74,6 +89,174 @@ static inline int rtcan_accept_msg(uint32_t can_id, can_filter_t *filter)
 }
 
 
+/*
+ * Store a frame in the socket's mapped reception ring. The timestamp is
+ * taken unconditionally here as the slot has room for it anyway.
+ */
+static inline void rtcan_rcv_deliver_ring(struct rtcan_socket *sock,
+					  struct rtcan_rx_ring *ring,
+					  struct rtcan_skb *skb)
+{
+    struct rtcan_rb_frame *frame = &skb->rb_frame;
+    struct rtcan_ring_header *hdr = ring->hdr;
+    struct rtcan_ring_slot *slot;
+    uint32_t head = ring->head;
+    uint32_t tail = hdr->tail;
+    size_t data_size = min_t(size_t, rtcan_skb_payload(skb), 8);
+    uint32_t seq = ring->seq++;
+
+    if (head - tail > ring->mask) {
+	/* Overflow of socket's ring! */
+	hdr->overruns++;
+	sock->rx_buf_full++;
+	return;
+    }
+
+    slot = &ring->slots[head & ring->mask];
+
+    slot->frame.can_id = frame->can_id;
+    slot->frame.can_dlc = frame->can_dlc & RTCAN_HAS_NO_TIMESTAMP;
+    memcpy(slot->frame.data, frame->data, data_size);
+    memset(slot->frame.data + data_size, 0, 8 - data_size);
+    memcpy(&slot->timestamp, (void *)frame + skb->rb_frame_size,
+	   RTCAN_TIMESTAMP_SIZE);
+    slot->ifindex = frame->can_ifindex;
+    slot->seq = seq;
+
+    /* Slot contents must be visible before the new head */
+    smp_wmb();
+    ring->head = ++head;
+    hdr->head = head;
+
+    /* Wake up a consumer waiting for the ring to become non-empty */
+    if (head - 1 == tail)
+	rtdm_event_signal(&sock->ring_event);
+}
+
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE
+
+/* Called by rtcan_rcv_deliver() once the socket's rx_lock is taken */
+static inline void rtcan_trace_lock(struct rtcan_socket *sock,
+				    struct rtcan_skb *skb)
+{
+    nanosecs_abs_t now = rtdm_clock_read();
+
+    if (!skb->trace_lock)
+	skb->trace_lock = now;
+
+    /* The reader measures its wakeup from the first delivery on */
+    if (!sock->trace_wake) {
+	sock->trace_wake = now;
+	sock->trace_ifindex = skb->rb_frame.can_ifindex;
+    }
+}
+
+/* Record the steps of a received frame, recv_list_lock held */
+static inline void rtcan_trace_rx(struct rtcan_device *dev,
+				  struct rtcan_skb *skb,
+				  nanosecs_abs_t trace_rcv)
+{
+    struct rtcan_trace *trace = &dev->trace;
+    unsigned int i = trace->rx_next++ & (RTCAN_TRACE_SAMPLES - 1);
+    nanosecs_abs_t trace_lock = skb->trace_lock ? skb->trace_lock : trace_rcv;
+
+    trace->samples[RTCAN_TRACE_HW][i] = skb->trace_hw - skb->trace_irq;
+    trace->samples[RTCAN_TRACE_RCV][i] = trace_rcv - skb->trace_hw;
+    trace->samples[RTCAN_TRACE_LOCK][i] = trace_lock - trace_rcv;
+    trace->samples[RTCAN_TRACE_DELIVER][i] = rtdm_clock_read() - trace_lock;
+}
+
+#else /* !CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE */
+
+#define rtcan_trace_lock(sock, skb)             do {} while(0)
+#define rtcan_trace_rx(dev, skb, trace_rcv)     do {} while(0)
+
+#endif /* CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE */
+
+
+/* Fill a receive slot from the frame stored in @skb */
+static inline void rtcan_rx_slot_fill(struct rtcan_rx_slot *slot,
+				      struct rtcan_skb *skb)
+{
+    struct rtcan_rb_frame *frame = &skb->rb_frame;
+    size_t data_size = min_t(size_t, rtcan_skb_payload(skb), 8);
+
+    slot->can_id = frame->can_id;
+    slot->can_ifindex = frame->can_ifindex;
+    slot->can_dlc = frame->can_dlc;
+    slot->__pad = 0;
+    memcpy(slot->data, frame->data, data_size);
+    memset(slot->data + data_size, 0, 8 - data_size);
+    memcpy(&slot->timestamp, (void *)frame + skb->rb_frame_size,
+	   RTCAN_TIMESTAMP_SIZE);
+}
+
+
+/*
+ * Store a frame in the socket's fixed-slot ring. Called with rx_lock held,
+ * which serialises the producers, the consumers don't take it.
+ */
+static inline void rtcan_rcv_deliver_slot(struct rtcan_socket *sock,
+					  struct rtcan_skb *skb)
+{
+    struct rtcan_rx_slot slot;
+    unsigned int tail = sock->recv_slot_tail;
+
+    if (tail - ACCESS_ONCE(sock->recv_slot_head) > sock->recv_slot_mask) {
+	/* Overflow of socket's ring! */
+	sock->rx_buf_full++;
+	return;
+    }
+
+    /* The slot must not be written before the head was read */
+    smp_mb();
+
+    rtcan_rx_slot_fill(&slot, skb);
+    sock->recv_slots[tail & sock->recv_slot_mask] = slot;
+
+    /* Slot contents must be visible before the new tail */
+    smp_wmb();
+    ACCESS_ONCE(sock->recv_slot_tail) = tail + 1;
+
+    rtdm_sem_up(&sock->recv_sem);
+}
+
+
+/*
+ * Overwrite the entry of the frame's CAN ID in the socket's last-value
+ * cache, adding the ID if it is new. recv_sem is only raised when the
+ * entry becomes dirty, a repetition of an unread frame just replaces it.
+ * Called with rx_lock held.
+ */
+static inline void rtcan_rcv_deliver_lvc(struct rtcan_socket *sock,
+					 struct rtcan_skb *skb)
+{
+    struct rtcan_lvc *lvc = sock->lvc;
+    uint32_t can_id = skb->rb_frame.can_id;
+    unsigned int i = hash_32(can_id, lvc->bits);
+
+    /* The table is at most half full, so there is always a free entry */
+    while (lvc->entry[i].can_id != can_id) {
+	if (lvc->entry[i].can_id == RTCAN_LVC_EMPTY) {
+	    if (lvc->used == lvc->max_ids) {
+		/* No room for another ID */
+		sock->rx_buf_full++;
+		return;
+	    }
+	    lvc->used++;
+	    break;
+	}
+	i = (i + 1) & (lvc->size - 1);
+    }
+
+    rtcan_rx_slot_fill(&lvc->entry[i], skb);
+
+    if (!test_and_set_bit(i, lvc->dirty))
+	rtdm_sem_up(&sock->recv_sem);
+}
+
+
 static void rtcan_rcv_deliver(struct rtcan_recv *recv_listener,
 			      struct rtcan_skb *skb)
 {
@@ -83,6 +266,32 @@ static void rtcan_rcv_deliver(struct rtcan_recv *recv_listener,
     struct rtcan_socket *sock = recv_listener->sock;
     struct rtdm_dev_context *context = rtcan_socket_context(sock);
 
+    /* Interrupts are off, the device's recv_list_lock is held */
+    rtdm_lock_get(&sock->rx_lock);
+    rtcan_trace_lock(sock, skb);
+
+    /* A capture takes all frames, CAN FD frames included */
+    if (unlikely(rtcan_capture_active(sock))) {
+	rtcan_capture_frame(sock, skb);
+	rtdm_lock_put(&sock->rx_lock);
+	return;
+    }
+
+    /* FD frames only go to sockets asking for them, and only into the
+     * byte-packed buffer */
+    if (unlikely(frame->can_dlc & RTCAN_FD_FRAME) &&
+	(!sock->fd_frames || rtcan_rx_ring_mapped(sock->rx_ring) ||
+	 sock->recv_slots || sock->lvc)) {
+	rtdm_lock_put(&sock->rx_lock);
+	return;
+    }
+
+    if (unlikely(rtcan_rx_ring_mapped(sock->rx_ring))) {
+	rtcan_rcv_deliver_ring(sock, sock->rx_ring, skb);
+	rtdm_lock_put(&sock->rx_lock);
+	return;
+    }
+
     cpy_size = skb->rb_frame_size;
     /* Check if socket wants to receive a timestamp */
     if (test_bit(RTCAN_GET_TIMESTAMP, &context->context_flags)) {
@@ -91,18 +300,30 @@ static void rtcan_rcv_deliver(struct rtcan_recv *recv_listener,
     } else
 	frame->can_dlc &= RTCAN_HAS_NO_TIMESTAMP;
 
+    if (sock->recv_slots) {
+	rtcan_rcv_deliver_slot(sock, skb);
+	rtdm_lock_put(&sock->rx_lock);
+	return;
+    }
+
+    if (sock->lvc) {
+	rtcan_rcv_deliver_lvc(sock, skb);
+	rtdm_lock_put(&sock->rx_lock);
+	return;
+    }
+
     /* Calculate free size in the ring buffer */
     size_free = sock->recv_head - sock->recv_tail;
     if (size_free <= 0)
-	size_free += RTCAN_RXBUF_SIZE;
+	size_free += sock->recv_buf_size;
 
     /* Test if ring buffer has enough space. */
     if (size_free > cpy_size) {
 	/* Check if we must wrap around the end of buffer */
-	if ((sock->recv_tail + cpy_size) > RTCAN_RXBUF_SIZE) {
+	if ((sock->recv_tail + cpy_size) > sock->recv_buf_size) {
 	    /* Wrap around: Two memcpy operations */
 
-	    first_part_size = RTCAN_RXBUF_SIZE - sock->recv_tail;
+	    first_part_size = sock->recv_buf_size - sock->recv_tail;
 
 	    memcpy(&sock->recv_buf[sock->recv_tail], (void *)frame,
 		   first_part_size);
@@ -114,7 +335,7 @@ static void rtcan_rcv_deliver(struct rtcan_recv *recv_listener,
 
 	/* Adjust tail */
 	sock->recv_tail = (sock->recv_tail + cpy_size) &
-	    (RTCAN_RXBUF_SIZE - 1);
+	    (sock->recv_buf_size - 1);
 
 	/*Notify the delivery of the message */
 	rtdm_sem_up(&sock->recv_sem);
@@ -125,22 +346,136 @@ static void rtcan_rcv_deliver(struct rtcan_recv *recv_listener,
 	RTCAN_RTDM_DBG("%s: socket buffer overflow (fd=%d), message discarded\n",
 		       rtcan_proto_raw_dev.driver_name, context->fd);
     }
+
+    rtdm_lock_put(&sock->rx_lock);
 }
 
 
-void rtcan_rcv(struct rtcan_device *dev, struct rtcan_skb *skb)
+/*
+ * Deliver a frame to all matching listeners of one hash bucket, except the
+ * socket the frame was sent from (if any).
+ */
+static inline void rtcan_rcv_index(struct rtcan_recv *recv_listener,
+				   struct rtcan_skb *skb,
+				   struct rtcan_socket *tx_sock)
+{
+    uint32_t can_id = skb->rb_frame.can_id;
+
+    while (recv_listener != NULL) {
+	if (recv_listener->sock != tx_sock &&
+	    rtcan_accept_msg(can_id, &recv_listener->can_filter)) {
+	    recv_listener->match_count++;
+	    rtcan_rcv_deliver(recv_listener, skb);
+	}
+	recv_listener = recv_listener->index_next;
+    }
+}
+
+
+/*
+ * Deliver a frame to all matching filters of the compiled masked filter
+ * arrays, except those of the socket the frame was sent from (if any).
+ */
+static inline void rtcan_rcv_masks(struct rtcan_recv_masks *masks,
+				   struct rtcan_skb *skb,
+				   struct rtcan_socket *tx_sock)
+{
+    uint32_t can_id = skb->rb_frame.can_id;
+    struct rtcan_recv *recv_listener;
+    unsigned int base, i, n;
+    uint32_t hits;
+
+    for (base = 0; base < masks->count; base += RTCAN_RECV_BLOCK) {
+	n = min_t(unsigned int, masks->count - base, RTCAN_RECV_BLOCK);
+
+	hits = 0;
+	for (i = 0; i < n; i++)
+	    hits |= (uint32_t)(((can_id & masks->mask[base + i]) ==
+				masks->id[base + i]) ^
+			       masks->inv[base + i]) << i;
+
+	while (hits) {
+	    i = __ffs(hits);
+	    hits &= hits - 1;
+
+	    recv_listener = masks->recv[base + i];
+	    if (recv_listener->sock != tx_sock) {
+		recv_listener->match_count++;
+		rtcan_rcv_deliver(recv_listener, skb);
+	    }
+	}
+    }
+}
+
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_STATS
+/* Format of a received frame for rtcan_stats_rx() */
+static inline unsigned int rtcan_stats_format(struct rtcan_rb_frame *frame)
+{
+    if (!(frame->can_dlc & RTCAN_FD_FRAME))
+	return 0;
+    return RTCAN_STATS_FD |
+	((frame->can_dlc & RTCAN_FD_BRS) ? RTCAN_STATS_BRS : 0);
+}
+#endif /* CONFIG_XENO_DRIVERS_CAN_STATS */
+
+
+/*
+ * Complete a transaction whose response matches the frame, the first one
+ * in the table if there are several. Called with recv_list_lock held.
+ */
+static void rtcan_rcv_transact(struct rtcan_device *dev,
+			       struct rtcan_skb *skb)
+{
+    struct rtcan_rb_frame *frame = &skb->rb_frame;
+    struct rtcan_transact *transact;
+    int i;
+
+    /* Responses are classic frames */
+    if (frame->can_dlc & RTCAN_FD_FRAME)
+	return;
+
+    for (i = 0; i < RTCAN_MAX_TRANSACTIONS; i++) {
+	transact = dev->transact[i];
+	if (!transact ||
+	    ((frame->can_id ^ transact->can_id) & transact->can_mask))
+	    continue;
+
+	transact->response.can_id = frame->can_id;
+	transact->response.can_dlc = frame->can_dlc & RTCAN_HAS_NO_TIMESTAMP;
+	memcpy(transact->response.data, frame->data,
+	       min_t(size_t, rtcan_skb_payload(skb), 8));
+	transact->timestamp = skb->timestamp;
+	transact->matched = 1;
+
+	dev->transact[i] = NULL;
+	dev->transact_count--;
+	rtdm_event_signal(&transact->done);
+	return;
+    }
+}
+
+
+/*
+ * Reception path walking the reception list, see rtcan_rcv()
+ */
+void rtcan_rcv_list(struct rtcan_device *dev, struct rtcan_skb *skb)
 {
-    nanosecs_abs_t timestamp = rtdm_clock_read();
     /* Entry in reception list, begin with head */
     struct rtcan_recv *recv_listener = dev->recv_list;
     struct rtcan_rb_frame *frame = &skb->rb_frame;
+#ifdef CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE
+    nanosecs_abs_t trace_rcv = rtdm_clock_read();
+
+    skb->trace_lock = 0;
+#endif
 
-    /* Copy timestamp to skb */
+    /* Copy the driver's timestamp behind the frame data */
     memcpy((void *)&skb->rb_frame + skb->rb_frame_size,
-	   &timestamp, RTCAN_TIMESTAMP_SIZE);
+	   &skb->timestamp, RTCAN_TIMESTAMP_SIZE);
 
     if ((frame->can_id & CAN_ERR_FLAG)) {
-	dev->err_count++;
+	rtcan_dev_count_err(dev);
 	while (recv_listener != NULL) {
 	    if ((frame->can_id & recv_listener->sock->err_mask)) {
 		recv_listener->match_count++;
@@ -149,62 +484,191 @@ void rtcan_rcv(struct rtcan_device *dev, struct rtcan_skb *skb)
 	    recv_listener = recv_listener->next;
 	}
     } else {
-	dev->rx_count++;
-	while (recv_listener != NULL) {
-	    if (rtcan_accept_msg(frame->can_id, &recv_listener->can_filter)) {
-		recv_listener->match_count++;
-		rtcan_rcv_deliver(recv_listener, skb);
-	    }
-	    recv_listener = recv_listener->next;
-	}
+	rtcan_dev_count_rx(dev);
+	rtcan_stats_rx(dev, frame->can_id, rtcan_skb_payload(skb),
+		       rtcan_stats_format(frame));
+	if (unlikely(dev->transact_count))
+	    rtcan_rcv_transact(dev, skb);
+	rtcan_gw_route(dev, skb);
+	rtcan_rcv_index(dev->recv_hash[rtcan_recv_hash(frame->can_id)],
+			skb, NULL);
+	rtcan_rcv_masks(&dev->recv_masks, skb, NULL);
+	rtcan_trace_rx(dev, skb, trace_rcv);
+    }
+}
+
+
+/*
+ * Reception path of a device whose only listener is a socket bound without
+ * filter, see rtcan_raw_index_filter(). A data frame is written straight
+ * into the socket's ring buffer, its timestamp taken from skb as the socket
+ * wants it. Error frames and pending transactions take the list path,
+ * sockets with another receive buffer, CAN FD frames and frames wrapping
+ * around the end of the buffer or not fitting into it rtcan_rcv_deliver().
+ */
+void rtcan_rcv_single(struct rtcan_device *dev, struct rtcan_skb *skb)
+{
+    struct rtcan_recv *recv_listener = dev->rx_single;
+    struct rtcan_socket *sock = recv_listener->sock;
+    struct rtcan_rb_frame *frame = &skb->rb_frame;
+    size_t frame_size = skb->rb_frame_size;
+    size_t cpy_size = frame_size + sock->rx_ts_size;
+    unsigned int tail;
+    int size_free;
+#ifdef CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE
+    nanosecs_abs_t trace_rcv;
+#endif
+
+    if (unlikely((frame->can_id & CAN_ERR_FLAG) || dev->transact_count)) {
+	rtcan_rcv_list(dev, skb);
+	return;
+    }
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE
+    trace_rcv = rtdm_clock_read();
+    skb->trace_lock = 0;
+#endif
+
+    rtcan_dev_count_rx(dev);
+    rtcan_stats_rx(dev, frame->can_id, rtcan_skb_payload(skb),
+		   rtcan_stats_format(frame));
+    recv_listener->match_count++;
+    rtcan_gw_route(dev, skb);
+
+    /* Interrupts are off, the device's recv_list_lock is held */
+    rtdm_lock_get(&sock->rx_lock);
+    rtcan_trace_lock(sock, skb);
+
+    tail = sock->recv_tail;
+    size_free = sock->recv_head - tail;
+    if (size_free <= 0)
+	size_free += sock->recv_buf_size;
+
+    if (likely(!sock->rx_ring && !sock->recv_slots && !sock->lvc &&
+	       !rtcan_capture_active(sock) &&
+	       !(frame->can_dlc & RTCAN_FD_FRAME) && size_free > cpy_size &&
+	       tail + cpy_size <= sock->recv_buf_size)) {
+	frame->can_dlc = (frame->can_dlc & RTCAN_HAS_NO_TIMESTAMP) |
+	    (sock->rx_ts_size ? RTCAN_HAS_TIMESTAMP : 0);
+	memcpy(&sock->recv_buf[tail], frame, frame_size);
+	memcpy(&sock->recv_buf[tail + frame_size], &skb->timestamp,
+	       sock->rx_ts_size);
+	sock->recv_tail = (tail + cpy_size) & (sock->recv_buf_size - 1);
+
+	rtdm_sem_up(&sock->recv_sem);
+	rtdm_lock_put(&sock->rx_lock);
+    } else {
+	rtdm_lock_put(&sock->rx_lock);
+
+	memcpy((void *)frame + frame_size, &skb->timestamp,
+	       RTCAN_TIMESTAMP_SIZE);
+	rtcan_rcv_deliver(recv_listener, skb);
     }
+
+    rtcan_trace_rx(dev, skb, trace_rcv);
 }
 
 #ifdef CONFIG_XENO_DRIVERS_CAN_LOOPBACK
 
+/*
+ * Prepare the echo of a frame about to be passed to hard_start_xmit().
+ * Called with device_lock held.
+ */
 void rtcan_tx_push(struct rtcan_device *dev, struct rtcan_socket *sock,
 		   can_frame_t *frame)
 {
-    struct rtcan_rb_frame *rb_frame = &dev->tx_skb.rb_frame;
-
-    RTCAN_ASSERT(dev->tx_socket == 0,
-		 rtdm_printk("(%d) TX skb still in use", dev->ifindex););
+    struct rtcan_tx_echo *echo = dev->tx_echo_next;
+    struct rtcan_rb_frame *rb_frame = &echo->skb.rb_frame;
 
     rb_frame->can_id = frame->can_id;
     rb_frame->can_dlc = frame->can_dlc;
-    dev->tx_skb.rb_frame_size = EMPTY_RB_FRAME_SIZE;
+    echo->skb.rb_frame_size = EMPTY_RB_FRAME_SIZE;
+    /* A DLC of 9 to 15 still means 8 data bytes */
     if (frame->can_dlc && !(frame->can_id & CAN_RTR_FLAG)) {
-	memcpy(rb_frame->data, frame->data, frame->can_dlc);
-	dev->tx_skb.rb_frame_size += frame->can_dlc;
+	memcpy(rb_frame->data, frame->data, min_t(size_t, frame->can_dlc, 8));
+	echo->skb.rb_frame_size += min_t(size_t, frame->can_dlc, 8);
     }
     rb_frame->can_ifindex = dev->ifindex;
-    dev->tx_socket = sock;
+    echo->sock = sock;
+}
+
+/* Like rtcan_tx_push(), for a CAN FD frame */
+static void rtcan_tx_push_fd(struct rtcan_device *dev,
+			     struct rtcan_socket *sock,
+			     struct canfd_frame *frame)
+{
+    struct rtcan_tx_echo *echo = dev->tx_echo_next;
+    struct rtcan_rb_frame *rb_frame = &echo->skb.rb_frame;
+
+    rb_frame->can_id = frame->can_id;
+    rb_frame->can_dlc = rtcan_fd_len2dlc(frame->len) | RTCAN_FD_FRAME |
+	((frame->flags & CANFD_BRS) ? RTCAN_FD_BRS : 0) |
+	((frame->flags & CANFD_ESI) ? RTCAN_FD_ESI : 0);
+    memcpy(rb_frame->data, frame->data, frame->len);
+    echo->skb.rb_frame_size = EMPTY_RB_FRAME_SIZE + frame->len;
+    rb_frame->can_ifindex = dev->ifindex;
+    echo->sock = sock;
+}
+
+/*
+ * The frame prepared by rtcan_tx_push() went to dev->tx_mailbox: attach
+ * its echo to that mailbox, unless the driver looped it back already.
+ * The mailbox's previous echo entry becomes the next one to prepare.
+ */
+static inline void rtcan_tx_commit(struct rtcan_device *dev)
+{
+    struct rtcan_tx_echo *echo = dev->tx_echo_next;
+
+    if (echo->sock) {
+	dev->tx_echo_next = dev->tx_echo[dev->tx_mailbox];
+	dev->tx_echo[dev->tx_mailbox] = echo;
+    }
+}
+
+/* hard_start_xmit() refused the frame prepared by rtcan_tx_push() */
+static inline void rtcan_tx_drop(struct rtcan_device *dev)
+{
+    dev->tx_echo_next->sock = NULL;
 }
 
-void rtcan_loopback(struct rtcan_device *dev)
+/*
+ * Deliver the echo of the frame transmitted from @mailbox (or of the one
+ * being submitted, RTCAN_TX_SUBMITTING) to the local sockets. Called with
+ * device_lock and recv_list_lock held if rtcan_loopback_pending().
+ */
+void rtcan_loopback(struct rtcan_device *dev, int mailbox)
 {
     nanosecs_abs_t timestamp = rtdm_clock_read();
-    /* Entry in reception list, begin with head */
-    struct rtcan_recv *recv_listener = dev->recv_list;
-    struct rtcan_rb_frame *frame = &dev->tx_skb.rb_frame;
+    struct rtcan_tx_echo *echo = rtcan_tx_echo(dev, mailbox);
+    struct rtcan_rb_frame *frame = &echo->skb.rb_frame;
+    struct rtcan_socket *tx_sock = echo->sock;
 
-    memcpy((void *)&dev->tx_skb.rb_frame + dev->tx_skb.rb_frame_size,
+    memcpy((void *)frame + echo->skb.rb_frame_size,
 	   &timestamp, RTCAN_TIMESTAMP_SIZE);
 
-    while (recv_listener != NULL) {
-	dev->rx_count++;
-	if ((dev->tx_socket != recv_listener->sock) &&
-	    rtcan_accept_msg(frame->can_id, &recv_listener->can_filter)) {
-	    recv_listener->match_count++;
-	    rtcan_rcv_deliver(recv_listener, &dev->tx_skb);
-	}
-	recv_listener = recv_listener->next;
-    }
-    dev->tx_socket = NULL;
+    /* The sender gets its own frame only if it asked for it, stamped
+     * with the end of the transmission */
+    if (tx_sock->recv_own_msgs)
+	tx_sock = NULL;
+
+    rtcan_dev_count_rx(dev);
+    rtcan_rcv_index(dev->recv_hash[rtcan_recv_hash(frame->can_id)],
+		    &echo->skb, tx_sock);
+    rtcan_rcv_masks(&dev->recv_masks, &echo->skb, tx_sock);
+
+    echo->sock = NULL;
 }
 
 EXPORT_SYMBOL_GPL(rtcan_loopback);
 
+#else /* !CONFIG_XENO_DRIVERS_CAN_LOOPBACK */
+
+static inline void rtcan_tx_push_fd(struct rtcan_device *dev,
+				    struct rtcan_socket *sock,
+				    struct canfd_frame *frame) { }
+static inline void rtcan_tx_commit(struct rtcan_device *dev) { }
+static inline void rtcan_tx_drop(struct rtcan_device *dev) { }
+
 #endif /* CONFIG_XENO_DRIVERS_CAN_LOOPBACK */
 
 
@@ -215,9 +679,7 @@ int rtcan_raw_socket(struct rtdm_dev_context *context,
     if (protocol != CAN_RAW && protocol != 0)
 	return -EPROTONOSUPPORT;
 
-    rtcan_socket_init(context);
-
-    return 0;
+    return rtcan_socket_init(context);
 }
 
 
@@ -232,6 +694,169 @@ static inline void rtcan_raw_unbind(struct rtcan_socket *sock)
 }
 
 
+static void rtcan_raw_ring_put(struct rtcan_rx_ring *ring)
+{
+    if (atomic_dec_and_test(&ring->refcount)) {
+	vfree(ring->hdr);
+	kfree(ring);
+    }
+}
+
+
+static void rtcan_raw_ring_vm_open(struct vm_area_struct *vma)
+{
+    struct rtcan_rx_ring *ring = vma->vm_private_data;
+
+    atomic_inc(&ring->refcount);
+}
+
+
+static void rtcan_raw_ring_vm_close(struct vm_area_struct *vma)
+{
+    rtcan_raw_ring_put(vma->vm_private_data);
+}
+
+
+static struct vm_operations_struct rtcan_raw_ring_vm_ops = {
+    open:       rtcan_raw_ring_vm_open,
+    close:      rtcan_raw_ring_vm_close,
+};
+
+
+/*
+ * Detach the reception ring from the socket and drop the socket's
+ * reference. Must be called in non-real-time context.
+ */
+static void rtcan_raw_ring_release(struct rtcan_socket *sock)
+{
+    struct rtcan_rx_ring *ring;
+    rtdm_lockctx_t lock_ctx;
+
+    rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+    ring = sock->rx_ring;
+    sock->rx_ring = NULL;
+    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+    if (ring)
+	rtcan_raw_ring_put(ring);
+}
+
+
+static int rtcan_raw_ring_map(struct rtdm_dev_context *context,
+			      rtdm_user_info_t *user_info,
+			      struct rtcan_ring_map *map)
+{
+    struct rtcan_socket *sock =
+	(struct rtcan_socket *)&context->dev_private;
+    struct rtcan_rx_ring *ring;
+    unsigned int slots = map->slots;
+    rtdm_lockctx_t lock_ctx;
+    void *addr;
+    int ret;
+
+    /* Only user space can map the ring */
+    if (!user_info)
+	return -EINVAL;
+
+    if (slots == 0)
+	slots = RTCAN_RING_DEFAULT_SLOTS;
+    if (slots > RTCAN_RING_MAX_SLOTS || (slots & (slots - 1)))
+	return -EINVAL;
+
+    if (rtcan_rx_ring_mapped(sock->rx_ring) || rtcan_capture_active(sock))
+	return -EBUSY;
+
+    /* An old ring not mapped anymore is replaced */
+    rtcan_raw_ring_release(sock);
+
+    ring = kmalloc(sizeof(struct rtcan_rx_ring), GFP_KERNEL);
+    if (!ring)
+	return -ENOMEM;
+
+    ring->size = PAGE_ALIGN(sizeof(struct rtcan_ring_header) +
+			    slots * sizeof(struct rtcan_ring_slot));
+    ring->hdr = vmalloc(ring->size);
+    if (!ring->hdr) {
+	kfree(ring);
+	return -ENOMEM;
+    }
+    memset(ring->hdr, 0, ring->size);
+    ring->hdr->slot_count = slots;
+    ring->slots = (struct rtcan_ring_slot *)(ring->hdr + 1);
+    ring->mask = slots - 1;
+    ring->head = 0;
+    ring->seq = 0;
+
+    /* One reference for the socket, one for the mapping */
+    atomic_set(&ring->refcount, 2);
+
+    ret = rtdm_mmap_to_user(user_info, ring->hdr, ring->size,
+			    PROT_READ | PROT_WRITE, &addr,
+			    &rtcan_raw_ring_vm_ops, ring);
+    if (ret) {
+	vfree(ring->hdr);
+	kfree(ring);
+	return ret;
+    }
+
+    rtdm_event_clear(&sock->ring_event);
+
+    rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+    sock->rx_ring = ring;
+    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+    map->slots = slots;
+    map->addr = addr;
+    map->size = ring->size;
+
+    return 0;
+}
+
+
+static int rtcan_raw_ring_wait(struct rtcan_socket *sock,
+			       nanosecs_rel_t timeout)
+{
+    struct rtcan_rx_ring *ring;
+    rtdm_toseq_t timeout_seq;
+    rtdm_lockctx_t lock_ctx;
+    int empty, ret;
+
+    rtdm_toseq_init(&timeout_seq, timeout);
+
+    for (;;) {
+	/* The ring can only be replaced under the socket's rx_lock */
+	rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+	ring = sock->rx_ring;
+	if (!rtcan_rx_ring_mapped(ring)) {
+	    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+	    return -EINVAL;
+	}
+	empty = (ring->head == ring->hdr->tail);
+	rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+	if (!empty)
+	    return 0;
+
+	ret = rtdm_event_timedwait(&sock->ring_event, timeout, &timeout_seq);
+	switch (ret) {
+	case 0:
+	    break;
+
+	case -EIDRM:
+	    /* Socket was closed */
+	    return -EBADF;
+
+	case -EWOULDBLOCK:
+	    /* We would block but don't want to */
+	    return -EAGAIN;
+
+	default:
+	    return ret;
+	}
+    }
+}
+
+
 static int rtcan_raw_close(struct rtdm_dev_context *context,
 			   rtdm_user_info_t *user_info)
 {
@@ -248,6 +873,12 @@ static int rtcan_raw_close(struct rtdm_dev_context *context,
 
     rtdm_lock_put_irqrestore(&rtcan_recv_list_lock, lock_ctx);
 
+    /* Stop the socket's cyclic transmissions, if any */
+    rtcan_cyclic_stop(sock);
+
+    rtcan_capture_stop(sock);
+
+    rtcan_raw_ring_release(sock);
 
     rtcan_socket_cleanup(context);
 
@@ -271,6 +902,11 @@ int rtcan_raw_bind(struct rtdm_dev_context *context,
     if (scan->can_ifindex < 0 || scan->can_ifindex > RTCAN_MAX_DEVICES)
 	return -ENODEV;
 
+    /* Make room for the filters while we may still allocate */
+    if (!rtdm_in_rt_context() &&
+	(ret = rtcan_raw_reserve_filter(sock, scan->can_ifindex, NULL)))
+	return ret;
+
     /* Get lock for reception lists */
     rtdm_lock_get_irqsave(&rtcan_recv_list_lock, lock_ctx);
 
@@ -297,12 +933,184 @@ int rtcan_raw_bind(struct rtdm_dev_context *context,
 }
 
 
-static int rtcan_raw_setsockopt(struct rtdm_dev_context *context,
-				rtdm_user_info_t *user_info,
-				struct _rtdm_setsockopt_args *so)
+/*
+ * Replace the socket's receive ring buffer by one of @size bytes. Frames
+ * pending in the old buffer are moved over if they fit. The new buffer is
+ * vmalloc'ed, so large ones don't drain the RTDM heap shared by all
+ * real-time drivers; called in non-real-time context only.
+ */
+static int rtcan_raw_set_rcvbuf(struct rtcan_socket *sock, unsigned int size)
 {
-    struct rtcan_socket *sock = (struct rtcan_socket *)&context->dev_private;
-    struct rtcan_filter_list *flist;
+    unsigned char *new_buf, *old_buf;
+    unsigned int used, first_part_size;
+    rtdm_lockctx_t lock_ctx;
+    int old_vmalloc;
+
+    new_buf = vmalloc(size);
+    if (!new_buf)
+	return -ENOMEM;
+
+    rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+
+    used = (sock->recv_tail - sock->recv_head) & (sock->recv_buf_size - 1);
+    if (used >= size) {
+	rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+	vfree(new_buf);
+	return -EBUSY;
+    }
+
+    /* Move pending frames to the beginning of the new buffer */
+    first_part_size = sock->recv_buf_size - sock->recv_head;
+    if (first_part_size > used)
+	first_part_size = used;
+    memcpy(new_buf, &sock->recv_buf[sock->recv_head], first_part_size);
+    memcpy(new_buf + first_part_size, sock->recv_buf,
+	   used - first_part_size);
+
+    old_buf = sock->recv_buf;
+    old_vmalloc = sock->recv_buf_vmalloc;
+    sock->recv_buf = new_buf;
+    sock->recv_buf_size = size;
+    sock->recv_buf_vmalloc = 1;
+    sock->recv_head = 0;
+    sock->recv_tail = used;
+
+    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+    if (old_vmalloc)
+	vfree(old_buf);
+    else
+	rtdm_free(old_buf);
+
+    return 0;
+}
+
+
+/*
+ * Switch the socket to a fixed-slot receive ring of @slots entries, or back
+ * to the byte ring if @slots is 0. Fails if frames are pending.
+ */
+static int rtcan_raw_set_rx_slots(struct rtcan_socket *sock,
+				  unsigned int slots)
+{
+    struct rtcan_rx_slot *new_slots = NULL, *old_slots;
+    rtdm_lockctx_t lock_ctx;
+
+    if (slots) {
+	new_slots = rtdm_malloc(slots * sizeof(struct rtcan_rx_slot));
+	if (!new_slots)
+	    return -ENOMEM;
+    }
+
+    rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+
+    if (sock->recv_head != sock->recv_tail ||
+	sock->recv_slot_head != sock->recv_slot_tail || sock->lvc) {
+	rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+	if (new_slots)
+	    rtdm_free(new_slots);
+	return -EBUSY;
+    }
+
+    old_slots = sock->recv_slots;
+    sock->recv_slots = new_slots;
+    sock->recv_slot_mask = slots - 1;
+    sock->recv_slot_head = 0;
+    sock->recv_slot_tail = 0;
+
+    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+    if (old_slots)
+	rtdm_free(old_slots);
+
+    return 0;
+}
+
+
+/*
+ * Switch the socket to a last-value cache of @max_ids CAN IDs, or back to
+ * the byte ring if @max_ids is 0. Fails if frames are pending.
+ */
+static int rtcan_raw_set_lvc(struct rtcan_socket *sock, unsigned int max_ids)
+{
+    struct rtcan_lvc *new_lvc = NULL, *old_lvc;
+    unsigned int bits = 3, size, i;
+    rtdm_lockctx_t lock_ctx;
+
+    if (max_ids) {
+	/* Keep the table at most half full */
+	while ((1U << bits) < 2 * max_ids)
+	    bits++;
+	size = 1 << bits;
+
+	new_lvc = rtdm_malloc(sizeof(struct rtcan_lvc) +
+			      size * sizeof(struct rtcan_rx_slot) +
+			      BITS_TO_LONGS(size) * sizeof(unsigned long));
+	if (!new_lvc)
+	    return -ENOMEM;
+
+	new_lvc->bits = bits;
+	new_lvc->size = size;
+	new_lvc->used = 0;
+	new_lvc->max_ids = max_ids;
+	new_lvc->next = 0;
+	new_lvc->dirty = (unsigned long *)&new_lvc->entry[size];
+	memset(new_lvc->dirty, 0,
+	       BITS_TO_LONGS(size) * sizeof(unsigned long));
+	for (i = 0; i < size; i++)
+	    new_lvc->entry[i].can_id = RTCAN_LVC_EMPTY;
+    }
+
+    rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+
+    if (sock->recv_head != sock->recv_tail || sock->recv_slots ||
+	(sock->lvc && find_first_bit(sock->lvc->dirty, sock->lvc->size) <
+	 sock->lvc->size)) {
+	rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+	if (new_lvc)
+	    rtdm_free(new_lvc);
+	return -EBUSY;
+    }
+
+    old_lvc = sock->lvc;
+    sock->lvc = new_lvc;
+
+    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+    if (old_lvc)
+	rtdm_free(old_lvc);
+
+    return 0;
+}
+
+
+/*
+ * Fetch the int value of a socket option, from user space if @user_info
+ * is set.
+ */
+static int rtcan_raw_get_int_opt(rtdm_user_info_t *user_info,
+				 struct _rtdm_setsockopt_args *so, int *val)
+{
+    if (so->optlen != sizeof(int))
+	return -EINVAL;
+
+    if (user_info) {
+	if (!rtdm_read_user_ok(user_info, so->optval, so->optlen) ||
+	    rtdm_copy_from_user(user_info, val, so->optval, so->optlen))
+	    return -EFAULT;
+    } else
+	memcpy(val, so->optval, so->optlen);
+
+    return 0;
+}
+
+
+static int rtcan_raw_setsockopt(struct rtdm_dev_context *context,
+				rtdm_user_info_t *user_info,
+				struct _rtdm_setsockopt_args *so)
+{
+    struct rtcan_socket *sock = (struct rtcan_socket *)&context->dev_private;
+    struct rtcan_filter_list *flist;
     int ifindex = atomic_read(&sock->ifindex);
     rtdm_lockctx_t lock_ctx;
     can_err_mask_t err_mask;
@@ -319,7 +1127,7 @@ static int rtcan_raw_setsockopt(struct rtdm_dev_context *context,
 	} else {
 	    int flistlen;
 	    flistlen = so->optlen / sizeof(struct can_filter);
-	    if (flistlen < 1 || flistlen > RTCAN_MAX_RECEIVERS ||
+	    if (flistlen < 1 || flistlen > rtcan_max_filters ||
 		so->optlen % sizeof(struct can_filter) != 0)
 		return -EINVAL;
 
@@ -338,6 +1146,14 @@ static int rtcan_raw_setsockopt(struct rtdm_dev_context *context,
 	    flist->flistlen = flistlen;
 	}
 
+	/* Make room for the filters while we may still allocate */
+	if (rtcan_sock_is_bound(sock) && !rtdm_in_rt_context() &&
+	    (ret = rtcan_raw_reserve_filter(sock, ifindex, flist))) {
+	    if (!rtcan_flist_no_filter(flist))
+		rtdm_free(flist);
+	    break;
+	}
+
 	/* Get lock for reception lists */
 	rtdm_lock_get_irqsave(&rtcan_recv_list_lock, lock_ctx);
 
@@ -385,24 +1201,119 @@ static int rtcan_raw_setsockopt(struct rtdm_dev_context *context,
 
     case CAN_RAW_LOOPBACK:
 
-	if (so->optlen != sizeof(int))
+	if ((ret = rtcan_raw_get_int_opt(user_info, so, &val)))
+	    return ret;
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_LOOPBACK
+	sock->loopback = val;
+#else
+	if (val)
+	    return -EOPNOTSUPP;
+#endif
+	break;
+
+    case CAN_RAW_TX_PRIO:
+
+	if ((ret = rtcan_raw_get_int_opt(user_info, so, &val)))
+	    return ret;
+
+	if (val < 0 || val > CAN_RAW_TX_PRIO_MAX)
 	    return -EINVAL;
 
-	if (user_info) {
-	    if (!rtdm_read_user_ok(user_info, so->optval, so->optlen) ||
-		rtdm_copy_from_user(user_info, &val, so->optval, so->optlen))
-		return -EFAULT;
-	} else
-	    memcpy(&val, so->optval, so->optlen);
+	sock->tx_prio = val;
+	break;
+
+    case CAN_RAW_RECV_OWN_MSGS:
+
+	if ((ret = rtcan_raw_get_int_opt(user_info, so, &val)))
+	    return ret;
 
 #ifdef CONFIG_XENO_DRIVERS_CAN_LOOPBACK
-	sock->loopback = val;
+	sock->recv_own_msgs = val;
 #else
 	if (val)
 	    return -EOPNOTSUPP;
 #endif
 	break;
 
+    case CAN_RAW_RCVBUF: {
+	unsigned int size = RTCAN_RXBUF_MIN_SIZE;
+
+	/* The buffer is vmalloc'ed, only possible in non-real-time context */
+	if (rtdm_in_rt_context())
+	    return -ENOSYS;
+
+	if ((ret = rtcan_raw_get_int_opt(user_info, so, &val)))
+	    return ret;
+
+	if (val <= 0 || val > rcvbuf_max)
+	    return -EINVAL;
+
+	/* Round up to the next power of 2 */
+	while (size < val)
+	    size <<= 1;
+
+	ret = rtcan_raw_set_rcvbuf(sock, size);
+	break;
+    }
+
+    case CAN_RAW_RX_SLOTS: {
+	unsigned int slots = RTCAN_RX_SLOTS_MIN;
+
+	if ((ret = rtcan_raw_get_int_opt(user_info, so, &val)))
+	    return ret;
+
+	if (val < 0 || val > RTCAN_RX_SLOTS_MAX)
+	    return -EINVAL;
+
+	if (val == 0)
+	    slots = 0;
+	else
+	    /* Round up to the next power of 2 */
+	    while (slots < val)
+		slots <<= 1;
+
+	ret = rtcan_raw_set_rx_slots(sock, slots);
+	break;
+    }
+
+    case CAN_RAW_LAST_VALUE:
+	if ((ret = rtcan_raw_get_int_opt(user_info, so, &val)))
+	    return ret;
+
+	if (val < 0 || val > RTCAN_LVC_MAX_IDS)
+	    return -EINVAL;
+
+	ret = rtcan_raw_set_lvc(sock, val);
+	break;
+
+    case CAN_RAW_LATENCY_CRITICAL:
+	if ((ret = rtcan_raw_get_int_opt(user_info, so, &val)))
+	    return ret;
+
+	/* Rebind to update the counters of the devices */
+	rtdm_lock_get_irqsave(&rtcan_recv_list_lock, lock_ctx);
+	if (rtcan_sock_is_bound(sock))
+	    rtcan_raw_remove_filter(sock);
+	sock->latency_critical = !!val;
+	if (rtcan_sock_is_bound(sock))
+	    sock->flistlen = rtcan_raw_add_filter(sock, ifindex);
+	rtdm_lock_put_irqrestore(&rtcan_recv_list_lock, lock_ctx);
+	break;
+
+    case CAN_RAW_FD_FRAMES:
+	if ((ret = rtcan_raw_get_int_opt(user_info, so, &val)))
+	    return ret;
+
+	/* Frames already queued were sized for the old setting */
+	rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+	if (sock->recv_head != sock->recv_tail)
+	    ret = -EBUSY;
+	else
+	    sock->fd_frames = !!val;
+	rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+	break;
+
     default:
 	ret = -ENOPROTOOPT;
     }
@@ -475,10 +1386,16 @@ int rtcan_raw_ioctl(struct rtdm_dev_context *context,
     case RTCAN_RTIOC_TAKE_TIMESTAMP: {
 	long timestamp_switch = (long)arg;
 
-	if (timestamp_switch == RTCAN_TAKE_TIMESTAMPS)
+	struct rtcan_socket *sock =
+	    (struct rtcan_socket *)&context->dev_private;
+
+	if (timestamp_switch == RTCAN_TAKE_TIMESTAMPS) {
 	    set_bit(RTCAN_GET_TIMESTAMP, &context->context_flags);
-	else
+	    sock->rx_ts_size = RTCAN_TIMESTAMP_SIZE;
+	} else {
 	    clear_bit(RTCAN_GET_TIMESTAMP, &context->context_flags);
+	    sock->rx_ts_size = 0;
+	}
 	break;
     }
 
@@ -511,274 +1428,1176 @@ int rtcan_raw_ioctl(struct rtdm_dev_context *context,
 	break;
     }
 
-    default:
-	ret = rtcan_raw_ioctl_dev(context, user_info, request, arg);
+    case RTCAN_RTIOC_RECV_BATCH: {
+	struct rtcan_recv_batch *batch = (struct rtcan_recv_batch *)arg;
+	struct rtcan_recv_batch batch_buf;
+
+	/* May block on the reception semaphore */
+	if (!rtdm_in_rt_context())
+	    return -ENOSYS;
+
+	if (user_info) {
+	    if (!rtdm_rw_user_ok(user_info, arg,
+				 sizeof(struct rtcan_recv_batch)) ||
+		rtdm_copy_from_user(user_info, &batch_buf, arg,
+				    sizeof(struct rtcan_recv_batch)))
+		return -EFAULT;
+
+	    batch = &batch_buf;
+	}
+
+	ret = rtcan_raw_recv_batch(context, user_info, batch);
+
+	/* Give back the number of frames received */
+	if (ret > 0 && user_info &&
+	    rtdm_copy_to_user(user_info,
+			      &((struct rtcan_recv_batch *)arg)->count,
+			      &batch->count, sizeof(batch->count)))
+	    ret = -EFAULT;
 	break;
     }
 
-    return ret;
-}
+    case RTCAN_RTIOC_MMAP_RING: {
+	struct rtcan_ring_map map;
 
+	/* Memory mapping can only be done in non-real-time context */
+	if (rtdm_in_rt_context())
+	    return -ENOSYS;
 
-#define MEMCPY_FROM_RING_BUF(to, len)                                       \
-									    \
-    if (unlikely((recv_buf_index + len) > RTCAN_RXBUF_SIZE)) {              \
-	/* Wrap around end of buffer */                                     \
-									    \
-	first_part_size = RTCAN_RXBUF_SIZE - recv_buf_index;                \
-									    \
-	memcpy(to, &recv_buf[recv_buf_index], first_part_size);             \
-	memcpy((void *)to + first_part_size, recv_buf,                      \
-					     len - first_part_size);        \
-									    \
-    } else                                                                  \
-									    \
-	memcpy(to, &recv_buf[recv_buf_index], len);                         \
-									    \
-									    \
-    recv_buf_index = (recv_buf_index + len) & (RTCAN_RXBUF_SIZE - 1);
+	if (!user_info)
+	    return -EINVAL;
 
+	if (!rtdm_rw_user_ok(user_info, arg, sizeof(struct rtcan_ring_map)) ||
+	    rtdm_copy_from_user(user_info, &map, arg,
+				sizeof(struct rtcan_ring_map)))
+	    return -EFAULT;
 
-ssize_t rtcan_raw_recvmsg(struct rtdm_dev_context *context,
-			  rtdm_user_info_t *user_info,
-			  struct msghdr *msg, int flags)
-{
-    struct rtcan_socket *sock =
-	(struct rtcan_socket *)&context->dev_private;
-    struct sockaddr_can scan;
-    nanosecs_rel_t timeout;
-    struct iovec *iov = (struct iovec *)msg->msg_iov;
-    struct iovec iov_buf;
-    can_frame_t frame;
-    nanosecs_abs_t timestamp = 0;
-    unsigned char ifindex;
-    unsigned char can_dlc;
-    unsigned char *recv_buf;
-    int recv_buf_index;
-    size_t first_part_size;
-    size_t payload_size;
-    rtdm_lockctx_t lock_ctx;
-    int ret;
+	ret = rtcan_raw_ring_map(context, user_info, &map);
 
-    /* Clear frame memory location */
-    memset(&frame, 0, sizeof(can_frame_t));
+	if (!ret && rtdm_copy_to_user(user_info, arg, &map,
+				      sizeof(struct rtcan_ring_map)))
+	    ret = -EFAULT;
+	break;
+    }
 
-    /* Check flags */
-    if (flags & ~(MSG_DONTWAIT | MSG_PEEK))
-	return -EINVAL;
+    case RTCAN_RTIOC_RING_WAIT: {
+	struct rtcan_socket *sock =
+	    (struct rtcan_socket *)&context->dev_private;
+	nanosecs_rel_t *timeout = (nanosecs_rel_t *)arg;
+	nanosecs_rel_t timeo_buf;
 
+	/* May block on the ring event */
+	if (!rtdm_in_rt_context())
+	    return -ENOSYS;
 
-    /* Check if msghdr entries are sane */
+	if (user_info) {
+	    if (!rtdm_read_user_ok(user_info, arg,
+				   sizeof(nanosecs_rel_t)) ||
+		rtdm_copy_from_user(user_info, &timeo_buf,
+				    arg, sizeof(nanosecs_rel_t)))
+		return -EFAULT;
 
-    if (msg->msg_name != NULL) {
-	if (msg->msg_namelen < sizeof(struct sockaddr_can))
-	    return -EINVAL;
+	    timeout = &timeo_buf;
+	}
+
+	ret = rtcan_raw_ring_wait(sock, *timeout);
+	break;
+    }
+
+    case RTCAN_RTIOC_TRANSACT: {
+	struct rtcan_transaction *tr = (struct rtcan_transaction *)arg;
+	struct rtcan_transaction tr_buf;
+
+	/* Blocks for the response */
+	if (!rtdm_in_rt_context())
+	    return -ENOSYS;
 
 	if (user_info) {
-	    if (!rtdm_rw_user_ok(user_info, msg->msg_name, msg->msg_namelen))
+	    if (!rtdm_rw_user_ok(user_info, arg,
+				 sizeof(struct rtcan_transaction)) ||
+		rtdm_copy_from_user(user_info, &tr_buf, arg,
+				    sizeof(struct rtcan_transaction)))
 		return -EFAULT;
+
+	    tr = &tr_buf;
 	}
 
-    } else {
-	if (msg->msg_namelen != 0)
-	    return -EINVAL;
+	ret = rtcan_raw_transact(context, tr);
+
+	if (!ret && user_info &&
+	    rtdm_copy_to_user(user_info, arg, tr,
+			      sizeof(struct rtcan_transaction)))
+	    ret = -EFAULT;
+	break;
     }
 
-    /* Check msg_iovlen, only one buffer allowed */
-    if (msg->msg_iovlen != 1)
-	return -EMSGSIZE;
+    case RTCAN_RTIOC_CYCLIC_START: {
+	struct rtcan_socket *sock =
+	    (struct rtcan_socket *)&context->dev_private;
+	struct rtcan_cyclic_start start;
 
-    if (user_info) {
-	/* Copy IO vector from userspace */
-	if (!rtdm_rw_user_ok(user_info, msg->msg_iov,
-			     sizeof(struct iovec)) ||
-	    rtdm_copy_from_user(user_info, &iov_buf, msg->msg_iov,
-				sizeof(struct iovec)))
-	    return -EFAULT;
+	/* Memory mapping can only be done in non-real-time context */
+	if (rtdm_in_rt_context())
+	    return -ENOSYS;
+
+	if (user_info) {
+	    if (!rtdm_rw_user_ok(user_info, arg, sizeof(start)) ||
+		rtdm_copy_from_user(user_info, &start, arg, sizeof(start)))
+		return -EFAULT;
+	} else
+	    memcpy(&start, arg, sizeof(start));
+
+	ret = rtcan_cyclic_start(sock, user_info, &start);
+	if (ret)
+	    break;
+
+	if (user_info) {
+	    if (rtdm_copy_to_user(user_info, arg, &start, sizeof(start)))
+		ret = -EFAULT;
+	} else
+	    memcpy(arg, &start, sizeof(start));
+	break;
+    }
+
+    case RTCAN_RTIOC_CYCLIC_STOP: {
+	struct rtcan_socket *sock =
+	    (struct rtcan_socket *)&context->dev_private;
+
+	if (rtdm_in_rt_context())
+	    return -ENOSYS;
+
+	ret = rtcan_cyclic_stop(sock);
+	break;
+    }
+
+    case RTCAN_RTIOC_CAPTURE_START: {
+	struct rtcan_socket *sock =
+	    (struct rtcan_socket *)&context->dev_private;
+	struct rtcan_capture_start start;
+
+	/* The buffers are allocated in non-real-time context */
+	if (rtdm_in_rt_context())
+	    return -ENOSYS;
+
+	if (user_info) {
+	    if (!rtdm_rw_user_ok(user_info, arg, sizeof(start)) ||
+		rtdm_copy_from_user(user_info, &start, arg, sizeof(start)))
+		return -EFAULT;
+	} else
+	    memcpy(&start, arg, sizeof(start));
+
+	ret = rtcan_capture_start(sock, &start);
+	if (ret)
+	    break;
+
+	if (user_info) {
+	    if (rtdm_copy_to_user(user_info, arg, &start, sizeof(start)))
+		ret = -EFAULT;
+	} else
+	    memcpy(arg, &start, sizeof(start));
+	break;
+    }
+
+    case RTCAN_RTIOC_CAPTURE_STOP: {
+	struct rtcan_socket *sock =
+	    (struct rtcan_socket *)&context->dev_private;
+
+	if (rtdm_in_rt_context())
+	    return -ENOSYS;
+
+	ret = rtcan_capture_stop(sock);
+	break;
+    }
+
+    case RTCAN_RTIOC_CAPTURE_READ: {
+	struct rtcan_socket *sock =
+	    (struct rtcan_socket *)&context->dev_private;
+	struct rtcan_capture_read rd;
+
+	/* The reader waits and copies in non-real-time context */
+	if (rtdm_in_rt_context())
+	    return -ENOSYS;
+
+	if (user_info) {
+	    if (!rtdm_rw_user_ok(user_info, arg, sizeof(rd)) ||
+		rtdm_copy_from_user(user_info, &rd, arg, sizeof(rd)))
+		return -EFAULT;
+	} else
+	    memcpy(&rd, arg, sizeof(rd));
+
+	ret = rtcan_capture_read(sock, user_info, &rd);
+	if (ret)
+	    break;
+
+	if (user_info) {
+	    if (rtdm_copy_to_user(user_info, arg, &rd, sizeof(rd)))
+		ret = -EFAULT;
+	} else
+	    memcpy(arg, &rd, sizeof(rd));
+	break;
+    }
+
+    case RTCAN_RTIOC_GW_ADD: {
+	struct rtcan_gw_rule rule;
+
+	if (rtdm_in_rt_context())
+	    return -ENOSYS;
+
+	if (user_info) {
+	    if (!rtdm_rw_user_ok(user_info, arg, sizeof(rule)) ||
+		rtdm_copy_from_user(user_info, &rule, arg, sizeof(rule)))
+		return -EFAULT;
+	} else
+	    memcpy(&rule, arg, sizeof(rule));
+
+	ret = rtcan_gw_add(&rule);
+	if (ret)
+	    break;
+
+	if (user_info) {
+	    if (rtdm_copy_to_user(user_info, arg, &rule, sizeof(rule)))
+		ret = -EFAULT;
+	} else
+	    memcpy(arg, &rule, sizeof(rule));
+	break;
+    }
+
+    case RTCAN_RTIOC_GW_DEL:
+	if (rtdm_in_rt_context())
+	    return -ENOSYS;
+
+	ret = rtcan_gw_del((long)arg);
+	break;
+
+    default:
+	ret = rtcan_raw_ioctl_dev(context, user_info, request, arg);
+	break;
+    }
+
+    return ret;
+}
+
+
+#define MEMCPY_FROM_RING_BUF(to, len)                                       \
+									    \
+    if (unlikely((recv_buf_index + len) > recv_buf_size)) {                 \
+	/* Wrap around end of buffer */                                     \
+									    \
+	first_part_size = recv_buf_size - recv_buf_index;                   \
+									    \
+	memcpy(to, &recv_buf[recv_buf_index], first_part_size);             \
+	memcpy((void *)to + first_part_size, recv_buf,                      \
+					     len - first_part_size);        \
+									    \
+    } else                                                                  \
+									    \
+	memcpy(to, &recv_buf[recv_buf_index], len);                         \
+									    \
+									    \
+    recv_buf_index = (recv_buf_index + len) & (recv_buf_size - 1);
+
+
+/*
+ * Construct a struct can_frame with data from the socket's ring buffer,
+ * starting at *index. Must be called with the socket's rx_lock held after
+ * recv_sem has been passed for this frame. On return, *index points
+ * behind the frame; the caller consumes it by adjusting recv_head. A CAN
+ * FD frame, only stored for sockets with CAN_RAW_FD_FRAMES, is constructed
+ * as struct canfd_frame, @frame must have room for it then.
+ *
+ * Returns RTCAN_HAS_TIMESTAMP if the frame carried a timestamp, or'ed with
+ * RTCAN_FD_FRAME for a CAN FD frame.
+ */
+static inline int rtcan_raw_fetch_frame(struct rtcan_socket *sock, int *index,
+					can_frame_t *frame,
+					nanosecs_abs_t *timestamp,
+					unsigned char *ifindex)
+{
+    unsigned char *recv_buf = sock->recv_buf;
+    unsigned int recv_buf_size = sock->recv_buf_size;
+    int recv_buf_index = *index;
+    size_t first_part_size;
+    size_t payload_size;
+    unsigned char can_dlc;
+
+    /* Begin with CAN ID */
+    MEMCPY_FROM_RING_BUF(&frame->can_id, sizeof(uint32_t));
+
+    /* Fetch interface index */
+    *ifindex = recv_buf[recv_buf_index];
+    recv_buf_index = (recv_buf_index + 1) & (recv_buf_size - 1);
+
+    /* Fetch DLC (with indicator if a timestamp exists) */
+    can_dlc = recv_buf[recv_buf_index];
+    recv_buf_index = (recv_buf_index + 1) & (recv_buf_size - 1);
+
+    if (unlikely(can_dlc & RTCAN_FD_FRAME)) {
+	struct canfd_frame *fd_frame = (struct canfd_frame *)frame;
+
+	fd_frame->len = payload_size = rtcan_fd_dlc2len(can_dlc);
+	fd_frame->flags = ((can_dlc & RTCAN_FD_BRS) ? CANFD_BRS : 0) |
+	    ((can_dlc & RTCAN_FD_ESI) ? CANFD_ESI : 0);
+	fd_frame->__res0 = fd_frame->__res1 = 0;
+	if (payload_size) {
+	    MEMCPY_FROM_RING_BUF(fd_frame->data, payload_size);
+	}
+	memset(fd_frame->data + payload_size, 0,
+	       CANFD_MAX_DLEN - payload_size);
+    } else {
+	frame->can_dlc = can_dlc & RTCAN_HAS_NO_TIMESTAMP;
+	payload_size = (frame->can_dlc > 8) ? 8 : frame->can_dlc;
+
+	/* If frame is an RTR or one with no payload it's not necessary
+	 * to copy the data bytes. */
+	if (!(frame->can_id & CAN_RTR_FLAG) && payload_size) {
+	    /* Copy data bytes */
+	    MEMCPY_FROM_RING_BUF(frame->data, payload_size);
+	}
+    }
+
+    /* The timestamp must be consumed even if the caller isn't interested
+     * in it, otherwise the ring buffer would get out of sync. */
+    if (can_dlc & RTCAN_HAS_TIMESTAMP) {
+	MEMCPY_FROM_RING_BUF(timestamp, RTCAN_TIMESTAMP_SIZE);
+    }
+
+    *index = recv_buf_index;
+
+    return can_dlc & (RTCAN_HAS_TIMESTAMP | RTCAN_FD_FRAME);
+}
+
+
+/* Copy a receive slot to @frame, returns non-zero if it has a timestamp */
+static inline int rtcan_rx_slot_get(struct rtcan_rx_slot *slot,
+				    can_frame_t *frame,
+				    nanosecs_abs_t *timestamp,
+				    unsigned char *ifindex)
+{
+    frame->can_id = slot->can_id;
+    frame->can_dlc = slot->can_dlc & RTCAN_HAS_NO_TIMESTAMP;
+    memcpy(frame->data, slot->data, 8);
+    *ifindex = slot->can_ifindex;
+
+    if (slot->can_dlc & RTCAN_HAS_TIMESTAMP)
+	*timestamp = slot->timestamp;
+
+    return slot->can_dlc & RTCAN_HAS_TIMESTAMP;
+}
+
+
+/*
+ * Fetch the oldest frame from the socket's fixed-slot ring, after recv_sem
+ * has been passed for it. No lock is taken: concurrent readers race for
+ * the head with cmpxchg, and a copy only counts if the head did not move
+ * meanwhile, otherwise the slot may have been consumed and refilled. With
+ * @peek, the frame stays in the ring.
+ *
+ * Returns non-zero if the frame carried a timestamp.
+ */
+static inline int rtcan_raw_fetch_slot(struct rtcan_socket *sock, int peek,
+				       can_frame_t *frame,
+				       nanosecs_abs_t *timestamp,
+				       unsigned char *ifindex)
+{
+    struct rtcan_rx_slot slot;
+    unsigned int head;
+
+    for (;;) {
+	head = ACCESS_ONCE(sock->recv_slot_head);
+	smp_rmb();
+
+	slot = sock->recv_slots[head & sock->recv_slot_mask];
+
+	/* The slot must be read completely before it is released */
+	smp_mb();
+
+	if (peek) {
+	    if (ACCESS_ONCE(sock->recv_slot_head) == head)
+		break;
+	} else if (cmpxchg(&sock->recv_slot_head, head, head + 1) == head)
+	    break;
+    }
+
+    return rtcan_rx_slot_get(&slot, frame, timestamp, ifindex);
+}
+
+
+/*
+ * Fetch the next dirty entry of the last-value cache after recv_sem has
+ * been passed for it. The scan continues after the entry returned last,
+ * so a busy ID cannot hide the others. Called with rx_lock held. With
+ * @peek, the entry stays dirty.
+ *
+ * Returns non-zero if the frame carried a timestamp.
+ */
+static inline int rtcan_raw_fetch_lvc(struct rtcan_socket *sock, int peek,
+				      can_frame_t *frame,
+				      nanosecs_abs_t *timestamp,
+				      unsigned char *ifindex)
+{
+    struct rtcan_lvc *lvc = sock->lvc;
+    unsigned int i;
+
+    i = find_next_bit(lvc->dirty, lvc->size, lvc->next);
+    if (i >= lvc->size)
+	i = find_first_bit(lvc->dirty, lvc->size);
+
+    if (!peek) {
+	__clear_bit(i, lvc->dirty);
+	lvc->next = (i + 1) & (lvc->size - 1);
+    }
+
+    return rtcan_rx_slot_get(&lvc->entry[i], frame, timestamp, ifindex);
+}
+
+
+/*
+ * Wait for a frame, i.e. pass recv_sem. With latency tracing, a reader
+ * which has to sleep records the time from the delivery that woke it up.
+ */
+static inline int rtcan_raw_recv_wait(struct rtcan_socket *sock,
+				      nanosecs_rel_t timeout,
+				      rtdm_toseq_t *timeout_seq)
+{
+#ifdef CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE
+    struct rtcan_device *dev;
+    unsigned int i;
+    int ret;
+
+    ret = rtdm_sem_timeddown(&sock->recv_sem, RTDM_TIMEOUT_NONE, NULL);
+    if (ret != -EWOULDBLOCK || timeout == RTDM_TIMEOUT_NONE)
+	return ret;
+
+    sock->trace_wake = 0;
+    ret = rtdm_sem_timeddown(&sock->recv_sem, timeout, timeout_seq);
+    if (ret || !sock->trace_wake)
+	return ret;
+
+    if ((dev = rtcan_dev_get_by_index(sock->trace_ifindex)) != NULL) {
+	i = atomic_inc_return(&dev->trace.wake_next) - 1;
+	dev->trace.samples[RTCAN_TRACE_WAKEUP][i & (RTCAN_TRACE_SAMPLES - 1)] =
+	    rtdm_clock_read() - sock->trace_wake;
+	rtcan_dev_dereference(dev);
+    }
+
+    return 0;
+#else
+    return rtdm_sem_timeddown(&sock->recv_sem, timeout, timeout_seq);
+#endif
+}
+
+
+ssize_t rtcan_raw_recvmsg(struct rtdm_dev_context *context,
+			  rtdm_user_info_t *user_info,
+			  struct msghdr *msg, int flags)
+{
+    struct rtcan_socket *sock =
+	(struct rtcan_socket *)&context->dev_private;
+    struct sockaddr_can scan;
+    nanosecs_rel_t timeout;
+    struct iovec *iov = (struct iovec *)msg->msg_iov;
+    struct iovec iov_buf;
+    union {
+	can_frame_t cf;
+	struct canfd_frame fd;
+    } frame;
+    size_t frame_size = sizeof(can_frame_t);
+    nanosecs_abs_t timestamp = 0;
+    unsigned char ifindex;
+    int has_timestamp;
+    int recv_buf_index;
+    rtdm_lockctx_t lock_ctx;
+    int ret;
+
+    /* Clear frame memory location */
+    memset(&frame, 0, sizeof(can_frame_t));
+
+    /* Check flags */
+    if (flags & ~(MSG_DONTWAIT | MSG_PEEK))
+	return -EINVAL;
+
+    /* Frames go to the mapped ring or the capture instead */
+    if (rtcan_rx_ring_mapped(sock->rx_ring) || rtcan_capture_active(sock))
+	return -EBUSY;
+
+
+    /* Check if msghdr entries are sane */
+
+    if (msg->msg_name != NULL) {
+	if (msg->msg_namelen < sizeof(struct sockaddr_can))
+	    return -EINVAL;
+
+	if (user_info) {
+	    if (!rtdm_rw_user_ok(user_info, msg->msg_name, msg->msg_namelen))
+		return -EFAULT;
+	}
+
+    } else {
+	if (msg->msg_namelen != 0)
+	    return -EINVAL;
+    }
+
+    /* Check msg_iovlen, only one buffer allowed */
+    if (msg->msg_iovlen != 1)
+	return -EMSGSIZE;
+
+    if (user_info) {
+	/* Copy IO vector from userspace */
+	if (!rtdm_rw_user_ok(user_info, msg->msg_iov,
+			     sizeof(struct iovec)) ||
+	    rtdm_copy_from_user(user_info, &iov_buf, msg->msg_iov,
+				sizeof(struct iovec)))
+	    return -EFAULT;
+
+	iov = &iov_buf;
+    }
+
+    /* Check size of buffer, against CANFD_MTU once a CAN FD frame is
+     * dequeued */
+    if (iov->iov_len < sizeof(can_frame_t))
+	return -EMSGSIZE;
+
+    /* Check buffer if in user space */
+    if (user_info) {
+	if (!rtdm_rw_user_ok(user_info, iov->iov_base, iov->iov_len))
+	    return -EFAULT;
+    }
+
+    if (msg->msg_control != NULL) {
+	if (msg->msg_controllen < sizeof(nanosecs_abs_t))
+	    return -EINVAL;
+
+	if (user_info) {
+	    if (!rtdm_rw_user_ok(user_info, msg->msg_control,
+				 msg->msg_controllen))
+		return -EFAULT;
+	}
+
+    } else {
+	if (msg->msg_controllen != 0)
+	    return -EINVAL;
+    }
+
+    rtcan_raw_enable_bus_err(sock);
+
+    /* Set RX timeout */
+    timeout = (flags & MSG_DONTWAIT) ? RTDM_TIMEOUT_NONE : sock->rx_timeout;
+
+    /* Fetch message (ok, try it ...) */
+    ret = rtcan_raw_recv_wait(sock, timeout, NULL);
+
+    /* Error code returned? */
+    if (unlikely(ret)) {
+	/* Which error code? */
+
+	if (ret == -EIDRM)
+	    /* Socket was closed */
+	    return -EBADF;
+
+	else if (ret == -EWOULDBLOCK)
+	    /* We would block but don't want to */
+	    return -EAGAIN;
+
+	else
+	    /* Return all other error codes unmodified. */
+	    return ret;
+    }
+
+
+    /* OK, we've got mail. */
+
+    if (sock->recv_slots) {
+	/* Fixed-slot ring, no lock needed */
+	has_timestamp = rtcan_raw_fetch_slot(sock, flags & MSG_PEEK,
+					     &frame.cf, &timestamp, &ifindex);
+	if (flags & MSG_PEEK)
+	    rtdm_sem_up(&sock->recv_sem);
+
+    } else if (sock->lvc) {
+	rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+	has_timestamp = rtcan_raw_fetch_lvc(sock, flags & MSG_PEEK,
+					    &frame.cf, &timestamp, &ifindex);
+	if (flags & MSG_PEEK)
+	    rtdm_sem_up(&sock->recv_sem);
+	rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+
+    } else {
+	rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+
+	recv_buf_index = sock->recv_head;
+	has_timestamp = rtcan_raw_fetch_frame(sock, &recv_buf_index,
+					      &frame.cf, &timestamp, &ifindex);
+	if (unlikely(has_timestamp & RTCAN_FD_FRAME)) {
+	    frame_size = CANFD_MTU;
+	    if (iov->iov_len < CANFD_MTU) {
+		/* Leave the frame for a call with a larger buffer */
+		rtdm_sem_up(&sock->recv_sem);
+		rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+		return -EMSGSIZE;
+	    }
+	}
+	has_timestamp &= RTCAN_HAS_TIMESTAMP;
+
+	/* Message completely read from the socket's ring buffer. Now check
+	 * if caller is just peeking. */
+	if (flags & MSG_PEEK)
+	    /* Next one, please! */
+	    rtdm_sem_up(&sock->recv_sem);
+	else
+	    /* Adjust begin of first message in the ring buffer. */
+	    sock->recv_head = recv_buf_index;
+
+	/* Release lock */
+	rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+    }
+
+    /* Create CAN socket address to give back */
+    if (msg->msg_namelen) {
+	scan.can_family = AF_CAN;
+	scan.can_ifindex = ifindex;
+    }
+
+
+    /* Last duty: Copy all back to the caller's buffers. */
+
+    if (user_info) {
+	/* Copy to user space */
+
+	/* Copy socket address */
+	if (msg->msg_namelen) {
+	    if (rtdm_copy_to_user(user_info, msg->msg_name, &scan,
+				  sizeof(struct sockaddr_can)))
+		return -EFAULT;
+
+	    msg->msg_namelen = sizeof(struct sockaddr_can);
+	}
+
+	/* Copy CAN frame */
+	if (rtdm_copy_to_user(user_info, iov->iov_base, &frame, frame_size))
+	    return -EFAULT;
+	/* Adjust iovec in the common way */
+	iov->iov_base += frame_size;
+	iov->iov_len -= frame_size;
+	/* ... and copy it, too. */
+	if (rtdm_copy_to_user(user_info, msg->msg_iov, iov,
+			      sizeof(struct iovec)))
+	    return -EFAULT;
+
+	/* Copy timestamp if existent and wanted */
+	if (msg->msg_controllen) {
+	    if (has_timestamp) {
+		if (rtdm_copy_to_user(user_info, msg->msg_control,
+				      &timestamp, RTCAN_TIMESTAMP_SIZE))
+		    return -EFAULT;
+
+		msg->msg_controllen = RTCAN_TIMESTAMP_SIZE;
+	    } else
+		msg->msg_controllen = 0;
+	}
+
+    } else {
+	/* Kernel space */
+
+	/* Copy socket address */
+	if (msg->msg_namelen) {
+	    memcpy(msg->msg_name, &scan, sizeof(struct sockaddr_can));
+	    msg->msg_namelen = sizeof(struct sockaddr_can);
+	}
+
+	/* Copy CAN frame */
+	memcpy(iov->iov_base, &frame, frame_size);
+	/* Adjust iovec in the common way */
+	iov->iov_base += frame_size;
+	iov->iov_len -= frame_size;
+
+	/* Copy timestamp if existent and wanted */
+	if (msg->msg_controllen) {
+	    if (has_timestamp) {
+		memcpy(msg->msg_control, &timestamp, RTCAN_TIMESTAMP_SIZE);
+		msg->msg_controllen = RTCAN_TIMESTAMP_SIZE;
+	    } else
+		msg->msg_controllen = 0;
+	}
+    }
+
+
+    return frame_size;
+}
+
+
+/* Number of frames fetched per lock acquisition and copy to the caller */
+#define RTCAN_RECV_BATCH_CHUNK  16
+
+static int rtcan_raw_recv_batch(struct rtdm_dev_context *context,
+				rtdm_user_info_t *user_info,
+				struct rtcan_recv_batch *batch)
+{
+    struct rtcan_socket *sock =
+	(struct rtcan_socket *)&context->dev_private;
+    can_frame_t frames[RTCAN_RECV_BATCH_CHUNK];
+    nanosecs_abs_t timestamps[RTCAN_RECV_BATCH_CHUNK];
+    int ifindex[RTCAN_RECV_BATCH_CHUNK];
+    unsigned char frame_ifindex;
+    rtdm_toseq_t timeout_seq;
+    nanosecs_rel_t timeout;
+    rtdm_lockctx_t lock_ctx;
+    unsigned int received = 0, n;
+    int recv_buf_index = 0;
+    int use_slots, use_lvc, has_timestamp;
+    int ret;
+
+    if (batch->flags & ~MSG_DONTWAIT)
+	return -EINVAL;
+
+    /* The batch layout has no room for CAN FD frames */
+    if (sock->fd_frames)
+	return -EINVAL;
+
+    if (rtcan_rx_ring_mapped(sock->rx_ring) || rtcan_capture_active(sock))
+	return -EBUSY;
+
+    /* The limit also keeps the buffer sizes below from overflowing */
+    if (batch->frames == NULL || batch->count == 0 ||
+	batch->count > RTCAN_RECV_BATCH_MAX ||
+	batch->min_count > batch->count)
+	return -EINVAL;
+
+    /* Check buffers if in user space */
+    if (user_info) {
+	if (!rtdm_rw_user_ok(user_info, batch->frames,
+			     batch->count * sizeof(can_frame_t)) ||
+	    (batch->timestamps &&
+	     !rtdm_rw_user_ok(user_info, batch->timestamps,
+			      batch->count * sizeof(nanosecs_abs_t))) ||
+	    (batch->ifindex &&
+	     !rtdm_rw_user_ok(user_info, batch->ifindex,
+			      batch->count * sizeof(int))))
+	    return -EFAULT;
+    }
+
+    rtcan_raw_enable_bus_err(sock);
+
+    /* The minimum count has to be reached within this time frame */
+    rtdm_toseq_init(&timeout_seq, batch->timeout);
+
+    /* Wait for the first frame like recvmsg() does */
+    timeout = (batch->flags & MSG_DONTWAIT) ?
+	RTDM_TIMEOUT_NONE : sock->rx_timeout;
+    ret = rtcan_raw_recv_wait(sock, timeout, NULL);
+
+    while (!ret) {
+	/* We hold one frame, take all others that are queued already
+	 * without blocking. */
+	n = 0;
+
+	/* The ring type can't change while frames are pending */
+	use_slots = sock->recv_slots != NULL;
+	use_lvc = sock->lvc != NULL;
+	if (!use_slots) {
+	    rtdm_lock_get_irqsave(&sock->rx_lock, lock_ctx);
+	    recv_buf_index = sock->recv_head;
+	}
+
+	do {
+	    memset(&frames[n], 0, sizeof(can_frame_t));
+	    if (use_slots)
+		has_timestamp = rtcan_raw_fetch_slot(sock, 0, &frames[n],
+						     &timestamps[n],
+						     &frame_ifindex);
+	    else if (use_lvc)
+		has_timestamp = rtcan_raw_fetch_lvc(sock, 0, &frames[n],
+						    &timestamps[n],
+						    &frame_ifindex);
+	    else
+		has_timestamp = rtcan_raw_fetch_frame(sock, &recv_buf_index,
+						      &frames[n],
+						      &timestamps[n],
+						      &frame_ifindex);
+	    if (!has_timestamp)
+		timestamps[n] = 0;
+	    ifindex[n] = frame_ifindex;
+	    n++;
+	} while (n < RTCAN_RECV_BATCH_CHUNK && received + n < batch->count &&
+		 rtdm_sem_timeddown(&sock->recv_sem,
+				    RTDM_TIMEOUT_NONE, NULL) == 0);
+
+	if (!use_slots) {
+	    if (!use_lvc)
+		sock->recv_head = recv_buf_index;
+	    rtdm_lock_put_irqrestore(&sock->rx_lock, lock_ctx);
+	}
+
+	/* Copy this chunk back to the caller's buffers */
+	if (user_info) {
+	    if (rtdm_copy_to_user(user_info, batch->frames + received,
+				  frames, n * sizeof(can_frame_t)))
+		return -EFAULT;
+	    if (batch->timestamps &&
+		rtdm_copy_to_user(user_info, batch->timestamps + received,
+				  timestamps, n * sizeof(nanosecs_abs_t)))
+		return -EFAULT;
+	    if (batch->ifindex &&
+		rtdm_copy_to_user(user_info, batch->ifindex + received,
+				  ifindex, n * sizeof(int)))
+		return -EFAULT;
+	} else {
+	    memcpy(batch->frames + received, frames,
+		   n * sizeof(can_frame_t));
+	    if (batch->timestamps)
+		memcpy(batch->timestamps + received, timestamps,
+		       n * sizeof(nanosecs_abs_t));
+	    if (batch->ifindex)
+		memcpy(batch->ifindex + received, ifindex, n * sizeof(int));
+	}
+
+	received += n;
+	if (received == batch->count)
+	    break;
+
+	if (received < batch->min_count)
+	    /* Wait for more within the remaining time */
+	    ret = rtcan_raw_recv_wait(sock, batch->timeout, &timeout_seq);
+	else
+	    /* Only pick up what arrived while copying */
+	    ret = rtdm_sem_timeddown(&sock->recv_sem, RTDM_TIMEOUT_NONE,
+				     NULL);
+    }
+
+    if (received) {
+	batch->count = received;
+	return received;
+    }
+
+    /* Which error code? */
+    if (ret == -EIDRM)
+	/* Socket was closed */
+	return -EBADF;
+    else if (ret == -EWOULDBLOCK)
+	/* We would block but don't want to */
+	return -EAGAIN;
+
+    return ret;
+}
+
+
+/* Maximum number of frames passed to the controller per call of
+ * rtcan_raw_xmit() */
+#define RTCAN_SEND_BATCH_CHUNK  16
+
+/*
+ * Acquire one TX slot of the controller, i.e. pass dev->tx_sem once.
+ */
+static int rtcan_raw_tx_wait(struct rtdm_dev_context *context,
+			     struct rtcan_socket *sock,
+			     struct rtcan_device *dev,
+			     nanosecs_rel_t timeout,
+			     rtdm_toseq_t *timeout_seq)
+{
+    struct tx_wait_queue tx_wait;
+    int ret = 0;
+
+    tx_wait.rt_task = rtdm_task_current();
+
+    /* If socket was not closed recently, register the task at the
+     * socket's TX wait queue and decrement the TX semaphore. This must be
+     * atomic. Finally, the task must be deregistered again (also atomic). */
+    RTDM_EXECUTE_ATOMICALLY(
+	if (likely(!test_bit(RTDM_CLOSING, &context->context_flags))) {
+
+	    list_add(&tx_wait.tx_wait_list, &sock->tx_wait_head);
+
+	    /* Try to pass the guard in order to access the controller */
+	    ret = rtdm_sem_timeddown(&dev->tx_sem, timeout, timeout_seq);
+
+	    /* Only dequeue task again if socket isn't being closed i.e. if
+	     * this task was not unblocked within the close() function. */
+	    if (likely(tx_wait.tx_wait_list.next != LIST_POISON1))
+		/* Dequeue this task from the TX wait queue */
+		list_del(&tx_wait.tx_wait_list);
+	    else
+		/* The socket was closed. */
+		ret = -EBADF;
+
+	} else
+	/* The socket was closed. */
+	ret = -EBADF;
+	);
 
-	iov = &iov_buf;
-    }
+    /* Which error code? */
+    switch (ret) {
+    case -EIDRM:
+	/* Controller is stopped or bus-off */
+	return -ENETDOWN;
 
-    /* Check size of buffer */
-    if (iov->iov_len < sizeof(can_frame_t))
-	return -EMSGSIZE;
+    case -EWOULDBLOCK:
+	/* We would block but don't want to */
+	return -EAGAIN;
 
-    /* Check buffer if in user space */
-    if (user_info) {
-	if (!rtdm_rw_user_ok(user_info, iov->iov_base, iov->iov_len))
-	    return -EFAULT;
+    default:
+	/* Return all other error codes unmodified. */
+	return ret;
     }
+}
 
-    if (msg->msg_control != NULL) {
-	if (msg->msg_controllen < sizeof(nanosecs_abs_t))
-	    return -EINVAL;
-
-	if (user_info) {
-	    if (!rtdm_rw_user_ok(user_info, msg->msg_control,
-				 msg->msg_controllen))
-		return -EFAULT;
-	}
 
-    } else {
-	if (msg->msg_controllen != 0)
-	    return -EINVAL;
-    }
+/*
+ * Hand over @count frames to the controller under a single device_lock
+ * round. One TX slot per frame must have been acquired already. Returns
+ * the number of frames accepted or a negative error code if none was.
+ */
+int rtcan_raw_xmit(struct rtcan_socket *sock, struct rtcan_device *dev,
+		   can_frame_t *frames, int count)
+{
+    rtdm_lockctx_t lock_ctx;
+    nanosecs_abs_t now;
+    int i, n, ret = 0;
 
-    rtcan_raw_enable_bus_err(sock);
+    rtcan_dev_tx_taken(dev);
 
-    /* Set RX timeout */
-    timeout = (flags & MSG_DONTWAIT) ? RTDM_TIMEOUT_NONE : sock->rx_timeout;
+    rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
 
-    /* Fetch message (ok, try it ...) */
-    ret = rtdm_sem_timeddown(&sock->recv_sem, timeout, NULL);
+    /* Controller should be operating */
+    if (!CAN_STATE_OPERATING(dev->state)) {
+	if (dev->state == CAN_STATE_SLEEPING) {
+	    rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+	    for (i = 0; i < count; i++)
+		rtcan_dev_tx_release(dev);
+	    return -ECOMM;
+	}
+	rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+	return -ENETDOWN;
+    }
 
-    /* Error code returned? */
-    if (unlikely(ret)) {
-	/* Which error code? */
+    now = rtdm_clock_read();
 
-	if (ret == -EIDRM)
-	    /* Socket was closed */
-	    return -EBADF;
+    for (i = 0; i < count; i++) {
+	/* Push message onto stack for loopback when TX done */
+	if (rtcan_loopback_enabled(sock))
+	    rtcan_tx_push(dev, sock, &frames[i]);
 
-	else if (ret == -EWOULDBLOCK)
-	    /* We would block but don't want to */
-	    return -EAGAIN;
+	rtcan_dev_count_tx(dev);
+	dev->tx_prio = sock->tx_prio;
+	ret = dev->hard_start_xmit(dev, &frames[i]);
+	if (ret) {
+	    if (rtcan_loopback_enabled(sock))
+		rtcan_tx_drop(dev);
+	    break;
+	}
 
-	else
-	    /* Return all other error codes unmodified. */
-	    return ret;
+	/* The TX-done IRQ can't interfere, we hold device_lock */
+	dev->tx_submit[dev->tx_mailbox] = now;
+	rtcan_stats_tx(dev, frames[i].can_id,
+		       (frames[i].can_id & CAN_RTR_FLAG) ? 0 :
+		       min_t(unsigned int, frames[i].can_dlc, 8), 0);
+	if (rtcan_loopback_enabled(sock))
+	    rtcan_tx_commit(dev);
     }
 
+    rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
 
-    /* OK, we've got mail. */
+    if (i < count) {
+	/* Frame i was refused, give back the slots of those not tried */
+	n = i;
+	while (++i < count)
+	    rtcan_dev_tx_release(dev);
+	return n ? n : (ret < 0 ? ret : -EIO);
+    }
 
-    rtdm_lock_get_irqsave(&rtcan_socket_lock, lock_ctx);
+    return count;
+}
 
 
-    /* Construct a struct can_frame with data from socket's ring buffer */
-    recv_buf_index = sock->recv_head;
-    recv_buf = sock->recv_buf;
+/* Check a CAN FD frame passed to sendmsg() */
+static inline int rtcan_raw_check_fd_frame(struct canfd_frame *frame)
+{
+    if (frame->len > CANFD_MAX_DLEN ||
+	rtcan_fd_dlc2len(rtcan_fd_len2dlc(frame->len)) != frame->len ||
+	(frame->flags & ~(CANFD_BRS | CANFD_ESI)) ||
+	(frame->can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG)))
+	return -EINVAL;
 
+    /* Standard frame IDs between 0 and 2031, as for classic frames */
+    if (!(frame->can_id & CAN_EFF_FLAG) &&
+	(frame->can_id & CAN_EFF_MASK) > (CAN_SFF_MASK - 16))
+	return -EINVAL;
 
-    /* Begin with CAN ID */
-    MEMCPY_FROM_RING_BUF(&frame.can_id, sizeof(uint32_t));
+    return 0;
+}
 
 
-    /* Fetch interface index */
-    ifindex = recv_buf[recv_buf_index];
-    recv_buf_index = (recv_buf_index + 1) & (RTCAN_RXBUF_SIZE - 1);
+/*
+ * Hand over a CAN FD frame to the controller, like rtcan_raw_xmit(). One
+ * TX slot must have been acquired already. Returns 0 or a negative error
+ * code.
+ */
+static int rtcan_raw_xmit_fd(struct rtcan_socket *sock,
+			     struct rtcan_device *dev,
+			     struct canfd_frame *frame)
+{
+    rtdm_lockctx_t lock_ctx;
+    int ret;
 
+    rtcan_dev_tx_taken(dev);
 
-    /* Fetch DLC (with indicator if a timestamp exists) */
-    can_dlc = recv_buf[recv_buf_index];
-    recv_buf_index = (recv_buf_index + 1) & (RTCAN_RXBUF_SIZE - 1);
+    rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
 
-    frame.can_dlc = can_dlc & RTCAN_HAS_NO_TIMESTAMP;
-    payload_size = (frame.can_dlc > 8) ? 8 : frame.can_dlc;
+    /* Controller should be operating, in FD mode */
+    if (!CAN_STATE_OPERATING(dev->state)) {
+	if (dev->state == CAN_STATE_SLEEPING) {
+	    rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+	    rtcan_dev_tx_release(dev);
+	    return -ECOMM;
+	}
+	rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+	return -ENETDOWN;
+    }
 
+    if (!(dev->ctrl_mode & CAN_CTRLMODE_FD)) {
+	rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+	rtcan_dev_tx_release(dev);
+	return -EOPNOTSUPP;
+    }
 
-    /* If frame is an RTR or one with no payload it's not necessary
-     * to copy the data bytes. */
-    if (!(frame.can_id & CAN_RTR_FLAG) && payload_size) {
-	/* Copy data bytes */
-	MEMCPY_FROM_RING_BUF(frame.data, payload_size);
+    if (rtcan_loopback_enabled(sock))
+	rtcan_tx_push_fd(dev, sock, frame);
+
+    rtcan_dev_count_tx(dev);
+    dev->tx_prio = sock->tx_prio;
+    ret = dev->hard_start_xmit_fd(dev, frame);
+    if (ret) {
+	if (rtcan_loopback_enabled(sock))
+	    rtcan_tx_drop(dev);
+    } else {
+	dev->tx_submit[dev->tx_mailbox] = rtdm_clock_read();
+	rtcan_stats_tx(dev, frame->can_id, frame->len, RTCAN_STATS_FD |
+		       ((frame->flags & CANFD_BRS) ? RTCAN_STATS_BRS : 0));
+	if (rtcan_loopback_enabled(sock))
+	    rtcan_tx_commit(dev);
     }
 
+    rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
 
-    /* Is a timestamp available and is the caller actually interested? */
-    if (msg->msg_controllen && (can_dlc & RTCAN_HAS_TIMESTAMP)) {
-	/* Copy timestamp */
-	MEMCPY_FROM_RING_BUF(&timestamp, RTCAN_TIMESTAMP_SIZE);
-    }
+    return ret;
+}
 
 
+/*
+ * sendmsg() of a single CAN FD frame on a socket with CAN_RAW_FD_FRAMES
+ */
+static ssize_t rtcan_raw_send_fd(struct rtdm_dev_context *context,
+				 rtdm_user_info_t *user_info,
+				 struct rtcan_device *dev,
+				 struct iovec *iov, nanosecs_rel_t timeout)
+{
+    struct rtcan_socket *sock =
+	(struct rtcan_socket *)&context->dev_private;
+    struct canfd_frame frame;
+    int ret;
 
-    /* Message completely read from the socket's ring buffer. Now check if
-     * caller is just peeking. */
-    if (flags & MSG_PEEK)
-	/* Next one, please! */
-	rtdm_sem_up(&sock->recv_sem);
-    else
-	/* Adjust begin of first message in the ring buffer. */
-	sock->recv_head = recv_buf_index;
+    if (user_info) {
+	if (rtdm_copy_from_user(user_info, &frame, iov->iov_base,
+				sizeof(frame)))
+	    return -EFAULT;
+    } else
+	memcpy(&frame, iov->iov_base, sizeof(frame));
 
+    if (rtcan_raw_check_fd_frame(&frame))
+	return -EINVAL;
 
-    /* Release lock */
-    rtdm_lock_put_irqrestore(&rtcan_socket_lock, lock_ctx);
+    if (!dev->hard_start_xmit_fd)
+	return -EOPNOTSUPP;
 
+    ret = rtcan_raw_tx_wait(context, sock, dev, timeout, NULL);
+    if (ret)
+	return ret;
 
-    /* Create CAN socket address to give back */
-    if (msg->msg_namelen) {
-	scan.can_family = AF_CAN;
-	scan.can_ifindex = ifindex;
-    }
+    ret = rtcan_raw_xmit_fd(sock, dev, &frame);
+    if (ret)
+	return ret;
 
+    iov->iov_base += sizeof(frame);
+    iov->iov_len -= sizeof(frame);
 
-    /* Last duty: Copy all back to the caller's buffers. */
+    return sizeof(frame);
+}
 
-    if (user_info) {
-	/* Copy to user space */
 
-	/* Copy socket address */
-	if (msg->msg_namelen) {
-	    if (rtdm_copy_to_user(user_info, msg->msg_name, &scan,
-				  sizeof(struct sockaddr_can)))
-		return -EFAULT;
+/*
+ * Send the request of a transaction and wait for its response. The match
+ * is armed before the request goes out, so an immediate response is not
+ * missed. The timeout covers both steps.
+ */
+static int rtcan_raw_transact(struct rtdm_dev_context *context,
+			      struct rtcan_transaction *tr)
+{
+    struct rtcan_socket *sock =
+	(struct rtcan_socket *)&context->dev_private;
+    struct rtcan_transact transact;
+    struct rtcan_device *dev;
+    rtdm_toseq_t timeout_seq;
+    rtdm_lockctx_t lock_ctx;
+    int ifindex, i, ret;
 
-	    msg->msg_namelen = sizeof(struct sockaddr_can);
-	}
+    ifindex = tr->ifindex ? tr->ifindex : atomic_read(&sock->ifindex);
+    if (!ifindex)
+	return -ENXIO;
 
-	/* Copy CAN frame */
-	if (rtdm_copy_to_user(user_info, iov->iov_base, &frame,
-			      sizeof(can_frame_t)))
-	    return -EFAULT;
-	/* Adjust iovec in the common way */
-	iov->iov_base += sizeof(can_frame_t);
-	iov->iov_len -= sizeof(can_frame_t);
-	/* ... and copy it, too. */
-	if (rtdm_copy_to_user(user_info, msg->msg_iov, iov,
-			      sizeof(struct iovec)))
-	    return -EFAULT;
+    if (rtcan_raw_check_frame(&tr->request))
+	return -EINVAL;
 
-	/* Copy timestamp if existent and wanted */
-	if (msg->msg_controllen) {
-	    if (can_dlc & RTCAN_HAS_TIMESTAMP) {
-		if (rtdm_copy_to_user(user_info, msg->msg_control,
-				      &timestamp, RTCAN_TIMESTAMP_SIZE))
-		    return -EFAULT;
+    if ((dev = rtcan_dev_get_by_index(ifindex)) == NULL)
+	return -ENXIO;
 
-		msg->msg_controllen = RTCAN_TIMESTAMP_SIZE;
-	    } else
-		msg->msg_controllen = 0;
-	}
+    memset(&transact.response, 0, sizeof(can_frame_t));
+    transact.can_id = tr->resp_id;
+    transact.can_mask = tr->resp_mask;
+    transact.matched = 0;
+    rtdm_event_init(&transact.done, 0);
 
-    } else {
-	/* Kernel space */
+    rtdm_toseq_init(&timeout_seq, tr->timeout);
 
-	/* Copy socket address */
-	if (msg->msg_namelen) {
-	    memcpy(msg->msg_name, &scan, sizeof(struct sockaddr_can));
-	    msg->msg_namelen = sizeof(struct sockaddr_can);
-	}
+    rtdm_lock_get_irqsave(&dev->recv_list_lock, lock_ctx);
+    for (i = 0; i < RTCAN_MAX_TRANSACTIONS && dev->transact[i]; i++);
+    if (i < RTCAN_MAX_TRANSACTIONS) {
+	dev->transact[i] = &transact;
+	dev->transact_count++;
+    }
+    rtdm_lock_put_irqrestore(&dev->recv_list_lock, lock_ctx);
 
-	/* Copy CAN frame */
-	memcpy(iov->iov_base, &frame, sizeof(can_frame_t));
-	/* Adjust iovec in the common way */
-	iov->iov_base += sizeof(can_frame_t);
-	iov->iov_len -= sizeof(can_frame_t);
+    if (i == RTCAN_MAX_TRANSACTIONS) {
+	ret = -EBUSY;
+	goto out;
+    }
 
-	/* Copy timestamp if existent and wanted */
-	if (msg->msg_controllen) {
-	    if (can_dlc & RTCAN_HAS_TIMESTAMP) {
-		memcpy(msg->msg_control, &timestamp, RTCAN_TIMESTAMP_SIZE);
-		msg->msg_controllen = RTCAN_TIMESTAMP_SIZE;
-	    } else
-		msg->msg_controllen = 0;
-	}
+    ret = rtcan_raw_tx_wait(context, sock, dev, tr->timeout, &timeout_seq);
+    if (!ret) {
+	/* An error code if the controller refused the frame */
+	ret = rtcan_raw_xmit(sock, dev, &tr->request, 1);
+	if (ret == 1)
+	    ret = rtdm_event_timedwait(&transact.done, tr->timeout,
+				       &timeout_seq);
+    }
+
+    /* Disarm the match, unless the response came meanwhile */
+    rtdm_lock_get_irqsave(&dev->recv_list_lock, lock_ctx);
+    if (!transact.matched) {
+	dev->transact[i] = NULL;
+	dev->transact_count--;
     }
+    rtdm_lock_put_irqrestore(&dev->recv_list_lock, lock_ctx);
+
+    if (transact.matched) {
+	tr->response = transact.response;
+	tr->timestamp = transact.timestamp;
+	ret = 0;
+    } else if (ret == -EWOULDBLOCK)
+	ret = -EAGAIN;
 
+ out:
+    rtdm_event_destroy(&transact.done);
+    rtcan_dev_dereference(dev);
 
-    return sizeof(can_frame_t);
+    return ret;
 }
 
 
@@ -792,14 +2611,15 @@ ssize_t rtcan_raw_sendmsg(struct rtdm_dev_context *context,
     struct sockaddr_can scan_buf;
     struct iovec *iov = (struct iovec *)msg->msg_iov;
     struct iovec iov_buf;
-    can_frame_t *frame;
-    can_frame_t frame_buf;
-    rtdm_lockctx_t lock_ctx;
+    can_frame_t *frames = NULL;
+    can_frame_t frame_buf[RTCAN_SEND_BATCH_CHUNK];
+    rtdm_toseq_t timeout_seq;
     nanosecs_rel_t timeout = 0;
-    struct tx_wait_queue tx_wait;
     struct rtcan_device *dev;
+    int nframes, sent = 0;
+    int pos = 0, avail = 0;
     int ifindex = 0;
-    int ret  = 0;
+    int i, n, ret = 0;
 
 
     if (flags & MSG_OOB)   /* Mirror BSD error message compatibility */
@@ -862,131 +2682,164 @@ ssize_t rtcan_raw_sendmsg(struct rtdm_dev_context *context,
 	iov = &iov_buf;
     }
 
-    /* Check size of buffer */
-    if (iov->iov_len != sizeof(can_frame_t))
-	return -EMSGSIZE;
-
-    frame = (can_frame_t *)iov->iov_base;
-
-    if (user_info) {
-	/* Copy CAN frame from userspace */
-	if (!rtdm_read_user_ok(user_info, iov->iov_base,
-			       sizeof(can_frame_t)) ||
-	    rtdm_copy_from_user(user_info, &frame_buf, iov->iov_base,
-				sizeof(can_frame_t)))
+    if (unlikely(sock->fd_frames) && iov->iov_len == CANFD_MTU) {
+	/* A single CAN FD frame */
+	if (user_info &&
+	    !rtdm_read_user_ok(user_info, iov->iov_base, iov->iov_len))
 	    return -EFAULT;
 
-	frame = &frame_buf;
-    }
+	if ((dev = rtcan_dev_get_by_index(ifindex)) == NULL)
+	    return -ENXIO;
 
-    /* Adjust iovec in the common way */
-    iov->iov_base += sizeof(can_frame_t);
-    iov->iov_len -= sizeof(can_frame_t);
-    /* ... and copy it back to userspace if necessary */
-    if (user_info) {
-	if (rtdm_copy_to_user(user_info, msg->msg_iov, iov,
+	timeout = (flags & MSG_DONTWAIT) ? RTDM_TIMEOUT_NONE :
+	    sock->tx_timeout;
+	ret = rtcan_raw_send_fd(context, user_info, dev, iov, timeout);
+	rtcan_dev_dereference(dev);
+
+	/* Copy the adjusted iovec back to userspace if necessary */
+	if (ret > 0 && user_info &&
+	    rtdm_copy_to_user(user_info, msg->msg_iov, iov,
 			      sizeof(struct iovec)))
 	    return -EFAULT;
+
+	return ret;
     }
 
-    /* At last, we've got the frame ... */
+    /* Check size of buffer. An array of frames may be passed, it is sent
+     * in order. */
+    if (iov->iov_len == 0 || iov->iov_len % sizeof(can_frame_t) != 0)
+	return -EMSGSIZE;
 
-    /* Check if DLC between 0 and 15 */
-    if (frame->can_dlc > 15)
-	return -EINVAL;
+    nframes = iov->iov_len / sizeof(can_frame_t);
 
-    /* Check if it is a standard frame and the ID between 0 and 2031 */
-    if (!(frame->can_id & CAN_EFF_FLAG)) {
-	u32 id = frame->can_id & CAN_EFF_MASK;
-	if (id > (CAN_SFF_MASK - 16))
-	    return -EINVAL;
-    }
+    if (user_info &&
+	!rtdm_read_user_ok(user_info, iov->iov_base, iov->iov_len))
+	return -EFAULT;
 
     if ((dev = rtcan_dev_get_by_index(ifindex)) == NULL)
 	return -ENXIO;
 
     timeout = (flags & MSG_DONTWAIT) ? RTDM_TIMEOUT_NONE : sock->tx_timeout;
 
-    tx_wait.rt_task = rtdm_task_current();
-
-    /* If socket was not closed recently, register the task at the
-     * socket's TX wait queue and decrement the TX semaphore. This must be
-     * atomic. Finally, the task must be deregistered again (also atomic). */
-    RTDM_EXECUTE_ATOMICALLY(
-	if (likely(!test_bit(RTDM_CLOSING, &context->context_flags))) {
+    /* The timeout applies to the whole call */
+    rtdm_toseq_init(&timeout_seq, timeout);
 
-	    list_add(&tx_wait.tx_wait_list, &sock->tx_wait_head);
+    while (sent < nframes) {
+	if (pos == avail) {
+	    /* Fetch the next chunk of frames */
+	    avail = min(nframes - sent, RTCAN_SEND_BATCH_CHUNK);
 
-	    /* Try to pass the guard in order to access the controller */
-	    ret = rtdm_sem_timeddown(&dev->tx_sem, timeout, NULL);
+	    if (user_info) {
+		/* Copy CAN frames from userspace */
+		if (rtdm_copy_from_user(user_info, frame_buf,
+					(can_frame_t *)iov->iov_base + sent,
+					avail * sizeof(can_frame_t))) {
+		    ret = -EFAULT;
+		    break;
+		}
+		frames = frame_buf;
+	    } else
+		frames = (can_frame_t *)iov->iov_base + sent;
+
+	    /* Only frames in front of an invalid one are sent */
+	    for (i = 0; i < avail; i++)
+		if (rtcan_raw_check_frame(&frames[i]))
+		    break;
+	    avail = i;
+	    pos = 0;
+
+	    if (!avail) {
+		ret = -EINVAL;
+		break;
+	    }
+	}
 
-	    /* Only dequeue task again if socket isn't being closed i.e. if
-	     * this task was not unblocked within the close() function. */
-	    if (likely(tx_wait.tx_wait_list.next != LIST_POISON1))
-		/* Dequeue this task from the TX wait queue */
-		list_del(&tx_wait.tx_wait_list);
-	    else
-		/* The socket was closed. */
-		ret = -EBADF;
+	/* Block for the first TX slot only, then take as many as the
+	 * controller has free right now. */
+	ret = rtcan_raw_tx_wait(context, sock, dev, timeout, &timeout_seq);
+	if (ret)
+	    break;
 
-	} else
-	/* The socket was closed. */
-	ret = -EBADF;
-	);
+	for (n = 1; n < avail - pos &&
+		 rtdm_sem_timeddown(&dev->tx_sem,
+				    RTDM_TIMEOUT_NONE, NULL) == 0; n++);
 
-    /* Error code returned? */
-    if (ret != 0) {
-	/* Which error code? */
-	switch (ret) {
-	case -EIDRM:
-	    /* Controller is stopped or bus-off */
-	    ret = -ENETDOWN;
-	    goto send_out1;
+	/* We got access */
+	ret = rtcan_raw_xmit(sock, dev, &frames[pos], n);
+	if (ret < 0)
+	    break;
 
-	case -EWOULDBLOCK:
-	    /* We would block but don't want to */
-	    ret = -EAGAIN;
-	    goto send_out1;
+	pos += ret;
+	sent += ret;
 
-	default:
-	    /* Return all other error codes unmodified. */
-	    goto send_out1;
+	if (ret < n) {
+	    /* Controller refused a frame */
+	    ret = -EIO;
+	    break;
 	}
     }
 
-    /* We got access */
+    rtcan_dev_dereference(dev);
 
+    if (!sent)
+	return ret;
 
-    /* Push message onto stack for loopback when TX done */
-    if (rtcan_loopback_enabled(sock))
-	rtcan_tx_push(dev, sock, frame);
+    /* Adjust iovec in the common way */
+    iov->iov_base += sent * sizeof(can_frame_t);
+    iov->iov_len -= sent * sizeof(can_frame_t);
+    /* ... and copy it back to userspace if necessary */
+    if (user_info) {
+	if (rtdm_copy_to_user(user_info, msg->msg_iov, iov,
+			      sizeof(struct iovec)))
+	    return -EFAULT;
+    }
 
-    rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+    /* Return number of bytes sent upon successful completion */
+    return sent * sizeof(can_frame_t);
+}
 
-    /* Controller should be operating */
-    if (!CAN_STATE_OPERATING(dev->state)) {
-	if (dev->state == CAN_STATE_SLEEPING) {
-	    ret = -ECOMM;
-	    rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
-	    rtdm_sem_up(&dev->tx_sem);
-	    goto send_out1;
-	}
-	ret = -ENETDOWN;
-	goto send_out2;
-    }
 
-    dev->tx_count++;
-    ret = dev->hard_start_xmit(dev, frame);
+/*
+ * Bind a selector to the socket: reading is possible while recv_sem can be
+ * passed (or the mapped ring has been signalled non-empty), writing while
+ * the bound device's tx_event is set, i.e. it may have a free TX slot or
+ * is stopped and sending fails right away.
+ */
+static int rtcan_raw_select_bind(struct rtdm_dev_context *context,
+				 rtdm_selector_t *selector,
+				 enum rtdm_selecttype type,
+				 unsigned fd_index)
+{
+    struct rtcan_socket *sock = (struct rtcan_socket *)&context->dev_private;
+    struct rtcan_device *dev;
+    int ifindex, ret;
+
+    switch (type) {
+    case RTDM_SELECTTYPE_READ:
+	if (rtcan_rx_ring_mapped(sock->rx_ring))
+	    return rtdm_event_select_bind(&sock->ring_event, selector,
+					  type, fd_index);
+	return rtdm_sem_select_bind(&sock->recv_sem, selector,
+				    type, fd_index);
+
+    case RTDM_SELECTTYPE_WRITE:
+	/* Only a socket bound to one interface has a TX semaphore */
+	ifindex = atomic_read(&sock->ifindex);
+	if (!ifindex)
+	    return -EDESTADDRREQ;
+
+	if ((dev = rtcan_dev_get_by_index(ifindex)) == NULL)
+	    return -ENXIO;
 
-    /* Return number of bytes sent upon successful completion */
-    if (ret == 0)
-	ret = sizeof(can_frame_t);
+	ret = rtdm_event_select_bind(&dev->tx_event, selector,
+				     type, fd_index);
 
- send_out2:
-    rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
- send_out1:
-    rtcan_dev_dereference(dev);
-    return ret;
+	rtcan_dev_dereference(dev);
+	return ret;
+
+    default:
+	return -EINVAL;
+    }
 }
 
 
@@ -1007,6 +2860,8 @@ static struct rtdm_device rtcan_proto_raw_dev = {
 	ioctl_rt:       rtcan_raw_ioctl,
 	ioctl_nrt:      rtcan_raw_ioctl,
 
+	select_bind:    rtcan_raw_select_bind,
+
 	read_rt:        NULL,
 	read_nrt:       NULL,
 
@@ -1037,14 +2892,22 @@ static struct rtdm_device rtcan_proto_raw_dev = {
 
 int __init rtcan_raw_proto_register(void)
 {
-    return rtdm_dev_register(&rtcan_proto_raw_dev);
+    int err;
+
+    if ((err = rtcan_raw_filter_init()) != 0)
+	return err;
+
+    if ((err = rtdm_dev_register(&rtcan_proto_raw_dev)) != 0)
+	rtcan_raw_filter_cleanup();
+
+    return err;
 }
 
 
 void __exit rtcan_raw_proto_unregister(void)
 {
     rtdm_dev_unregister(&rtcan_proto_raw_dev, 1000);
+    rtcan_raw_filter_cleanup();
 }
 
 
-EXPORT_SYMBOL_GPL(rtcan_rcv);
@@ -25,20 +25,41 @@
 int rtcan_raw_ioctl_dev(struct rtdm_dev_context *context,
 			rtdm_user_info_t *user_info, int request, void *arg);
 
+/* Upper limit of the reception list pool, see rtcan_raw_filter.c */
+extern unsigned int rtcan_max_filters;
+
+int rtcan_raw_filter_init(void);
+void rtcan_raw_filter_cleanup(void);
+int rtcan_raw_reserve_filter(struct rtcan_socket *sock,
+			     int ifindex, struct rtcan_filter_list *flist);
 int rtcan_raw_check_filter(struct rtcan_socket *sock,
 			   int ifindex, struct rtcan_filter_list *flist);
 int rtcan_raw_add_filter(struct rtcan_socket *sock, int ifindex);
 void rtcan_raw_remove_filter(struct rtcan_socket *sock);
 
-void rtcan_rcv(struct rtcan_device *rtcandev, struct rtcan_skb *skb);
+void rtcan_rcv_list(struct rtcan_device *dev, struct rtcan_skb *skb);
+void rtcan_rcv_single(struct rtcan_device *dev, struct rtcan_skb *skb);
+
+/* Pass a received frame to the sockets, called with recv_list_lock held */
+static inline void rtcan_rcv(struct rtcan_device *dev, struct rtcan_skb *skb)
+{
+    dev->rx_handler(dev, skb);
+}
+
+/* Mailbox argument of rtcan_loopback() for the frame just being passed to
+ * hard_start_xmit(), for drivers which complete it right away */
+#define RTCAN_TX_SUBMITTING     -1
 
-void rtcan_loopback(struct rtcan_device *rtcandev);
+void rtcan_loopback(struct rtcan_device *rtcandev, int mailbox);
 #ifdef CONFIG_XENO_DRIVERS_CAN_LOOPBACK
 #define rtcan_loopback_enabled(sock) (sock->loopback)
-#define rtcan_loopback_pending(dev) (dev->tx_socket)
+#define rtcan_tx_echo(dev, mailbox) \
+    ((mailbox) < 0 ? (dev)->tx_echo_next : (dev)->tx_echo[mailbox])
+#define rtcan_loopback_pending(dev, mailbox) \
+    (rtcan_tx_echo(dev, mailbox)->sock)
 #else /* !CONFIG_XENO_DRIVERS_CAN_LOOPBACK */
 #define rtcan_loopback_enabled(sock) (0)
-#define rtcan_loopback_pending(dev) (0)
+#define rtcan_loopback_pending(dev, mailbox) (0)
 #endif /* CONFIG_XENO_DRIVERS_CAN_LOOPBACK */
 
 #ifdef CONFIG_XENO_DRIVERS_CAN_BUS_ERR
@@ -52,6 +73,106 @@ static inline void rtcan_raw_enable_bus_err(struct rtcan_socket *sock)
 #define rtcan_raw_enable_bus_err(sock)
 #endif
 
+static inline int rtcan_raw_check_frame(can_frame_t *frame)
+{
+    /* Check if DLC between 0 and 15 */
+    if (frame->can_dlc > 15)
+	return -EINVAL;
+
+    /* Check if it is a standard frame and the ID between 0 and 2031 */
+    if (!(frame->can_id & CAN_EFF_FLAG)) {
+	u32 id = frame->can_id & CAN_EFF_MASK;
+	if (id > (CAN_SFF_MASK - 16))
+	    return -EINVAL;
+    }
+
+    return 0;
+}
+
+int rtcan_raw_xmit(struct rtcan_socket *sock, struct rtcan_device *dev,
+		   can_frame_t *frames, int count);
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_CYCLIC
+struct rtcan_cyclic_start;
+
+int rtcan_cyclic_start(struct rtcan_socket *sock, rtdm_user_info_t *user_info,
+		       struct rtcan_cyclic_start *start);
+int rtcan_cyclic_stop(struct rtcan_socket *sock);
+#else /* !CONFIG_XENO_DRIVERS_CAN_CYCLIC */
+struct rtcan_cyclic_start;
+
+static inline int rtcan_cyclic_start(struct rtcan_socket *sock,
+				     rtdm_user_info_t *user_info,
+				     struct rtcan_cyclic_start *start)
+{
+    return -EOPNOTSUPP;
+}
+static inline int rtcan_cyclic_stop(struct rtcan_socket *sock)
+{
+    return -EOPNOTSUPP;
+}
+#endif /* CONFIG_XENO_DRIVERS_CAN_CYCLIC */
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_CAPTURE
+struct rtcan_capture_start;
+struct rtcan_capture_read;
+
+int rtcan_capture_start(struct rtcan_socket *sock,
+			struct rtcan_capture_start *start);
+int rtcan_capture_stop(struct rtcan_socket *sock);
+int rtcan_capture_read(struct rtcan_socket *sock, rtdm_user_info_t *user_info,
+		       struct rtcan_capture_read *rd);
+void rtcan_capture_frame(struct rtcan_socket *sock, struct rtcan_skb *skb);
+#define rtcan_capture_active(sock)  ((sock)->capture != NULL)
+#else /* !CONFIG_XENO_DRIVERS_CAN_CAPTURE */
+struct rtcan_capture_start;
+struct rtcan_capture_read;
+
+static inline int rtcan_capture_start(struct rtcan_socket *sock,
+				      struct rtcan_capture_start *start)
+{
+    return -EOPNOTSUPP;
+}
+static inline int rtcan_capture_stop(struct rtcan_socket *sock)
+{
+    return -EOPNOTSUPP;
+}
+static inline int rtcan_capture_read(struct rtcan_socket *sock,
+				     rtdm_user_info_t *user_info,
+				     struct rtcan_capture_read *rd)
+{
+    return -EOPNOTSUPP;
+}
+static inline void rtcan_capture_frame(struct rtcan_socket *sock,
+				       struct rtcan_skb *skb) { }
+static inline int rtcan_capture_active(struct rtcan_socket *sock)
+{
+    return 0;
+}
+#endif /* CONFIG_XENO_DRIVERS_CAN_CAPTURE */
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_GW
+struct rtcan_gw_rule;
+struct seq_file;
+
+int rtcan_gw_add(struct rtcan_gw_rule *rule);
+int rtcan_gw_del(int handle);
+int rtcan_gw_read_proc(struct seq_file *p, void *data);
+void __rtcan_gw_route(struct rtcan_device *dev, struct rtcan_skb *skb);
+
+/* Route a received data frame, called with recv_list_lock held */
+static inline void rtcan_gw_route(struct rtcan_device *dev,
+				  struct rtcan_skb *skb)
+{
+    if (unlikely(dev->gw_routes != NULL))
+	__rtcan_gw_route(dev, skb);
+}
+#else /* !CONFIG_XENO_DRIVERS_CAN_GW */
+#define rtcan_gw_add(rule)          (-EOPNOTSUPP)
+#define rtcan_gw_del(handle)        (-EOPNOTSUPP)
+#define rtcan_gw_route(dev, skb)    do {} while(0)
+#endif /* CONFIG_XENO_DRIVERS_CAN_GW */
+
 int __init rtcan_raw_proto_register(void);
 void __exit rtcan_raw_proto_unregister(void);
 
@@ -38,6 +38,7 @@
  * Most parts of this code is from Arnaud Westenberg <arnaud@wanadoo.nl>
  */
 static int rtcan_calc_bit_time(struct rtcan_device *dev,
+			       const struct can_bittiming_const *btc,
 			       can_baudrate_t rate,
 			       struct can_bittime_std *bit_time)
 {
@@ -132,10 +133,10 @@ static int can_update_spt(const struct can_bittiming_const *btc,
 }
 
 static int rtcan_calc_bit_time(struct rtcan_device *dev,
+			       const struct can_bittiming_const *btc,
 			       can_baudrate_t bitrate,
 			       struct can_bittime_std *bt)
 {
-    const struct can_bittiming_const *btc = dev->bittiming_const;
     long rate;	/* current bitrate */
     long rate_error;/* difference between current and target value */
     long best_rate_error = 1000000000;
@@ -147,7 +148,7 @@ static int rtcan_calc_bit_time(struct rtcan_device *dev,
     unsigned int brp, tsegall, tseg, tseg1, tseg2;
     u64 v64;
 
-    if (!dev->bittiming_const)
+    if (!btc)
 	return -ENOTSUPP;
 
     /* Use CIA recommended sample points */
@@ -292,7 +293,8 @@ static inline int rtcan_raw_ioctl_dev_set(struct rtcan_device *dev,
 	if (!dev->do_set_bit_time)
 	    return 0;
 	baudrate = (can_baudrate_t *)&ifr->ifr_ifru;
-	ret = rtcan_calc_bit_time(dev, *baudrate, &bit_time.std);
+	ret = rtcan_calc_bit_time(dev, dev->bittiming_const, *baudrate,
+				  &bit_time.std);
 	if (ret)
 	    break;
 	bit_time.type = CAN_BITTIME_STD;
@@ -319,12 +321,19 @@ static inline int rtcan_raw_ioctl_dev_set(struct rtcan_device *dev,
     case SIOCSCANMODE:
 	mode = (can_mode_t *)&ifr->ifr_ifru;
 	if (dev->do_set_mode &&
-	    !(*mode == CAN_MODE_START && CAN_STATE_OPERATING(dev->state)))
+	    !(*mode == CAN_MODE_START && CAN_STATE_OPERATING(dev->state))) {
 	    ret = dev->do_set_mode(dev, *mode, &lock_ctx);
+	    if (!ret)
+		rtcan_stats_set_mode(dev, *mode);
+	}
 	break;
 
     case SIOCSCANCTRLMODE:
 	ctrl_mode = (can_ctrlmode_t *)&ifr->ifr_ifru;
+	if ((*ctrl_mode & CAN_CTRLMODE_FD) && !dev->hard_start_xmit_fd) {
+	    ret = -EOPNOTSUPP;
+	    break;
+	}
 	dev->ctrl_mode = *ctrl_mode;
 	break;
 
@@ -366,6 +375,107 @@ static inline int rtcan_raw_ioctl_dev_set(struct rtcan_device *dev,
     return ret;
 }
 
+/*
+ * RTCAN_RTIOC_GET/SET_DATA_BITTIME: data phase bit timing of CAN FD
+ * controllers
+ */
+static int rtcan_raw_ioctl_data_bittime(struct rtcan_device *dev, int request,
+					struct rtcan_data_bittime *dbt)
+{
+    struct can_bittime_std bit_time = dbt->bit_time;
+    rtdm_lockctx_t lock_ctx;
+    int ret = 0, started = 0;
+
+    if (!dev->do_set_data_bit_time)
+	return -EOPNOTSUPP;
+
+    if (request == RTCAN_RTIOC_GET_DATA_BITTIME) {
+	rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+	dbt->bitrate = dev->data_baudrate;
+	dbt->bit_time = dev->data_bit_time;
+	rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+	return 0;
+    }
+
+    if (dbt->bitrate) {
+	ret = rtcan_calc_bit_time(dev, dev->data_bittiming_const, dbt->bitrate,
+				  &bit_time);
+	if (ret)
+	    return ret;
+    }
+
+    rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+
+    if (dev->do_get_state)
+	dev->state = dev->do_get_state(dev);
+
+    if ((started = CAN_STATE_OPERATING(dev->state))) {
+	if ((ret = dev->do_set_mode(dev, CAN_MODE_STOP, &lock_ctx)))
+	    goto out;
+    }
+
+    ret = dev->do_set_data_bit_time(dev, &bit_time, &lock_ctx);
+    if (!ret) {
+	dev->data_bit_time = bit_time;
+	dev->data_baudrate = dbt->bitrate ? dbt->bitrate :
+	    CAN_BAUDRATE_UNKNOWN;
+    }
+
+ out:
+    if (started)
+	dev->do_set_mode(dev, CAN_MODE_START, &lock_ctx);
+
+    rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+
+    return ret;
+}
+
+/* Largest argument of a driver specific request */
+#define RTCAN_DRIVER_IOCTL_MAX  128
+
+/*
+ * Driver specific requests, listed in rtcan_raw_ioctl_dev(), are passed
+ * to the do_ioctl() handler of the device named at the start of their
+ * argument.
+ */
+static int rtcan_raw_ioctl_driver(rtdm_user_info_t *user_info,
+				  int request, void *arg)
+{
+    char buf[RTCAN_DRIVER_IOCTL_MAX] __attribute__((aligned(8)));
+    size_t size = _IOC_SIZE(request);
+    int out = _IOC_DIR(request) & _IOC_READ;
+    struct rtcan_device *dev;
+    int ret;
+
+    if (_IOC_TYPE(request) != RTIOC_TYPE_CAN ||
+	size < IFNAMSIZ || size > sizeof(buf))
+	return -EOPNOTSUPP;
+
+    if (user_info) {
+	if (!(out ? rtdm_rw_user_ok(user_info, arg, size) :
+		    rtdm_read_user_ok(user_info, arg, size)) ||
+	    rtdm_copy_from_user(user_info, buf, arg, size))
+	    return -EFAULT;
+    } else
+	memcpy(buf, arg, size);
+    buf[IFNAMSIZ - 1] = '\0';
+
+    if ((dev = rtcan_dev_get_by_name(buf)) == NULL)
+	return -ENODEV;
+    ret = dev->do_ioctl ? dev->do_ioctl(dev, request, buf) : -EOPNOTSUPP;
+    rtcan_dev_dereference(dev);
+
+    if (!ret && out) {
+	if (user_info) {
+	    if (rtdm_copy_to_user(user_info, arg, buf, size))
+		return -EFAULT;
+	} else
+	    memcpy(arg, buf, size);
+    }
+
+    return ret;
+}
+
 int rtcan_raw_ioctl_dev(struct rtdm_dev_context *context,
 			rtdm_user_info_t *user_info, int request, void *arg)
 {
@@ -429,6 +539,71 @@ int rtcan_raw_ioctl_dev(struct rtdm_dev_context *context,
 	rtcan_dev_dereference(dev);
 	break;
 
+    case RTCAN_RTIOC_GET_DATA_BITTIME:
+    case RTCAN_RTIOC_SET_DATA_BITTIME: {
+	struct rtcan_data_bittime dbt;
+
+	if (user_info) {
+	    if (!(request == RTCAN_RTIOC_GET_DATA_BITTIME ?
+		  rtdm_rw_user_ok(user_info, arg, sizeof(dbt)) :
+		  rtdm_read_user_ok(user_info, arg, sizeof(dbt))) ||
+		rtdm_copy_from_user(user_info, &dbt, arg, sizeof(dbt)))
+		return -EFAULT;
+	} else
+	    memcpy(&dbt, arg, sizeof(dbt));
+	dbt.ifname[IFNAMSIZ - 1] = '\0';
+
+	if ((dev = rtcan_dev_get_by_name(dbt.ifname)) == NULL)
+	    return -ENODEV;
+	ret = rtcan_raw_ioctl_data_bittime(dev, request, &dbt);
+	rtcan_dev_dereference(dev);
+
+	if (!ret && request == RTCAN_RTIOC_GET_DATA_BITTIME) {
+	    if (user_info) {
+		if (rtdm_copy_to_user(user_info, arg, &dbt, sizeof(dbt)))
+		    return -EFAULT;
+	    } else
+		memcpy(arg, &dbt, sizeof(dbt));
+	}
+	break;
+    }
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_STATS
+    case RTCAN_RTIOC_BUS_STATS: {
+	struct rtcan_bus_stats stats;
+
+	if (user_info) {
+	    if (!rtdm_rw_user_ok(user_info, arg, sizeof(stats)) ||
+		rtdm_copy_from_user(user_info, stats.ifname, arg,
+				    IFNAMSIZ))
+		return -EFAULT;
+	} else
+	    memcpy(stats.ifname, arg, IFNAMSIZ);
+	stats.ifname[IFNAMSIZ - 1] = '\0';
+
+	if ((dev = rtcan_dev_get_by_name(stats.ifname)) == NULL)
+	    return -ENODEV;
+	rtcan_dev_get_stats(dev, &stats);
+	rtcan_dev_dereference(dev);
+
+	if (user_info) {
+	    if (rtdm_copy_to_user(user_info, arg, &stats, sizeof(stats)))
+		return -EFAULT;
+	} else
+	    memcpy(arg, &stats, sizeof(stats));
+	break;
+    }
+#endif
+
+    case RTCAN_RTIOC_VIRT_GET_CONFIG:
+    case RTCAN_RTIOC_VIRT_SET_CONFIG:
+    case RTCAN_RTIOC_GET_COALESCE:
+    case RTCAN_RTIOC_SET_COALESCE:
+    case RTCAN_RTIOC_GET_RESTART:
+    case RTCAN_RTIOC_SET_RESTART:
+	ret = rtcan_raw_ioctl_driver(user_info, request, arg);
+	break;
+
     default:
 	ret = -EOPNOTSUPP;
 	break;
@@ -33,17 +33,41 @@
 #include "rtcan_raw.h"
 
 
+unsigned int rtcan_max_filters = 4096;
+module_param_named(max_filters, rtcan_max_filters, uint, 0444);
+MODULE_PARM_DESC(max_filters, "Maximum number of receive filters of all "
+		 "devices together (default 4096)");
+
+/*
+ * Pool of reception list entries shared by all devices. It is created with
+ * RTCAN_MAX_RECEIVERS entries and grows by chunks of at least as many when
+ * a socket binds in non-real-time context, but never shrinks. The free
+ * entries are chained by their next pointer. Protected by
+ * rtcan_recv_list_lock.
+ */
+struct rtcan_recv_chunk {
+    struct rtcan_recv_chunk *next;
+    unsigned int            count;
+    struct rtcan_recv       entry[0];
+};
+
+static struct rtcan_recv_chunk *rtcan_recv_chunks;
+static struct rtcan_recv *rtcan_recv_free;
+static unsigned int rtcan_recv_free_count;
+static unsigned int rtcan_recv_total;
+
+
 #if 0
 void rtcan_raw_print_filter(struct rtcan_device *dev)
 {
-    int i;
-    struct rtcan_recv *r = dev->receivers;
-
-    rtdm_printk("%s: recv_list=%p empty_list=%p free_entries=%d\n",
-		dev->name, dev->recv_list, dev->empty_list, dev->free_entries);
-    for (i = 0; i < RTCAN_MAX_RECEIVERS; i++, r++) {
-	rtdm_printk("%2d %p sock=%p next=%p id=%x mask=%x\n",
-		    i, r, r->sock, r->next,
+    struct rtcan_recv *r;
+
+    rtdm_printk("%s: recv_list=%p pool_free=%u pool_total=%u\n",
+		dev->name, dev->recv_list, rtcan_recv_free_count,
+		rtcan_recv_total);
+    for (r = dev->recv_list; r != NULL; r = r->next) {
+	rtdm_printk("%p sock=%p next=%p id=%x mask=%x\n",
+		    r, r->sock, r->next,
 		    r->can_filter.can_id, r->can_filter.can_mask);
     }
 }
@@ -52,6 +76,67 @@ void rtcan_raw_print_filter(struct rtcan_device *dev)
 #endif
 
 
+/*
+ * Add @count entries to the pool. Allocates, so it must be called in
+ * non-real-time context.
+ */
+static int rtcan_raw_grow_pool(unsigned int count, unsigned int limit)
+{
+    struct rtcan_recv_chunk *chunk;
+    rtdm_lockctx_t lock_ctx;
+    unsigned int i;
+
+    chunk = kmalloc(sizeof(*chunk) + count * sizeof(struct rtcan_recv),
+		    GFP_KERNEL);
+    if (chunk == NULL)
+	return -ENOMEM;
+
+    memset(chunk->entry, 0, count * sizeof(struct rtcan_recv));
+    chunk->count = count;
+    for (i = 0; i < count - 1; i++)
+	chunk->entry[i].next = &chunk->entry[i + 1];
+
+    rtdm_lock_get_irqsave(&rtcan_recv_list_lock, lock_ctx);
+
+    /* Someone else may have grown the pool in the meantime */
+    if (rtcan_recv_total + count > limit) {
+	rtdm_lock_put_irqrestore(&rtcan_recv_list_lock, lock_ctx);
+	kfree(chunk);
+	return -ENOSPC;
+    }
+
+    chunk->entry[count - 1].next = rtcan_recv_free;
+    rtcan_recv_free = chunk->entry;
+    rtcan_recv_free_count += count;
+    rtcan_recv_total += count;
+    chunk->next = rtcan_recv_chunks;
+    rtcan_recv_chunks = chunk;
+
+    rtdm_lock_put_irqrestore(&rtcan_recv_list_lock, lock_ctx);
+
+    return 0;
+}
+
+
+int __init rtcan_raw_filter_init(void)
+{
+    return rtcan_raw_grow_pool(RTCAN_MAX_RECEIVERS, UINT_MAX);
+}
+
+
+void rtcan_raw_filter_cleanup(void)
+{
+    struct rtcan_recv_chunk *chunk;
+
+    while ((chunk = rtcan_recv_chunks) != NULL) {
+	rtcan_recv_chunks = chunk->next;
+	kfree(chunk);
+    }
+    rtcan_recv_free = NULL;
+    rtcan_recv_free_count = rtcan_recv_total = 0;
+}
+
+
 static inline void rtcan_raw_mount_filter(can_filter_t *recv_filter,
 					  can_filter_t *filter)
 {
@@ -68,35 +153,135 @@ static inline void rtcan_raw_mount_filter(can_filter_t *recv_filter,
 }
 
 
-int rtcan_raw_check_filter(struct rtcan_socket *sock, int ifindex,
-			   struct rtcan_filter_list *flist)
+/*
+ * Rebuild the lookup index of a device from its reception list. Must be
+ * called with the device's recv_list_lock held whenever the reception list
+ * changed.
+ */
+static void rtcan_raw_index_filter(struct rtcan_device *dev)
 {
-    int old_ifindex = 0, old_flistlen_all = 0;
-    int free_entries, i, begin, end;
-    struct rtcan_device *dev;
-    int flistlen;
+    struct rtcan_recv_masks *masks = &dev->recv_masks;
+    struct rtcan_recv *recv_listener, **bucket;
+    can_filter_t *filter;
+    unsigned int n = 0;
 
-    if (rtcan_flist_no_filter(flist))
-	return 0;
+    memset(dev->recv_hash, 0, sizeof(dev->recv_hash));
 
-    /* Check if filter list has been defined by user */
-    flistlen = (flist) ? flist->flistlen : 1;
+    for (recv_listener = dev->recv_list; recv_listener != NULL;
+	 recv_listener = recv_listener->next) {
+	filter = &recv_listener->can_filter;
 
-    /* Now we check if a reception list would overflow. This takes some
-     * preparation, so let's go ... */
+	if (rtcan_recv_hashable(filter)) {
+	    bucket = &dev->recv_hash[rtcan_recv_hash(filter->can_id)];
+	    recv_listener->index_next = *bucket;
+	    *bucket = recv_listener;
+	    continue;
+	}
 
-    /* Check current bind status */
-    if (rtcan_sock_has_filter(sock)) {
-	/* Socket is bound */
-	i = atomic_read(&sock->ifindex);
+	/* rtcan_raw_check_filter() made sure there is room */
+	masks->id[n] = filter->can_id;
+	masks->mask[n] = filter->can_mask & ~CAN_INV_FILTER;
+	masks->inv[n] = !!(filter->can_mask & CAN_INV_FILTER);
+	masks->recv[n] = recv_listener;
+	n++;
+    }
 
-	if (i == 0)
-	    /* Socket was bound to ALL interfaces */
-	    old_flistlen_all = sock->flistlen;
-	else    /* Socket was bound to only one interface */
-	    old_ifindex = i;
+    masks->count = n;
+
+    /* A sole listener without filter gets all data frames directly */
+    recv_listener = dev->recv_list;
+    if (recv_listener != NULL && recv_listener->next == NULL &&
+	recv_listener->can_filter.can_id == 0 &&
+	recv_listener->can_filter.can_mask == 0) {
+	dev->rx_single = recv_listener;
+	dev->rx_handler = rtcan_rcv_single;
+    } else {
+	dev->rx_single = NULL;
+	dev->rx_handler = rtcan_rcv_list;
+    }
+}
+
+
+/*
+ * Merge all filters of the reception list into a single acceptance filter
+ * for the controller. Inverted filters and filters accepting both frame
+ * formats can't be expressed by one ID/mask pair, then everything must be
+ * accepted. Must be called with the device's recv_list_lock held.
+ */
+static void rtcan_raw_merge_filter(struct rtcan_device *dev,
+				   struct rtcan_hw_filter *hw_filter)
+{
+    struct rtcan_recv *recv_listener;
+    uint32_t id, mask;
+
+    hw_filter->can_id = 0;
+    hw_filter->can_mask = 0;
+
+    for (recv_listener = dev->recv_list; recv_listener != NULL;
+	 recv_listener = recv_listener->next) {
+	can_filter_t *filter = &recv_listener->can_filter;
+
+	if ((filter->can_mask & (CAN_INV_FILTER | CAN_EFF_FLAG)) !=
+	    CAN_EFF_FLAG)
+	    goto accept_all;
+
+	mask = filter->can_mask & ((filter->can_id & CAN_EFF_FLAG) ?
+				   CAN_EFF_MASK : CAN_SFF_MASK);
+	mask |= CAN_EFF_FLAG;
+	id = filter->can_id & mask;
+
+	if (recv_listener == dev->recv_list) {
+	    hw_filter->can_id = id;
+	    hw_filter->can_mask = mask;
+	} else {
+	    /* Only keep the bits all filters agree on */
+	    hw_filter->can_mask &= mask & ~(hw_filter->can_id ^ id);
+	    hw_filter->can_id &= hw_filter->can_mask;
+
+	    /* Different frame formats? */
+	    if (rtcan_hw_filter_accept_all(hw_filter))
+		goto accept_all;
+	}
     }
 
+    return;
+
+ accept_all:
+    hw_filter->can_id = 0;
+    hw_filter->can_mask = 0;
+}
+
+
+/*
+ * Store a new acceptance filter for the controller, picked up with its
+ * next start. Called with rtcan_recv_list_lock held and interrupts off,
+ * but without the device's recv_list_lock which nests inside device_lock.
+ */
+static void rtcan_raw_set_hw_filter(struct rtcan_device *dev,
+				    struct rtcan_hw_filter *hw_filter)
+{
+    rtdm_lock_get(&dev->device_lock);
+    dev->hw_filter = *hw_filter;
+    rtdm_lock_put(&dev->device_lock);
+}
+
+
+/*
+ * Number of pool entries missing for binding @sock with @flist to
+ * @ifindex, zero or less if the pool suffices. The entries the socket
+ * holds for its current binding are counted as available. Must be called
+ * with rtcan_recv_list_lock held.
+ */
+static int rtcan_raw_filter_deficit(struct rtcan_socket *sock, int ifindex,
+				    struct rtcan_filter_list *flist)
+{
+    int i, begin, end, flistlen;
+    int needed = 0, available = rtcan_recv_free_count;
+    struct rtcan_device *dev;
+
+    /* Check if filter list has been defined by user */
+    flistlen = (flist) ? flist->flistlen : 1;
+
     if (ifindex) {
 	/* We bind the socket to only one interface. */
 	begin = ifindex;
@@ -107,27 +292,239 @@ int rtcan_raw_check_filter(struct rtcan_socket *sock, int ifindex,
 	end = RTCAN_MAX_DEVICES;
     }
 
-    /* Check if there is space for the new binding */
     for (i = begin; i <= end; i++) {
 	if ((dev = rtcan_dev_get_by_index(i)) == NULL)
 	    continue;
-	free_entries = dev->free_entries + old_flistlen_all;
 	rtcan_dev_dereference(dev);
-	if (i == old_ifindex)
-	    free_entries += sock->flistlen;
-	/* Compare free list space to new filter list length */
-	if (free_entries < flistlen)
+	needed += flistlen;
+    }
+
+    /* Entries released by the current binding, if any */
+    if (rtcan_sock_has_filter(sock)) {
+	ifindex = atomic_read(&sock->ifindex);
+	if (ifindex) {
+	    /* Socket was bound to only one interface */
+	    begin = ifindex;
+	    end   = ifindex;
+	} else {
+	    /* Socket was bound to ALL interfaces */
+	    begin = 1;
+	    end = RTCAN_MAX_DEVICES;
+	}
+
+	for (i = begin; i <= end; i++) {
+	    if ((dev = rtcan_dev_get_by_index(i)) == NULL)
+		continue;
+	    rtcan_dev_dereference(dev);
+	    available += sock->flistlen;
+	}
+    }
+
+    return needed - available;
+}
+
+
+/* Number of filters of @flist which go into the mask arrays */
+static unsigned int rtcan_raw_masked_count(struct rtcan_filter_list *flist)
+{
+    unsigned int i, n = 0;
+    can_filter_t *filter;
+
+    /* No list means one filter accepting everything */
+    if (flist == NULL)
+	return 1;
+
+    for (i = 0; i < flist->flistlen; i++) {
+	filter = &flist->flist[i];
+	if ((filter->can_id & CAN_INV_FILTER) ||
+	    (filter->can_mask & CAN_SFF_MASK) != CAN_SFF_MASK)
+	    n++;
+    }
+
+    return n;
+}
+
+
+/*
+ * Number of entries the mask arrays of @dev need when @sock binds to it
+ * with @masked masked filters, the ones of its current binding released.
+ * Must be called with rtcan_recv_list_lock held.
+ */
+static unsigned int rtcan_raw_masks_needed(struct rtcan_device *dev,
+					   struct rtcan_socket *sock,
+					   unsigned int masked)
+{
+    unsigned int needed = dev->recv_masks.count + masked;
+    int ifindex;
+
+    if (rtcan_sock_has_filter(sock)) {
+	ifindex = atomic_read(&sock->ifindex);
+	if (!ifindex || ifindex == dev->ifindex)
+	    needed -= rtcan_raw_masked_count(sock->flist);
+    }
+
+    return needed;
+}
+
+
+/*
+ * Make room in the mask arrays of @dev for binding @sock with @masked
+ * masked filters. Called without rtcan_recv_list_lock held, in
+ * non-real-time context only.
+ */
+static int rtcan_raw_reserve_masks(struct rtcan_device *dev,
+				   struct rtcan_socket *sock,
+				   unsigned int masked)
+{
+    struct rtcan_recv_masks *masks = &dev->recv_masks;
+    struct rtcan_recv **block, **old;
+    rtdm_lockctx_t lock_ctx;
+    unsigned int needed, size;
+
+    rtdm_lock_get_irqsave(&rtcan_recv_list_lock, lock_ctx);
+    needed = rtcan_raw_masks_needed(dev, sock, masked);
+    rtdm_lock_put_irqrestore(&rtcan_recv_list_lock, lock_ctx);
+
+    if (needed <= masks->size)
+	return 0;
+
+    size = roundup(needed, RTCAN_MAX_RECEIVERS);
+    block = kmalloc(size * (sizeof(*block) + 3 * sizeof(uint32_t)),
+		    GFP_KERNEL);
+    if (block == NULL)
+	return -ENOMEM;
+
+    rtdm_lock_get_irqsave(&rtcan_recv_list_lock, lock_ctx);
+
+    /* Someone else may have grown the arrays in the meantime */
+    if (size <= masks->size) {
+	rtdm_lock_put_irqrestore(&rtcan_recv_list_lock, lock_ctx);
+	kfree(block);
+	return 0;
+    }
+
+    rtdm_lock_get(&dev->recv_list_lock);
+    old = masks->recv;
+    masks->size = size;
+    masks->recv = block;
+    masks->id = (uint32_t *)(block + size);
+    masks->mask = masks->id + size;
+    masks->inv = masks->mask + size;
+    rtcan_raw_index_filter(dev);
+    rtdm_lock_put(&dev->recv_list_lock);
+
+    rtdm_lock_put_irqrestore(&rtcan_recv_list_lock, lock_ctx);
+
+    kfree(old);
+
+    return 0;
+}
+
+
+/*
+ * Grow the pool and the mask arrays of the devices ahead of binding @sock
+ * with @flist to @ifindex, so that rtcan_raw_check_filter() finds enough
+ * room. @flist may be NULL for the filter list the socket already has.
+ * Called without rtcan_recv_list_lock held, in non-real-time context only.
+ */
+int rtcan_raw_reserve_filter(struct rtcan_socket *sock, int ifindex,
+			     struct rtcan_filter_list *flist)
+{
+    rtdm_lockctx_t lock_ctx;
+    unsigned int count = 0, room, masked;
+    struct rtcan_device *dev;
+    int i, begin, end, ret;
+    int deficit = 0;
+
+    rtdm_lock_get_irqsave(&rtcan_recv_list_lock, lock_ctx);
+    if (flist == NULL)
+	flist = sock->flist;
+    if (rtcan_flist_no_filter(flist)) {
+	rtdm_lock_put_irqrestore(&rtcan_recv_list_lock, lock_ctx);
+	return 0;
+    }
+    deficit = rtcan_raw_filter_deficit(sock, ifindex, flist);
+    if (deficit > 0) {
+	/* Grow in whole chunks, but never beyond max_filters */
+	room = rtcan_recv_total < rtcan_max_filters ?
+	    rtcan_max_filters - rtcan_recv_total : 0;
+	count = min_t(unsigned int, room,
+		      max_t(unsigned int, deficit, RTCAN_MAX_RECEIVERS));
+    }
+    masked = rtcan_raw_masked_count(flist);
+    rtdm_lock_put_irqrestore(&rtcan_recv_list_lock, lock_ctx);
+
+    if (deficit > 0) {
+	if (count < (unsigned int)deficit)
 	    return -ENOSPC;
+	if ((ret = rtcan_raw_grow_pool(count, rtcan_max_filters)))
+	    return ret;
+    }
+
+    if (ifindex) {
+	begin = ifindex;
+	end   = ifindex;
+    } else {
+	begin = 1;
+	end = RTCAN_MAX_DEVICES;
+    }
+
+    for (i = begin; i <= end; i++) {
+	if ((dev = rtcan_dev_get_by_index(i)) == NULL)
+	    continue;
+	ret = rtcan_raw_reserve_masks(dev, sock, masked);
+	rtcan_dev_dereference(dev);
+	if (ret)
+	    return ret;
     }
 
     return 0;
 }
 
 
+int rtcan_raw_check_filter(struct rtcan_socket *sock, int ifindex,
+			   struct rtcan_filter_list *flist)
+{
+    unsigned int masked;
+    struct rtcan_device *dev;
+    int i, begin, end, ret = 0;
+
+    if (rtcan_flist_no_filter(flist))
+	return 0;
+
+    /* Now we check if the pool would run out of entries */
+    if (rtcan_raw_filter_deficit(sock, ifindex, flist) > 0)
+	return -ENOSPC;
+
+    /* And if the mask arrays of the devices are large enough, they only
+     * grow in rtcan_raw_reserve_filter() */
+    masked = rtcan_raw_masked_count(flist);
+
+    if (ifindex) {
+	begin = ifindex;
+	end   = ifindex;
+    } else {
+	begin = 1;
+	end = RTCAN_MAX_DEVICES;
+    }
+
+    for (i = begin; i <= end && !ret; i++) {
+	if ((dev = rtcan_dev_get_by_index(i)) == NULL)
+	    continue;
+	if (rtcan_raw_masks_needed(dev, sock, masked) > dev->recv_masks.size)
+	    ret = -ENOSPC;
+	rtcan_dev_dereference(dev);
+    }
+
+    return ret;
+}
+
+
 int rtcan_raw_add_filter(struct rtcan_socket *sock, int ifindex)
 {
     int i, j, begin, end;
     struct rtcan_recv *first, *last;
+    struct rtcan_hw_filter hw_filter;
     struct rtcan_device *dev;
     /* Check if filter list has been defined by user */
     int flistlen;
@@ -152,8 +549,11 @@ int rtcan_raw_add_filter(struct rtcan_socket *sock, int ifindex)
 	if ((dev = rtcan_dev_get_by_index(i)) == NULL)
 	    continue;
 
-	/* Take first entry of empty list */
-	first = last = dev->empty_list;
+	/* Interrupts are already off, rtcan_recv_list_lock is held */
+	rtdm_lock_get(&dev->recv_list_lock);
+
+	/* Take first entry of the pool */
+	first = last = rtcan_recv_free;
 	/* Check if filter list is empty */
 	if (flistlen) {
 	    /* Filter list is not empty */
@@ -171,7 +571,7 @@ int rtcan_raw_add_filter(struct rtcan_socket *sock, int ifindex)
 		last->match_count = 0;
 	    }
 	    /* Decrease free entries counter by length of filter list */
-	    dev->free_entries -= flistlen;
+	    rtcan_recv_free_count -= flistlen;
 
 	} else {
 	    /* Filter list is empty. Socket must be bound to all CAN IDs. */
@@ -181,17 +581,25 @@ int rtcan_raw_add_filter(struct rtcan_socket *sock, int ifindex)
 	    last->match_count = 0;
 	    /* Decrease free entries counter by 1
 	     * (one filter for all CAN frames) */
-	    dev->free_entries--;
+	    rtcan_recv_free_count--;
 	}
 
-	/* Set new empty list header */
-	dev->empty_list = last->next;
+	if (sock->latency_critical)
+	    dev->rx_critical++;
+
+	/* Set new pool header */
+	rtcan_recv_free = last->next;
 	/* Add new partial recv list to the head of reception list */
 	last->next = dev->recv_list;
 	/* Adjust rececption list pointer */
 	dev->recv_list = first;
 
+	rtcan_raw_index_filter(dev);
+	rtcan_raw_merge_filter(dev, &hw_filter);
 	rtcan_raw_print_filter(dev);
+	rtdm_lock_put(&dev->recv_list_lock);
+
+	rtcan_raw_set_hw_filter(dev, &hw_filter);
 	rtcan_dev_dereference(dev);
     }
 
@@ -204,6 +612,7 @@ void rtcan_raw_remove_filter(struct rtcan_socket *sock)
     int i, j, begin, end;
     struct rtcan_recv *first, *next, *last;
     int ifindex = atomic_read(&sock->ifindex);
+    struct rtcan_hw_filter hw_filter;
     struct rtcan_device *dev;
 
     if (!rtcan_sock_has_filter(sock)) /* nothing to do */
@@ -224,6 +633,8 @@ void rtcan_raw_remove_filter(struct rtcan_socket *sock)
 	if ((dev = rtcan_dev_get_by_index(i)) == NULL)
 	    continue;
 
+	rtdm_lock_get(&dev->recv_list_lock);
+
 	/* Search for first list entry pointing to this socket */
 	first = NULL;
 	next = dev->recv_list;
@@ -242,15 +653,22 @@ void rtcan_raw_remove_filter(struct rtcan_socket *sock)
 	    first->next = last->next;
 	else
 	    dev->recv_list = last->next;
-	/* Add partial list to the head of empty list */
-	last->next = dev->empty_list;
-	/* Adjust empty list pointer */
-	dev->empty_list = next;
+	/* Return partial list to the head of the pool */
+	last->next = rtcan_recv_free;
+	rtcan_recv_free = next;
 
 	/* Increase free entries counter by length of old filter list */
-	dev->free_entries += sock->flistlen;
+	rtcan_recv_free_count += sock->flistlen;
 
+	if (sock->latency_critical)
+	    dev->rx_critical--;
+
+	rtcan_raw_index_filter(dev);
+	rtcan_raw_merge_filter(dev, &hw_filter);
 	rtcan_raw_print_filter(dev);
+	rtdm_lock_put(&dev->recv_list_lock);
+
+	rtcan_raw_set_hw_filter(dev, &hw_filter);
 	rtcan_dev_dereference(dev);
     }
 }
@@ -28,19 +28,35 @@
  * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <linux/vmalloc.h>
+
 #include "rtcan_socket.h"
 #include "rtcan_list.h"
 
 
 LIST_HEAD(rtcan_socket_list);
 
-void rtcan_socket_init(struct rtdm_dev_context *context)
+int rtcan_socket_init(struct rtdm_dev_context *context)
 {
     struct rtcan_socket *sock = (struct rtcan_socket *)&context->dev_private;
     rtdm_lockctx_t lock_ctx;
 
 
+    sock->recv_buf = rtdm_malloc(RTCAN_RXBUF_SIZE);
+    if (!sock->recv_buf)
+	return -ENOMEM;
+    sock->recv_buf_size = RTCAN_RXBUF_SIZE;
+    sock->recv_buf_vmalloc = 0;
+
+    rtdm_lock_init(&sock->rx_lock);
     rtdm_sem_init(&sock->recv_sem, 0);
+    rtdm_event_init(&sock->ring_event, 0);
+    sock->rx_ring = NULL;
+    sock->recv_slots = NULL;
+    sock->recv_slot_mask = 0;
+    sock->recv_slot_head = 0;
+    sock->recv_slot_tail = 0;
+    sock->lvc = NULL;
 
     sock->recv_head = 0;
     sock->recv_tail = 0;
@@ -48,9 +64,24 @@ void rtcan_socket_init(struct rtdm_dev_context *context)
     sock->flistlen = RTCAN_SOCK_UNBOUND;
     sock->flist = NULL;
     sock->err_mask = 0;
+    sock->tx_prio = 0;
+    sock->latency_critical = 0;
+    sock->fd_frames = 0;
+    sock->rx_ts_size = 0;
     sock->rx_buf_full = 0;
 #ifdef CONFIG_XENO_DRIVERS_CAN_LOOPBACK
     sock->loopback = 1;
+    sock->recv_own_msgs = 0;
+#endif
+#ifdef CONFIG_XENO_DRIVERS_CAN_CYCLIC
+    sock->cyclic = NULL;
+#endif
+#ifdef CONFIG_XENO_DRIVERS_CAN_CAPTURE
+    sock->capture = NULL;
+#endif
+#ifdef CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE
+    sock->trace_wake = 0;
+    sock->trace_ifindex = 0;
 #endif
 
     sock->tx_timeout = RTDM_TIMEOUT_INFINITE;
@@ -61,6 +92,8 @@ void rtcan_socket_init(struct rtdm_dev_context *context)
     rtdm_lock_get_irqsave(&rtcan_recv_list_lock, lock_ctx);
     list_add(&sock->socket_list, &rtcan_socket_list);
     rtdm_lock_put_irqrestore(&rtcan_recv_list_lock, lock_ctx);
+
+    return 0;
 }
 
 
@@ -96,6 +129,7 @@ void rtcan_socket_cleanup(struct rtdm_dev_context *context)
     } while (!tx_list_empty);
 
     rtdm_sem_destroy(&sock->recv_sem);
+    rtdm_event_destroy(&sock->ring_event);
 
     rtdm_lock_get_irqsave(&rtcan_recv_list_lock, lock_ctx);
     if (sock->socket_list.next) {
@@ -103,4 +137,18 @@ void rtcan_socket_cleanup(struct rtdm_dev_context *context)
 	sock->socket_list.next = NULL;
     }
     rtdm_lock_put_irqrestore(&rtcan_recv_list_lock, lock_ctx);
+
+    if (sock->recv_buf_vmalloc)
+	vfree(sock->recv_buf);
+    else
+	rtdm_free(sock->recv_buf);
+    sock->recv_buf = NULL;
+    if (sock->recv_slots) {
+	rtdm_free(sock->recv_slots);
+	sock->recv_slots = NULL;
+    }
+    if (sock->lvc) {
+	rtdm_free(sock->lvc);
+	sock->lvc = NULL;
+    }
 }
@@ -34,12 +34,18 @@
 #include <rtdm/rtdm_driver.h>
 
 #include <rtdm/rtcan.h>
+#include "rtcan_ext.h"
 
 
 
-/* This MUST BE 2^N */
+/* Default size of the receive ring buffer. This MUST BE 2^N */
 #define RTCAN_RXBUF_SIZE          CONFIG_XENO_DRIVERS_CAN_RXBUF_SIZE
 
+/* Limits for the ring buffer size set via CAN_RAW_RCVBUF, the maximum is
+ * the default of the rcvbuf_max module parameter */
+#define RTCAN_RXBUF_MIN_SIZE      64
+#define RTCAN_RXBUF_MAX_SIZE      (1 << 20)
+
 /* Size of timestamp */
 #define RTCAN_TIMESTAMP_SIZE      sizeof(nanosecs_abs_t)
 
@@ -50,6 +56,34 @@
 /* Mask for clearing bit RTCAN_HAS_TIMESTAMP */
 #define RTCAN_HAS_NO_TIMESTAMP    0x7F
 
+/* Bits in the can_dlc member of struct rtcan_rb_frame marking a CAN FD
+ * frame and its flags. The lower 4 bits hold the DLC code then, see
+ * rtcan_fd_dlc2len(). Classic frames never have them set. */
+#define RTCAN_FD_FRAME            0x40
+#define RTCAN_FD_BRS              0x20
+#define RTCAN_FD_ESI              0x10
+#define RTCAN_FD_DLC_MASK         0x0F
+
+/* Payload length of a CAN FD frame from its DLC code and back, rounding
+ * up to the next valid length */
+static inline unsigned int rtcan_fd_dlc2len(unsigned int dlc)
+{
+    static const unsigned char len[16] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64
+    };
+
+    return len[dlc & RTCAN_FD_DLC_MASK];
+}
+
+static inline unsigned int rtcan_fd_len2dlc(unsigned int len)
+{
+    if (len <= 8)
+	return len;
+    if (len <= 24)
+	return 8 + (len - 8 + 3) / 4;
+    return (len <= 32) ? 13 : (len <= 48) ? 14 : 15;
+}
+
 #define RTCAN_SOCK_UNBOUND        -1
 #define RTCAN_FLIST_NO_FILTER     (struct rtcan_filter_list *)-1
 #define rtcan_flist_no_filter(f)  ((f) == RTCAN_FLIST_NO_FILTER)
@@ -75,11 +109,11 @@ struct rtcan_rb_frame {
 
     /* DLC (between 0 and 15) and mark if frame has got a timestamp. The
      * existence of a timestamp is indicated by the RTCAN_HAS_TIMESTAMP
-     * bit. */
+     * bit, a CAN FD frame by RTCAN_FD_FRAME. */
     unsigned char       can_dlc;
 
     /* Data bytes */
-    uint8_t             data[8];
+    uint8_t             data[CANFD_MAX_DLEN];
 
     /* High precision timestamp indicating when the frame was received.
      * Exists when RTCAN_HAS_TIMESTAMP bit in can_dlc is set. */
@@ -90,7 +124,7 @@ struct rtcan_rb_frame {
 
 /* Size of struct rtcan_rb_frame without any data bytes and timestamp */
 #define EMPTY_RB_FRAME_SIZE \
-    sizeof(struct rtcan_rb_frame) - 8 - RTCAN_TIMESTAMP_SIZE
+    (sizeof(struct rtcan_rb_frame) - CANFD_MAX_DLEN - RTCAN_TIMESTAMP_SIZE)
 
 
 /*
@@ -105,10 +139,103 @@ struct rtcan_rb_frame {
 struct rtcan_skb {
     /* Actual size of following rb_frame (without timestamp) */
     size_t                rb_frame_size;
+    /* Reception time, set by the driver as close to the reception as it
+     * can (hardware timer or IRQ entry) and stored by rtcan_rcv() */
+    nanosecs_abs_t        timestamp;
+#ifdef CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE
+    /* Start of the frame's handling in the IRQ, end of reading it from
+     * the controller and first socket lock taken, see rtcan_trace_*() */
+    nanosecs_abs_t        trace_irq;
+    nanosecs_abs_t        trace_hw;
+    nanosecs_abs_t        trace_lock;
+#endif
     /* Frame to be stored in the sockets' ring buffers (as is) */
     struct rtcan_rb_frame rb_frame;
 };
 
+/* Number of data bytes of the frame stored in @skb */
+static inline size_t rtcan_skb_payload(struct rtcan_skb *skb)
+{
+    return skb->rb_frame_size - (EMPTY_RB_FRAME_SIZE);
+}
+
+/* Default number of slots of a mapped reception ring */
+#define RTCAN_RING_DEFAULT_SLOTS  256
+#define RTCAN_RING_MAX_SLOTS      65536
+
+/*
+ * Reception ring shared with user space via RTCAN_RTIOC_MMAP_RING. It is
+ * referenced by the socket and by every VMA mapping it and is released
+ * when the last reference is dropped.
+ */
+struct rtcan_rx_ring {
+    /* Start of the vmalloc'ed area, header first */
+    struct rtcan_ring_header *hdr;
+    struct rtcan_ring_slot *slots;
+    size_t              size;
+    uint32_t            mask;
+
+    /* Private copy of hdr->head, user space might scribble over it */
+    uint32_t            head;
+    uint32_t            seq;
+
+    atomic_t            refcount;
+};
+
+/* The socket holds one reference itself */
+#define rtcan_rx_ring_mapped(r)   ((r) && atomic_read(&(r)->refcount) > 1)
+
+/* Limits for the number of slots set via CAN_RAW_RX_SLOTS */
+#define RTCAN_RX_SLOTS_MIN        4
+#define RTCAN_RX_SLOTS_MAX        65536
+
+/*
+ * Entry of the fixed-slot receive ring selected by CAN_RAW_RX_SLOTS. The
+ * layout follows struct rtcan_rb_frame, but every slot has room for the
+ * full payload and the timestamp and is 8 byte aligned, so it is written
+ * and read as a whole instead of byte-wise with wraparound checks.
+ */
+struct rtcan_rx_slot {
+    uint32_t            can_id;
+    unsigned char       can_ifindex;
+
+    /* DLC and RTCAN_HAS_TIMESTAMP like in struct rtcan_rb_frame */
+    unsigned char       can_dlc;
+    uint16_t            __pad;
+    uint8_t             data[8];
+    nanosecs_abs_t      timestamp;
+} __attribute__ ((aligned(8)));
+
+/* Limit for the number of CAN IDs set via CAN_RAW_LAST_VALUE */
+#define RTCAN_LVC_MAX_IDS         4096
+
+/* can_id of an unused entry, no frame carries all flags at once */
+#define RTCAN_LVC_EMPTY           0xffffffff
+
+/*
+ * Last-value cache selected by CAN_RAW_LAST_VALUE: the latest frame of
+ * each CAN ID (including the EFF and RTR flags), hashed with linear
+ * probing into a table twice the number of IDs, so a lookup finds a free
+ * entry quickly. Entries are only removed when the cache is released.
+ * Entries updated since they were last read are marked in the dirty
+ * bitmap. All of it is protected by the socket's rx_lock.
+ */
+struct rtcan_lvc {
+    /* Number of entries, 2^bits */
+    unsigned int        bits;
+    unsigned int        size;
+
+    /* IDs stored and the limit set by the user */
+    unsigned int        used;
+    unsigned int        max_ids;
+
+    /* Entry the next reader starts scanning the dirty bitmap at */
+    unsigned int        next;
+
+    unsigned long       *dirty;
+    struct rtcan_rx_slot entry[0];
+};
+
 struct rtcan_filter_list {
     int flistlen;
     struct can_filter flist[1];
@@ -126,31 +253,70 @@ struct rtcan_socket {
 
     struct list_head    socket_list;
 
-    /* Transmission timeout in ns. Protected by rtcan_socket_lock
-     * in all socket structures. */
+    /* Transmission timeout in ns */
     nanosecs_rel_t      tx_timeout;
 
-    /* Reception timeout in ns. Protected by rtcan_socket_lock
-     * in all socket structures. */
+    /* Reception timeout in ns */
     nanosecs_rel_t      rx_timeout;
 
 
+    /* Spinlock for the ring buffer. There is one producer at a time (the
+     * reception path under the device's recv_list_lock) and one consumer,
+     * so only the sockets shared by several devices see contention. It
+     * starts the state written by the reception path, which is kept apart
+     * from the settings above and below. */
+    rtdm_lock_t         rx_lock ____cacheline_aligned_in_smp;
+
     /* Begin of first frame data in the ring buffer. Protected by
-     * rtcan_socket_lock in all socket structures. */
+     * rx_lock. */
     int                 recv_head;
 
     /* End of last frame data in the ring buffer. I.e. position of first
-     * free byte in the ring buffer. Protected by
-     * rtcan_socket_lock in all socket structures. */
+     * free byte in the ring buffer. Protected by rx_lock. */
     int                 recv_tail;
 
-    /* Ring buffer for incoming CAN frames. Protected by
-     * rtcan_socket_lock in all socket structures. */
-    unsigned char       recv_buf[RTCAN_RXBUF_SIZE];
+    /* Ring buffer for incoming CAN frames, allocated from the RTDM heap,
+     * or vmalloc'ed if set via CAN_RAW_RCVBUF. Protected by rx_lock. */
+    unsigned char       *recv_buf;
+
+    /* Size of recv_buf (2^N). Protected by rx_lock. */
+    unsigned int        recv_buf_size;
+
+    /* Set if recv_buf is vmalloc'ed */
+    int                 recv_buf_vmalloc;
+
+    /* Frames dropped because the buffer was full. Written by the
+     * reception path. */
+    uint32_t            rx_buf_full;
 
     /* Semaphore for receivers and incoming messages */
     rtdm_sem_t          recv_sem;
 
+    /* Reception ring mapped to user space, replaces recv_buf while
+     * mapped. Protected by rx_lock. */
+    struct rtcan_rx_ring *rx_ring;
+
+    /* Signalled when the mapped ring becomes non-empty */
+    rtdm_event_t        ring_event;
+
+    /* Fixed-slot receive ring (CAN_RAW_RX_SLOTS), replaces recv_buf if
+     * non-NULL. Only changed under rx_lock while no frame is pending. */
+    struct rtcan_rx_slot *recv_slots;
+    unsigned int        recv_slot_mask;
+
+    /* Free-running producer index of recv_slots. Written under rx_lock
+     * by the reception path only. */
+    unsigned int        recv_slot_tail;
+
+    /* Free-running consumer index of recv_slots. Advanced by the readers
+     * with cmpxchg, without taking rx_lock. */
+    unsigned int        recv_slot_head ____cacheline_aligned_in_smp;
+
+    /* Last-value cache (CAN_RAW_LAST_VALUE), replaces recv_buf if
+     * non-NULL. Every dirty entry holds one count of recv_sem. Protected
+     * by rx_lock and only changed while no frame is pending. */
+    struct rtcan_lvc    *lvc;
+
 
     /* All senders waiting to be able to send
      * via this socket are queued here */
@@ -168,12 +334,43 @@ struct rtcan_socket {
 
     uint32_t            err_mask;
 
-    uint32_t            rx_buf_full;
+    /* CAN_RAW_TX_PRIO */
+    int                 tx_prio;
+
+    /* Bytes of timestamp stored with each frame, RTCAN_TIMESTAMP_SIZE
+     * or 0 following RTCAN_RTIOC_TAKE_TIMESTAMP */
+    unsigned int        rx_ts_size;
+
+    /* CAN_RAW_LATENCY_CRITICAL. Protected by rtcan_recv_list_lock. */
+    int                 latency_critical;
+
+    /* CAN_RAW_FD_FRAMES. Only changed under rx_lock while no frame is
+     * pending. */
+    int                 fd_frames;
 
     struct rtcan_filter_list *flist;
 
 #ifdef CONFIG_XENO_DRIVERS_CAN_LOOPBACK
     int loopback;
+    int recv_own_msgs;
+#endif
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_CYCLIC
+    /* Cyclic transmission set started by this socket, see
+     * rtcan_cyclic.c. Protected by rtcan_cyclic_nrt_lock. */
+    struct rtcan_cyclic_set *cyclic;
+#endif
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_CAPTURE
+    /* Capture buffers replacing recv_buf, see rtcan_capture.c. Protected
+     * by rx_lock. */
+    struct rtcan_capture *capture;
+#endif
+
+#ifdef CONFIG_XENO_DRIVERS_CAN_LATENCY_TRACE
+    /* First delivery since the reader went to sleep and its device */
+    nanosecs_abs_t      trace_wake;
+    int                 trace_ifindex;
 #endif
 };
 
@@ -195,12 +392,9 @@ static inline struct rtdm_dev_context *rtcan_socket_context(
 	(void *)(&((struct rtdm_dev_context *)NULL)->dev_private));
 }
 
-/* Spinlock protecting the ring buffers and the timeouts of all
- * rtcan_sockets */
-extern rtdm_lock_t rtcan_socket_lock;
 extern struct list_head rtcan_socket_list;
 
-extern void rtcan_socket_init(struct rtdm_dev_context *context);
+extern int rtcan_socket_init(struct rtdm_dev_context *context);
 extern void rtcan_socket_cleanup(struct rtdm_dev_context *context);
 
 
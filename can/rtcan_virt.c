@@ -23,6 +23,7 @@
 #include <rtdm/rtcan.h>
 #include "rtcan_dev.h"
 #include "rtcan_raw.h"
+#include "rtcan_ext.h"
 
 #define RTCAN_DEV_NAME          "rtcan%d"
 #define RTCAN_DRV_NAME          "VIRT"
@@ -30,6 +31,9 @@
 
 #define VIRT_TX_BUFS            1
 
+/* Clock the bit timing is calculated for, as of an SJA1000 */
+#define VIRT_CAN_SYS_CLOCK      8000000
+
 static char *virt_ctlr_name  = "<virtual>";
 static char *virt_board_name = "<virtual>";
 
@@ -42,67 +46,540 @@ static unsigned int devices = 2;
 module_param(devices, uint, 0400);
 MODULE_PARM_DESC(devices, "Number of devices on the virtual bus");
 
+static unsigned int bitrate;
+
+module_param(bitrate, uint, 0400);
+MODULE_PARM_DESC(bitrate, "Bitrate of the virtual bus, 0 to deliver frames "
+		 "instantly (default)");
+
+static unsigned int load;
+
+module_param(load, uint, 0400);
+MODULE_PARM_DESC(load, "Background traffic in 1/10 % of the bitrate "
+		 "(default 0)");
+
+static unsigned int load_id = CAN_SFF_MASK;
+
+module_param(load_id, uint, 0400);
+MODULE_PARM_DESC(load_id, "CAN ID of the background frames (default 0x7ff)");
+
+static unsigned int load_dlc = 8;
+
+module_param(load_dlc, uint, 0400);
+MODULE_PARM_DESC(load_dlc, "Payload length of the background frames "
+		 "(default 8)");
+
 static struct rtcan_device *rtcan_virt_devs[RTCAN_MAX_VIRT_DEVS];
 
+#ifndef CONFIG_XENO_DRIVERS_CAN_CALC_BITTIME_OLD
+static struct can_bittiming_const virt_bittiming_const = {
+	.name = "virt",
+	.tseg1_min = 1,
+	.tseg1_max = 16,
+	.tseg2_min = 1,
+	.tseg2_max = 8,
+	.sjw_max = 4,
+	.brp_min = 1,
+	.brp_max = 64,
+	.brp_inc = 1,
+};
+
+static struct can_bittiming_const virt_data_bittiming_const = {
+	.name = "virt",
+	.tseg1_min = 1,
+	.tseg1_max = 16,
+	.tseg2_min = 1,
+	.tseg2_max = 8,
+	.sjw_max = 4,
+	.brp_min = 1,
+	.brp_max = 32,
+	.brp_inc = 1,
+};
+#endif
+
+/* Slot of the background traffic, after those of the devices */
+#define RTCAN_VIRT_LOAD_SLOT    RTCAN_MAX_VIRT_DEVS
+
+/* A frame waiting for the bus or being transmitted */
+struct rtcan_virt_slot {
+	struct rtcan_device *dev;	/* NULL for the background traffic */
+	can_frame_t frame;
+	unsigned int bitrate;
+	int pending;
+};
 
-static int rtcan_virt_start_xmit(struct rtcan_device *tx_dev,
-				 can_frame_t *tx_frame)
+/*
+ * State of the timed bus. Taken nested inside the device_lock of the
+ * sender, all device_locks in index order when reconfigured.
+ */
+static struct {
+	rtdm_lock_t lock;
+
+	/* Slot whose frame is on the wire, -1 while the bus is idle */
+	int cur;
+
+	/* Expires at the end of the frame on the wire */
+	rtdm_timer_t wire_timer;
+
+	/* Queues a background frame every period */
+	rtdm_timer_t load_timer;
+
+	unsigned int bitrate;
+	unsigned int load;
+	can_frame_t load_frame;
+	u32 load_frames;
+	u32 load_skipped;
+
+	struct rtcan_virt_slot slots[RTCAN_MAX_VIRT_DEVS + 1];
+} virt_bus;
+
+
+/* Bit stream of a frame from SOF to the end of the CRC sequence */
+struct rtcan_virt_bits {
+	unsigned int count;	/* bits including stuff bits */
+	unsigned int crc;
+	int last;		/* level of the previous bit */
+	int run;		/* consecutive bits of that level */
+};
+
+static void rtcan_virt_put_bits(struct rtcan_virt_bits *b, u32 val, int n,
+				int crc)
+{
+	int bit;
+
+	while (n--) {
+		bit = (val >> n) & 1;
+		if (crc) {
+			int crc_nxt = bit ^ (b->crc >> 14);
+
+			b->crc = (b->crc << 1) & 0x7fff;
+			if (crc_nxt)
+				b->crc ^= 0x4599;
+		}
+
+		b->count++;
+		if (bit != b->last) {
+			b->last = bit;
+			b->run = 1;
+		} else if (++b->run == 5) {
+			/* Stuff bit of the opposite level */
+			b->count++;
+			b->last = !bit;
+			b->run = 1;
+		}
+	}
+}
+
+/* Length of @frame on the bus in bits, including the intermission */
+static unsigned int rtcan_virt_frame_bits(can_frame_t *frame)
+{
+	struct rtcan_virt_bits b = { .last = -1 };
+	int rtr = !!(frame->can_id & CAN_RTR_FLAG);
+	int len = rtr ? 0 : min_t(int, frame->can_dlc, 8);
+	u32 id;
+	int i;
+
+	rtcan_virt_put_bits(&b, 0, 1, 1);			/* SOF */
+	if (frame->can_id & CAN_EFF_FLAG) {
+		id = frame->can_id & CAN_EFF_MASK;
+		rtcan_virt_put_bits(&b, id >> 18, 11, 1);
+		rtcan_virt_put_bits(&b, 3, 2, 1);		/* SRR, IDE */
+		rtcan_virt_put_bits(&b, id & 0x3ffff, 18, 1);
+		rtcan_virt_put_bits(&b, rtr << 2, 3, 1);	/* RTR, r1, r0 */
+	} else {
+		rtcan_virt_put_bits(&b, frame->can_id & CAN_SFF_MASK, 11, 1);
+		rtcan_virt_put_bits(&b, rtr << 2, 3, 1);	/* RTR, IDE, r0 */
+	}
+	rtcan_virt_put_bits(&b, frame->can_dlc & 0xf, 4, 1);
+	for (i = 0; i < len; i++)
+		rtcan_virt_put_bits(&b, frame->data[i], 8, 1);
+	rtcan_virt_put_bits(&b, b.crc, 15, 0);
+
+	/* CRC delimiter, ACK slot and delimiter, EOF, intermission */
+	return b.count + 1 + 2 + 7 + 3;
+}
+
+static nanosecs_rel_t rtcan_virt_frame_time(can_frame_t *frame,
+					    unsigned int rate)
+{
+	u64 ns = (u64)rtcan_virt_frame_bits(frame) * 1000000000;
+
+	do_div(ns, rate);
+	return ns;
+}
+
+/*
+ * The arbitration field as it appears on the bus, dominant bits being
+ * 0: the lowest key wins. A standard frame beats an extended one with
+ * the same base ID by its dominant IDE bit, a data frame a remote one.
+ */
+static u32 rtcan_virt_arb_key(can_frame_t *frame)
+{
+	u32 rtr = !!(frame->can_id & CAN_RTR_FLAG);
+	u32 id;
+
+	if (frame->can_id & CAN_EFF_FLAG) {
+		id = frame->can_id & CAN_EFF_MASK;
+		/* Base ID, SRR, IDE, extended ID, RTR */
+		return ((id >> 18) << 21) | (3 << 19) |
+			((id & 0x3ffff) << 1) | rtr;
+	}
+
+	/* ID, RTR, IDE */
+	return ((frame->can_id & CAN_SFF_MASK) << 21) | (rtr << 20);
+}
+
+/*
+ * Put the winner among the pending frames on the wire. Called with
+ * virt_bus.lock held while the bus is idle.
+ */
+static void rtcan_virt_arbitrate(int in_handler)
+{
+	struct rtcan_virt_slot *slot;
+	nanosecs_rel_t duration;
+	u32 key, best_key = 0;
+	int i, best = -1;
+
+	for (i = 0; i <= RTCAN_VIRT_LOAD_SLOT; i++) {
+		slot = &virt_bus.slots[i];
+		if (!slot->pending)
+			continue;
+		key = rtcan_virt_arb_key(&slot->frame);
+		if (best < 0 || key < best_key) {
+			best = i;
+			best_key = key;
+		}
+	}
+
+	if (best < 0)
+		return;
+
+	slot = &virt_bus.slots[best];
+	duration = rtcan_virt_frame_time(&slot->frame, slot->bitrate);
+	virt_bus.cur = best;
+	if (in_handler)
+		rtdm_timer_start_in_handler(&virt_bus.wire_timer, duration, 0,
+					    RTDM_TIMERMODE_RELATIVE);
+	else
+		rtdm_timer_start(&virt_bus.wire_timer, duration, 0,
+				 RTDM_TIMERMODE_RELATIVE);
+}
+
+
+/*
+ * Pass @skb to all other devices on the virtual bus and the echo from
+ * @mailbox to the sockets of @tx_dev (NULL for the background traffic).
+ */
+static void rtcan_virt_deliver_skb(struct rtcan_device *tx_dev,
+				   struct rtcan_skb *skb, int mailbox)
 {
 	int i;
 	struct rtcan_device *rx_dev;
-	struct rtcan_skb skb;
-	struct rtcan_rb_frame *rx_frame = &skb.rb_frame;
 	rtdm_lockctx_t lock_ctx;
 
-	/* we can transmit immediately again */
-	rtdm_sem_up(&tx_dev->tx_sem);
+	skb->timestamp = rtdm_clock_read();
+	rtcan_trace_irq(skb, skb->timestamp);
+	rtcan_trace_hw(skb);
 
-	skb.rb_frame_size = EMPTY_RB_FRAME_SIZE;
+	/* Deliver to all other devices on the virtual bus */
+	for (i = 0; i < devices; i++) {
+		rx_dev = rtcan_virt_devs[i];
+		if (rx_dev->state != CAN_STATE_ACTIVE)
+			continue;
+
+		rtdm_lock_get_irqsave(&rx_dev->recv_list_lock, lock_ctx);
+		if (tx_dev != rx_dev) {
+			skb->rb_frame.can_ifindex = rx_dev->ifindex;
+			rtcan_rcv(rx_dev, skb);
+		} else if (rtcan_loopback_pending(tx_dev, mailbox))
+			rtcan_loopback(tx_dev, mailbox);
+		rtdm_lock_put_irqrestore(&rx_dev->recv_list_lock, lock_ctx);
+	}
+}
+
+static void rtcan_virt_deliver(struct rtcan_device *tx_dev,
+			       can_frame_t *tx_frame, int mailbox)
+{
+	struct rtcan_skb skb;
+	struct rtcan_rb_frame *rx_frame = &skb.rb_frame;
 
+	skb.rb_frame_size = EMPTY_RB_FRAME_SIZE;
 	rx_frame->can_dlc = tx_frame->can_dlc;
 	rx_frame->can_id  = tx_frame->can_id;
 
+	/* a DLC of 9 to 15 still means 8 data bytes */
 	if (!(tx_frame->can_id & CAN_RTR_FLAG)) {
-		memcpy(rx_frame->data, tx_frame->data, tx_frame->can_dlc);
-		skb.rb_frame_size += tx_frame->can_dlc;
+		int len = min_t(int, tx_frame->can_dlc, 8);
+
+		memcpy(rx_frame->data, tx_frame->data, len);
+		skb.rb_frame_size += len;
 	}
 
-	rtdm_lock_get_irqsave(&rtcan_recv_list_lock, lock_ctx);
-	rtdm_lock_get(&rtcan_socket_lock);
+	rtcan_virt_deliver_skb(tx_dev, &skb, mailbox);
+}
 
 
-	/* Deliver to all other devices on the virtual bus */
-	for (i = 0; i < devices; i++) {
-		rx_dev = rtcan_virt_devs[i];
-		if (rx_dev->state == CAN_STATE_ACTIVE) {
-			if (tx_dev != rx_dev) {
-				rx_frame->can_ifindex = rx_dev->ifindex;
-				rtcan_rcv(rx_dev, &skb);
-			} else if (rtcan_loopback_pending(tx_dev))
-				rtcan_loopback(tx_dev);
+/* End of the frame on the wire: the TX-done interrupt of the bus */
+static void rtcan_virt_frame_done(rtdm_timer_t *timer)
+{
+	struct rtcan_virt_slot *slot = &virt_bus.slots[virt_bus.cur];
+	struct rtcan_device *dev = slot->dev;
+
+	if (dev) {
+		rtdm_lock_get(&dev->device_lock);
+
+		rtcan_virt_deliver(dev, &slot->frame, 0);
+
+		/* A stopped device gets its slot back when started */
+		if (dev->state == CAN_STATE_ACTIVE) {
+			rtcan_tx_done(dev, 0);
+			rtcan_dev_tx_release(dev);
 		}
+	} else
+		rtcan_virt_deliver(NULL, &slot->frame, 0);
+
+	rtdm_lock_get(&virt_bus.lock);
+	slot->pending = 0;
+	virt_bus.cur = -1;
+	rtcan_virt_arbitrate(1);
+	rtdm_lock_put(&virt_bus.lock);
+
+	if (dev)
+		rtdm_lock_put(&dev->device_lock);
+}
+
+/* Queue the next background frame, unless the last one is still waiting */
+static void rtcan_virt_load_tick(rtdm_timer_t *timer)
+{
+	struct rtcan_virt_slot *slot = &virt_bus.slots[RTCAN_VIRT_LOAD_SLOT];
+
+	rtdm_lock_get(&virt_bus.lock);
+
+	if (slot->pending)
+		virt_bus.load_skipped++;
+	else {
+		slot->frame = virt_bus.load_frame;
+		slot->bitrate = virt_bus.bitrate;
+		/* The payload counts the frames */
+		memcpy(slot->frame.data, &virt_bus.load_frames,
+		       min_t(unsigned int, slot->frame.can_dlc & 0xf,
+			     sizeof(virt_bus.load_frames)));
+		slot->pending = 1;
+		virt_bus.load_frames++;
+
+		if (virt_bus.cur < 0)
+			rtcan_virt_arbitrate(1);
+	}
+
+	rtdm_lock_put(&virt_bus.lock);
+}
+
+
+static int rtcan_virt_start_xmit(struct rtcan_device *tx_dev,
+				 can_frame_t *tx_frame)
+{
+	struct rtcan_virt_slot *slot = tx_dev->priv;
+
+	if (!virt_bus.bitrate) {
+		/* we can transmit immediately again */
+		rtcan_dev_tx_release(tx_dev);
+
+		rtcan_virt_deliver(tx_dev, tx_frame, RTCAN_TX_SUBMITTING);
+		return 0;
 	}
-	rtdm_lock_put(&rtcan_socket_lock);
-	rtdm_lock_put_irqrestore(&rtcan_recv_list_lock, lock_ctx);
 
+	/* The frame waits for the bus, its slot is freed at its end */
+	rtdm_lock_get(&virt_bus.lock);
+
+	slot->frame = *tx_frame;
+	slot->bitrate = virt_bus.bitrate;
+	if (tx_dev->baudrate && tx_dev->baudrate != CAN_BAUDRATE_UNKNOWN)
+		slot->bitrate = tx_dev->baudrate;
+	slot->pending = 1;
+
+	if (virt_bus.cur < 0)
+		rtcan_virt_arbitrate(0);
+
+	rtdm_lock_put(&virt_bus.lock);
+
+	return 0;
+}
+
+
+/*
+ * CAN FD frames are only passed on by the instant bus, the timed one
+ * models classic frames only.
+ */
+static int rtcan_virt_start_xmit_fd(struct rtcan_device *tx_dev,
+				    struct canfd_frame *tx_frame)
+{
+	struct rtcan_skb skb;
+	struct rtcan_rb_frame *rx_frame = &skb.rb_frame;
+
+	/* we can transmit immediately again, or not at all */
+	rtcan_dev_tx_release(tx_dev);
+
+	if (virt_bus.bitrate)
+		return -EOPNOTSUPP;
+
+	rx_frame->can_id  = tx_frame->can_id;
+	rx_frame->can_dlc = rtcan_fd_len2dlc(tx_frame->len) | RTCAN_FD_FRAME;
+	if (tx_frame->flags & CANFD_BRS)
+		rx_frame->can_dlc |= RTCAN_FD_BRS;
+	if (tx_frame->flags & CANFD_ESI)
+		rx_frame->can_dlc |= RTCAN_FD_ESI;
+
+	memcpy(rx_frame->data, tx_frame->data, tx_frame->len);
+	skb.rb_frame_size = EMPTY_RB_FRAME_SIZE + tx_frame->len;
+
+	rtcan_virt_deliver_skb(tx_dev, &skb, RTCAN_TX_SUBMITTING);
+	return 0;
+}
+
+
+/* Any bit timing goes, the bitrate just paces the device's frames */
+static int rtcan_virt_set_bit_time(struct rtcan_device *dev,
+				   struct can_bittime *bit_time,
+				   rtdm_lockctx_t *lock_ctx)
+{
+	return 0;
+}
+
+/* The data phase is not modelled at all */
+static int rtcan_virt_set_data_bit_time(struct rtcan_device *dev,
+					struct can_bittime_std *bit_time,
+					rtdm_lockctx_t *lock_ctx)
+{
 	return 0;
 }
 
 
+static void rtcan_virt_get_config(struct rtcan_virt_config *cfg)
+{
+	rtdm_lockctx_t lock_ctx;
+
+	rtdm_lock_get_irqsave(&virt_bus.lock, lock_ctx);
+
+	cfg->bitrate = virt_bus.bitrate;
+	cfg->load = virt_bus.load;
+	cfg->load_id = virt_bus.load_frame.can_id;
+	cfg->load_dlc = virt_bus.load_frame.can_dlc;
+	cfg->load_frames = virt_bus.load_frames;
+	cfg->load_skipped = virt_bus.load_skipped;
+
+	rtdm_lock_put_irqrestore(&virt_bus.lock, lock_ctx);
+}
+
+static int rtcan_virt_set_config(struct rtcan_virt_config *cfg)
+{
+	u32 id = cfg->load_id & ~(CAN_EFF_FLAG | CAN_RTR_FLAG);
+	nanosecs_rel_t period = 0;
+	rtdm_lockctx_t lock_ctx;
+	int i, ret = 0;
+	u64 ns;
+
+	if (cfg->load > 1000 || (cfg->load && !cfg->bitrate) ||
+	    cfg->load_dlc > 8 ||
+	    id > ((cfg->load_id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK))
+		return -EINVAL;
+
+	/* Keep the devices from being started meanwhile */
+	rtdm_lock_get_irqsave(&rtcan_virt_devs[0]->device_lock, lock_ctx);
+	for (i = 1; i < devices; i++)
+		rtdm_lock_get(&rtcan_virt_devs[i]->device_lock);
+	rtdm_lock_get(&virt_bus.lock);
+
+	if (cfg->bitrate != virt_bus.bitrate) {
+		for (i = 0; i < devices; i++)
+			if (rtcan_virt_devs[i]->state == CAN_STATE_ACTIVE) {
+				ret = -EBUSY;
+				goto out;
+			}
+
+		virt_bus.bitrate = cfg->bitrate;
+		for (i = 0; i < devices; i++)
+			rtcan_virt_devs[i]->baudrate =
+				cfg->bitrate ? : CAN_BAUDRATE_UNKNOWN;
+	}
+
+	memset(&virt_bus.load_frame, 0, sizeof(virt_bus.load_frame));
+	virt_bus.load_frame.can_id = cfg->load_id;
+	virt_bus.load_frame.can_dlc = cfg->load_dlc;
+	virt_bus.load = cfg->load;
+
+	if (cfg->load) {
+		/* One frame per its time on the bus divided by the load */
+		ns = (u64)rtcan_virt_frame_bits(&virt_bus.load_frame) *
+			1000000000000ULL;
+		do_div(ns, cfg->bitrate);
+		do_div(ns, cfg->load);
+		period = ns;
+	}
+
+ out:
+	rtdm_lock_put(&virt_bus.lock);
+	for (i = devices - 1; i > 0; i--)
+		rtdm_lock_put(&rtcan_virt_devs[i]->device_lock);
+	rtdm_lock_put_irqrestore(&rtcan_virt_devs[0]->device_lock, lock_ctx);
+
+	if (ret)
+		return ret;
+
+	if (period)
+		rtdm_timer_start(&virt_bus.load_timer, period, period,
+				 RTDM_TIMERMODE_RELATIVE);
+	else
+		rtdm_timer_stop(&virt_bus.load_timer);
+
+	return 0;
+}
+
+static int rtcan_virt_ioctl(struct rtcan_device *dev, int request, void *arg)
+{
+	switch (request) {
+	case RTCAN_RTIOC_VIRT_GET_CONFIG:
+		rtcan_virt_get_config(arg);
+		return 0;
+
+	case RTCAN_RTIOC_VIRT_SET_CONFIG:
+		return rtcan_virt_set_config(arg);
+
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+
 static int rtcan_virt_set_mode(struct rtcan_device *dev, can_mode_t mode,
 			       rtdm_lockctx_t *lock_ctx)
 {
+	rtdm_lockctx_t bus_ctx;
 	int err = 0;
 
 	switch (mode) {
 	case CAN_MODE_STOP:
 		dev->state = CAN_STATE_STOPPED;
 		/* Wake up waiting senders */
-		rtdm_sem_destroy(&dev->tx_sem);
+		rtcan_dev_tx_close(dev);
+
+		/* Withdraw a frame waiting for the bus. One already on the
+		 * wire is completed. */
+		rtdm_lock_get_irqsave(&virt_bus.lock, bus_ctx);
+		if ((virt_bus.cur < 0 ||
+		     virt_bus.slots[virt_bus.cur].dev != dev) &&
+		    ((struct rtcan_virt_slot *)dev->priv)->pending) {
+			((struct rtcan_virt_slot *)dev->priv)->pending = 0;
+			rtcan_tx_forget(dev, 0);
+		}
+		rtdm_lock_put_irqrestore(&virt_bus.lock, bus_ctx);
 		break;
 
 	case CAN_MODE_START:
-		rtdm_sem_init(&dev->tx_sem, VIRT_TX_BUFS);
+		rtdm_lock_get_irqsave(&virt_bus.lock, bus_ctx);
+		rtcan_dev_tx_open(dev,
+				  ((struct rtcan_virt_slot *)dev->priv)->pending ?
+				  0 : VIRT_TX_BUFS);
+		rtdm_lock_put_irqrestore(&virt_bus.lock, bus_ctx);
 		dev->state = CAN_STATE_ACTIVE;
 		break;
 
@@ -125,12 +602,25 @@ static int __init rtcan_virt_init_one(int idx)
 	dev->ctrl_name = virt_ctlr_name;
 	dev->board_name = virt_board_name;
 
+	virt_bus.slots[idx].dev = dev;
+	dev->priv = &virt_bus.slots[idx];
+	dev->bus = &virt_bus;
+
 	rtcan_virt_set_mode(dev, CAN_MODE_STOP, NULL);
 
 	strncpy(dev->name, RTCAN_DEV_NAME, IFNAMSIZ);
 
+	dev->can_sys_clock = VIRT_CAN_SYS_CLOCK;
+#ifndef CONFIG_XENO_DRIVERS_CAN_CALC_BITTIME_OLD
+	dev->bittiming_const = &virt_bittiming_const;
+	dev->data_bittiming_const = &virt_data_bittiming_const;
+#endif
+
 	dev->hard_start_xmit = rtcan_virt_start_xmit;
+	dev->hard_start_xmit_fd = rtcan_virt_start_xmit_fd;
 	dev->do_set_mode = rtcan_virt_set_mode;
+	dev->do_set_bit_time = rtcan_virt_set_bit_time;
+	dev->do_set_data_bit_time = rtcan_virt_set_data_bit_time;
 
 	/* Register RTDM device */
 	err = rtcan_dev_register(dev);
@@ -155,21 +645,55 @@ static int __init rtcan_virt_init_one(int idx)
 /** Init module */
 static int __init rtcan_virt_init(void)
 {
+	struct rtcan_virt_config cfg = {
+		.bitrate = bitrate,
+		.load = load,
+		.load_id = load_id,
+		.load_dlc = load_dlc,
+	};
 	int i, err = 0;
 
+	if (devices > RTCAN_MAX_VIRT_DEVS)
+		return -EINVAL;
+
+	rtdm_lock_init(&virt_bus.lock);
+	virt_bus.cur = -1;
+	rtdm_timer_init(&virt_bus.wire_timer, rtcan_virt_frame_done,
+			"rtcan_virt_bus");
+	rtdm_timer_init(&virt_bus.load_timer, rtcan_virt_load_tick,
+			"rtcan_virt_load");
+
 	for (i = 0; i < devices; i++) {
 		err = rtcan_virt_init_one(i);
-		if (err) {
-			while (--i >= 0) {
-				struct rtcan_device *dev = rtcan_virt_devs[i];
+		if (err)
+			goto error_out;
+	}
 
-				rtcan_dev_unregister(dev);
-				rtcan_dev_free(dev);
-			}
-			break;
+	if (devices) {
+		err = rtcan_virt_set_config(&cfg);
+		if (err) {
+			printk(KERN_ERR "%s: invalid bitrate or load "
+			       "parameters\n", RTCAN_DRV_NAME);
+			goto error_out;
 		}
 	}
 
+	/* Reconfiguration needs all devices */
+	for (i = 0; i < devices; i++)
+		rtcan_virt_devs[i]->do_ioctl = rtcan_virt_ioctl;
+
+	return 0;
+
+ error_out:
+	while (--i >= 0) {
+		struct rtcan_device *dev = rtcan_virt_devs[i];
+
+		rtcan_dev_unregister(dev);
+		rtcan_dev_free(dev);
+	}
+	rtdm_timer_destroy(&virt_bus.load_timer);
+	rtdm_timer_destroy(&virt_bus.wire_timer);
+
 	return err;
 }
 
@@ -180,12 +704,19 @@ static void __exit rtcan_virt_exit(void)
 	int i;
 	struct rtcan_device *dev;
 
+	rtdm_timer_destroy(&virt_bus.load_timer);
+
+	for (i = 0; i < devices; i++)
+		rtcan_virt_set_mode(rtcan_virt_devs[i], CAN_MODE_STOP, NULL);
+
+	/* No more frames on the wire */
+	rtdm_timer_destroy(&virt_bus.wire_timer);
+
 	for (i = 0; i < devices; i++) {
 		dev = rtcan_virt_devs[i];
 
 		printk("Unloading %s device %s\n", RTCAN_DRV_NAME, dev->name);
 
-		rtcan_virt_set_mode(dev, CAN_MODE_STOP, NULL);
 		rtcan_dev_unregister(dev);
 		rtcan_dev_free(dev);
 	}
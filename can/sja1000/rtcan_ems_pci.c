@@ -110,6 +110,19 @@ static u8 rtcan_ems_pci_read_reg(struct rtcan_device *dev, int port)
 	return readb(board->base_addr + (port * EMS_PCI_PORT_BYTES));
 }
 
+/* The registers are EMS_PCI_PORT_BYTES apart, so they are read one by one */
+static void rtcan_ems_pci_read_regs(struct rtcan_device *dev, int port,
+				    u8 *buf, int count)
+{
+	struct rtcan_ems_pci *board = (struct rtcan_ems_pci *)dev->board_priv;
+	volatile void __iomem *addr =
+		board->base_addr + (port * EMS_PCI_PORT_BYTES);
+	int i;
+
+	for (i = 0; i < count; i++)
+		buf[i] = readb(addr + i * EMS_PCI_PORT_BYTES);
+}
+
 static void rtcan_ems_pci_write_reg(struct rtcan_device *dev, int port, u8 data)
 {
 	struct rtcan_ems_pci *board = (struct rtcan_ems_pci *)dev->board_priv;
@@ -208,6 +221,7 @@ static int rtcan_ems_pci_add_chan(struct pci_dev *pdev, int channel,
 	dev->board_name = ems_pci_board_name;
 
 	chip->read_reg = rtcan_ems_pci_read_reg;
+	chip->read_regs = rtcan_ems_pci_read_regs;
 	chip->write_reg = rtcan_ems_pci_write_reg;
 	chip->irq_ack = rtcan_ems_pci_irq_ack;
 
@@ -86,6 +86,13 @@ static u8 rtcan_mem_readreg(struct rtcan_device *dev, int reg)
 	return readb(board->vmem + reg);
 }
 
+static void rtcan_mem_readregs(struct rtcan_device *dev, int reg, u8 *buf,
+			       int count)
+{
+	struct rtcan_mem *board = (struct rtcan_mem *)dev->board_priv;
+	memcpy_fromio(buf, board->vmem + reg, count);
+}
+
 static void rtcan_mem_writereg(struct rtcan_device *dev, int reg, u8 val)
 {
 	struct rtcan_mem *board = (struct rtcan_mem *)dev->board_priv;
@@ -111,6 +118,7 @@ int __init rtcan_mem_init_one(int idx)
 	chip->irq_num = irq[idx];
 	chip->irq_flags = RTDM_IRQTYPE_SHARED;
 	chip->read_reg = rtcan_mem_readreg;
+	chip->read_regs = rtcan_mem_readregs;
 	chip->write_reg = rtcan_mem_writereg;
 
 	if (!request_mem_region(mem[idx], RTCAN_MEM_RANGE, RTCAN_DRV_NAME)) {
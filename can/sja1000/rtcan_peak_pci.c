@@ -101,6 +101,19 @@ static u8 rtcan_peak_pci_read_reg(struct rtcan_device *dev, int port)
     return readb(board->base_addr + ((unsigned long)port << 2));
 }
 
+/* The registers are 4 bytes apart, so they are read one by one */
+static void rtcan_peak_pci_read_regs(struct rtcan_device *dev, int port,
+				     u8 *buf, int count)
+{
+    struct rtcan_peak_pci *board = (struct rtcan_peak_pci *)dev->board_priv;
+    volatile void __iomem *addr =
+	board->base_addr + ((unsigned long)port << 2);
+    int i;
+
+    for (i = 0; i < count; i++)
+	buf[i] = readb(addr + (i << 2));
+}
+
 static void rtcan_peak_pci_write_reg(struct rtcan_device *dev, int port, u8 data)
 {
     struct rtcan_peak_pci *board = (struct rtcan_peak_pci *)dev->board_priv;
@@ -225,6 +238,7 @@ static int rtcan_peak_pci_add_chan(struct pci_dev *pdev, int channel,
     dev->board_name = peak_pci_board_name;
 
     chip->read_reg = rtcan_peak_pci_read_reg;
+    chip->read_regs = rtcan_peak_pci_read_regs;
     chip->write_reg = rtcan_peak_pci_write_reg;
     chip->irq_ack = rtcan_peak_pci_irq_ack;
 
@@ -293,6 +293,13 @@ static u8 plx_pci_read_reg(struct rtcan_device *dev, int port)
 	return ioread8((void* __iomem)dev->base_addr + port);
 }
 
+/* Only for memory BARs, the chip's registers are mapped contiguously */
+static void plx_pci_read_regs(struct rtcan_device *dev, int port, u8 *buf,
+			      int count)
+{
+	memcpy_fromio(buf, (void* __iomem)dev->base_addr + port, count);
+}
+
 static void plx_pci_write_reg(struct rtcan_device *dev, int port, u8 val)
 {
 	iowrite8(val, (void* __iomem)dev->base_addr + port);
@@ -528,6 +535,8 @@ static int plx_pci_add_card(struct pci_dev *pdev,
 		dev->base_addr = (unsigned long)(addr + cm->offset);
 		chip->read_reg = plx_pci_read_reg;
 		chip->write_reg = plx_pci_write_reg;
+		if (pci_resource_flags(pdev, cm->bar) & IORESOURCE_MEM)
+			chip->read_regs = plx_pci_read_regs;
 
 		/* Check if channel is present */
 		if (plx_pci_check_sja1000(dev)) {
@@ -69,6 +69,10 @@
 				    SJA_IER_EPIE | SJA_IER_BEIE | \
 				    SJA_IER_ALIE | SJA_IER_DOIE
 
+/* Frames the 64 byte RX FIFO can hold at most, 3 bytes each for
+ * standard RTR frames */
+#define SJA_RX_FIFO_FRAMES          21
+
 static char *sja_ctrl_name = "SJA1000";
 
 #define STATE_OPERATING(state) \
@@ -83,6 +87,13 @@ MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("RT-Socket-CAN driver for SJA1000");
 MODULE_SUPPORTED_DEVICE("SJA1000 CAN controller");
 
+static int hw_filter;
+module_param(hw_filter, int, 0444);
+MODULE_PARM_DESC(hw_filter, "Program the acceptance filter from the bound "
+		 "sockets' filters when the controller is started (default 0). "
+		 "Filters changed while it is running take effect with the "
+		 "next start.");
+
 #ifndef CONFIG_XENO_DRIVERS_CAN_CALC_BITTIME_OLD
 static struct can_bittiming_const sja1000_bittiming_const = {
 	.name = "sja1000",
@@ -97,14 +108,30 @@ static struct can_bittiming_const sja1000_bittiming_const = {
 };
 #endif
 
+/* Read count consecutive registers, in one go if the board can */
+static inline void rtcan_sja_read_regs(struct rtcan_device *dev,
+				       struct rtcan_sja1000 *chip, int off,
+				       u8 *buf, int count)
+{
+    int i;
+
+    if (chip->read_regs)
+	chip->read_regs(dev, off, buf, count);
+    else
+	for (i = 0; i < count; i++)
+	    buf[i] = chip->read_reg(dev, off + i);
+}
+
 static inline void rtcan_sja_rx_interrupt(struct rtcan_device *dev,
 					  struct rtcan_skb *skb)
 {
-    int i;
     /* "Real" size of the payload */
     u8 size;
     /* Content of frame information register */
     u8 fir;
+    /* ID and data registers, read as a block */
+    u8 regs[4 + 8];
+    int id_size;
     /* Ring buffer frame within skb */
     struct rtcan_rb_frame *frame = &skb->rb_frame;
     struct rtcan_sja1000 *chip = dev->priv;
@@ -117,49 +144,36 @@ static inline void rtcan_sja_rx_interrupt(struct rtcan_device *dev,
 
     /* If DLC exceeds 8 bytes adjust it to 8 (for the payload size) */
     size = (frame->can_dlc > 8) ? 8 : frame->can_dlc;
+    if (fir & SJA_FIR_RTR)
+	size = 0;
 
+    /* The data registers follow the ID registers directly */
+    id_size = (fir & SJA_FIR_EFF) ? 4 : 2;
+    rtcan_sja_read_regs(dev, chip, SJA_ID1, regs, id_size + size);
 
     if (fir & SJA_FIR_EFF) {
 	/* Extended frame */
 	frame->can_id = CAN_EFF_FLAG;
-
-	/* Read ID */
-	frame->can_id |= chip->read_reg(dev, SJA_ID1) << 21;
-	frame->can_id |= chip->read_reg(dev, SJA_ID2) << 13;
-	frame->can_id |= chip->read_reg(dev, SJA_ID3) << 5;
-	frame->can_id |= chip->read_reg(dev, SJA_ID4) >> 3;
-
-	if (!(fir & SJA_FIR_RTR)) {
-	    /* No RTR, read data bytes */
-	    for (i = 0; i < size; i++)
-		frame->data[i] = chip->read_reg(dev,
-						SJA_DATA_EFF(i));
-	}
-
+	frame->can_id |= regs[0] << 21;
+	frame->can_id |= regs[1] << 13;
+	frame->can_id |= regs[2] << 5;
+	frame->can_id |= regs[3] >> 3;
     } else {
 	/* Standard frame */
-
-	/* Read ID */
-	frame->can_id  = chip->read_reg(dev, SJA_ID1) << 3;
-	frame->can_id |= chip->read_reg(dev, SJA_ID2) >> 5;
-
-	if (!(fir & SJA_FIR_RTR)) {
-	    /* No RTR, read data bytes */
-	    for (i = 0; i < size; i++)
-		frame->data[i] = chip->read_reg(dev, SJA_DATA_SFF(i));
-	}
+	frame->can_id  = regs[0] << 3;
+	frame->can_id |= regs[1] >> 5;
     }
 
+    memcpy(frame->data, regs + id_size, size);
+
     /* Release Receive Buffer */
     chip->write_reg(dev, SJA_CMR, SJA_CMR_RRB);
 
 
     /* RTR? */
-    if (fir & SJA_FIR_RTR) {
+    if (fir & SJA_FIR_RTR)
 	frame->can_id |= CAN_RTR_FLAG;
-	skb->rb_frame_size = EMPTY_RB_FRAME_SIZE;
-    } else
-	skb->rb_frame_size = EMPTY_RB_FRAME_SIZE + size;
+    skb->rb_frame_size = EMPTY_RB_FRAME_SIZE + size;
 
     /* Store the interface index */
     frame->can_ifindex = dev->ifindex;
@@ -246,7 +260,7 @@ static inline void rtcan_sja_err_interrupt(struct rtcan_device *dev,
 	       recovery) */
 	    chip->write_reg(dev, SJA_IER, SJA_IER_EIE);
 	    /* Wake up waiting senders */
-	    rtdm_sem_destroy(&dev->tx_sem);
+	    rtcan_dev_tx_close(dev);
 	}
 
 	/* Test error status (error warning limit) */
@@ -291,13 +305,22 @@ static int rtcan_sja_interrupt(rtdm_irq_t *irq_handle)
     dev = (struct rtcan_device *)rtdm_irq_get_arg(irq_handle, void);
     chip = (struct rtcan_sja1000 *)dev->priv;
 
+    /* Reception time of the frames, taken at IRQ entry */
+    skb.timestamp = rtdm_clock_read();
+    rtcan_trace_irq(&skb, skb.timestamp);
+
     /* Take spinlock protecting HW register access and device structures. */
     rtdm_lock_get(&dev->device_lock);
 
     /* Loop as long as the device reports an event */
     while ((irq_source = chip->read_reg(dev, SJA_IR))) {
 	ret = RTDM_IRQ_HANDLED;
-	irq_count++;
+
+	/* Frames following the first one arrived while we were busy */
+	if (irq_count++) {
+	    skb.timestamp = rtdm_clock_read();
+	    rtcan_trace_irq(&skb, skb.timestamp);
+	}
 
 	/* Now look up which interrupts appeared */
 
@@ -315,8 +338,7 @@ static int rtcan_sja_interrupt(rtdm_irq_t *irq_handle)
 
 		if (recv_lock_free) {
 		    recv_lock_free = 0;
-		    rtdm_lock_get(&rtcan_recv_list_lock);
-		    rtdm_lock_get(&rtcan_socket_lock);
+		    rtdm_lock_get(&dev->recv_list_lock);
 		}
 		/* Pass error frame out to the sockets */
 		rtcan_rcv(dev, &skb);
@@ -325,40 +347,51 @@ static int rtcan_sja_interrupt(rtdm_irq_t *irq_handle)
 
 	/* Transmit Interrupt? */
 	if (irq_source & SJA_IR_TI) {
+	    rtcan_tx_done(dev, 0);
+
 	    /* Wake up a sender */
-	    rtdm_sem_up(&dev->tx_sem);
+	    rtcan_dev_tx_release(dev);
 
-	    if (rtcan_loopback_pending(dev)) {
+	    if (rtcan_loopback_pending(dev, 0)) {
 
 		if (recv_lock_free) {
 		    recv_lock_free = 0;
-		    rtdm_lock_get(&rtcan_recv_list_lock);
-		    rtdm_lock_get(&rtcan_socket_lock);
+		    rtdm_lock_get(&dev->recv_list_lock);
 		}
 
-		rtcan_loopback(dev);
+		rtcan_loopback(dev, 0);
 	    }
 	}
 
-	/* Receive Interrupt? */
+	/* Receive Interrupt? Drain the RX FIFO while it holds frames,
+	 * bounded by the number of frames which fit into it. */
 	if (irq_source & SJA_IR_RI) {
+	    int rx_count = 0;
 
-	    /* Read out HW registers */
-	    rtcan_sja_rx_interrupt(dev, &skb);
-
-	    /* Take more locks. Ensure that they are taken and
-	     * released only once in the IRQ handler. */
-	    /* WARNING: Nested locks are dangerous! But they are
-	     * nested only in this routine so a deadlock should
-	     * not be possible. */
-	    if (recv_lock_free) {
-		recv_lock_free = 0;
-		rtdm_lock_get(&rtcan_recv_list_lock);
-		rtdm_lock_get(&rtcan_socket_lock);
-	    }
+	    do {
+		if (rx_count) {
+		    skb.timestamp = rtdm_clock_read();
+		    rtcan_trace_irq(&skb, skb.timestamp);
+		}
+
+		/* Read out HW registers */
+		rtcan_sja_rx_interrupt(dev, &skb);
+		rtcan_trace_hw(&skb);
 
-	    /* Pass received frame out to the sockets */
-	    rtcan_rcv(dev, &skb);
+		/* Take more locks. Ensure that they are taken and
+		 * released only once in the IRQ handler. */
+		/* WARNING: Nested locks are dangerous! But they are
+		 * nested only in this routine so a deadlock should
+		 * not be possible. */
+		if (recv_lock_free) {
+		    recv_lock_free = 0;
+		    rtdm_lock_get(&dev->recv_list_lock);
+		}
+
+		/* Pass received frame out to the sockets */
+		rtcan_rcv(dev, &skb);
+	    } while (++rx_count < SJA_RX_FIFO_FRAMES &&
+		     (chip->read_reg(dev, SJA_SR) & SJA_SR_RBS));
 	}
     }
 
@@ -367,8 +400,7 @@ static int rtcan_sja_interrupt(rtdm_irq_t *irq_handle)
 
     /* Release spinlocks */
     if (!recv_lock_free) {
-	rtdm_lock_put(&rtcan_socket_lock);
-	rtdm_lock_put(&rtcan_recv_list_lock);
+	rtdm_lock_put(&dev->recv_list_lock);
     }
     rtdm_lock_put(&dev->device_lock);
 
@@ -396,7 +428,7 @@ static inline int rtcan_sja_is_operating(struct rtcan_device *dev,
 	/* Disable the controller's interrupts */
 	chip->write_reg(dev, SJA_IER, 0x00);
 	/* Wake up waiting senders */
-	rtdm_sem_destroy(&dev->tx_sem);
+	rtcan_dev_tx_close(dev);
     }
 
     return is_operating;
@@ -451,7 +483,7 @@ static int rtcan_sja_mode_stop(struct rtcan_device *dev,
 	/* Volatile state could have changed while we slept busy. */
 	dev->state = CAN_STATE_STOPPED;
 	/* Wake up waiting senders */
-	rtdm_sem_destroy(&dev->tx_sem);
+	rtcan_dev_tx_close(dev);
     } else {
 	ret = -EAGAIN;
 	/* Enable interrupts again as we did not succeed */
@@ -471,6 +503,39 @@ static int rtcan_sja_mode_stop(struct rtcan_device *dev,
  * some time to avoid bus errors. Measured on an PHYTEC eNET card,
  * this time was 110 microseconds.
  */
+/*
+ * Program the acceptance filter in single filter mode from dev->hw_filter.
+ * Must be called in reset mode. The code and mask registers are taken as
+ * one 32-bit word, ID28 (EFF) or ID10 (SFF) in the MSB of ACR0/AMR0.
+ */
+static void rtcan_sja_set_acceptance(struct rtcan_device *dev, u8 *mod_reg)
+{
+    struct rtcan_sja1000 *chip = (struct rtcan_sja1000 *)dev->priv;
+    struct rtcan_hw_filter *filter = &dev->hw_filter;
+    u32 acr = 0, amr = 0xFFFFFFFF;
+
+    if (hw_filter && !rtcan_hw_filter_accept_all(filter)) {
+	if (filter->can_id & CAN_EFF_FLAG) {
+	    acr = (filter->can_id & CAN_EFF_MASK) << 3;
+	    amr = ~((filter->can_mask & CAN_EFF_MASK) << 3);
+	} else {
+	    acr = (filter->can_id & CAN_SFF_MASK) << 21;
+	    amr = ~((filter->can_mask & CAN_SFF_MASK) << 21);
+	}
+	*mod_reg |= SJA_MOD_AFM;
+    }
+
+    chip->write_reg(dev, SJA_ACR0, acr >> 24);
+    chip->write_reg(dev, SJA_ACR1, acr >> 16);
+    chip->write_reg(dev, SJA_ACR2, acr >> 8);
+    chip->write_reg(dev, SJA_ACR3, acr);
+    chip->write_reg(dev, SJA_AMR0, amr >> 24);
+    chip->write_reg(dev, SJA_AMR1, amr >> 16);
+    chip->write_reg(dev, SJA_AMR2, amr >> 8);
+    chip->write_reg(dev, SJA_AMR3, amr);
+}
+
+
 static int rtcan_sja_mode_start(struct rtcan_device *dev,
 				rtdm_lockctx_t *lock_ctx)
 {
@@ -503,10 +568,12 @@ static int rtcan_sja_mode_start(struct rtcan_device *dev,
 	/* Set error active state */
 	dev->state = CAN_STATE_ACTIVE;
 	/* Set up sender "mutex" */
-	rtdm_sem_init(&dev->tx_sem, 1);
+	rtcan_dev_tx_open(dev, 1);
 	/* Enable interrupts */
 	chip->write_reg(dev, SJA_IER, SJA1000_IER);
 
+	rtcan_sja_set_acceptance(dev, &mod_reg);
+
 	/* Clear reset mode bit in SJA1000 */
 	chip->write_reg(dev, SJA_MOD, mod_reg);
 
@@ -529,10 +596,12 @@ static int rtcan_sja_mode_start(struct rtcan_device *dev,
 	break;
 
     case CAN_STATE_BUS_OFF:
+	rtcan_sja_set_acceptance(dev, &mod_reg);
+
 	/* Trigger bus-off recovery */
 	chip->write_reg(dev, SJA_MOD, mod_reg);
 	/* Set up sender "mutex" */
-	rtdm_sem_init(&dev->tx_sem, 1);
+	rtcan_dev_tx_open(dev, 1);
 	/* Set error active state */
 	dev->state = CAN_STATE_ACTIVE;
 
@@ -25,6 +25,11 @@
 struct rtcan_sja1000 {
     unsigned char (*read_reg)(struct rtcan_device *dev, int off);
     void (*write_reg)(struct rtcan_device *dev, int off, unsigned char val);
+    /* Read count consecutive registers from off on, e.g. with a single
+     * memcpy_fromio(). Optional, read_reg is called for each register
+     * otherwise. Only used for registers without read side effects. */
+    void (*read_regs)(struct rtcan_device *dev, int off, unsigned char *buf,
+		      int count);
     void (*irq_ack)(struct rtcan_device *dev);
     unsigned short irq_num;
     unsigned short irq_flags;
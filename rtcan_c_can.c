@@ -49,6 +49,7 @@
 #include <rtdm/rtcan.h>
 #include "rtcan_dev.h"
 #include "rtcan_raw.h"
+#include "rtcan_ext.h"
 #include "rtcan_internal.h"
 
 #define DEV_NAME	"rtcan%d"
@@ -58,6 +59,30 @@
 #define CAN_MAX_DLC 8
 #define get_can_dlc(i)          (min_t(__u8, (i), CAN_MAX_DLC))
 
+static int rx_thread;
+module_param(rx_thread, int, 0444);
+MODULE_PARM_DESC(rx_thread, "Priority of a real-time task receiving the "
+		 "frames (1..99), 0 = receive in the interrupt handler "
+		 "(default)");
+
+static int rx_budget = 16;
+module_param(rx_budget, int, 0444);
+MODULE_PARM_DESC(rx_budget, "Maximum number of message objects read by the "
+		 "receive task before delivering them (1..16, default 16)");
+
+static int hw_filter;
+module_param(hw_filter, int, 0444);
+MODULE_PARM_DESC(hw_filter, "Program the RX message objects from the "
+		 "bound sockets' filters when the controller is started "
+		 "(default 0). Filters changed while it is running take "
+		 "effect with the next start.");
+
+static int restart_ms;
+module_param(restart_ms, int, 0444);
+MODULE_PARM_DESC(restart_ms, "Time in ms after which a controller gone "
+		 "bus-off is restarted automatically, 0 = wait for "
+		 "SIOCSCANMODE (default)");
+
 enum reg {
 	C_CAN_CTRL_REG = 0,
 	C_CAN_CTRL_EX_REG,
@@ -186,6 +211,29 @@ enum c_can_dev_id {
 	BOSCH_D_CAN,
 };
 
+/* message object split */
+#define C_CAN_NO_OF_OBJECTS	32
+#define C_CAN_MSG_OBJ_RX_NUM	16
+#define C_CAN_MSG_OBJ_TX_NUM	16
+
+#define C_CAN_MSG_OBJ_RX_FIRST	1
+#define C_CAN_MSG_OBJ_RX_LAST	(C_CAN_MSG_OBJ_RX_FIRST + \
+				C_CAN_MSG_OBJ_RX_NUM - 1)
+
+#define C_CAN_MSG_OBJ_TX_FIRST	(C_CAN_MSG_OBJ_RX_LAST + 1)
+#define C_CAN_MSG_OBJ_TX_LAST	(C_CAN_MSG_OBJ_TX_FIRST + \
+				C_CAN_MSG_OBJ_TX_NUM - 1)
+
+#define C_CAN_MSG_OBJ_RX_SPLIT	9
+#define C_CAN_MSG_RX_LOW_LAST	(C_CAN_MSG_OBJ_RX_SPLIT - 1)
+
+/* Frame waiting for a suitable TX message object */
+struct c_can_tx_entry {
+	struct can_frame frame;
+	u32 key;
+	u32 seq;
+};
+
 /* c_can private data structure */
 struct c_can_priv {
 	struct rtcan_device *dev;
@@ -198,19 +246,36 @@ struct c_can_priv {
 	int tx_object;
 	int current_status;
 	int last_status;
-	u16 (*read_reg) (struct c_can_priv *priv, enum reg index);
-	void (*write_reg) (struct c_can_priv *priv, enum reg index, u16 val);
 	void __iomem *base;
 	const u16 *regs;
+	unsigned int reg_shift;	/* see c_can_read_reg() */
 	unsigned long irq_flags; /* for request_irq() */
-	unsigned int tx_next;
-	unsigned int tx_echo;
+	/* TX scheduling, see c_can_start_xmit() */
+	u16 tx_busy;		/* TX objects holding a frame */
+	u16 tx_queued;		/* used entries of tx_queue */
+	u32 tx_seq;
+	u32 tx_key[C_CAN_MSG_OBJ_TX_NUM];	/* keys of the busy objects */
+	struct c_can_tx_entry tx_queue[C_CAN_MSG_OBJ_TX_NUM];
 	void *priv;		/* for board-specific data */
 	u16 irqstatus;
 	enum c_can_dev_id type;
 	u32 __iomem *raminit_ctrlreg;
 	unsigned int instance;
 	void (*raminit) (const struct c_can_priv *priv, bool enable);
+	rtdm_task_t rx_task;	/* receive task (rx_thread) */
+	rtdm_event_t rx_event;
+	nanosecs_abs_t irq_timestamp;	/* taken at IRQ entry */
+	/* receive interrupt moderation, see c_can_rx_timer() */
+	rtdm_timer_t rx_timer;
+	u32 rx_usecs;
+	int rx_window;
+	u32 rx_masked;		/* RX objects with RXIE cleared */
+	u32 rx_windows;
+	u32 rx_coalesced;
+	/* automatic bus-off recovery, see c_can_restart_timer() */
+	rtdm_timer_t restart_timer;
+	u32 restart_ms;
+	u32 restarts;
 };
 
 struct rtcan_device *alloc_c_can_dev(void);
@@ -228,6 +293,13 @@ int c_can_power_down(struct rtcan_device *dev);
 #define IF_ENUM_REG_LEN		11
 #define C_CAN_IFACE(reg, iface)	(C_CAN_IF1_##reg + (iface) * IF_ENUM_REG_LEN)
 
+/*
+ * IF1 is used for reception only, IF2 for transmission and for setting
+ * up the message objects, so neither has to wait for the other.
+ */
+#define IF_RX			0
+#define IF_TX			1
+
 /* control extension register D_CAN specific */
 #define CONTROL_EX_PDR		BIT(8)
 
@@ -294,12 +366,27 @@ int c_can_power_down(struct rtcan_device *dev);
 #define IF_COMM_ALL		(IF_COMM_MASK | IF_COMM_ARB | \
 				IF_COMM_CONTROL | IF_COMM_TXRQST | \
 				IF_COMM_DATAA | IF_COMM_DATAB)
+/*
+ * fields fetched for a received frame. DATAB is fetched even for frames
+ * of up to 4 bytes: the transfer from message RAM takes the same 6 CAN-CLK
+ * periods either way, while the DLC is only known after it. Fetching DATAB
+ * on demand would cost a second command request and busy-wait, and the
+ * object could be overwritten by the next frame in between. Only the data
+ * registers holding payload are read, see c_can_read_msg_object().
+ */
+#define IF_COMM_RCV		(IF_COMM_ARB | IF_COMM_CONTROL | \
+				IF_COMM_DATAA | IF_COMM_DATAB)
 
 /* IFx arbitration */
 #define IF_ARB_MSGVAL		BIT(15)
 #define IF_ARB_MSGXTD		BIT(14)
 #define IF_ARB_TRANSMIT		BIT(13)
 
+/* IFx mask and arbitration as 32-bit values, see
+ * c_can_setup_receive_object() */
+#define IF_MASK_MXTD		BIT(31)
+#define IF_ID_XTD		BIT(30)
+
 /* IFx message control */
 #define IF_MCONT_NEWDAT		BIT(15)
 #define IF_MCONT_MSGLST		BIT(14)
@@ -321,23 +408,6 @@ int c_can_power_down(struct rtcan_device *dev);
 #define IFX_WRITE_LOW_16BIT(x)	((x) & 0xFFFF)
 #define IFX_WRITE_HIGH_16BIT(x)	(((x) & 0xFFFF0000) >> 16)
 
-/* message object split */
-#define C_CAN_NO_OF_OBJECTS	32
-#define C_CAN_MSG_OBJ_RX_NUM	16
-#define C_CAN_MSG_OBJ_TX_NUM	16
-
-#define C_CAN_MSG_OBJ_RX_FIRST	1
-#define C_CAN_MSG_OBJ_RX_LAST	(C_CAN_MSG_OBJ_RX_FIRST + \
-				C_CAN_MSG_OBJ_RX_NUM - 1)
-
-#define C_CAN_MSG_OBJ_TX_FIRST	(C_CAN_MSG_OBJ_RX_LAST + 1)
-#define C_CAN_MSG_OBJ_TX_LAST	(C_CAN_MSG_OBJ_TX_FIRST + \
-				C_CAN_MSG_OBJ_TX_NUM - 1)
-
-#define C_CAN_MSG_OBJ_RX_SPLIT	9
-#define C_CAN_MSG_RX_LOW_LAST	(C_CAN_MSG_OBJ_RX_SPLIT - 1)
-
-#define C_CAN_NEXT_MSG_OBJ_MASK	(C_CAN_MSG_OBJ_TX_NUM - 1)
 #define RECEIVE_OBJECT_BITS	0x0000ffff
 
 /* status interrupt */
@@ -350,11 +420,17 @@ int c_can_power_down(struct rtcan_device *dev);
 /* minimum timeout for checking BUSY status */
 #define MIN_TIMEOUT_VALUE	6
 
+/* Upper bound of busy flag reads while waiting for a message transfer,
+ * which normally completes within 6 CAN clock cycles */
+#define IF_BUSY_POLL_COUNT	1000
+
 /* Wait for ~1 sec for INIT bit */
 #define INIT_WAIT_MS		1000
 
 /* napi related */
 #define C_CAN_NAPI_WEIGHT	C_CAN_MSG_OBJ_RX_NUM
+#define C_CAN_RX_OBJ_PENDING_MASK	(((1 << C_CAN_MSG_OBJ_RX_NUM) - 1) << \
+					(C_CAN_MSG_OBJ_RX_FIRST - 1))
 
 /* c_can lec values */
 enum c_can_lec_type {
@@ -425,29 +501,39 @@ static inline void c_can_reset_ram(const struct c_can_priv *priv, bool enable)
 		priv->raminit(priv, enable);
 }
 
-static inline int get_tx_next_msg_obj(const struct c_can_priv *priv)
+
+/*
+ * 16-bit c_can registers can be arranged differently in the memory
+ * architecture of different implementations. For example: 16-bit
+ * registers can be aligned to a 16-bit boundary or 32-bit boundary etc.
+ * The layout is fixed at probe time as a shift of the register offsets,
+ * so the accessors are inlined into the RX, TX and interrupt paths
+ * instead of being called through function pointers for every register.
+ */
+static inline u16 c_can_read_reg(struct c_can_priv *priv, enum reg index)
 {
-	return (priv->tx_next & C_CAN_NEXT_MSG_OBJ_MASK) +
-			C_CAN_MSG_OBJ_TX_FIRST;
+	return readw(priv->base + ((unsigned int)priv->regs[index] <<
+				   priv->reg_shift));
 }
 
-static inline int get_tx_echo_msg_obj(const struct c_can_priv *priv)
+static inline void c_can_write_reg(struct c_can_priv *priv, enum reg index,
+				   u16 val)
 {
-	return (priv->tx_echo & C_CAN_NEXT_MSG_OBJ_MASK) +
-			C_CAN_MSG_OBJ_TX_FIRST;
+	writew(val, priv->base + ((unsigned int)priv->regs[index] <<
+				  priv->reg_shift));
 }
 
-static u32 c_can_read_reg32(struct c_can_priv *priv, enum reg index)
+static inline u32 c_can_read_reg32(struct c_can_priv *priv, enum reg index)
 {
-	u32 val = priv->read_reg(priv, index);
-	val |= ((u32) priv->read_reg(priv, index + 1)) << 16;
+	u32 val = c_can_read_reg(priv, index);
+	val |= ((u32) c_can_read_reg(priv, index + 1)) << 16;
 	return val;
 }
 
 static void c_can_enable_all_interrupts(struct c_can_priv *priv,
 						int enable)
 {
-	unsigned int cntrl_save = priv->read_reg(priv,
+	unsigned int cntrl_save = c_can_read_reg(priv,
 						C_CAN_CTRL_REG);
 
 	if (enable)
@@ -455,40 +541,53 @@ static void c_can_enable_all_interrupts(struct c_can_priv *priv,
 	else
 		cntrl_save &= ~(CONTROL_EIE | CONTROL_IE | CONTROL_SIE);
 
-	priv->write_reg(priv, C_CAN_CTRL_REG, cntrl_save);
+	c_can_write_reg(priv, C_CAN_CTRL_REG, cntrl_save);
 }
 
 static inline int c_can_msg_obj_is_busy(struct c_can_priv *priv, int iface)
 {
-	int count = MIN_TIMEOUT_VALUE;
+	int count = IF_BUSY_POLL_COUNT;
 
-	while (count && priv->read_reg(priv,
-				C_CAN_IFACE(COMREQ_REG, iface)) &
-				IF_COMR_BUSY) {
-		count--;
-		udelay(1);
+	while (c_can_read_reg(priv, C_CAN_IFACE(COMREQ_REG, iface)) &
+			IF_COMR_BUSY) {
+		if (!--count)
+			return 1;
+		cpu_relax();
 	}
 
-	if (!count)
-		return 1;
-
 	return 0;
 }
 
+/*
+ * Wait for the last transfer of an interface to complete. Transfers to
+ * the message RAM (c_can_object_put()) are posted, so this must precede
+ * loading the interface registers again.
+ */
+static inline void c_can_object_wait(struct rtcan_device *dev, int iface)
+{
+	struct c_can_priv *priv = rtcan_priv(dev);
+
+	if (c_can_msg_obj_is_busy(priv, iface))
+		rtcandev_err(dev, "timed out waiting for interface %d\n",
+			     iface + 1);
+}
+
 static inline void c_can_object_get(struct rtcan_device *dev,
 					int iface, int objno, int mask)
 {
 	struct c_can_priv *priv = rtcan_priv(dev);
 
+	c_can_object_wait(dev, iface);
+
 	/*
 	 * As per specs, after writting the message object number in the
 	 * IF command request register the transfer b/w interface
 	 * register and message RAM must be complete in 6 CAN-CLK
 	 * period.
 	 */
-	priv->write_reg(priv, C_CAN_IFACE(COMMSK_REG, iface),
+	c_can_write_reg(priv, C_CAN_IFACE(COMMSK_REG, iface),
 			IFX_WRITE_LOW_16BIT(mask));
-	priv->write_reg(priv, C_CAN_IFACE(COMREQ_REG, iface),
+	c_can_write_reg(priv, C_CAN_IFACE(COMREQ_REG, iface),
 			IFX_WRITE_LOW_16BIT(objno));
 
 	if (c_can_msg_obj_is_busy(priv, iface))
@@ -501,18 +600,13 @@ static inline void c_can_object_put(struct rtcan_device *dev,
 	struct c_can_priv *priv = rtcan_priv(dev);
 
 	/*
-	 * As per specs, after writting the message object number in the
-	 * IF command request register the transfer b/w interface
-	 * register and message RAM must be complete in 6 CAN-CLK
-	 * period.
+	 * The transfer from the interface registers, which the caller has
+	 * loaded after c_can_object_wait(), completes in the background.
 	 */
-	priv->write_reg(priv, C_CAN_IFACE(COMMSK_REG, iface),
+	c_can_write_reg(priv, C_CAN_IFACE(COMMSK_REG, iface),
 			(IF_COMM_WR | IFX_WRITE_LOW_16BIT(mask)));
-	priv->write_reg(priv, C_CAN_IFACE(COMREQ_REG, iface),
+	c_can_write_reg(priv, C_CAN_IFACE(COMREQ_REG, iface),
 			IFX_WRITE_LOW_16BIT(objno));
-
-	if (c_can_msg_obj_is_busy(priv, iface))
-		rtcandev_err(dev, "timed out in object put\n");
 }
 
 static void c_can_write_msg_object(struct rtcan_device *dev,
@@ -523,6 +617,8 @@ static void c_can_write_msg_object(struct rtcan_device *dev,
 	unsigned int id;
 	struct c_can_priv *priv = rtcan_priv(dev);
 
+	c_can_object_wait(dev, iface);
+
 	if (!(frame->can_id & CAN_RTR_FLAG))
 		flags |= IF_ARB_TRANSMIT;
 
@@ -534,18 +630,18 @@ static void c_can_write_msg_object(struct rtcan_device *dev,
 
 	flags |= IF_ARB_MSGVAL;
 
-	priv->write_reg(priv, C_CAN_IFACE(ARB1_REG, iface),
+	c_can_write_reg(priv, C_CAN_IFACE(ARB1_REG, iface),
 				IFX_WRITE_LOW_16BIT(id));
-	priv->write_reg(priv, C_CAN_IFACE(ARB2_REG, iface), flags |
+	c_can_write_reg(priv, C_CAN_IFACE(ARB2_REG, iface), flags |
 				IFX_WRITE_HIGH_16BIT(id));
 
 	for (i = 0; i < frame->can_dlc; i += 2) {
-		priv->write_reg(priv, C_CAN_IFACE(DATA1_REG, iface) + i / 2,
+		c_can_write_reg(priv, C_CAN_IFACE(DATA1_REG, iface) + i / 2,
 				frame->data[i] | (frame->data[i + 1] << 8));
 	}
 
 	/* enable interrupt for this message object */
-	priv->write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface),
+	c_can_write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface),
 			IF_MCONT_TXIE | IF_MCONT_TXRQST | IF_MCONT_EOB |
 			frame->can_dlc);
 	c_can_object_put(dev, iface, objno, IF_COMM_ALL);
@@ -557,7 +653,8 @@ static inline void c_can_mark_rx_msg_obj(struct rtcan_device *dev,
 {
 	struct c_can_priv *priv = rtcan_priv(dev);
 
-	priv->write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface),
+	/* the interface is idle after c_can_object_get() */
+	c_can_write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface),
 			ctrl_mask & ~(IF_MCONT_MSGLST | IF_MCONT_INTPND));
 	c_can_object_put(dev, iface, obj, IF_COMM_CONTROL);
 
@@ -571,7 +668,8 @@ static inline void c_can_activate_all_lower_rx_msg_obj(struct rtcan_device *dev,
 	struct c_can_priv *priv = rtcan_priv(dev);
 
 	for (i = C_CAN_MSG_OBJ_RX_FIRST; i <= C_CAN_MSG_RX_LOW_LAST; i++) {
-		priv->write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface),
+		c_can_object_wait(dev, iface);
+		c_can_write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface),
 				ctrl_mask & ~(IF_MCONT_MSGLST |
 					IF_MCONT_INTPND | IF_MCONT_NEWDAT));
 		c_can_object_put(dev, iface, i, IF_COMM_CONTROL);
@@ -584,33 +682,40 @@ static inline void c_can_activate_rx_msg_obj(struct rtcan_device *dev,
 {
 	struct c_can_priv *priv = rtcan_priv(dev);
 
-	priv->write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface),
+	/* the interface is idle after c_can_object_get() */
+	c_can_write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface),
 			ctrl_mask & ~(IF_MCONT_MSGLST |
 				IF_MCONT_INTPND | IF_MCONT_NEWDAT));
 	c_can_object_put(dev, iface, obj, IF_COMM_CONTROL);
 }
 
+/*
+ * Called with the object already fetched into the interface by
+ * c_can_object_get(), ctrl is its message control value.
+ */
 static void c_can_handle_lost_msg_obj(struct rtcan_device *dev,
-					int iface, int objno)
+					int iface, int objno, int ctrl,
+					struct rtcan_skb *skb)
 {
 	struct c_can_priv *priv = rtcan_priv(dev);
 
-	struct rtcan_skb skb;
-	struct rtcan_rb_frame *cf = &skb.rb_frame;
+	struct rtcan_rb_frame *cf = &skb->rb_frame;
 
 	rtcandev_err(dev, "msg lost in buffer %d\n", objno);
 
-	c_can_object_get(dev, iface, objno, IF_COMM_ALL & ~IF_COMM_TXRQST);
-
-	priv->write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface),
-			IF_MCONT_CLR_MSGLST);
+	/* clear the overrun, keep the object's configuration */
+	c_can_write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface),
+			ctrl & ~(IF_MCONT_MSGLST | IF_MCONT_INTPND |
+				IF_MCONT_NEWDAT));
 
-	c_can_object_put(dev, 0, objno, IF_COMM_CONTROL);
+	c_can_object_put(dev, iface, objno, IF_COMM_CONTROL);
 
-	cf->can_id |= CAN_ERR_CRTL;
+	skb->rb_frame_size = EMPTY_RB_FRAME_SIZE + CAN_ERR_DLC;
+	memset(cf->data, 0, CAN_ERR_DLC);
+	cf->can_id = CAN_ERR_FLAG | CAN_ERR_CRTL;
+	cf->can_dlc = CAN_ERR_DLC;
+	cf->can_ifindex = dev->ifindex;
 	cf->data[1] = CAN_ERR_CRTL_RX_OVERFLOW;
-
-	rtcan_rcv(dev, &skb);
 }
 
 static int c_can_read_msg_object(struct rtcan_device *dev, int iface, int ctrl, struct rtcan_skb *skb)
@@ -622,22 +727,28 @@ static int c_can_read_msg_object(struct rtcan_device *dev, int iface, int ctrl,
 	struct rtcan_rb_frame *frame = &skb->rb_frame;
 
 	frame->can_dlc = get_can_dlc(ctrl & 0x0F);
-	skb->rb_frame_size = EMPTY_RB_FRAME_SIZE + CAN_ERR_DLC;
 
-	flags =	priv->read_reg(priv, C_CAN_IFACE(ARB2_REG, iface));
-	val = priv->read_reg(priv, C_CAN_IFACE(ARB1_REG, iface)) |
-		(flags << 16);
+	flags =	c_can_read_reg(priv, C_CAN_IFACE(ARB2_REG, iface));
 
-	if (flags & IF_ARB_MSGXTD)
+	if (flags & IF_ARB_MSGXTD) {
+		val = c_can_read_reg(priv, C_CAN_IFACE(ARB1_REG, iface)) |
+			(flags << 16);
 		frame->can_id = (val & CAN_EFF_MASK) | CAN_EFF_FLAG;
-	else
-		frame->can_id = (val >> 18) & CAN_SFF_MASK;
+	} else
+		/* a standard identifier is held in ARB2 alone */
+		frame->can_id = (flags >> 2) & CAN_SFF_MASK;
 
-	if (flags & IF_ARB_TRANSMIT)
+	/* Store the interface index */
+	frame->can_ifindex = dev->ifindex;
+
+	if (flags & IF_ARB_TRANSMIT) {
 		frame->can_id |= CAN_RTR_FLAG;
-	else {
+		skb->rb_frame_size = EMPTY_RB_FRAME_SIZE;
+	} else {
+		/* only the data registers holding payload are read */
+		skb->rb_frame_size = EMPTY_RB_FRAME_SIZE + frame->can_dlc;
 		for (i = 0; i < frame->can_dlc; i += 2) {
-			data = priv->read_reg(priv,
+			data = c_can_read_reg(priv,
 				C_CAN_IFACE(DATA1_REG, iface) + i / 2);
 			frame->data[i] = data;
 			frame->data[i + 1] = data >> 8;
@@ -653,21 +764,23 @@ static void c_can_setup_receive_object(struct rtcan_device *dev, int iface,
 {
 	struct c_can_priv *priv = rtcan_priv(dev);
 
-	priv->write_reg(priv, C_CAN_IFACE(MASK1_REG, iface),
+	c_can_object_wait(dev, iface);
+
+	c_can_write_reg(priv, C_CAN_IFACE(MASK1_REG, iface),
 			IFX_WRITE_LOW_16BIT(mask));
 
 	/* According to C_CAN documentation, the reserved bit
 	 * in IFx_MASK2 register is fixed 1
 	 */
-	priv->write_reg(priv, C_CAN_IFACE(MASK2_REG, iface),
+	c_can_write_reg(priv, C_CAN_IFACE(MASK2_REG, iface),
 			IFX_WRITE_HIGH_16BIT(mask) | BIT(13));
 
-	priv->write_reg(priv, C_CAN_IFACE(ARB1_REG, iface),
+	c_can_write_reg(priv, C_CAN_IFACE(ARB1_REG, iface),
 			IFX_WRITE_LOW_16BIT(id));
-	priv->write_reg(priv, C_CAN_IFACE(ARB2_REG, iface),
+	c_can_write_reg(priv, C_CAN_IFACE(ARB2_REG, iface),
 			(IF_ARB_MSGVAL | IFX_WRITE_HIGH_16BIT(id)));
 
-	priv->write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface), mcont);
+	c_can_write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface), mcont);
 	c_can_object_put(dev, iface, objno, IF_COMM_ALL & ~IF_COMM_TXRQST);
 
 	//rtcandev_dbg(dev, "setup obj no:%d, msgval:0x%08x\n", objno,
@@ -678,9 +791,11 @@ static void c_can_inval_msg_object(struct rtcan_device *dev, int iface, int objn
 {
 	struct c_can_priv *priv = rtcan_priv(dev);
 
-	priv->write_reg(priv, C_CAN_IFACE(ARB1_REG, iface), 0);
-	priv->write_reg(priv, C_CAN_IFACE(ARB2_REG, iface), 0);
-	priv->write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface), 0);
+	c_can_object_wait(dev, iface);
+
+	c_can_write_reg(priv, C_CAN_IFACE(ARB1_REG, iface), 0);
+	c_can_write_reg(priv, C_CAN_IFACE(ARB2_REG, iface), 0);
+	c_can_write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, iface), 0);
 
 	c_can_object_put(dev, iface, objno, IF_COMM_ARB | IF_COMM_CONTROL);
 
@@ -702,21 +817,111 @@ static inline int c_can_is_next_tx_obj_busy(struct c_can_priv *priv, int objno)
 	return 0;
 }
 
+/*
+ * TX scheduling:
+ *
+ * The core transmits the pending TX object with the lowest number first.
+ * Each frame gets a key, lower keys are more urgent: the socket's
+ * CAN_RAW_TX_PRIO in the top bits, below it the identifier as it takes
+ * part in bus arbitration. A frame may take the lowest free object above
+ * all busy objects holding a frame of the same or a lower key. Thus it
+ * overtakes frames of higher keys where possible but never one of the
+ * same or a lower key. If there is no such object, the frame waits in
+ * priv->tx_queue for the objects above to drain. dev->tx_sem counts the
+ * objects, so the queue never holds more frames than there are objects.
+ */
+static inline u32 c_can_tx_key(struct rtcan_device *dev, struct can_frame *cf)
+{
+	u32 key;
+
+	if (cf->can_id & CAN_EFF_FLAG)
+		key = cf->can_id & CAN_EFF_MASK;
+	else
+		key = (cf->can_id & CAN_SFF_MASK) << 18;
+
+	return key | (u32)(CAN_RAW_TX_PRIO_MAX - dev->tx_prio) << 29;
+}
+
+/* Returns the index of the TX object for @key or -1 if there is none */
+static int c_can_tx_find_obj(struct c_can_priv *priv, u32 key)
+{
+	int i, above = -1;
+
+	for (i = 0; i < C_CAN_MSG_OBJ_TX_NUM; i++)
+		if ((priv->tx_busy & (1 << i)) && priv->tx_key[i] <= key)
+			above = i;
+
+	for (i = above + 1; i < C_CAN_MSG_OBJ_TX_NUM; i++)
+		if (!(priv->tx_busy & (1 << i)))
+			return i;
+
+	return -1;
+}
+
+/*
+ * Move queued frames to TX objects, most urgent first, as long as they
+ * find one. Returns the index of the object the frame of queue entry
+ * @entry went to, -1 if it is still queued.
+ */
+static int c_can_tx_dispatch(struct rtcan_device *dev, int entry)
+{
+	struct c_can_priv *priv = rtcan_priv(dev);
+	struct c_can_tx_entry *tx;
+	int i, best, obj, ret = -1;
+
+	while (priv->tx_queued) {
+		best = -1;
+		for (i = 0; i < C_CAN_MSG_OBJ_TX_NUM; i++) {
+			if (!(priv->tx_queued & (1 << i)))
+				continue;
+			tx = &priv->tx_queue[i];
+			if (best < 0 || tx->key < priv->tx_queue[best].key ||
+			    (tx->key == priv->tx_queue[best].key &&
+			     (s32)(tx->seq - priv->tx_queue[best].seq) < 0))
+				best = i;
+		}
+
+		tx = &priv->tx_queue[best];
+		obj = c_can_tx_find_obj(priv, tx->key);
+		if (obj < 0)
+			break;
+
+		c_can_write_msg_object(dev, IF_TX, &tx->frame,
+				       C_CAN_MSG_OBJ_TX_FIRST + obj);
+		priv->tx_busy |= 1 << obj;
+		priv->tx_key[obj] = tx->key;
+		priv->tx_queued &= ~(1 << best);
+		rtcan_tx_move(dev, C_CAN_MSG_OBJ_TX_NUM + best, obj);
+
+		if (best == entry)
+			ret = obj;
+	}
+
+	return ret;
+}
+
 static int c_can_start_xmit(struct rtcan_device *dev, struct can_frame *cf)
 {
-	u32 msg_obj_no;
 	struct c_can_priv *priv = rtcan_priv(dev);
-	
-	msg_obj_no = get_tx_next_msg_obj(priv);
+	struct c_can_tx_entry *tx;
+	int entry, obj;
 
-	/* prepare message object for transmission */
-	c_can_write_msg_object(dev, 0, cf, msg_obj_no);
+	/* there is a free entry as dev->tx_sem was obtained */
+	entry = ffs(~priv->tx_queued & ((1 << C_CAN_MSG_OBJ_TX_NUM) - 1)) - 1;
+	if (entry < 0)
+		return -EBUSY;
 
-	/*
-	 * we have to stop the queue in case of a wrap around or
-	 * if the next TX message object is still in use
-	 */
-	priv->tx_next++;
+	tx = &priv->tx_queue[entry];
+	tx->frame = *cf;
+	tx->key = c_can_tx_key(dev, cf);
+	tx->seq = priv->tx_seq++;
+	priv->tx_queued |= 1 << entry;
+
+	/* queue slots are tracked behind the objects in dev->tx_submit */
+	dev->tx_submit[C_CAN_MSG_OBJ_TX_NUM + entry] = rtdm_clock_read();
+
+	obj = c_can_tx_dispatch(dev, entry);
+	dev->tx_mailbox = (obj < 0) ? C_CAN_MSG_OBJ_TX_NUM + entry : obj;
 
 	return 0;
 }
@@ -743,16 +948,58 @@ static int c_can_set_bittiming(struct rtcan_device *dev)
 
 	rtcandev_info(dev,"setting BTR=%04x BRPE=%04x\n", reg_btr, reg_brpe);
 
-	ctrl_save = priv->read_reg(priv, C_CAN_CTRL_REG);
-	priv->write_reg(priv, C_CAN_CTRL_REG,
+	ctrl_save = c_can_read_reg(priv, C_CAN_CTRL_REG);
+	c_can_write_reg(priv, C_CAN_CTRL_REG,
 			ctrl_save | CONTROL_CCE | CONTROL_INIT);
-	priv->write_reg(priv, C_CAN_BTR_REG, reg_btr);
-	priv->write_reg(priv, C_CAN_BRPEXT_REG, reg_brpe);
-	priv->write_reg(priv, C_CAN_CTRL_REG, ctrl_save);
+	c_can_write_reg(priv, C_CAN_BTR_REG, reg_btr);
+	c_can_write_reg(priv, C_CAN_BRPEXT_REG, reg_brpe);
+	c_can_write_reg(priv, C_CAN_CTRL_REG, ctrl_save);
 
 	return 0;
 }
 
+/*
+ * Translate the acceptance filter of the device into mask and
+ * arbitration values for the RX message objects. Everything is accepted
+ * unless the hw_filter module parameter is set.
+ */
+static void c_can_get_rx_filter(struct rtcan_device *dev,
+				unsigned int *mask, unsigned int *id)
+{
+	struct rtcan_hw_filter *filter = &dev->hw_filter;
+
+	if (!hw_filter || rtcan_hw_filter_accept_all(filter)) {
+		*mask = 0;
+		*id = 0;
+	} else if (filter->can_id & CAN_EFF_FLAG) {
+		*mask = IF_MASK_MXTD | (filter->can_mask & CAN_EFF_MASK);
+		*id = IF_ID_XTD | (filter->can_id & CAN_EFF_MASK);
+	} else {
+		*mask = IF_MASK_MXTD | ((filter->can_mask & CAN_SFF_MASK) << 18);
+		*id = (filter->can_id & CAN_SFF_MASK) << 18;
+	}
+}
+
+/* Set up the RX message objects as one FIFO */
+static void c_can_setup_rx_msg_objects(struct rtcan_device *dev)
+{
+	unsigned int mask, id;
+	int i;
+
+	/* all receive message objects share the acceptance filter derived
+	 * from the bound sockets, this keeps the FIFO in order */
+	c_can_get_rx_filter(dev, &mask, &id);
+
+	/* setup receive message objects */
+	for (i = C_CAN_MSG_OBJ_RX_FIRST; i < C_CAN_MSG_OBJ_RX_LAST; i++)
+		c_can_setup_receive_object(dev, IF_TX, i, mask, id,
+			(IF_MCONT_RXIE | IF_MCONT_UMASK) & ~IF_MCONT_EOB);
+
+	c_can_setup_receive_object(dev, IF_TX, C_CAN_MSG_OBJ_RX_LAST, mask, id,
+			IF_MCONT_EOB | IF_MCONT_RXIE | IF_MCONT_UMASK);
+	c_can_object_wait(dev, IF_TX);
+}
+
 /*
  * Configure C_CAN message objects for Tx and Rx purposes:
  * C_CAN provides a total of 32 message objects that can be configured
@@ -768,15 +1015,10 @@ static void c_can_configure_msg_objects(struct rtcan_device *dev)
 
 	/* first invalidate all message objects */
 	for (i = C_CAN_MSG_OBJ_RX_FIRST; i <= C_CAN_NO_OF_OBJECTS; i++)
-		c_can_inval_msg_object(dev, 0, i);
+		c_can_inval_msg_object(dev, IF_TX, i);
 
 	/* setup receive message objects */
-	for (i = C_CAN_MSG_OBJ_RX_FIRST; i < C_CAN_MSG_OBJ_RX_LAST; i++)
-		c_can_setup_receive_object(dev, 0, i, 0, 0,
-			(IF_MCONT_RXIE | IF_MCONT_UMASK) & ~IF_MCONT_EOB);
-
-	c_can_setup_receive_object(dev, 0, C_CAN_MSG_OBJ_RX_LAST, 0, 0,
-			IF_MCONT_EOB | IF_MCONT_RXIE | IF_MCONT_UMASK);
+	c_can_setup_rx_msg_objects(dev);
 }
 
 /*
@@ -790,36 +1032,36 @@ static void c_can_chip_config(struct rtcan_device *dev)
 	struct c_can_priv *priv = rtcan_priv(dev);
 
 	/* enable automatic retransmission */
-	priv->write_reg(priv, C_CAN_CTRL_REG,
+	c_can_write_reg(priv, C_CAN_CTRL_REG,
 			CONTROL_ENABLE_AR);
 
 	if ((dev->ctrl_mode & CAN_CTRLMODE_LISTENONLY) &&
 	    (dev->ctrl_mode & CAN_CTRLMODE_LOOPBACK)) {
 		/* loopback + silent mode : useful for hot self-test */
-		priv->write_reg(priv, C_CAN_CTRL_REG, CONTROL_EIE |
+		c_can_write_reg(priv, C_CAN_CTRL_REG, CONTROL_EIE |
 				CONTROL_SIE | CONTROL_IE | CONTROL_TEST);
-		priv->write_reg(priv, C_CAN_TEST_REG,
+		c_can_write_reg(priv, C_CAN_TEST_REG,
 				TEST_LBACK | TEST_SILENT);
 	} else if (dev->ctrl_mode & CAN_CTRLMODE_LOOPBACK) {
 		/* loopback mode : useful for self-test function */
-		priv->write_reg(priv, C_CAN_CTRL_REG, CONTROL_EIE |
+		c_can_write_reg(priv, C_CAN_CTRL_REG, CONTROL_EIE |
 				CONTROL_SIE | CONTROL_IE | CONTROL_TEST);
-		priv->write_reg(priv, C_CAN_TEST_REG, TEST_LBACK);
+		c_can_write_reg(priv, C_CAN_TEST_REG, TEST_LBACK);
 	} else if (dev->ctrl_mode & CAN_CTRLMODE_LISTENONLY) {
 		/* silent mode : bus-monitoring mode */
-		priv->write_reg(priv, C_CAN_CTRL_REG, CONTROL_EIE |
+		c_can_write_reg(priv, C_CAN_CTRL_REG, CONTROL_EIE |
 				CONTROL_SIE | CONTROL_IE | CONTROL_TEST);
-		priv->write_reg(priv, C_CAN_TEST_REG, TEST_SILENT);
+		c_can_write_reg(priv, C_CAN_TEST_REG, TEST_SILENT);
 	} else
 		/* normal mode*/
-		priv->write_reg(priv, C_CAN_CTRL_REG,
+		c_can_write_reg(priv, C_CAN_CTRL_REG,
 				CONTROL_EIE | CONTROL_SIE | CONTROL_IE);
 
 	/* configure message objects */
 	c_can_configure_msg_objects(dev);
 
 	/* set a `lec` value so that we can check for updates later */
-	priv->write_reg(priv, C_CAN_STS_REG, LEC_UNUSED);
+	c_can_write_reg(priv, C_CAN_STS_REG, LEC_UNUSED);
 
 	/* set bittiming params */
 	c_can_set_bittiming(dev);
@@ -836,6 +1078,90 @@ static int c_can_save_bit_time(struct rtcan_device *dev,
 	return 0;
 }
 
+/*
+ * Drop the frames of the TX objects and of the queue, with their loopback
+ * echoes. Called with device_lock held.
+ */
+static void c_can_tx_forget_all(struct rtcan_device *dev)
+{
+	struct c_can_priv *priv = rtcan_priv(dev);
+	int i;
+
+	for (i = 0; i < C_CAN_MSG_OBJ_TX_NUM; i++) {
+		if (priv->tx_busy & (1 << i))
+			rtcan_tx_forget(dev, i);
+		if (priv->tx_queued & (1 << i))
+			rtcan_tx_forget(dev, C_CAN_MSG_OBJ_TX_NUM + i);
+	}
+	priv->tx_busy = priv->tx_queued = 0;
+}
+
+/*
+ * Bus-off recovery without reconfiguration. The controller has set INIT
+ * on its own when it went bus-off and keeps its bit timing, test mode and
+ * message objects meanwhile, so the RX objects with the acceptance filter
+ * of the sockets stay as they are. Only the frames left in the TX objects
+ * are dropped. Clearing INIT lets the core rejoin the bus after 128
+ * times 11 recessive bits, which cannot be shortened. Called with
+ * device_lock held.
+ */
+static void c_can_warm_restart(struct rtcan_device *dev)
+{
+	struct c_can_priv *priv = rtcan_priv(dev);
+	struct rtcan_skb skb;
+	struct rtcan_rb_frame *cf = &skb.rb_frame;
+	u16 busy = priv->tx_busy;
+	int i;
+
+	for (i = 0; busy; i++, busy >>= 1)
+		if (busy & 1)
+			c_can_inval_msg_object(dev, IF_TX,
+					       C_CAN_MSG_OBJ_TX_FIRST + i);
+	c_can_tx_forget_all(dev);
+
+	c_can_write_reg(priv, C_CAN_STS_REG, LEC_UNUSED);
+	c_can_write_reg(priv, C_CAN_CTRL_REG,
+			c_can_read_reg(priv, C_CAN_CTRL_REG) & ~CONTROL_INIT);
+	dev->state = CAN_STATE_ERROR_ACTIVE;
+	priv->restarts++;
+
+	/* Set up sender "mutex" */
+	rtcan_dev_tx_open(dev, C_CAN_MSG_OBJ_TX_NUM);
+
+	/* enable status change, error and module interrupts */
+	c_can_enable_all_interrupts(priv, ENABLE_ALL_INTERRUPTS);
+
+	skb.rb_frame_size = EMPTY_RB_FRAME_SIZE + CAN_ERR_DLC;
+	skb.timestamp = rtdm_clock_read();
+	memset(cf->data, 0, CAN_ERR_DLC);
+	cf->can_id = CAN_ERR_FLAG | CAN_ERR_RESTARTED;
+	cf->can_dlc = CAN_ERR_DLC;
+	cf->can_ifindex = dev->ifindex;
+
+	rtdm_lock_get(&dev->recv_list_lock);
+	rtcan_rcv(dev, &skb);
+	rtdm_lock_put(&dev->recv_list_lock);
+}
+
+/*
+ * Armed on bus-off when priv->restart_ms is set. A stop or a restart
+ * through SIOCSCANMODE in the meantime leaves nothing to do here.
+ */
+static void c_can_restart_timer(rtdm_timer_t *timer)
+{
+	struct c_can_priv *priv =
+		container_of(timer, struct c_can_priv, restart_timer);
+	struct rtcan_device *dev = priv->dev;
+	rtdm_lockctx_t lock_ctx;
+
+	rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+	if (dev->state == CAN_STATE_BUS_OFF) {
+		rtcandev_dbg(dev, "restarting after bus-off\n");
+		c_can_warm_restart(dev);
+	}
+	rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+}
+
 static int c_can_mode_start(struct rtcan_device *dev, rtdm_lockctx_t *lock_ctx)
 {
 	struct c_can_priv *priv = rtcan_priv(dev);
@@ -866,29 +1192,21 @@ static int c_can_mode_start(struct rtcan_device *dev, rtdm_lockctx_t *lock_ctx)
 		c_can_chip_config(dev);
 		dev->state = CAN_STATE_ERROR_ACTIVE;
 
-		/* reset tx helper pointers */
-		priv->tx_next = priv->tx_echo = 0;
+		/* all TX objects are free now */
+		priv->tx_busy = priv->tx_queued = 0;
 
 		/* enable status change, error and module interrupts */
 		c_can_enable_all_interrupts(priv, ENABLE_ALL_INTERRUPTS);
 		
 		/* Set up sender "mutex" */
-		rtdm_sem_init(&dev->tx_sem, C_CAN_MSG_OBJ_TX_NUM);
+		rtcan_dev_tx_open(dev, C_CAN_MSG_OBJ_TX_NUM);
 
 		break;
 
 	case CAN_STATE_BUS_OFF:
-		/* Set up sender "mutex" */
-		rtdm_sem_init(&dev->tx_sem, C_CAN_MSG_OBJ_TX_NUM);
-		/* start chip and queuing */
-		c_can_pm_runtime_get_sync(priv);
-		c_can_reset_ram(priv, true);
-		c_can_chip_config(dev);
-		dev->state = CAN_STATE_ERROR_ACTIVE;
-		/* reset tx helper pointers */
-		priv->tx_next = priv->tx_echo = 0;
-		/* enable status change, error and module interrupts */
-		c_can_enable_all_interrupts(priv, ENABLE_ALL_INTERRUPTS);
+		/* still powered and configured, see c_can_warm_restart() */
+		rtdm_timer_stop(&priv->restart_timer);
+		c_can_warm_restart(dev);
 		break;
 
 	case CAN_STATE_SLEEPING:
@@ -913,18 +1231,26 @@ static void c_can_mode_stop(struct rtcan_device *dev, rtdm_lockctx_t *lock_ctx)
 	
 	state = dev->state;
 	/* If controller is not operating anyway, go out */
-	if (!CAN_STATE_OPERATING(state))
+	if (!CAN_STATE_OPERATING(state) && state != CAN_STATE_BUS_OFF)
 		return;
 	
 	//rtcandev_info(dev, "Mode stop.\n");
 	/* disable all interrupts */
 	c_can_enable_all_interrupts(priv, DISABLE_ALL_INTERRUPTS);
+	c_can_tx_forget_all(dev);
+
+	if (priv->rx_window) {
+		rtdm_timer_stop(&priv->rx_timer);
+		priv->rx_window = 0;
+	}
+	rtdm_timer_stop(&priv->restart_timer);
 
 	/* set the state as STOPPED */
 	dev->state = CAN_STATE_STOPPED;
 	
-	/* Wake up waiting senders */
-	rtdm_sem_destroy(&dev->tx_sem);
+	/* Wake up waiting senders, done on bus-off already */
+	if (state != CAN_STATE_BUS_OFF)
+		rtcan_dev_tx_close(dev);
 
 	rtdm_irq_free(&dev->irq_handle);
 	c_can_pm_runtime_put_sync(priv);
@@ -958,39 +1284,38 @@ int c_can_set_mode(struct rtcan_device *dev, can_mode_t mode, rtdm_lockctx_t *lo
 }
 
 /*
- * theory of operation:
- *
- * priv->tx_echo holds the number of the oldest can_frame put for
- * transmission into the hardware, but not yet ACKed by the CAN tx
- * complete IRQ.
- *
- * We iterate from priv->tx_echo to priv->tx_next and check if the
- * packet has been transmitted, echo it back to the CAN framework.
- * If we discover a not yet transmitted packet, stop looking for more.
+ * Release the TX objects whose frames have been sent and move queued
+ * frames to the objects which became usable.
  */
 static void c_can_do_tx(struct rtcan_device *dev)
 {
-	u32 val;
-	u32 msg_obj_no;
 	struct c_can_priv *priv = rtcan_priv(dev);
+	u32 done;
+	int i;
 
-	for (/* nix */; (priv->tx_next - priv->tx_echo) > 0; priv->tx_echo++) {
-		msg_obj_no = get_tx_echo_msg_obj(priv);
-		val = c_can_read_reg32(priv, C_CAN_TXRQST1_REG);
-		if (!(val & (1 << (msg_obj_no - 1)))) {
-			//can_get_echo_skb(dev, msg_obj_no - C_CAN_MSG_OBJ_TX_FIRST);
-			c_can_inval_msg_object(dev, 0, msg_obj_no);
-		} else {
-			rtdm_sem_up(&dev->tx_sem);
-			break;
-		}
-	}
+	/* the last transfer might still be about to set its TXRQST bit */
+	c_can_object_wait(dev, IF_TX);
 
-	/* restart queue if wrap-up or if queue stalled on last pkt */
-	if (((priv->tx_next & C_CAN_NEXT_MSG_OBJ_MASK) != 0) ||
-			((priv->tx_echo & C_CAN_NEXT_MSG_OBJ_MASK) == 0)){
-		rtdm_sem_up(&dev->tx_sem);
+	/*
+	 * as transmission request register's bit n-1 corresponds to
+	 * message object n, we need to handle the same properly.
+	 */
+	done = priv->tx_busy & ~(c_can_read_reg32(priv, C_CAN_TXRQST1_REG) >>
+				 (C_CAN_MSG_OBJ_TX_FIRST - 1));
+
+	for (i = 0; done; i++, done >>= 1) {
+		if (!(done & 1))
+			continue;
+
+		rtcan_tx_done(dev, i);
+		if (rtcan_loopback_pending(dev, i))
+			rtcan_loopback(dev, i);
+		c_can_inval_msg_object(dev, IF_TX, C_CAN_MSG_OBJ_TX_FIRST + i);
+		priv->tx_busy &= ~(1 << i);
+		rtcan_dev_tx_release(dev);
 	}
+
+	c_can_tx_dispatch(dev, -1);
 }
 
 /*
@@ -1015,15 +1340,61 @@ static void c_can_do_tx(struct rtcan_device *dev)
  *   C_CAN_MSG_RX_LOW_LAST then clear the NEWDAT bit of
  *   only this message object.
  */
+/*
+ * Read one pending receive message object into skb and re-activate it.
+ * Returns 1 if skb holds a frame (or an overflow error frame), 0 if the
+ * object held no new data and -1 at the end of a buffer.
+ */
+static int c_can_rx_msg_obj(struct rtcan_device *dev, unsigned int msg_obj,
+			   struct rtcan_skb *skb)
+{
+	unsigned int msg_ctrl_save;
+	struct c_can_priv *priv = rtcan_priv(dev);
+
+	c_can_object_get(dev, IF_RX, msg_obj, IF_COMM_RCV);
+	msg_ctrl_save = c_can_read_reg(priv, C_CAN_IFACE(MSGCTRL_REG, IF_RX));
+
+	if (msg_ctrl_save & IF_MCONT_EOB)
+		return -1;
+
+	if (msg_ctrl_save & IF_MCONT_MSGLST) {
+		c_can_handle_lost_msg_obj(dev, IF_RX, msg_obj,
+				msg_ctrl_save, skb);
+		return 1;
+	}
+
+	if (!(msg_ctrl_save & IF_MCONT_NEWDAT))
+		return 0;
+
+	/* read the data from the message object */
+	c_can_read_msg_object(dev, IF_RX, msg_ctrl_save, skb);
+
+	if (msg_obj < C_CAN_MSG_RX_LOW_LAST)
+		c_can_mark_rx_msg_obj(dev, IF_RX, msg_ctrl_save, msg_obj);
+	else if (msg_obj > C_CAN_MSG_RX_LOW_LAST)
+		/* activate this msg obj */
+		c_can_activate_rx_msg_obj(dev, IF_RX, msg_ctrl_save, msg_obj);
+	else if (msg_obj == C_CAN_MSG_RX_LOW_LAST)
+		/* activate all lower message objects */
+		c_can_activate_all_lower_rx_msg_obj(dev, IF_RX,
+				msg_ctrl_save);
+
+	return 1;
+}
+
 static int c_can_do_rx_poll(struct rtcan_device *dev)
 {
 	u32 num_rx_pkts = 0;
-	unsigned int msg_obj, msg_ctrl_save;
+	unsigned int msg_obj;
 	struct c_can_priv *priv = rtcan_priv(dev);
 	u32 val = c_can_read_reg32(priv, C_CAN_INTPND1_REG);
+	int ret;
 	
 	struct rtcan_skb skb;
 
+	skb.timestamp = priv->irq_timestamp;
+	rtcan_trace_irq(&skb, priv->irq_timestamp);
+
 	for (msg_obj = C_CAN_MSG_OBJ_RX_FIRST;
 			msg_obj <= C_CAN_MSG_OBJ_RX_LAST;
 			val = c_can_read_reg32(priv, C_CAN_INTPND1_REG),
@@ -1033,46 +1404,242 @@ static int c_can_do_rx_poll(struct rtcan_device *dev)
 		 * message object n, we need to handle the same properly.
 		 */
 		if (val & (1 << (msg_obj - 1))) {
-			c_can_object_get(dev, 0, msg_obj, IF_COMM_ALL &
-					~IF_COMM_TXRQST);
-			msg_ctrl_save = priv->read_reg(priv,
-					C_CAN_IFACE(MSGCTRL_REG, 0));
-
-			if (msg_ctrl_save & IF_MCONT_EOB)
+			ret = c_can_rx_msg_obj(dev, msg_obj, &skb);
+			if (ret < 0)
 				return num_rx_pkts;
-
-			if (msg_ctrl_save & IF_MCONT_MSGLST) {
-				c_can_handle_lost_msg_obj(dev, 0, msg_obj);
+			if (ret) {
+				rtcan_trace_hw(&skb);
+				rtcan_rcv(dev, &skb);
 				num_rx_pkts++;
-				continue;
 			}
-
-			if (!(msg_ctrl_save & IF_MCONT_NEWDAT))
-				continue;
-
-			/* read the data from the message object */
-			c_can_read_msg_object(dev, 0, msg_ctrl_save, &skb);
-
-			if (msg_obj < C_CAN_MSG_RX_LOW_LAST)
-				c_can_mark_rx_msg_obj(dev, 0,
-						msg_ctrl_save, msg_obj);
-			else if (msg_obj > C_CAN_MSG_RX_LOW_LAST)
-				/* activate this msg obj */
-				c_can_activate_rx_msg_obj(dev, 0,
-						msg_ctrl_save, msg_obj);
-			else if (msg_obj == C_CAN_MSG_RX_LOW_LAST)
-				/* activate all lower message objects */
-				c_can_activate_all_lower_rx_msg_obj(dev,
-						0, msg_ctrl_save);
-			
-			rtcan_rcv(dev, &skb);
-			num_rx_pkts++;
 		}
 	}
 
 	return num_rx_pkts;
 }
 
+/*
+ * Receive task, used instead of c_can_do_rx_poll() if rx_thread is set.
+ *
+ * The interrupt handler leaves all controller interrupts disabled when
+ * it sees a receive event and wakes up this task. Each pass reads at most
+ * rx_budget message objects under device_lock, taking the pending bits
+ * once per pass, and only then delivers the frames to the sockets with
+ * device_lock released. Interrupts are enabled again as soon as all
+ * objects pending at the start of a pass have been read.
+ */
+static void c_can_rx_task(void *arg)
+{
+	struct rtcan_device *dev = arg;
+	struct c_can_priv *priv = rtcan_priv(dev);
+	struct rtcan_skb skb[C_CAN_MSG_OBJ_RX_NUM];
+	rtdm_lockctx_t lock_ctx;
+	unsigned int msg_obj;
+	nanosecs_abs_t timestamp;
+	u32 pending;
+	int i, count, ret;
+
+	while (!rtdm_task_should_stop()) {
+		if (rtdm_event_wait(&priv->rx_event))
+			break;
+
+		/* the first pass gets the frames pending at IRQ entry */
+		timestamp = priv->irq_timestamp;
+
+		do {
+			count = 0;
+			pending = 0;
+
+			rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+
+			if (CAN_STATE_OPERATING(dev->state))
+				pending = c_can_read_reg32(priv,
+						C_CAN_INTPND1_REG) &
+					C_CAN_RX_OBJ_PENDING_MASK;
+
+			for (msg_obj = C_CAN_MSG_OBJ_RX_FIRST;
+					pending && count < rx_budget;
+					msg_obj++) {
+				if (!(pending & (1 << (msg_obj - 1))))
+					continue;
+
+				pending &= ~(1 << (msg_obj - 1));
+				skb[count].timestamp = timestamp;
+				rtcan_trace_irq(&skb[count], timestamp);
+				ret = c_can_rx_msg_obj(dev, msg_obj,
+						&skb[count]);
+				if (ret < 0) {
+					pending = 0;
+					break;
+				}
+				rtcan_trace_hw(&skb[count]);
+				count += ret;
+			}
+
+			rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+
+			if (count) {
+				rtdm_lock_get_irqsave(&dev->recv_list_lock,
+						lock_ctx);
+				for (i = 0; i < count; i++)
+					rtcan_rcv(dev, &skb[i]);
+				rtdm_lock_put_irqrestore(&dev->recv_list_lock,
+						lock_ctx);
+			}
+
+			timestamp = rtdm_clock_read();
+		} while (pending);
+
+		rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+		if (CAN_STATE_OPERATING(dev->state))
+			c_can_enable_all_interrupts(priv,
+					ENABLE_ALL_INTERRUPTS);
+		rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+	}
+}
+
+/*
+ * Receive moderation masks the RX message objects only, so that TX and
+ * status interrupts are still served while a window is open. Opening a
+ * window clears RXIE and INTPND in every RX object but those holding a
+ * frame read already (NEWDAT is kept in the lower ones until
+ * C_CAN_MSG_RX_LOW_LAST is read, see c_can_rx_msg_obj()). Called with
+ * device_lock held.
+ */
+static void c_can_rx_mask(struct rtcan_device *dev)
+{
+	struct c_can_priv *priv = rtcan_priv(dev);
+	unsigned int msg_obj, ctrl;
+
+	priv->rx_masked = 0;
+
+	for (msg_obj = C_CAN_MSG_OBJ_RX_FIRST;
+			msg_obj <= C_CAN_MSG_OBJ_RX_LAST; msg_obj++) {
+		c_can_object_get(dev, IF_RX, msg_obj, IF_COMM_CONTROL);
+		ctrl = c_can_read_reg(priv, C_CAN_IFACE(MSGCTRL_REG, IF_RX));
+		if ((ctrl & (IF_MCONT_NEWDAT | IF_MCONT_INTPND)) ==
+				IF_MCONT_NEWDAT)
+			continue;
+
+		c_can_write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, IF_RX),
+				ctrl & ~(IF_MCONT_RXIE | IF_MCONT_INTPND));
+		c_can_object_put(dev, IF_RX, msg_obj, IF_COMM_CONTROL);
+		priv->rx_masked |= 1 << (msg_obj - 1);
+	}
+}
+
+/*
+ * Set RXIE again in the objects masked by c_can_rx_mask(), and INTPND in
+ * those which hold a frame now, for c_can_do_rx_poll() to find them. A
+ * frame stored into an empty object between reading and writing back its
+ * control would lose NEWDAT, but that takes a few register accesses, far
+ * less than a frame on the bus. Called with device_lock held.
+ */
+static void c_can_rx_unmask(struct rtcan_device *dev)
+{
+	struct c_can_priv *priv = rtcan_priv(dev);
+	unsigned int msg_obj, ctrl;
+
+	for (msg_obj = C_CAN_MSG_OBJ_RX_FIRST;
+			msg_obj <= C_CAN_MSG_OBJ_RX_LAST; msg_obj++) {
+		if (!(priv->rx_masked & (1 << (msg_obj - 1))))
+			continue;
+
+		c_can_object_get(dev, IF_RX, msg_obj, IF_COMM_CONTROL);
+		ctrl = c_can_read_reg(priv, C_CAN_IFACE(MSGCTRL_REG, IF_RX)) |
+			IF_MCONT_RXIE;
+		if (ctrl & (IF_MCONT_NEWDAT | IF_MCONT_MSGLST))
+			ctrl |= IF_MCONT_INTPND;
+		c_can_write_reg(priv, C_CAN_IFACE(MSGCTRL_REG, IF_RX), ctrl);
+		c_can_object_put(dev, IF_RX, msg_obj, IF_COMM_CONTROL);
+	}
+	c_can_object_wait(dev, IF_RX);
+
+	priv->rx_masked = 0;
+}
+
+/*
+ * End of a receive moderation window. The interrupt handler masks the RX
+ * objects on the first receive event if rx_usecs is set and no
+ * latency-critical socket is bound, and arms this timer. The frames
+ * received meanwhile are stored in the message objects and read here in
+ * one pass (or by the receive task). Their reception time is unknown, so
+ * they are dated when they are read, up to rx_usecs late.
+ */
+static void c_can_rx_timer(rtdm_timer_t *timer)
+{
+	struct c_can_priv *priv =
+		container_of(timer, struct c_can_priv, rx_timer);
+	struct rtcan_device *dev = priv->dev;
+	rtdm_lockctx_t lock_ctx;
+
+	rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+
+	/* stopped meanwhile? */
+	if (!priv->rx_window)
+		goto out;
+	priv->rx_window = 0;
+
+	c_can_rx_unmask(dev);
+	priv->irq_timestamp = rtdm_clock_read();
+
+	if (rx_thread) {
+		rtdm_event_signal(&priv->rx_event);
+		goto out;
+	}
+
+	rtdm_lock_get(&dev->recv_list_lock);
+	priv->rx_coalesced += c_can_do_rx_poll(dev);
+	rtdm_lock_put(&dev->recv_list_lock);
+out:
+	rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+}
+
+static int c_can_ioctl(struct rtcan_device *dev, int request, void *arg)
+{
+	struct c_can_priv *priv = rtcan_priv(dev);
+	struct rtcan_coalesce *coal = arg;
+	struct rtcan_restart *restart = arg;
+	rtdm_lockctx_t lock_ctx;
+
+	switch (request) {
+	case RTCAN_RTIOC_GET_COALESCE:
+		rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+		coal->rx_usecs = priv->rx_usecs;
+		coal->rx_frames = 0;
+		coal->rx_windows = priv->rx_windows;
+		coal->rx_coalesced = priv->rx_coalesced;
+		rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+		return 0;
+
+	case RTCAN_RTIOC_SET_COALESCE:
+		if (coal->rx_usecs > RTCAN_COALESCE_MAX_USECS)
+			return -EINVAL;
+		/* there is no fill level interrupt, rx_frames is ignored */
+		rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+		priv->rx_usecs = coal->rx_usecs;
+		rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+		return 0;
+
+	case RTCAN_RTIOC_GET_RESTART:
+		rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+		restart->restart_ms = priv->restart_ms;
+		restart->restarts = priv->restarts;
+		rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+		return 0;
+
+	case RTCAN_RTIOC_SET_RESTART:
+		/* an armed timer still fires, it is not rearmed */
+		rtdm_lock_get_irqsave(&dev->device_lock, lock_ctx);
+		priv->restart_ms = restart->restart_ms;
+		rtdm_lock_put_irqrestore(&dev->device_lock, lock_ctx);
+		return 0;
+
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
 static int c_can_handle_state_change(struct rtcan_device *dev,
 				enum c_can_bus_error_types error_type)
 {
@@ -1083,9 +1650,11 @@ static int c_can_handle_state_change(struct rtcan_device *dev,
 	struct c_can_priv *priv = rtcan_priv(dev);
 	struct rtcan_skb skb;
 	struct rtcan_rb_frame *cf = &skb.rb_frame;
+
+	skb.timestamp = priv->irq_timestamp;
 	
 	/* propagate the error condition to the CAN stack */
-	reg_err_counter = priv->read_reg(priv, C_CAN_ERR_CNT_REG);
+	reg_err_counter = c_can_read_reg(priv, C_CAN_ERR_CNT_REG);
 	rxerr = (reg_err_counter & ERR_CNT_REC_MASK) >> ERR_CNT_REC_SHIFT;
 	txerr = reg_err_counter & ERR_CNT_TEC_MASK;
 	rx_err_passive = (reg_err_counter & ERR_CNT_RP_MASK) >>
@@ -1128,7 +1697,11 @@ static int c_can_handle_state_change(struct rtcan_device *dev,
 		 */
 		c_can_enable_all_interrupts(priv, DISABLE_ALL_INTERRUPTS);
 		/* Wake up waiting senders */
-		rtdm_sem_destroy(&dev->tx_sem);
+		rtcan_dev_tx_close(dev);
+		if (priv->restart_ms)
+			rtdm_timer_start_in_handler(&priv->restart_timer,
+				(nanosecs_rel_t)priv->restart_ms * 1000000,
+				0, RTDM_TIMERMODE_RELATIVE);
 		break;
 	default:
 		break;
@@ -1146,6 +1719,7 @@ static int c_can_handle_bus_err(struct rtcan_device *dev,
 	struct rtcan_skb skb;
 	struct rtcan_rb_frame *cf = &skb.rb_frame;
 	skb.rb_frame_size = EMPTY_RB_FRAME_SIZE + CAN_ERR_DLC;
+	skb.timestamp = priv->irq_timestamp;
 	/*
 	 * early exit if no lec update or no error.
 	 * no lec update means that no CAN bus event has been detected
@@ -1201,7 +1775,7 @@ static int c_can_handle_bus_err(struct rtcan_device *dev,
 	}
 
 	/* set a `lec` value so that we can check for updates later */
-	priv->write_reg(priv, C_CAN_STS_REG, LEC_UNUSED);
+	c_can_write_reg(priv, C_CAN_STS_REG, LEC_UNUSED);
 
 	rtcan_rcv(dev, &skb);
 
@@ -1214,31 +1788,65 @@ static int c_can_interrupt(rtdm_irq_t *irq_handle)
 	struct c_can_priv *priv = rtcan_priv(dev);
 	//u16 irqstatus;
 	int lec_type = 0;
-	int recv_lock_free = 1;
 	int ret = RTDM_IRQ_NONE;
+	nanosecs_abs_t timestamp = rtdm_clock_read();
 	
-	priv->irqstatus = priv->read_reg(priv, C_CAN_INT_REG);
+	priv->irqstatus = c_can_read_reg(priv, C_CAN_INT_REG);
 	if (!priv->irqstatus)
 		return RTDM_IRQ_NONE;
+
+	priv->irq_timestamp = timestamp;
 	
 	c_can_enable_all_interrupts(priv, DISABLE_ALL_INTERRUPTS);
+
+	/* open a moderation window, see c_can_rx_timer() */
+	if (priv->rx_usecs && !dev->rx_critical &&
+			priv->irqstatus >= C_CAN_MSG_OBJ_RX_FIRST &&
+			priv->irqstatus <= C_CAN_MSG_OBJ_RX_LAST) {
+		rtdm_lock_get(&dev->device_lock);
+		if (!priv->rx_window) {
+			priv->rx_window = 1;
+			priv->rx_windows++;
+			c_can_rx_mask(dev);
+			rtdm_timer_start_in_handler(&priv->rx_timer,
+					(nanosecs_rel_t)priv->rx_usecs * 1000,
+					0, RTDM_TIMERMODE_RELATIVE);
+			rtdm_lock_put(&dev->device_lock);
+			c_can_enable_all_interrupts(priv,
+					ENABLE_ALL_INTERRUPTS);
+			return RTDM_IRQ_HANDLED;
+		}
+		rtdm_lock_put(&dev->device_lock);
+	}
+
+	/* leave receive events to the receive task, which also enables
+	 * the interrupts again */
+	if (rx_thread && priv->irqstatus >= C_CAN_MSG_OBJ_RX_FIRST &&
+			priv->irqstatus <= C_CAN_MSG_OBJ_RX_LAST) {
+		rtdm_event_signal(&priv->rx_event);
+		return RTDM_IRQ_HANDLED;
+	}
 	
 	rtdm_lock_get(&dev->device_lock);
-	
+
+	/* All event handlers below may deliver frames, take the reception
+	 * lock before calling any of them. */
+	rtdm_lock_get(&dev->recv_list_lock);
+
 	/* status events have the highest priority */
 	if (priv->irqstatus == STATUS_INTERRUPT) {
-		priv->current_status = priv->read_reg(priv,
+		priv->current_status = c_can_read_reg(priv,
 					C_CAN_STS_REG);
 
 		/* handle Tx/Rx events */
 		if (priv->current_status & STATUS_TXOK){
-			priv->write_reg(priv, C_CAN_STS_REG,
+			c_can_write_reg(priv, C_CAN_STS_REG,
 					priv->current_status & ~STATUS_TXOK);
 			//rtcandev_info(dev, "IRQ: TX OK.\r\n");
 		}
 
 		if (priv->current_status & STATUS_RXOK){
-			priv->write_reg(priv, C_CAN_STS_REG,
+			c_can_write_reg(priv, C_CAN_STS_REG,
 					priv->current_status & ~STATUS_RXOK);
 			//rtcandev_info(dev, "IRQ: RX OK.\r\n");
 		}
@@ -1248,33 +1856,18 @@ static int c_can_interrupt(rtdm_irq_t *irq_handle)
 				(!(priv->last_status & STATUS_EWARN))) {
 			rtcandev_dbg(dev, "entered error warning state\n");
 			c_can_handle_state_change(dev,C_CAN_ERROR_WARNING);
-			if (recv_lock_free) {
-				recv_lock_free = 0;
-				rtdm_lock_get(&rtcan_recv_list_lock);
-				rtdm_lock_get(&rtcan_socket_lock);
-			}
 			ret = RTDM_IRQ_HANDLED;
 		}
 		if ((priv->current_status & STATUS_EPASS) &&
 				(!(priv->last_status & STATUS_EPASS))) {
 			rtcandev_dbg(dev, "entered error passive state\n");
 			c_can_handle_state_change(dev, C_CAN_ERROR_PASSIVE);
-			if (recv_lock_free) {
-				recv_lock_free = 0;
-				rtdm_lock_get(&rtcan_recv_list_lock);
-				rtdm_lock_get(&rtcan_socket_lock);
-			}
 			ret = RTDM_IRQ_HANDLED;
 		}
 		if ((priv->current_status & STATUS_BOFF) &&
 				(!(priv->last_status & STATUS_BOFF))) {
 			rtcandev_dbg(dev, "entered bus off state\n");
 			c_can_handle_state_change(dev,C_CAN_BUS_OFF);
-			if (recv_lock_free) {
-				recv_lock_free = 0;
-				rtdm_lock_get(&rtcan_recv_list_lock);
-				rtdm_lock_get(&rtcan_socket_lock);
-			}
 			ret = RTDM_IRQ_HANDLED;
 		}
 
@@ -1298,25 +1891,14 @@ static int c_can_interrupt(rtdm_irq_t *irq_handle)
 		lec_type = (priv->current_status & LEC_UNUSED);
 		if (lec_type)
 			c_can_handle_bus_err(dev, lec_type);
-			
-			if (recv_lock_free) {
-				recv_lock_free = 0;
-				rtdm_lock_get(&rtcan_recv_list_lock);
-				rtdm_lock_get(&rtcan_socket_lock);
-			}
-			ret = RTDM_IRQ_HANDLED;
+
+		ret = RTDM_IRQ_HANDLED;
 			
 	} 
 	else if ((priv->irqstatus >= C_CAN_MSG_OBJ_RX_FIRST) &&
 			(priv->irqstatus <= C_CAN_MSG_OBJ_RX_LAST)) {
 		/* handle events corresponding to receive message objects */
 		c_can_do_rx_poll(dev);
-		
-		if (recv_lock_free) {
-			recv_lock_free = 0;
-			rtdm_lock_get(&rtcan_recv_list_lock);
-			rtdm_lock_get(&rtcan_socket_lock);
-		}
 
 		ret = RTDM_IRQ_HANDLED;
 		
@@ -1325,22 +1907,10 @@ static int c_can_interrupt(rtdm_irq_t *irq_handle)
 			(priv->irqstatus <= C_CAN_MSG_OBJ_TX_LAST)) {
 		/* handle events corresponding to transmit message objects */
 		c_can_do_tx(dev);
-		
-		if (rtcan_loopback_pending(dev)) {
-			if (recv_lock_free) {
-				recv_lock_free = 0;
-				rtdm_lock_get(&rtcan_recv_list_lock);
-				rtdm_lock_get(&rtcan_socket_lock);
-			}
-			rtcan_loopback(dev);
-		}
 		ret = RTDM_IRQ_HANDLED;
 	}
 
-	if (!recv_lock_free) {
-		rtdm_lock_put(&rtcan_socket_lock);
-		rtdm_lock_put(&rtcan_recv_list_lock);
-	}
+	rtdm_lock_put(&dev->recv_list_lock);
 	rtdm_lock_put(&dev->device_lock);
 	c_can_enable_all_interrupts(priv, ENABLE_ALL_INTERRUPTS);
 	
@@ -1373,13 +1943,13 @@ int c_can_power_down(struct rtcan_device *dev)
 	WARN_ON(priv->type != BOSCH_D_CAN);
 
 	/* set PDR value so the device goes to power down mode */
-	val = priv->read_reg(priv, C_CAN_CTRL_EX_REG);
+	val = c_can_read_reg(priv, C_CAN_CTRL_EX_REG);
 	val |= CONTROL_EX_PDR;
-	priv->write_reg(priv, C_CAN_CTRL_EX_REG, val);
+	c_can_write_reg(priv, C_CAN_CTRL_EX_REG, val);
 
 	/* Wait for the PDA bit to get set */
 	time_out = jiffies + msecs_to_jiffies(INIT_WAIT_MS);
-	while (!(priv->read_reg(priv, C_CAN_STS_REG) & STATUS_PDA) &&
+	while (!(c_can_read_reg(priv, C_CAN_STS_REG) & STATUS_PDA) &&
 				time_after(time_out, jiffies))
 		cpu_relax();
 
@@ -1411,16 +1981,16 @@ int c_can_power_up(struct rtcan_device *dev)
 	c_can_reset_ram(priv, true);
 
 	/* Clear PDR and INIT bits */
-	val = priv->read_reg(priv, C_CAN_CTRL_EX_REG);
+	val = c_can_read_reg(priv, C_CAN_CTRL_EX_REG);
 	val &= ~CONTROL_EX_PDR;
-	priv->write_reg(priv, C_CAN_CTRL_EX_REG, val);
-	val = priv->read_reg(priv, C_CAN_CTRL_REG);
+	c_can_write_reg(priv, C_CAN_CTRL_EX_REG, val);
+	val = c_can_read_reg(priv, C_CAN_CTRL_REG);
 	val &= ~CONTROL_INIT;
-	priv->write_reg(priv, C_CAN_CTRL_REG, val);
+	c_can_write_reg(priv, C_CAN_CTRL_REG, val);
 
 	/* Wait for the PDA bit to get clear */
 	time_out = jiffies + msecs_to_jiffies(INIT_WAIT_MS);
-	while ((priv->read_reg(priv, C_CAN_STS_REG) & STATUS_PDA) &&
+	while ((c_can_read_reg(priv, C_CAN_STS_REG) & STATUS_PDA) &&
 				time_after(time_out, jiffies))
 		cpu_relax();
 
@@ -1439,14 +2009,33 @@ int register_c_candev(struct rtcan_device *dev)
 	struct c_can_priv *priv = rtcan_priv(dev);
 	
 	c_can_pm_runtime_enable(priv);
+
+	rtdm_timer_init(&priv->rx_timer, c_can_rx_timer, DRV_NAME);
+	rtdm_timer_init(&priv->restart_timer, c_can_restart_timer, DRV_NAME);
+	priv->restart_ms = restart_ms > 0 ? restart_ms : 0;
 	
 	err = rtcan_dev_register(dev);
 	if (err)
 		goto out_chip_disable;
 
+	if (rx_thread) {
+		rtdm_event_init(&priv->rx_event, 0);
+		err = rtdm_task_init(&priv->rx_task, dev->name,
+				     c_can_rx_task, dev, rx_thread, 0);
+		if (err) {
+			rtcandev_err(dev, "couldn't create receive task\n");
+			rtdm_event_destroy(&priv->rx_event);
+			goto out_unregister;
+		}
+	}
+
 	return 0;
 
+out_unregister:
+	rtcan_dev_unregister(dev);
 out_chip_disable:
+	rtdm_timer_destroy(&priv->restart_timer);
+	rtdm_timer_destroy(&priv->rx_timer);
 	c_can_pm_runtime_disable(priv);
 
 	return err;
@@ -1454,44 +2043,24 @@ out_chip_disable:
 
 void unregister_c_candev(struct rtcan_device *dev)
 {
+	struct c_can_priv *priv = rtcan_priv(dev);
+
 	c_can_mode_stop(dev, NULL);
+
+	if (rx_thread) {
+		rtdm_event_destroy(&priv->rx_event);
+		rtdm_task_destroy(&priv->rx_task);
+	}
+
 	rtcan_dev_unregister(dev);
+	rtdm_timer_destroy(&priv->restart_timer);
+	rtdm_timer_destroy(&priv->rx_timer);
 }
 
 
 /*PLATFORM part from here:*/
 #define CAN_RAMINIT_START_MASK(i)	(1 << (i))
 
-/*
- * 16-bit c_can registers can be arranged differently in the memory
- * architecture of different implementations. For example: 16-bit
- * registers can be aligned to a 16-bit boundary or 32-bit boundary etc.
- * Handle the same by providing a common read/write interface.
- */
-static u16 c_can_plat_read_reg_aligned_to_16bit(struct c_can_priv *priv,
-						enum reg index)
-{
-	return readw(priv->base + priv->regs[index]);
-}
-
-static void c_can_plat_write_reg_aligned_to_16bit(struct c_can_priv *priv,
-						enum reg index, u16 val)
-{
-	writew(val, priv->base + priv->regs[index]);
-}
-
-static u16 c_can_plat_read_reg_aligned_to_32bit(struct c_can_priv *priv,
-						enum reg index)
-{
-	return readw(priv->base + 2 * priv->regs[index]);
-}
-
-static void c_can_plat_write_reg_aligned_to_32bit(struct c_can_priv *priv,
-						enum reg index, u16 val)
-{
-	writew(val, priv->base + 2 * priv->regs[index]);
-}
-
 static void c_can_hw_raminit(const struct c_can_priv *priv, bool enable)
 {
 	u32 val;
@@ -1541,6 +2110,13 @@ static int c_can_plat_probe(struct platform_device *pdev)
 	int irq;
 	struct clk *clk;
 
+	if (rx_thread < 0 || rx_thread > RTDM_TASK_HIGHEST_PRIORITY) {
+		dev_err(&pdev->dev, "invalid rx_thread priority %d\n",
+			rx_thread);
+		ret = -EINVAL;
+		goto exit;
+	}
+
 	if (pdev->dev.of_node) {
 		match = of_match_device(c_can_of_table, &pdev->dev);
 		if (!match) {
@@ -1604,25 +2180,26 @@ static int c_can_plat_probe(struct platform_device *pdev)
 	}
 
 	priv = rtcan_priv(dev);
+
+	if (rx_budget < 1 || rx_budget > C_CAN_MSG_OBJ_RX_NUM)
+		rx_budget = C_CAN_MSG_OBJ_RX_NUM;
+
 	switch (id->driver_data) {
 	case BOSCH_C_CAN:
 		priv->regs = reg_map_c_can;
 		switch (mem->flags & IORESOURCE_MEM_TYPE_MASK) {
 		case IORESOURCE_MEM_32BIT:
-			priv->read_reg = c_can_plat_read_reg_aligned_to_32bit;
-			priv->write_reg = c_can_plat_write_reg_aligned_to_32bit;
+			priv->reg_shift = 1;
 			break;
 		case IORESOURCE_MEM_16BIT:
 		default:
-			priv->read_reg = c_can_plat_read_reg_aligned_to_16bit;
-			priv->write_reg = c_can_plat_write_reg_aligned_to_16bit;
+			priv->reg_shift = 0;
 			break;
 		}
 		break;
 	case BOSCH_D_CAN:
 		priv->regs = reg_map_d_can;
-		priv->read_reg = c_can_plat_read_reg_aligned_to_16bit;
-		priv->write_reg = c_can_plat_write_reg_aligned_to_16bit;
+		priv->reg_shift = 0;
 
 		if (pdev->dev.of_node)
 			priv->instance = of_alias_get_id(pdev->dev.of_node, "d_can");
@@ -1662,6 +2239,7 @@ static int c_can_plat_probe(struct platform_device *pdev)
 	dev->hard_start_xmit = c_can_start_xmit;
 	dev->do_set_mode = c_can_set_mode;
 	dev->do_set_bit_time = c_can_save_bit_time;
+	dev->do_ioctl = c_can_ioctl;
 	dev->bittiming_const = &c_can_bittiming_const;
 	dev->state = CAN_STATE_STOPPED;
 	
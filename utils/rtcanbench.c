@@ -0,0 +1,1050 @@
+/*
+ * Benchmark for RT-Socket-CAN
+ *
+ * Copyright (C) 2026 RT-Socket-CAN Development Team
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Frames are exchanged between two interfaces on the same bus, e.g. two
+ * devices of the virtual bus (xeno_can_virt) or two controllers wired
+ * together. With --external, the pings are answered by another node which
+ * echoes PING_ID + n as PONG_ID + n. Every result is printed to stdout as
+ * one JSON object per line, so runs can be stored and compared.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/mman.h>
+
+#include <native/task.h>
+#include <native/timer.h>
+
+#include <rtdm/rtcan.h>
+#include "rtcan_ext.h"
+
+#define PING_ID             0x100   /* + sender number */
+#define PONG_ID             0x500   /* + sender number */
+#define STREAM_ID           0x123
+#define LONG_DLC_ID         0x234
+
+#define DUMMY_ID            (CAN_EFF_FLAG | 0x100000)
+
+#define MAX_SENDERS         64
+#define MAX_RECEIVERS       16
+#define MAX_BURST           64
+
+#define POLL_TIMEOUT        100000000LL     /* 100 ms */
+#define PING_TIMEOUT        100000000LL     /* 100 ms */
+#define PACING_PERIOD       1000000LL       /* 1 ms */
+#define DRAIN_PERIOD        50000000LL      /* 50 ms */
+#define MAX_RATE            (1 << 21)       /* frames/s */
+
+extern int optind, opterr, optopt;
+
+static struct {
+    const char      *tx_if;
+    const char      *rx_if;
+    const char      *label;
+    int             senders;
+    int             receivers;
+    unsigned int    count;
+    unsigned int    duration;
+    unsigned int    rate;
+    unsigned int    filters;
+    unsigned int    burst;
+    int             exact;
+    int             batch;
+    int             external;
+    int             prio;
+} cfg = {
+    .tx_if      = "rtcan0",
+    .rx_if      = "rtcan1",
+    .label      = "",
+    .senders    = 1,
+    .receivers  = 1,
+    .count      = 10000,
+    .duration   = 1000,
+    .rate       = 1000,
+    .filters    = 16,
+    .burst      = 16,
+    .prio       = 80,
+};
+
+static RT_TASK main_task;
+static volatile int stop;
+
+
+static void print_usage(char *prg)
+{
+    fprintf(stderr,
+	    "Usage: %s [Options] [latency|filters|rxrate|txburst|longdlc|all]\n"
+	    "Options:\n"
+	    " -t, --tx=IFNAME       interface of the senders (default rtcan0)\n"
+	    " -r, --rx=IFNAME       interface of the receivers (default rtcan1)\n"
+	    " -s, --senders=N       latency: number of pinging tasks (default 1)\n"
+	    " -e, --echoes=M        latency: number of echoing tasks (default 1)\n"
+	    " -x, --external        pings are echoed by another node\n"
+	    " -n, --count=N         pings per sender, frames per burst test\n"
+	    "                       (default 10000)\n"
+	    " -d, --duration=MS     rxrate: duration of a step (default 1000)\n"
+	    " -R, --rate=FPS        rxrate: rate of the first step (default 1000)\n"
+	    " -f, --filters=N       filters: maximum number of filters (default 16)\n"
+	    " -X, --exact           filters: use exact-match instead of masked filters\n"
+	    " -b, --burst=N         txburst: maximum frames per call (default 16)\n"
+	    " -B, --batch           receive with RTCAN_RTIOC_RECV_BATCH\n"
+	    " -p, --prio=PRIO       priority of the senders (default 80)\n"
+	    " -l, --label=TEXT      label added to every result\n"
+	    " -h, --help            this help\n",
+	    prg);
+}
+
+
+static void cleanup_and_exit(int sig)
+{
+    stop = 1;
+}
+
+
+static void begin_record(const char *test)
+{
+    printf("{\"test\":\"%s\",\"label\":\"%s\",\"tx\":\"%s\",\"rx\":\"%s\"",
+	   test, cfg.label, cfg.tx_if, cfg.rx_if);
+}
+
+
+static void end_record(void)
+{
+    printf("}\n");
+    fflush(stdout);
+}
+
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+/* Adds min, avg, percentiles and max of @n samples (sorted in place) */
+static void print_distribution(uint32_t *v, unsigned int n)
+{
+    unsigned long long sum = 0;
+    unsigned int i;
+
+    if (n == 0)
+	return;
+
+    qsort(v, n, sizeof(*v), cmp_u32);
+    for (i = 0; i < n; i++)
+	sum += v[i];
+
+    printf(",\"min_ns\":%u,\"avg_ns\":%llu,\"p50_ns\":%u,\"p90_ns\":%u"
+	   ",\"p99_ns\":%u,\"p999_ns\":%u,\"max_ns\":%u",
+	   v[0], sum / n, v[n * 50 / 100], v[n * 90 / 100], v[n * 99 / 100],
+	   v[n * 999 / 1000], v[n - 1]);
+}
+
+
+static int open_socket(const char *ifname, struct can_filter *filters,
+		       int nfilters, nanosecs_rel_t timeout)
+{
+    struct sockaddr_can addr;
+    struct ifreq ifr;
+    int s, ret;
+
+    s = rt_dev_socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (s < 0) {
+	fprintf(stderr, "rt_dev_socket: %s\n", strerror(-s));
+	return s;
+    }
+
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ);
+    ret = rt_dev_ioctl(s, SIOCGIFINDEX, &ifr);
+    if (ret < 0) {
+	fprintf(stderr, "%s: %s\n", ifname, strerror(-ret));
+	goto failure;
+    }
+
+    /* Set before binding, so nothing else gets queued. No filters at all
+     * means the socket does not receive. */
+    ret = rt_dev_setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, filters,
+			    nfilters * sizeof(struct can_filter));
+    if (ret < 0) {
+	fprintf(stderr, "CAN_RAW_FILTER: %s\n", strerror(-ret));
+	goto failure;
+    }
+
+    ret = rt_dev_ioctl(s, RTCAN_RTIOC_RCV_TIMEOUT, &timeout);
+    if (ret < 0) {
+	fprintf(stderr, "RTCAN_RTIOC_RCV_TIMEOUT: %s\n", strerror(-ret));
+	goto failure;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    ret = rt_dev_bind(s, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret < 0) {
+	fprintf(stderr, "bind to %s: %s\n", ifname, strerror(-ret));
+	goto failure;
+    }
+
+    return s;
+
+ failure:
+    rt_dev_close(s);
+    return ret;
+}
+
+
+/* The number of overflows of socket @fd's buffer, -1 if unknown */
+static long read_rx_buf_full(int fd)
+{
+    char line[256], name[32], rx_timeout[32], tx_timeout[32];
+    unsigned int err_mask;
+    long full = -1, val;
+    int sfd, flist;
+    FILE *f;
+
+    f = fopen("/proc/rtcan/sockets", "r");
+    if (!f)
+	return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+	if (sscanf(line, "%d %31s %d %x %31s %31s %ld", &sfd, name, &flist,
+		   &err_mask, rx_timeout, tx_timeout, &val) == 7 &&
+	    sfd == fd) {
+	    full = val;
+	    break;
+	}
+    }
+
+    fclose(f);
+    return full;
+}
+
+
+static int create_task(RT_TASK *task, const char *name, int prio,
+		       void (*entry)(void *), void *arg)
+{
+    int ret;
+
+    ret = rt_task_create(task, name, 0, prio, T_JOINABLE);
+    if (ret) {
+	fprintf(stderr, "rt_task_create: %s\n", strerror(-ret));
+	return ret;
+    }
+
+    ret = rt_task_start(task, entry, arg);
+    if (ret) {
+	fprintf(stderr, "rt_task_start: %s\n", strerror(-ret));
+	rt_task_delete(task);
+    }
+    return ret;
+}
+
+
+/*
+ * Round-trip latency: every pinger sends PING_ID + n and waits for the
+ * echo PONG_ID + n carrying the same sequence number before sending the
+ * next ping. Echo tasks share the pingers' identifiers round-robin.
+ */
+
+struct pinger {
+    RT_TASK         task;
+    int             index;
+    int             sock;
+    uint32_t        *rtt;
+    unsigned int    samples;
+    unsigned int    lost;
+    int             error;
+};
+
+struct echo {
+    RT_TASK         task;
+    int             sock;
+    volatile int    running;
+    unsigned long   echoed;
+    int             error;
+};
+
+static void pinger_task(void *arg)
+{
+    struct pinger *p = arg;
+    can_frame_t ping, pong;
+    RTIME start;
+    uint32_t seq;
+    int ret;
+
+    memset(&ping, 0, sizeof(ping));
+    ping.can_id = PING_ID + p->index;
+    ping.can_dlc = 8;
+
+    for (seq = 0; seq < cfg.count && !stop; seq++) {
+	memcpy(ping.data, &seq, sizeof(seq));
+
+	start = rt_timer_read();
+	ret = rt_dev_send(p->sock, &ping, sizeof(ping), 0);
+	if (ret < 0) {
+	    p->error = ret;
+	    return;
+	}
+
+	/* Skip late echoes of pings which timed out */
+	do {
+	    ret = rt_dev_recv(p->sock, &pong, sizeof(pong), 0);
+	} while (ret >= 0 && memcmp(pong.data, &seq, sizeof(seq)));
+
+	if (ret == -ETIMEDOUT) {
+	    p->lost++;
+	    continue;
+	}
+	if (ret < 0) {
+	    p->error = ret;
+	    return;
+	}
+
+	p->rtt[p->samples++] = rt_timer_ticks2ns(rt_timer_read() - start);
+    }
+}
+
+static void echo_task(void *arg)
+{
+    struct echo *e = arg;
+    can_frame_t frame;
+    int ret;
+
+    while (e->running) {
+	ret = rt_dev_recv(e->sock, &frame, sizeof(frame), 0);
+	if (ret == -ETIMEDOUT)
+	    continue;
+	if (ret < 0) {
+	    e->error = ret;
+	    return;
+	}
+
+	frame.can_id += PONG_ID - PING_ID;
+	ret = rt_dev_send(e->sock, &frame, sizeof(frame), 0);
+	if (ret < 0) {
+	    e->error = ret;
+	    return;
+	}
+	e->echoed++;
+    }
+}
+
+/*
+ * Runs one latency measurement. @dummies non-matching filters are
+ * installed on an extra socket bound to the interface the pings are
+ * received on, so every frame has to be checked against them.
+ */
+static int run_latency(const char *test, int senders, int receivers,
+		       unsigned int dummies)
+{
+    struct pinger pingers[MAX_SENDERS];
+    struct echo echoes[MAX_RECEIVERS];
+    struct can_filter filter[MAX_SENDERS];
+    struct can_filter *dummy = NULL;
+    unsigned int i, samples = 0, lost = 0;
+    int j, n, dummy_sock = -1, ret = 0;
+    uint32_t *rtt;
+    char name[32];
+
+    if (cfg.external)
+	receivers = 0;
+
+    rtt = malloc(senders * cfg.count * sizeof(*rtt));
+    if (!rtt) {
+	fprintf(stderr, "out of memory\n");
+	return -ENOMEM;
+    }
+
+    memset(pingers, 0, sizeof(pingers));
+    memset(echoes, 0, sizeof(echoes));
+    for (j = 0; j < senders; j++)
+	pingers[j].sock = -1;
+    for (j = 0; j < receivers; j++)
+	echoes[j].sock = -1;
+
+    if (dummies) {
+	dummy = calloc(dummies, sizeof(*dummy));
+	if (!dummy) {
+	    ret = -ENOMEM;
+	    goto out;
+	}
+	for (i = 0; i < dummies; i++) {
+	    dummy[i].can_id = DUMMY_ID + 2 * i;
+	    dummy[i].can_mask = CAN_EFF_FLAG | CAN_EFF_MASK;
+	    if (!cfg.exact)
+		dummy[i].can_mask &= ~1;
+	}
+	dummy_sock = open_socket(cfg.external ? cfg.tx_if : cfg.rx_if,
+				 dummy, dummies, POLL_TIMEOUT);
+	if (dummy_sock < 0) {
+	    ret = dummy_sock;
+	    goto out;
+	}
+    }
+
+    for (j = 0; j < receivers; j++) {
+	for (n = 0, i = j; i < senders; i += receivers, n++) {
+	    filter[n].can_id = PING_ID + i;
+	    filter[n].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG;
+	}
+	echoes[j].sock = open_socket(cfg.rx_if, filter, n, POLL_TIMEOUT);
+	if (echoes[j].sock < 0) {
+	    ret = echoes[j].sock;
+	    goto out;
+	}
+	echoes[j].running = 1;
+	snprintf(name, sizeof(name), "echo%d", j);
+	ret = create_task(&echoes[j].task, name, cfg.prio + 1, echo_task,
+			  &echoes[j]);
+	if (ret) {
+	    echoes[j].running = 0;
+	    goto out;
+	}
+    }
+
+    for (j = 0; j < senders; j++) {
+	filter[0].can_id = PONG_ID + j;
+	filter[0].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG;
+	pingers[j].index = j;
+	pingers[j].rtt = rtt + j * cfg.count;
+	pingers[j].sock = open_socket(cfg.tx_if, filter, 1, PING_TIMEOUT);
+	if (pingers[j].sock < 0) {
+	    ret = pingers[j].sock;
+	    goto out;
+	}
+    }
+
+    for (j = 0; j < senders; j++) {
+	snprintf(name, sizeof(name), "ping%d", j);
+	ret = create_task(&pingers[j].task, name, cfg.prio, pinger_task,
+			  &pingers[j]);
+	if (ret) {
+	    while (--j >= 0)
+		rt_task_join(&pingers[j].task);
+	    goto out;
+	}
+    }
+
+    for (j = 0; j < senders; j++) {
+	rt_task_join(&pingers[j].task);
+	if (pingers[j].error && !ret) {
+	    fprintf(stderr, "ping%d: %s\n", j, strerror(-pingers[j].error));
+	    ret = pingers[j].error;
+	}
+	/* Gather the samples in one array */
+	memmove(rtt + samples, pingers[j].rtt,
+		pingers[j].samples * sizeof(*rtt));
+	samples += pingers[j].samples;
+	lost += pingers[j].lost;
+    }
+
+    if (!ret) {
+	begin_record(test);
+	printf(",\"senders\":%d,\"echoes\":%d,\"filters\":%u,\"exact\":%d"
+	       ",\"samples\":%u,\"lost\":%u",
+	       senders, receivers, dummies, cfg.exact, samples, lost);
+	print_distribution(rtt, samples);
+	end_record();
+    }
+
+ out:
+    for (j = 0; j < receivers; j++) {
+	if (echoes[j].running) {
+	    echoes[j].running = 0;
+	    rt_task_join(&echoes[j].task);
+	    if (echoes[j].error && !ret) {
+		fprintf(stderr, "echo%d: %s\n", j,
+			strerror(-echoes[j].error));
+		ret = echoes[j].error;
+	    }
+	}
+	if (echoes[j].sock >= 0)
+	    rt_dev_close(echoes[j].sock);
+    }
+    for (j = 0; j < senders; j++)
+	if (pingers[j].sock >= 0)
+	    rt_dev_close(pingers[j].sock);
+    if (dummy_sock >= 0)
+	rt_dev_close(dummy_sock);
+    free(dummy);
+    free(rtt);
+
+    return ret;
+}
+
+static int test_latency(void)
+{
+    return run_latency("latency", cfg.senders, cfg.receivers, 0);
+}
+
+/* Latency with 0, 1, 2, 4, ... filters up to cfg.filters */
+static int test_filters(void)
+{
+    unsigned int n = 0;
+    int ret;
+
+    for (;;) {
+	ret = run_latency("filters", 1, 1, n);
+	if (ret == -ENOSPC) {
+	    fprintf(stderr, "filters: no room for %u filters, see "
+		    "CONFIG_XENO_DRIVERS_CAN_MAX_RECEIVERS\n", n);
+	    return 0;
+	}
+	if (ret || n >= cfg.filters || stop)
+	    return ret;
+	n = n ? n * 2 : 1;
+	if (n > cfg.filters)
+	    n = cfg.filters;
+    }
+}
+
+
+/*
+ * Stream tests: the main task sends STREAM_ID frames carrying a sequence
+ * number, a counting task receives them and notes the gaps.
+ */
+
+struct counter {
+    RT_TASK             task;
+    int                 sock;
+    volatile int        running;
+    volatile unsigned long frames;
+    volatile unsigned long gaps;
+    uint32_t            next_seq;
+    int                 error;
+};
+
+static void counter_account(struct counter *c, can_frame_t *frame)
+{
+    uint32_t seq;
+
+    memcpy(&seq, frame->data, sizeof(seq));
+    if (seq != c->next_seq)
+	c->gaps += seq - c->next_seq;
+    c->next_seq = seq + 1;
+    c->frames++;
+}
+
+static void counter_task(void *arg)
+{
+    struct counter *c = arg;
+    can_frame_t frames[MAX_BURST];
+    struct rtcan_recv_batch batch;
+    int i, ret;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.frames = frames;
+
+    while (c->running) {
+	if (cfg.batch) {
+	    batch.count = MAX_BURST;
+	    ret = rt_dev_ioctl(c->sock, RTCAN_RTIOC_RECV_BATCH, &batch);
+	} else {
+	    ret = rt_dev_recv(c->sock, frames, sizeof(frames[0]), 0);
+	    if (ret > 0)
+		ret = 1;
+	}
+	if (ret == -ETIMEDOUT)
+	    continue;
+	if (ret < 0) {
+	    c->error = ret;
+	    return;
+	}
+	for (i = 0; i < ret; i++)
+	    counter_account(c, &frames[i]);
+    }
+}
+
+static int start_counter(struct counter *c, int prio)
+{
+    struct can_filter filter;
+    int ret;
+
+    memset(c, 0, sizeof(*c));
+    filter.can_id = STREAM_ID;
+    filter.can_mask = CAN_SFF_MASK | CAN_EFF_FLAG;
+    c->sock = open_socket(cfg.rx_if, &filter, 1, POLL_TIMEOUT);
+    if (c->sock < 0)
+	return c->sock;
+
+    c->running = 1;
+    ret = create_task(&c->task, "counter", prio, counter_task, c);
+    if (ret) {
+	rt_dev_close(c->sock);
+	return ret;
+    }
+    return 0;
+}
+
+static int stop_counter(struct counter *c)
+{
+    c->running = 0;
+    rt_task_join(&c->task);
+    rt_dev_close(c->sock);
+    if (c->error)
+	fprintf(stderr, "counter: %s\n", strerror(-c->error));
+    return c->error;
+}
+
+/* Waits until the counter has taken all frames it will get */
+static unsigned long drain_counter(struct counter *c)
+{
+    unsigned long frames;
+
+    do {
+	frames = c->frames;
+	rt_task_sleep(rt_timer_ns2ticks(DRAIN_PERIOD));
+    } while (c->frames != frames && !stop);
+
+    return frames;
+}
+
+static void fill_stream_frame(can_frame_t *frame, uint32_t seq)
+{
+    memset(frame, 0, sizeof(*frame));
+    frame->can_id = STREAM_ID;
+    frame->can_dlc = 8;
+    memcpy(frame->data, &seq, sizeof(seq));
+}
+
+/* Maximum reception rate: doubles the rate until frames get lost */
+static int test_rxrate(void)
+{
+    struct counter c;
+    can_frame_t frame;
+    unsigned long long elapsed;
+    unsigned long count, sent, due, frames, gaps, received, lost;
+    unsigned int rate, max_rate = 0;
+    long full, full_before;
+    uint32_t seq = 0;
+    RTIME start;
+    int ret, sock;
+
+    /* One below the sender: the socket buffer has to absorb what arrives
+     * while the receiver does not get the CPU. */
+    ret = start_counter(&c, cfg.prio - 1);
+    if (ret)
+	return ret;
+
+    sock = open_socket(cfg.tx_if, NULL, 0, POLL_TIMEOUT);
+    if (sock < 0) {
+	stop_counter(&c);
+	return sock;
+    }
+
+    for (rate = cfg.rate; rate <= MAX_RATE && !stop; rate *= 2) {
+	count = (unsigned long long)rate * cfg.duration / 1000;
+	frames = c.frames;
+	gaps = c.gaps;
+	full_before = read_rx_buf_full(c.sock);
+
+	start = rt_timer_read();
+	for (sent = 0; sent < count && !stop; ) {
+	    elapsed = rt_timer_ticks2ns(rt_timer_read() - start);
+	    due = elapsed * rate / 1000000000ULL + 1;
+	    if (due > count)
+		due = count;
+	    if (sent >= due) {
+		rt_task_sleep(rt_timer_ns2ticks(PACING_PERIOD));
+		continue;
+	    }
+	    for (; sent < due; sent++) {
+		fill_stream_frame(&frame, seq++);
+		ret = rt_dev_send(sock, &frame, sizeof(frame), 0);
+		if (ret < 0) {
+		    fprintf(stderr, "send: %s\n", strerror(-ret));
+		    goto out;
+		}
+	    }
+	}
+	elapsed = rt_timer_ticks2ns(rt_timer_read() - start);
+
+	received = drain_counter(&c) - frames;
+	lost = sent - received;
+	full = read_rx_buf_full(c.sock);
+
+	begin_record("rxrate");
+	printf(",\"rate\":%u,\"sent\":%lu,\"received\":%lu,\"lost\":%lu"
+	       ",\"gaps\":%lu,\"rx_buf_full\":%ld,\"tx_fps\":%llu",
+	       rate, sent, received, lost, c.gaps - gaps,
+	       full >= 0 && full_before >= 0 ? full - full_before : -1,
+	       elapsed ? sent * 1000000000ULL / elapsed : 0);
+	end_record();
+
+	if (lost || full > full_before)
+	    break;
+	/* The sender cannot go faster, so the receiver was not the limit */
+	if (elapsed > cfg.duration * 1100000ULL) {
+	    fprintf(stderr, "rxrate: sender saturated at %u frames/s\n",
+		    rate);
+	    break;
+	}
+	max_rate = rate;
+    }
+
+    begin_record("rxrate_max");
+    printf(",\"rate\":%u", max_rate);
+    end_record();
+    ret = 0;
+
+ out:
+    rt_dev_close(sock);
+    if (stop_counter(&c) && !ret)
+	ret = -EIO;
+    return ret;
+}
+
+/* Transmission throughput with 1, 2, 4, ... frames per sendmsg() call */
+static int test_txburst(void)
+{
+    can_frame_t frames[MAX_BURST];
+    struct counter c;
+    unsigned long long elapsed;
+    unsigned long before, received;
+    unsigned int burst, sent, n, i;
+    uint32_t seq = 0;
+    RTIME start;
+    int ret, sock;
+
+    /* Above the sender, so the socket buffer never overflows */
+    ret = start_counter(&c, cfg.prio + 1);
+    if (ret)
+	return ret;
+
+    sock = open_socket(cfg.tx_if, NULL, 0, POLL_TIMEOUT);
+    if (sock < 0) {
+	stop_counter(&c);
+	return sock;
+    }
+
+    for (burst = 1; !stop; burst = burst * 2 > cfg.burst ? cfg.burst :
+							   burst * 2) {
+	before = c.frames;
+
+	start = rt_timer_read();
+	for (sent = 0; sent < cfg.count && !stop; sent += n) {
+	    n = cfg.count - sent < burst ? cfg.count - sent : burst;
+	    for (i = 0; i < n; i++)
+		fill_stream_frame(&frames[i], seq + i);
+	    ret = rt_dev_send(sock, frames, n * sizeof(frames[0]), 0);
+	    if (ret <= 0) {
+		fprintf(stderr, "send: %s\n", strerror(ret ? -ret : EIO));
+		goto out;
+	    }
+	    n = ret / sizeof(frames[0]);
+	    seq += n;
+	}
+	elapsed = rt_timer_ticks2ns(rt_timer_read() - start);
+
+	received = drain_counter(&c) - before;
+
+	begin_record("txburst");
+	printf(",\"burst\":%u,\"sent\":%u,\"received\":%lu,\"tx_fps\":%llu",
+	       burst, sent, received,
+	       elapsed ? sent * 1000000000ULL / elapsed : 0);
+	end_record();
+
+	if (burst >= cfg.burst)
+	    break;
+    }
+    ret = 0;
+
+ out:
+    rt_dev_close(sock);
+    if (stop_counter(&c) && !ret)
+	ret = -EIO;
+    return ret;
+}
+
+
+/*
+ * A DLC of 9 to 15 means 8 data bytes. Such frames are sent to a
+ * receiver of each buffer type and looped back to the sender, the data
+ * must arrive intact and the kernel must not write past the 8 bytes.
+ */
+
+#define LONG_DLC_RECEIVERS  5
+
+static int recv_ring(struct rtcan_ring_header *hdr, int sock,
+		     can_frame_t *frame)
+{
+    struct rtcan_ring_slot *slots = (struct rtcan_ring_slot *)(hdr + 1);
+    nanosecs_rel_t timeout = POLL_TIMEOUT;
+    int ret;
+
+    ret = rt_dev_ioctl(sock, RTCAN_RTIOC_RING_WAIT, &timeout);
+    if (ret < 0)
+	return ret;
+
+    __sync_synchronize();
+    *frame = slots[hdr->tail & (hdr->slot_count - 1)].frame;
+    __sync_synchronize();
+    hdr->tail++;
+
+    return sizeof(*frame);
+}
+
+static int test_longdlc(void)
+{
+    static const char *names[LONG_DLC_RECEIVERS] = {
+	"buffer", "slots", "last_value", "ring", "loopback"
+    };
+    struct can_filter filter = { LONG_DLC_ID, CAN_SFF_MASK };
+    struct rtcan_ring_map map = { 0 };
+    unsigned int ok[LONG_DLC_RECEIVERS] = { 0 };
+    int socks[LONG_DLC_RECEIVERS];
+    can_frame_t frame, rx;
+    int one = 1, sixteen = 16;
+    int i, dlc, ret = 0, failed = 0;
+
+    for (i = 0; i < LONG_DLC_RECEIVERS; i++)
+	socks[i] = -1;
+
+    for (i = 0; i < LONG_DLC_RECEIVERS; i++) {
+	socks[i] = open_socket(i == 4 ? cfg.tx_if : cfg.rx_if, &filter, 1,
+			       POLL_TIMEOUT);
+	if (socks[i] < 0) {
+	    ret = socks[i];
+	    goto out;
+	}
+    }
+
+    if ((ret = rt_dev_setsockopt(socks[1], SOL_CAN_RAW, CAN_RAW_RX_SLOTS,
+				 &sixteen, sizeof(sixteen))) < 0 ||
+	(ret = rt_dev_setsockopt(socks[2], SOL_CAN_RAW, CAN_RAW_LAST_VALUE,
+				 &sixteen, sizeof(sixteen))) < 0 ||
+	(ret = rt_dev_ioctl(socks[3], RTCAN_RTIOC_MMAP_RING, &map)) < 0 ||
+	(ret = rt_dev_setsockopt(socks[4], SOL_CAN_RAW,
+				 CAN_RAW_RECV_OWN_MSGS, &one,
+				 sizeof(one))) < 0) {
+	fprintf(stderr, "longdlc: setting up the receivers: %s\n",
+		strerror(-ret));
+	goto out;
+    }
+
+    for (dlc = 9; dlc <= 15 && !stop; dlc++) {
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = LONG_DLC_ID;
+	frame.can_dlc = dlc;
+	for (i = 0; i < 8; i++)
+	    frame.data[i] = dlc * 16 + i;
+
+	ret = rt_dev_send(socks[4], &frame, sizeof(frame), 0);
+	if (ret < 0) {
+	    fprintf(stderr, "send: %s\n", strerror(-ret));
+	    goto out;
+	}
+
+	for (i = 0; i < LONG_DLC_RECEIVERS; i++) {
+	    memset(&rx, 0, sizeof(rx));
+	    if (i == 3)
+		ret = recv_ring(map.addr, socks[i], &rx);
+	    else
+		ret = rt_dev_recv(socks[i], &rx, sizeof(rx), 0);
+	    if (ret == sizeof(rx) && rx.can_id == frame.can_id &&
+		!memcmp(rx.data, frame.data, 8))
+		ok[i]++;
+	    else
+		failed = 1;
+	}
+    }
+
+    begin_record("longdlc");
+    for (i = 0; i < LONG_DLC_RECEIVERS; i++)
+	printf(",\"%s\":%u", names[i], ok[i]);
+    end_record();
+
+    ret = failed ? -EIO : 0;
+
+ out:
+    if (map.addr)
+	munmap(map.addr, map.size);
+    for (i = 0; i < LONG_DLC_RECEIVERS; i++)
+	if (socks[i] >= 0)
+	    rt_dev_close(socks[i]);
+    return ret;
+}
+
+
+static const struct {
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    { "latency", test_latency },
+    { "filters", test_filters },
+    { "rxrate", test_rxrate },
+    { "txburst", test_txburst },
+    { "longdlc", test_longdlc },
+};
+
+#define NUM_TESTS (sizeof(tests) / sizeof(tests[0]))
+
+int main(int argc, char **argv)
+{
+    const char *which = "all";
+    unsigned int i;
+    int opt, ret, found = 0;
+
+    struct option long_options[] = {
+	{ "help", no_argument, 0, 'h' },
+	{ "tx", required_argument, 0, 't'},
+	{ "rx", required_argument, 0, 'r'},
+	{ "senders", required_argument, 0, 's'},
+	{ "echoes", required_argument, 0, 'e'},
+	{ "external", no_argument, 0, 'x'},
+	{ "count", required_argument, 0, 'n'},
+	{ "duration", required_argument, 0, 'd'},
+	{ "rate", required_argument, 0, 'R'},
+	{ "filters", required_argument, 0, 'f'},
+	{ "exact", no_argument, 0, 'X'},
+	{ "burst", required_argument, 0, 'b'},
+	{ "batch", no_argument, 0, 'B'},
+	{ "prio", required_argument, 0, 'p'},
+	{ "label", required_argument, 0, 'l'},
+	{ 0, 0, 0, 0},
+    };
+
+    while ((opt = getopt_long(argc, argv, "ht:r:s:e:xn:d:R:f:Xb:Bp:l:",
+			      long_options, NULL)) != -1) {
+	switch (opt) {
+	case 'h':
+	    print_usage(argv[0]);
+	    exit(0);
+
+	case 't':
+	    cfg.tx_if = optarg;
+	    break;
+
+	case 'r':
+	    cfg.rx_if = optarg;
+	    break;
+
+	case 's':
+	    cfg.senders = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 'e':
+	    cfg.receivers = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 'x':
+	    cfg.external = 1;
+	    break;
+
+	case 'n':
+	    cfg.count = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 'd':
+	    cfg.duration = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 'R':
+	    cfg.rate = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 'f':
+	    cfg.filters = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 'X':
+	    cfg.exact = 1;
+	    break;
+
+	case 'b':
+	    cfg.burst = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 'B':
+	    cfg.batch = 1;
+	    break;
+
+	case 'p':
+	    cfg.prio = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 'l':
+	    cfg.label = optarg;
+	    break;
+
+	default:
+	    fprintf(stderr, "Unknown option %c\n", opt);
+	    print_usage(argv[0]);
+	    exit(1);
+	}
+    }
+
+    if (optind < argc)
+	which = argv[optind];
+
+    if (cfg.senders < 1 || cfg.senders > MAX_SENDERS ||
+	cfg.receivers < 1 || cfg.receivers > MAX_RECEIVERS ||
+	cfg.receivers > cfg.senders) {
+	fprintf(stderr, "1 to %d senders and 1 to %d, at most as many, "
+		"echo tasks please\n", MAX_SENDERS, MAX_RECEIVERS);
+	exit(1);
+    }
+    if (cfg.count < 1 || cfg.duration < 1 || cfg.rate < 1 ||
+	cfg.burst < 1 || cfg.burst > MAX_BURST ||
+	cfg.prio < 2 || cfg.prio > 98) {
+	fprintf(stderr, "invalid count, duration, rate, burst (1..%d) or "
+		"priority (2..98)\n", MAX_BURST);
+	exit(1);
+    }
+
+    signal(SIGTERM, cleanup_and_exit);
+    signal(SIGINT, cleanup_and_exit);
+
+    mlockall(MCL_CURRENT | MCL_FUTURE);
+
+    ret = rt_task_shadow(&main_task, "rtcanbench", cfg.prio, 0);
+    if (ret) {
+	fprintf(stderr, "rt_task_shadow: %s\n", strerror(-ret));
+	exit(1);
+    }
+
+    for (i = 0; i < NUM_TESTS && !stop; i++) {
+	if (strcmp(which, "all") && strcmp(which, tests[i].name))
+	    continue;
+	found = 1;
+	ret = tests[i].run();
+	if (ret) {
+	    fprintf(stderr, "%s failed: %s\n", tests[i].name, strerror(-ret));
+	    exit(1);
+	}
+    }
+
+    if (!found) {
+	fprintf(stderr, "Unknown test %s\n", which);
+	print_usage(argv[0]);
+	exit(1);
+    }
+
+    return 0;
+}
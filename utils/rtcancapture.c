@@ -0,0 +1,252 @@
+/*
+ * Bus capture to a pcap file for RT-Socket-CAN
+ *
+ * Copyright (C) 2026 RT-Socket-CAN Development Team
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The frames of an interface (or all of them) are captured by the kernel
+ * into double buffers (RTCAN_RTIOC_CAPTURE_START) and written to the file
+ * a whole buffer at a time, so the disk may stall for as long as it takes
+ * the bus to fill a buffer without a frame being lost. The file can be
+ * read by the usual pcap tools and replayed with rtcanreplay.
+ *
+ * Frames sent by local sockets are captured only if the sender has
+ * loopback enabled (the default) and the kernel was built with
+ * CONFIG_XENO_DRIVERS_CAN_LOOPBACK, since the capture sees their loopback
+ * echoes. Frames of other nodes are always captured.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/mman.h>
+
+#include <native/task.h>
+
+#include <rtdm/rtcan.h>
+#include "rtcan_ext.h"
+
+#define READ_TIMEOUT        500000000LL     /* 500 ms */
+
+extern int optind, opterr, optopt;
+
+static RT_TASK main_task;
+static volatile int stop;
+
+
+static void print_usage(char *prg)
+{
+    fprintf(stderr,
+	    "Usage: %s [Options] <can-interface|all> <file|->\n"
+	    "Options:\n"
+	    " -s, --size=BYTES      size of each kernel buffer (default %u)\n"
+	    " -e, --errors          capture error frames as well\n"
+	    " -p, --prio=PRIO       priority of the reader (default 1)\n"
+	    " -h, --help            this help\n",
+	    prg, RTCAN_CAPTURE_DEFAULT_SIZE);
+}
+
+
+static void cleanup_and_exit(int sig)
+{
+    stop = 1;
+}
+
+
+int main(int argc, char **argv)
+{
+    struct rtcan_capture_start start;
+    struct rtcan_capture_read rd;
+    struct rtcan_pcap_hdr hdr;
+    struct sockaddr_can addr;
+    struct ifreq ifr;
+    can_err_mask_t err_mask = 0;
+    unsigned long long bytes = 0;
+    size_t size = 0;
+    int prio = 1;
+    FILE *out;
+    int opt, s, i, ret;
+
+    struct option long_options[] = {
+	{ "help", no_argument, 0, 'h' },
+	{ "size", required_argument, 0, 's'},
+	{ "errors", no_argument, 0, 'e'},
+	{ "prio", required_argument, 0, 'p'},
+	{ 0, 0, 0, 0},
+    };
+
+    while ((opt = getopt_long(argc, argv, "hs:ep:",
+			      long_options, NULL)) != -1) {
+	switch (opt) {
+	case 'h':
+	    print_usage(argv[0]);
+	    exit(0);
+
+	case 's':
+	    size = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 'e':
+	    err_mask = CAN_ERR_MASK;
+	    break;
+
+	case 'p':
+	    prio = strtoul(optarg, NULL, 0);
+	    break;
+
+	default:
+	    fprintf(stderr, "Unknown option %c\n", opt);
+	    print_usage(argv[0]);
+	    exit(1);
+	}
+    }
+
+    if (argc - optind != 2) {
+	print_usage(argv[0]);
+	exit(1);
+    }
+
+    if (strcmp(argv[optind + 1], "-") == 0)
+	out = stdout;
+    else if ((out = fopen(argv[optind + 1], "w")) == NULL) {
+	perror(argv[optind + 1]);
+	exit(1);
+    }
+
+    signal(SIGTERM, cleanup_and_exit);
+    signal(SIGINT, cleanup_and_exit);
+
+    mlockall(MCL_CURRENT | MCL_FUTURE);
+
+    ret = rt_task_shadow(&main_task, "rtcancapture", prio, 0);
+    if (ret) {
+	fprintf(stderr, "rt_task_shadow: %s\n", strerror(-ret));
+	exit(1);
+    }
+
+    s = rt_dev_socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (s < 0) {
+	fprintf(stderr, "rt_dev_socket: %s\n", strerror(-s));
+	exit(1);
+    }
+
+    if (strcmp(argv[optind], "all") == 0)
+	ifr.ifr_ifindex = 0;
+    else {
+	strncpy(ifr.ifr_name, argv[optind], IFNAMSIZ);
+	ret = rt_dev_ioctl(s, SIOCGIFINDEX, &ifr);
+	if (ret < 0) {
+	    fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+	    goto failure;
+	}
+    }
+
+    if (err_mask) {
+	ret = rt_dev_setsockopt(s, SOL_CAN_RAW, CAN_RAW_ERR_FILTER,
+				&err_mask, sizeof(err_mask));
+	if (ret < 0) {
+	    fprintf(stderr, "CAN_RAW_ERR_FILTER: %s\n", strerror(-ret));
+	    goto failure;
+	}
+    }
+
+    /* Capture before binding, so nothing is queued the normal way */
+    memset(&start, 0, sizeof(start));
+    start.buf_size = size;
+    ret = rt_dev_ioctl(s, RTCAN_RTIOC_CAPTURE_START, &start);
+    if (ret < 0) {
+	fprintf(stderr, "RTCAN_RTIOC_CAPTURE_START: %s\n", strerror(-ret));
+	goto failure;
+    }
+
+    memset(&rd, 0, sizeof(rd));
+    rd.size = start.buf_size;
+    rd.buf = malloc(rd.size);
+    if (rd.buf == NULL) {
+	fprintf(stderr, "out of memory\n");
+	goto failure;
+    }
+    rd.timeout = READ_TIMEOUT;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    ret = rt_dev_bind(s, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret < 0) {
+	fprintf(stderr, "bind: %s\n", strerror(-ret));
+	goto failure;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = RTCAN_PCAP_MAGIC_NSEC;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.snaplen = CANFD_MTU;
+    hdr.linktype = RTCAN_PCAP_LINKTYPE_CAN;
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1) {
+	perror("write");
+	goto failure;
+    }
+
+    while (!stop) {
+	/* Waits and copies in secondary mode, like the writing */
+	ret = rt_dev_ioctl(s, RTCAN_RTIOC_CAPTURE_READ, &rd);
+	if (ret == -ETIMEDOUT)
+	    continue;
+	if (ret < 0) {
+	    if (ret != -EINTR)
+		fprintf(stderr, "RTCAN_RTIOC_CAPTURE_READ: %s\n",
+			strerror(-ret));
+	    break;
+	}
+
+	if (fwrite(rd.buf, 1, rd.length, out) != rd.length) {
+	    perror("write");
+	    break;
+	}
+	fflush(out);
+	bytes += rd.length;
+    }
+
+    /* Fetch what is left in both buffers before stopping */
+    rd.timeout = RTDM_TIMEOUT_NONE;
+    for (i = 0; i < 2; i++) {
+	if (rt_dev_ioctl(s, RTCAN_RTIOC_CAPTURE_READ, &rd) != 0 ||
+	    fwrite(rd.buf, 1, rd.length, out) != rd.length)
+	    break;
+	bytes += rd.length;
+    }
+
+    fprintf(stderr, "%llu bytes written, %u frames dropped\n",
+	    bytes, rd.dropped);
+
+    rt_dev_ioctl(s, RTCAN_RTIOC_CAPTURE_STOP);
+    rt_dev_close(s);
+    fclose(out);
+
+    return 0;
+
+ failure:
+    rt_dev_close(s);
+    return 1;
+}
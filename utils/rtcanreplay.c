@@ -0,0 +1,305 @@
+/*
+ * Replay of pcap captures for RT-Socket-CAN
+ *
+ * Copyright (C) 2026 RT-Socket-CAN Development Team
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The frames of a capture (LINKTYPE_CAN_SOCKETCAN, as written by
+ * rtcancapture or other pcap tools) are sent on one interface with their
+ * original spacing, e.g. to a device of the virtual bus for regression
+ * load tests. The file is mapped and locked in memory before the first
+ * frame, so the replaying task never waits for the disk. Error frames
+ * are skipped, CAN FD frames need an interface in FD mode.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <native/task.h>
+#include <native/timer.h>
+
+#include <rtdm/rtcan.h>
+#include "rtcan_ext.h"
+
+#define PCAP_MAGIC_USEC     0xa1b2c3d4
+
+/* Delay of the first frame of each pass */
+#define START_DELAY         1000000LL       /* 1 ms */
+
+extern int optind, opterr, optopt;
+
+static RT_TASK main_task;
+static volatile int stop;
+
+
+static void print_usage(char *prg)
+{
+    fprintf(stderr,
+	    "Usage: %s [Options] <can-interface> <file>\n"
+	    "Options:\n"
+	    " -l, --loop=N          replay N times, 0 for ever (default 1)\n"
+	    " -s, --speed=PERCENT   speed relative to the capture (default 100)\n"
+	    " -i, --ifindex=N       only frames captured on interface N\n"
+	    " -p, --prio=PRIO       priority of the replaying task (default 80)\n"
+	    " -h, --help            this help\n",
+	    prg);
+}
+
+
+static void cleanup_and_exit(int sig)
+{
+    stop = 1;
+}
+
+
+static inline uint32_t get32(const void *p, int swap)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+
+int main(int argc, char **argv)
+{
+    struct canfd_frame frame;
+    struct sockaddr_can addr;
+    struct ifreq ifr;
+    struct stat st;
+    const unsigned char *file, *p, *end;
+    unsigned int loops = 1, speed = 100, pass;
+    unsigned int sent = 0, skipped = 0;
+    long long base = 0, t0 = 0, due, now, late, max_late = 0;
+    int ifindex = -1, prio = 80;
+    int swap, nsec, fd_frames = 1, first;
+    int opt, fd, s, one = 1, ret;
+    uint32_t magic;
+
+    struct option long_options[] = {
+	{ "help", no_argument, 0, 'h' },
+	{ "loop", required_argument, 0, 'l'},
+	{ "speed", required_argument, 0, 's'},
+	{ "ifindex", required_argument, 0, 'i'},
+	{ "prio", required_argument, 0, 'p'},
+	{ 0, 0, 0, 0},
+    };
+
+    while ((opt = getopt_long(argc, argv, "hl:s:i:p:",
+			      long_options, NULL)) != -1) {
+	switch (opt) {
+	case 'h':
+	    print_usage(argv[0]);
+	    exit(0);
+
+	case 'l':
+	    loops = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 's':
+	    speed = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 'i':
+	    ifindex = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 'p':
+	    prio = strtoul(optarg, NULL, 0);
+	    break;
+
+	default:
+	    fprintf(stderr, "Unknown option %c\n", opt);
+	    print_usage(argv[0]);
+	    exit(1);
+	}
+    }
+
+    if (argc - optind != 2) {
+	print_usage(argv[0]);
+	exit(1);
+    }
+    if (speed < 1 || prio < 1 || prio > 99) {
+	fprintf(stderr, "invalid speed or priority (1..99)\n");
+	exit(1);
+    }
+
+    fd = open(argv[optind + 1], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+	perror(argv[optind + 1]);
+	exit(1);
+    }
+    if (st.st_size < sizeof(struct rtcan_pcap_hdr)) {
+	fprintf(stderr, "%s: not a pcap file\n", argv[optind + 1]);
+	exit(1);
+    }
+
+    signal(SIGTERM, cleanup_and_exit);
+    signal(SIGINT, cleanup_and_exit);
+
+    /* Also locks the mapping of the file */
+    mlockall(MCL_CURRENT | MCL_FUTURE);
+
+    file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+	perror("mmap");
+	exit(1);
+    }
+    end = file + st.st_size;
+
+    magic = get32(file, 0);
+    swap = (magic == __builtin_bswap32(RTCAN_PCAP_MAGIC_NSEC) ||
+	    magic == __builtin_bswap32(PCAP_MAGIC_USEC));
+    nsec = (get32(file, swap) == RTCAN_PCAP_MAGIC_NSEC);
+    if (!nsec && get32(file, swap) != PCAP_MAGIC_USEC) {
+	fprintf(stderr, "%s: not a pcap file\n", argv[optind + 1]);
+	exit(1);
+    }
+    if (get32(file + offsetof(struct rtcan_pcap_hdr, linktype), swap) !=
+	RTCAN_PCAP_LINKTYPE_CAN) {
+	fprintf(stderr, "%s: not a CAN capture\n", argv[optind + 1]);
+	exit(1);
+    }
+
+    ret = rt_task_shadow(&main_task, "rtcanreplay", prio, 0);
+    if (ret) {
+	fprintf(stderr, "rt_task_shadow: %s\n", strerror(-ret));
+	exit(1);
+    }
+
+    s = rt_dev_socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (s < 0) {
+	fprintf(stderr, "rt_dev_socket: %s\n", strerror(-s));
+	exit(1);
+    }
+
+    strncpy(ifr.ifr_name, argv[optind], IFNAMSIZ);
+    ret = rt_dev_ioctl(s, SIOCGIFINDEX, &ifr);
+    if (ret < 0) {
+	fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+	goto failure;
+    }
+
+    /* The socket only sends */
+    ret = rt_dev_setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+    if (ret < 0) {
+	fprintf(stderr, "CAN_RAW_FILTER: %s\n", strerror(-ret));
+	goto failure;
+    }
+
+    /* Without CAN FD support, FD frames are skipped */
+    if (rt_dev_setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES,
+			  &one, sizeof(one)) < 0)
+	fd_frames = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    ret = rt_dev_bind(s, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret < 0) {
+	fprintf(stderr, "bind to %s: %s\n", argv[optind], strerror(-ret));
+	goto failure;
+    }
+
+    for (pass = 0; !stop && (loops == 0 || pass < loops); pass++) {
+	p = file + sizeof(struct rtcan_pcap_hdr);
+	first = 1;
+
+	while (!stop && p + sizeof(struct rtcan_pcap_rec) + 8 <= end) {
+	    long long ts = get32(p, swap) * 1000000000LL +
+		get32(p + 4, swap) * (nsec ? 1 : 1000);
+	    uint32_t incl_len = get32(p + 8, swap);
+	    uint32_t orig_len = get32(p + 12, swap);
+	    const unsigned char *data = p + sizeof(struct rtcan_pcap_rec);
+	    int is_fd;
+
+	    p = data + incl_len;
+	    if (p > end || incl_len < 8)
+		break;
+
+	    is_fd = (data[5] & RTCAN_PCAP_FDF) || orig_len == CANFD_MTU;
+
+	    memset(&frame, 0, sizeof(frame));
+	    memcpy(&frame.can_id, data, sizeof(frame.can_id));
+	    frame.can_id = ntohl(frame.can_id);
+	    frame.len = data[4];
+
+	    if ((frame.can_id & CAN_ERR_FLAG) ||
+		(ifindex >= 0 && data[6] != ifindex) ||
+		(is_fd && !fd_frames) ||
+		frame.len > (is_fd ? CANFD_MAX_DLEN : 8) ||
+		(!(frame.can_id & CAN_RTR_FLAG) && incl_len < 8 + frame.len)) {
+		skipped++;
+		continue;
+	    }
+	    if (!(frame.can_id & CAN_RTR_FLAG))
+		memcpy(frame.data, data + 8, frame.len);
+	    if (is_fd)
+		frame.flags = data[5] & (CANFD_BRS | CANFD_ESI);
+
+	    now = rt_timer_ticks2ns(rt_timer_read());
+	    if (first) {
+		t0 = ts;
+		base = now + START_DELAY;
+		first = 0;
+	    }
+
+	    due = base + (ts - t0) * 100 / speed;
+	    if (due > now) {
+		rt_task_sleep_until(rt_timer_ns2ticks(due));
+		now = rt_timer_ticks2ns(rt_timer_read());
+	    }
+	    late = now - due;
+	    if (late > max_late)
+		max_late = late;
+
+	    /* A classic frame has the layout of can_frame_t */
+	    ret = rt_dev_send(s, &frame, is_fd ? CANFD_MTU : CAN_MTU, 0);
+	    if (ret < 0) {
+		if (ret != -EINTR)
+		    fprintf(stderr, "rt_dev_send: %s\n", strerror(-ret));
+		stop = 1;
+		break;
+	    }
+	    sent++;
+	}
+    }
+
+    fprintf(stderr, "%u frames sent, %u skipped, max lateness %lld us\n",
+	    sent, skipped, max_late / 1000);
+
+    rt_dev_close(s);
+    munmap((void *)file, st.st_size);
+    close(fd);
+
+    return 0;
+
+ failure:
+    rt_dev_close(s);
+    return 1;
+}